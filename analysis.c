@@ -0,0 +1,191 @@
+/*
+ * analysis of whole files in the calling thread
+ *
+ * Frames go straight from the decoder into the loudness meter or the
+ * waveform summary, without an audio output or a conversion to pcm.
+ * Every track analysed for loudness is added to the album values until
+ * the next reset. A scan only looks at the frame headers.
+ */
+
+#include <sys/types.h>
+
+#include <fcntl.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <mad.h>
+
+#include "maddec.h"
+#include "error.h"
+#include "input.h"
+#include "decoder.h"
+#include "loudness.h"
+#include "waveform.h"
+#include "scan.h"
+#include "misc.h"
+
+struct mp3dec_analysis_s {
+  decoder_t decoder;
+  loudness_t track;
+  loudness_t album;
+
+  mp3dec_error_t error;
+};
+
+mp3dec_analysis_t *mp3dec_analysis_new(void) {
+  mp3dec_analysis_t *analysis = malloc(sizeof(mp3dec_analysis_t));
+  if (analysis == NULL)
+    return NULL;
+
+  decoder_init(&analysis->decoder);
+  loudness_init(&analysis->track);
+  loudness_init(&analysis->album);
+  error_reset(&analysis->error);
+  return analysis;
+}
+
+void mp3dec_analysis_delete(mp3dec_analysis_t *analysis) {
+  decoder_finish(&analysis->decoder);
+  free(analysis);
+}
+
+/* start a new album */
+void mp3dec_analysis_reset(mp3dec_analysis_t *analysis) {
+  loudness_init(&analysis->album);
+}
+
+static void mp3dec_analysis_result(loudness_t const *loudness,
+				   mp3dec_loudness_t *result) {
+  result->integrated = loudness_integrated(loudness);
+  result->peak = loudness_true_peak(loudness);
+  result->true_peak = (result->peak > 0) ?
+    20.0 * log10(result->peak) : LOUDNESS_MIN;
+  result->gain = (result->integrated > LOUDNESS_MIN) ?
+    LOUDNESS_REFERENCE - result->integrated : 0;
+  result->seconds = (loudness->samplerate > 0) ?
+    (double)loudness->samples / loudness->samplerate : 0;
+}
+
+/* decode filename from start to end into the loudness meter and the
+   waveform, either can be NULL */
+static int mp3dec_analysis_decode(mp3dec_analysis_t *analysis,
+				  char *filename, loudness_t *loudness,
+				  waveform_t *waveform) {
+  decoder_t *decoder = &analysis->decoder;
+  int fd;
+
+  fd = open(filename, O_RDONLY);
+  if (fd < 0) {
+    error_printf_strerror(&analysis->error, "Could not open \"%s\"",
+			  filename);
+    return -1;
+  }
+  if (decoder_open_fd(decoder, fd, filename, &analysis->error) < 0)
+    return -1;
+
+  for (;;) {
+    switch (decoder_frame(decoder, &analysis->error)) {
+    case DECODER_FRAME:
+      if (loudness != NULL)
+	loudness_add(loudness, &decoder->synth.pcm);
+      if ((waveform != NULL) &&
+	  (waveform_add(waveform, &decoder->synth.pcm,
+			&analysis->error) < 0)) {
+	decoder_close(decoder);
+	return -1;
+      }
+      continue;
+    case DECODER_SKIP:
+      continue;
+    case DECODER_WAIT:
+      unix_wait_fd_read(input_wait_fd(&decoder->input), -1);
+      continue;
+    case DECODER_EOF:
+      break;
+    default:
+      error_prepend(&analysis->error, filename);
+      decoder_close(decoder);
+      return -1;
+    }
+    break;
+  }
+
+  decoder_close(decoder);
+  return 0;
+}
+
+int mp3dec_analyze(mp3dec_analysis_t *analysis, char *filename,
+		   mp3dec_loudness_t *track) {
+  loudness_init(&analysis->track);
+  if (mp3dec_analysis_decode(analysis, filename, &analysis->track,
+			     NULL) < 0)
+    return -1;
+
+  loudness_merge(&analysis->album, &analysis->track);
+  mp3dec_analysis_result(&analysis->track, track);
+  return 0;
+}
+
+/* values over all tracks analysed since the last reset */
+void mp3dec_analysis_album(mp3dec_analysis_t *analysis,
+			   mp3dec_loudness_t *album) {
+  mp3dec_analysis_result(&analysis->album, album);
+}
+
+/* write the waveform summary of filename to output, header is set to
+   the header of the file */
+int mp3dec_waveform(mp3dec_analysis_t *analysis, char *filename,
+		    char *output, mp3dec_waveform_header_t *header) {
+  waveform_t waveform;
+  int fd, ret = -1;
+
+  waveform_init(&waveform);
+  if (mp3dec_analysis_decode(analysis, filename, NULL, &waveform) < 0)
+    goto out;
+
+  fd = open(output, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    error_printf_strerror(&analysis->error, "Could not create \"%s\"",
+			  output);
+    goto out;
+  }
+  ret = waveform_write(&waveform, fd, header, &analysis->error);
+  if (close(fd) < 0) {
+    error_printf_strerror(&analysis->error, "Could not write \"%s\"",
+			  output);
+    ret = -1;
+  }
+  if (ret < 0)
+    unlink(output);
+
+ out:
+  waveform_finish(&waveform);
+  return ret;
+}
+
+int mp3dec_scan(mp3dec_analysis_t *analysis, char *filename,
+		mp3dec_scan_t *scan) {
+  int fd, ret;
+
+  fd = open(filename, O_RDONLY);
+  if (fd < 0) {
+    error_printf_strerror(&analysis->error, "Could not open \"%s\"",
+			  filename);
+    return -1;
+  }
+  ret = scan_fd(fd, scan, &analysis->error);
+  if (ret < 0)
+    error_prepend(&analysis->error, filename);
+  close(fd);
+  return ret;
+}
+
+char *mp3dec_analysis_error(mp3dec_analysis_t *analysis) {
+  return error_get(&analysis->error);
+}
+
+mp3dec_errcode_e mp3dec_analysis_error_code(mp3dec_analysis_t *analysis) {
+  return error_code(&analysis->error);
+}
@@ -1,7 +1,23 @@
 #ifndef AUDIO_H__
 #define AUDIO_H__
 
-int  audio_write(struct mad_pcm *pcm, error_t *error);
-int audio_close(error_t *error);
+#include "pcm.h"
+
+/* the format of the staging buffers audio_write is given, converted
+   with pcm_stage. The buffer is not kept after audio_write returns. */
+mp3dec_format_e audio_format(void);
+int  audio_write(pcm_buffer_t *buf, mp3dec_error_t *error);
+int audio_close(mp3dec_error_t *error);
+
+/* how much audio to buffer ahead of the device, in ms, 0 for the
+   default of the backend. Applied with the next audio_write. */
+int audio_set_latency(unsigned int ms, mp3dec_error_t *error);
+
+/* playback stops on purpose, running dry until the next audio_write
+   is not an underrun */
+void audio_pause(void);
+
+/* fill in the audio fields of the status */
+void audio_stats(mp3dec_status_t *status);
 
 #endif /* AUDIO_H__ */
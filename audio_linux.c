@@ -2,37 +2,81 @@
 #include <sys/uio.h>
 #include <sys/ioctl.h>
 #include <sys/stat.h>
+#include <sys/soundcard.h>
+
+#include <fcntl.h>
+#include <unistd.h>
 
 #include <mad.h>
 
 #include "error.h"
 #include "audio.h"
+#include "pcm.h"
+#include "misc.h"
+
+/* limits of SNDCTL_DSP_SETFRAGMENT */
+#define AUDIO_MIN_FRAGMENT_SHIFT 4
+#define AUDIO_MAX_FRAGMENT_SHIFT 16
+#define AUDIO_MAX_FRAGMENTS      0x7fff
 
 typedef struct audio_s {
   int snd_fd;
   unsigned int channels;
   unsigned int samplerate;
+
+  /* the target, and what the driver made of it */
+  unsigned int latency_ms;
+  int reconfigure;
+  unsigned long latency_usec;
+  unsigned int wakeups;
 } audio_t;
 
-static audio_t audio;
+static audio_t audio = { -1, 0, 0 };
 static int audio_initialized = 0;
 
+/* the buffer split into two or more fragments of a power of two bytes,
+   the device wakes the player up once per fragment */
+static int audio_set_fragments(audio_t *audio, unsigned int bytes_per_sec,
+			       mp3dec_error_t *error) {
+  unsigned long total = (unsigned long long)bytes_per_sec *
+    audio->latency_ms / 1000;
+  unsigned int shift = AUDIO_MIN_FRAGMENT_SHIFT, count;
+  int arg;
+
+  while ((shift < AUDIO_MAX_FRAGMENT_SHIFT) && ((2UL << shift) <= total / 2))
+    shift++;
+  count = total >> shift;
+  if (count < 2)
+    count = 2;
+  if (count > AUDIO_MAX_FRAGMENTS)
+    count = AUDIO_MAX_FRAGMENTS;
+
+  arg = (count << 16) | shift;
+  if (ioctl(audio->snd_fd, SNDCTL_DSP_SETFRAGMENT, &arg) < 0) {
+    error_printf_strerror(error, "Could not set a latency of %u ms",
+			  audio->latency_ms);
+    return 0;
+  }
+  return 1;
+}
+
 static int audio_set_params(audio_t *audio,
                             unsigned int channels,
                             unsigned int samplerate,
-                            error_t *error) {
+                            mp3dec_error_t *error) {
   int ret = 0;
   int fmts;
   unsigned int tchannels;
   unsigned int tsamplerate;
+  audio_buf_info info;
 
   ret = ioctl(audio->snd_fd, SNDCTL_DSP_RESET, NULL);
   if (ret < 0) {
     error_set_strerror(error, "Could not reset audio");
-    goto error;
+    return 0;
   }
 
-  /* 16 bits big endian for now */
+  /* 16 bits native endian */
   fmts = AFMT_S16_NE;
   ret = ioctl(audio->snd_fd, SNDCTL_DSP_SETFMT, &fmts);
   if ((fmts != AFMT_S16_NE) || (ret < 0)) {
@@ -40,23 +84,33 @@ static int audio_set_params(audio_t *audio,
     return 0;
   }
 
-  tchannels = channels;
+  tchannels = (channels == 2) ? 1 : 0;
   ret = ioctl(audio->snd_fd, SNDCTL_DSP_STEREO, &tchannels);
   if (ret < 0) {
     error_printf_strerror(error, "Could not enable %d channels",
 			  channels);
     return 0;
   }
-  audio.channels = channels;
+  audio->channels = channels;
 
-  tsamplerate = audio->samplerate;
+  tsamplerate = samplerate;
   ret = ioctl(audio->snd_fd, SNDCTL_DSP_SPEED, &tsamplerate);
   if (ret < 0) {
     error_printf_strerror(error, "Could not set samplerate of %d hz",
 			  samplerate);
     return 0;
   }
-  audio.samplerate = samplerate;
+  audio->samplerate = samplerate;
+
+  /* what the driver settled on */
+  ret = ioctl(audio->snd_fd, SNDCTL_DSP_GETOSPACE, &info);
+  if ((ret == 0) && (info.fragsize > 0)) {
+    unsigned int bytes_per_sec = samplerate * channels * 2;
+
+    audio->latency_usec = (unsigned long long)info.fragstotal *
+      info.fragsize * 1000000 / bytes_per_sec;
+    audio->wakeups = bytes_per_sec / info.fragsize;
+  }
   
   return 1;
 }
@@ -64,16 +118,23 @@ static int audio_set_params(audio_t *audio,
 /* open the soundcard, and set parameters from the mp3 header */
 static int audio_init(unsigned int channels,
                        unsigned int samplerate,
-                       error_t *error) {
+                       mp3dec_error_t *error) {
   audio.snd_fd = open("/dev/dsp", O_RDWR);
   if (audio.snd_fd < 0) {
     error_set_strerror(error, "Could not open sound device");
     return 0;
   }
+  audio.reconfigure = 0;
 
-  if (!audio_set_params(channels, samplerate, error))
+  /* before the format, the driver lays out its buffer with it */
+  if ((audio.latency_ms > 0) &&
+      !audio_set_fragments(&audio, samplerate * channels * 2, error))
     goto error;
-  
+
+  if (!audio_set_params(&audio, channels, samplerate, error))
+    goto error;
+
+  audio_initialized = 1;
   return 1;
   
  error:
@@ -82,50 +143,38 @@ static int audio_init(unsigned int channels,
   return 0;
 }
 
-int audio_write(struct mad_pcm *pcm, error_t *error) {
-  unsigned char audio_buf[1500000];
-  unsigned int nchannels, nsamples;
-  mad_fixed_t const *left_ch, *right_ch;
-  unsigned int len = 0;
-  unsigned char *ptr = NULL;
+/* AFMT_S16_NE, the native layout of pcm_convert */
+mp3dec_format_e audio_format(void) {
+  return MP3DEC_FORMAT_S16;
+}
+
+int audio_write(pcm_buffer_t *buf, mp3dec_error_t *error) {
+  unsigned int len;
   int ret;
 
-  nchannels = pcm->channels;
-  nsamples  = pcm->length;
-  left_ch   = pcm->samples[0];
-  right_ch  = pcm->samples[1];
+  /* the fragments are only laid out on a freshly opened device */
+  if (audio_initialized && audio.reconfigure) {
+    close(audio.snd_fd);
+    audio.snd_fd = -1;
+    audio_initialized = 0;
+  }
 
   if (!audio_initialized) {
-    if (!audio_init(nchannels, nsamples, error))
+    if (!audio_init(buf->channels, buf->samplerate, error))
       return 0;
   }
   
-  if ((nchannels != audio->channels) ||
-      (pcm->samplerate != audio->samplerate)) {
-    if (!audio_set_params(nchannels, samplerate, error)) {
+  if ((buf->channels != audio.channels) ||
+      (buf->samplerate != audio.samplerate)) {
+    if (!audio_set_params(&audio, buf->channels, buf->samplerate, error)) {
       error_prepend(error, "Could not reset audio");
       return 0;
     }
   }
 
-  ptr = audio_buf;
-  while (nsamples--) {
-    signed int sample;
-    
-    sample = mad_scale(*left_ch++);
-    *ptr++ = (sample& 0xFF);
-    *ptr++ = ((sample >> 8) & 0xFF);
-    
-    if (nchannels == 2) {
-      sample = mad_scale(*right_ch++);
-      *ptr++ = (sample& 0xFF);
-      *ptr++ = ((sample >> 8) & 0xFF);
-    }
-  }
-  
-  len = ptr - audio_buf;
+  len = buf->length * buf->channels * sizeof(signed short);
 
-  ret = unix_write(audio.snd_fd, audio_buf, len);
+  ret = unix_write(audio.snd_fd, buf->data, len);
   if (ret < 0) {
     error_set(error, "Error while writing audio data");
     return 0;
@@ -137,7 +186,25 @@ int audio_write(struct mad_pcm *pcm, error_t *error) {
   }
 }
 
-int audio_close(error_t *error) {
+/* reopens the device, dropping what it has buffered */
+int audio_set_latency(unsigned int ms, mp3dec_error_t *error) {
+  if (ms != audio.latency_ms) {
+    audio.latency_ms = ms;
+    audio.reconfigure = 1;
+  }
+  return 1;
+}
+
+/* the device keeps its own time, nothing is counted here */
+void audio_pause(void) {
+}
+
+void audio_stats(mp3dec_status_t *status) {
+  status->audio_latency_usec = audio.latency_usec;
+  status->audio_wakeups = audio.wakeups;
+}
+
+int audio_close(mp3dec_error_t *error) {
   if (audio.snd_fd != -1)
     close(audio.snd_fd);
   audio.snd_fd = -1;
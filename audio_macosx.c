@@ -18,8 +18,15 @@
 #include "audio_macosx_rb.h"
 #include "error.h"
 #include "audio.h"
+#include "pcm.h"
 
-#define AUDIO_BUFFER_SIZE 1152 * 2
+/* frames per device buffer and in the ring without a latency target */
+#define AUDIO_BUFFER_FRAMES 1152
+#define AUDIO_RING_FRAMES   (RB_COUNT * AUDIO_BUFFER_FRAMES)
+
+/* device buffers for a target, a quarter of it within these */
+#define AUDIO_MIN_FRAMES    64
+#define AUDIO_MAX_FRAMES    4096
 
 typedef struct audio_s {
   AudioDeviceID device;
@@ -28,12 +35,22 @@ typedef struct audio_s {
   unsigned long samplerate;
   
   rb_t rb;
+
+  /* the target, and the buffers it was mapped onto */
+  unsigned int latency_ms;
+  int reconfigure;
+  unsigned long latency_usec;
+  unsigned int wakeups;
 } audio_t;
 
 static audio_t audio;
 static int audio_initialized = 0;
 static int audio_started = 0;
 
+/* buffers the device played silence for, unless paused */
+static volatile unsigned long audio_underruns = 0;
+static volatile int audio_paused = 0;
+
 /* audio_play_proc has to be thread safe */
 static OSStatus audio_play_proc(AudioDeviceID inDevice,
                                 const AudioTimeStamp *inNow,
@@ -46,25 +63,81 @@ static OSStatus audio_play_proc(AudioDeviceID inDevice,
   for(i = 0; i < outOutputData->mNumberBuffers; i++) {
     AudioBuffer *buffer = outOutputData->mBuffers + i;
 
-    if ((buffer->mDataByteSize / sizeof(float)) != (1152 * 2)) {
-      memset(buffer->mData, 0, 1152 * 2 * sizeof(float));
-      continue;
-    }
-
     int ret;
-    ret = rb_dequeue(&audio.rb, buffer->mData, 1152 * 2);
-    if (ret == 0)
-      memset(buffer->mData, 0, 1152 * 2 * sizeof(float));
+    ret = rb_dequeue(&audio.rb, buffer->mData,
+		     buffer->mDataByteSize / sizeof(float));
+    if (ret == 0) {
+      memset(buffer->mData, 0, buffer->mDataByteSize);
+      if (!audio_paused)
+	audio_underruns++;
+    }
   }
 
   return 0;
 }
 
-static int audio_init(error_t *error) {
+/* the device buffer is a quarter of the target, the ring the rest of
+   it. audio_write puts in an mp3 frame at a time and the IO proc takes
+   a whole device buffer, so the ring holds at least one of each, else
+   they wait on each other forever. The device wakes up the player once
+   per buffer. */
+static int audio_set_buffers(mp3dec_error_t *error) {
+  unsigned long frames = AUDIO_BUFFER_FRAMES, ring = AUDIO_RING_FRAMES;
+  unsigned long total = 0;
+  UInt32 size, byte_count;
+  int ret;
+
+  if (audio.latency_ms > 0) {
+    total = audio.samplerate * audio.latency_ms / 1000;
+    frames = total / 4;
+    if (frames < AUDIO_MIN_FRAMES)
+      frames = AUDIO_MIN_FRAMES;
+    if (frames > AUDIO_MAX_FRAMES)
+      frames = AUDIO_MAX_FRAMES;
+  }
+
+  byte_count = frames * audio.channels * sizeof(float);
+  ret = AudioDeviceSetProperty(audio.device, NULL, 0, false,
+                               kAudioDevicePropertyBufferSize,
+                               sizeof(byte_count), &byte_count);
+  if (ret) {
+    error_set(error, "Could not set the buffer size");
+    return 0;
+  }
+
+  /* what the device settled on */
+  size = sizeof(byte_count);
+  ret = AudioDeviceGetProperty(audio.device, 0, false,
+                               kAudioDevicePropertyBufferSize,
+                               &size, &byte_count);
+  if ((ret == 0) && (byte_count > 0))
+    frames = byte_count / (audio.channels * sizeof(float));
+  if (frames + AUDIO_BUFFER_FRAMES > AUDIO_RING_FRAMES) {
+    error_printf(error, "The device buffer of %lu frames is too large",
+                 frames);
+    return 0;
+  }
+
+  if (audio.latency_ms > 0) {
+    ring = (total > frames) ? total - frames : 0;
+    if (ring < frames + AUDIO_BUFFER_FRAMES)
+      ring = frames + AUDIO_BUFFER_FRAMES;
+    if (ring > AUDIO_RING_FRAMES)
+      ring = AUDIO_RING_FRAMES;
+  }
+  rb_set_size(&audio.rb, ring * audio.channels);
+
+  audio.latency_usec = (frames + ring) * 1000000ULL / audio.samplerate;
+  audio.wakeups = audio.samplerate / frames;
+  audio.reconfigure = 0;
+
+  return 1;
+}
+
+static int audio_init(mp3dec_error_t *error) {
   UInt32 size;
   int ret;
   AudioStreamBasicDescription format;
-  UInt32 byte_count;
 
   /* get device */
   size = sizeof(audio.device);
@@ -93,27 +166,15 @@ static int audio_init(error_t *error) {
     return 0;
   }
 
+  /* initialize the ring buffer */
+  rb_init(&audio.rb);
+
   /* set the buffer size, channels, samplerate */
   /* XXX channels, samplerate */
-  size = sizeof(byte_count);
-  ret = AudioDeviceGetProperty(audio.device, 0, false,
-                               kAudioDevicePropertyBufferSize,
-                               &size, &byte_count);
-  if (ret) {
-    error_set(error, "Could not get the buffer size");
+  if (!audio_set_buffers(error)) {
+    rb_destroy(&audio.rb);
     return 0;
   }
-  byte_count = 1152 * 2 * sizeof(float);
-  ret = AudioDeviceSetProperty(audio.device, NULL, 0, false,
-                               kAudioDevicePropertyBufferSize,
-                               size, &byte_count);
-  if (ret) {
-    error_set(error, "Could not set the buffer size");
-    return 0;
-  }
-
-  /* initialize the ring buffer */
-  rb_init(&audio.rb);
   
   ret = AudioDeviceAddIOProc(audio.device, audio_play_proc, NULL);
   if (ret) {
@@ -126,73 +187,68 @@ static int audio_init(error_t *error) {
   return 1;
 }
 
-static inline
-float mad_scale_float(mad_fixed_t sample) {
-  return (float)(sample/(float)(1L << MAD_F_FRACBITS));
+/* the device plays floats */
+mp3dec_format_e audio_format(void) {
+  return MP3DEC_FORMAT_FLOAT;
 }
 
-static inline
-signed int mad_scale(mad_fixed_t sample)
-{
-  /* round */
-  sample += (1L << (MAD_F_FRACBITS - 16));
-
-  /* clip */
-  if (sample >= MAD_F_ONE)
-    sample = MAD_F_ONE - 1;
-  else if (sample < -MAD_F_ONE)
-    sample = -MAD_F_ONE;
-
-  /* quantize */
-  return sample >> (MAD_F_FRACBITS + 1 - 16);
-}
+int audio_write(pcm_buffer_t *buf, mp3dec_error_t *error) {
+  int ret;
 
-int audio_write(struct mad_pcm *pcm, error_t *error) {
   if (!audio_initialized) {
-    audio.channels = pcm->channels;
-    audio.samplerate = pcm->samplerate;
+    audio.channels = buf->channels;
+    audio.samplerate = buf->samplerate;
     if (!audio_init(error)) {
       error_prepend(error, "Could not initialize audio");
       return 0;
     }
   }
 
-  if ((audio.channels != pcm->channels) ||
-      (audio.samplerate != pcm->samplerate)) {
+  /* the device is stopped to change its buffer size, it starts again
+     with the samples of this write. What is left in the ring is
+     dropped, a smaller ring could not take this write until the
+     stopped device drained it. */
+  if (audio.reconfigure) {
+    if (audio_started) {
+      ret = AudioDeviceStop(audio.device, audio_play_proc);
+      if (ret) {
+        error_set(error, "Could not stop audio playback");
+        return 0;
+      }
+      audio_started = 0;
+    }
+    rb_clear(&audio.rb);
+    if (!audio_set_buffers(error)) {
+      error_prepend(error, "Could not change the latency");
+      return 0;
+    }
+  }
+
+  if ((audio.channels != buf->channels) ||
+      (audio.samplerate != buf->samplerate)) {
     /* XXX */
     error_set(error, "Changing the audio parameters is not supported");
     return 0;
   }
 
-  if (pcm->length != 1152) {
+  if (buf->length != 1152) {
     error_printf(error, "Unknown number of samples in the mad buffer: %d",
-                 pcm->length);
+                 buf->length);
     return 0;
   }
 
-  if (pcm->channels != 2) {
+  if (buf->channels != 2) {
     error_set(error, "Only stereo PCM data supported");
     return 0;
   }
 
-  int ret;
-  float buf[1152 * pcm->channels];
-  float *ptr = buf;
-  int i;
-  mad_fixed_t const *left_ch, *right_ch;
-  left_ch  = pcm->samples[0];
-  right_ch = pcm->samples[1];
-  for (i = 0; i < pcm->length; i++) {
-    signed int sample;
-    *ptr++ = mad_scale(*left_ch++) / 32768.0;
-    *ptr++ = mad_scale(*right_ch++) / 32768.0;
-  }
-  ret = rb_enqueue(&audio.rb, buf, 1152 * pcm->channels);
+  ret = rb_enqueue(&audio.rb, buf->data, buf->length * buf->channels);
 
   if (ret == 0) {
     error_set(error, "Could not enqueue the PCM samples");
     return 0;
   }
+  audio_paused = 0;
 
   if (!audio_started) {
     ret = AudioDeviceStart(audio.device, audio_play_proc);
@@ -206,7 +262,25 @@ int audio_write(struct mad_pcm *pcm, error_t *error) {
   return 1;
 }
 
-int audio_close(error_t *error) {
+int audio_set_latency(unsigned int ms, mp3dec_error_t *error) {
+  if (ms != audio.latency_ms) {
+    audio.latency_ms = ms;
+    audio.reconfigure = audio_initialized;
+  }
+  return 1;
+}
+
+void audio_pause(void) {
+  audio_paused = 1;
+}
+
+void audio_stats(mp3dec_status_t *status) {
+  status->audio_underruns = audio_underruns;
+  status->audio_latency_usec = audio.latency_usec;
+  status->audio_wakeups = audio.wakeups;
+}
+
+int audio_close(mp3dec_error_t *error) {
   int ret;
   if (audio_started) {
     ret = AudioDeviceStop(audio.device, audio_play_proc);
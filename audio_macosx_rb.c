@@ -11,9 +11,15 @@
 
 #define min(a, b) ((a) < (b) ? (a) : (b))
 
+/* room below the depth, none while it was made smaller than the count */
+static unsigned long rb_left(rb_t *rb) {
+  return (rb->count < rb->size) ? rb->size - rb->count : 0;
+}
+
 void rb_init(rb_t *rb) {
   rb->start = 0;
   rb->count = 0;
+  rb->size = countof(rb->buf);
   memset(rb->buf, 0, sizeof(rb->buf));
 
 #ifdef USE_PTHREAD
@@ -37,16 +43,53 @@ void rb_destroy(rb_t *rb) {
   memset(rb->buf, 0, sizeof(rb->buf));
 }
 
+/* use only size elements of the buffer, at most all of it */
+void rb_set_size(rb_t *rb, unsigned long size) {
+#ifdef USE_PTHREAD
+  int ret;
+  ret = pthread_mutex_lock(&rb->mutex);
+  assert(ret == 0);
+#endif
+
+  rb->size = min(size, countof(rb->buf));
+
+#ifdef USE_PTHREAD
+  ret = pthread_cond_signal(&rb->cond);
+  assert(ret == 0);
+  ret = pthread_mutex_unlock(&rb->mutex);
+  assert(ret == 0);
+#endif
+}
+
+/* drop what is in the buffer */
+void rb_clear(rb_t *rb) {
+#ifdef USE_PTHREAD
+  int ret;
+  ret = pthread_mutex_lock(&rb->mutex);
+  assert(ret == 0);
+#endif
+
+  rb->start = 0;
+  rb->count = 0;
+
+#ifdef USE_PTHREAD
+  ret = pthread_cond_signal(&rb->cond);
+  assert(ret == 0);
+  ret = pthread_mutex_unlock(&rb->mutex);
+  assert(ret == 0);
+#endif
+}
+
 #ifdef USE_PTHREAD
 /* call with rb->mutex held */
 void rb_wait(rb_t *rb, unsigned long count) {
   int ret;
   unsigned long left;
-  left = countof(rb->buf) - rb->count;
+  left = rb_left(rb);
   while (left < count) {
     ret = pthread_cond_wait(&rb->cond, &rb->mutex);
     assert(ret == 0);
-    left = countof(rb->buf) - rb->count;
+    left = rb_left(rb);
   }
 }
 #endif
@@ -64,15 +107,15 @@ int rb_enqueue(rb_t *rb, rb_elt_t *data, unsigned long count) {
 #endif
 
   unsigned long left;
-  left = countof(rb->buf) - rb->count;
+  left = rb_left(rb);
   
 #ifdef USE_PTHREAD
-  if (count > countof(rb->buf)) {
+  if (count > rb->size) {
     retval = 0;
     goto exit;
   }
   rb_wait(rb, count);
-  left = countof(rb->buf) - rb->count;
+  left = rb_left(rb);
   assert(count <= left);
 #else /* USE_PTHREAD */
   if (count > left) {
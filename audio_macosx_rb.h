@@ -26,6 +26,7 @@ typedef struct rb_s {
   rb_elt_t buf[RB_SIZE];
   unsigned long start;
   unsigned long count;
+  unsigned long size;     /* the depth in use, at most RB_SIZE */
 
 #ifdef USE_PTHREAD
   pthread_mutex_t mutex;
@@ -34,6 +35,8 @@ typedef struct rb_s {
 } rb_t;
 
 void rb_init(rb_t *rb);
+void rb_set_size(rb_t *rb, unsigned long size);
+void rb_clear(rb_t *rb);
 int  rb_enqueue(rb_t *rb, rb_elt_t *data, unsigned long count);
 int  rb_dequeue(rb_t *rb, rb_elt_t *dest, unsigned long count);
 void rb_destroy(rb_t *rb);
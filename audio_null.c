@@ -1,16 +1,157 @@
-#include <stdio.h>
+/*
+ * null audio output
+ *
+ * Plays nothing, but takes pcm at the pace of its samplerate, as a
+ * device with a buffer of the latency target would, or of
+ * $MP3DEC_NULL_BUFFER_MS or AUDIO_NULL_BUFFER_MS without one. Writes
+ * block until a period of the buffer has played, so that the player
+ * runs in real time on machines without a sound card and load tests
+ * see the deadlines and wakeups a device would set.
+ */
+
+#include <stdlib.h>
 
 #include <mad.h>
 
+#include "maddec.h"
 #include "error.h"
 #include "audio.h"
+#include "misc.h"
+
+#define AUDIO_NULL_BUFFER_MS  100
+#define AUDIO_NULL_PERIODS    2
+
+/* waking up later than this after the buffer has room is a miss */
+#define AUDIO_NULL_SLACK_USEC 1000
+
+typedef struct audio_s {
+  int initialized;
+  int paused;
+  unsigned int latency_ms;   /* 0 for the default buffer */
+  unsigned long long buffer_usec;
+
+  /* the buffer runs dry at start_usec plus the time of samples */
+  unsigned long long start_usec;
+  unsigned long long samples;
+  unsigned int samplerate;
+
+  unsigned long underruns;
+  unsigned long late;
+  unsigned long max_late_usec;
+
+  /* the deepest the buffer got and the wakeups, over a second */
+  unsigned long long window_usec;
+  unsigned long window_wakeups;
+  unsigned long long window_latency_usec;
+  unsigned long latency_usec;
+  unsigned int wakeups;
+} audio_t;
+
+static audio_t audio;
+
+static void audio_set_buffer(void) {
+  char *ms = getenv("MP3DEC_NULL_BUFFER_MS");
+
+  audio.buffer_usec = AUDIO_NULL_BUFFER_MS * 1000ULL;
+  if (audio.latency_ms > 0)
+    audio.buffer_usec = audio.latency_ms * 1000ULL;
+  else if ((ms != NULL) && (atoi(ms) > 0))
+    audio.buffer_usec = atoi(ms) * 1000ULL;
+}
+
+static void audio_init(void) {
+  audio_set_buffer();
+  audio.samplerate = 0;
+  audio.window_usec = unix_time_usec();
+  audio.window_wakeups = 0;
+  audio.window_latency_usec = 0;
+  audio.paused = 1;
+  audio.initialized = 1;
+}
+
+static unsigned long long audio_empty_usec(void) {
+  return audio.start_usec + audio.samples * 1000000 / audio.samplerate;
+}
+
+mp3dec_format_e audio_format(void) {
+  return MP3DEC_FORMAT_S16;
+}
 
-int audio_write(struct mad_pcm *pcm, error_t *error) {
-  printf("Asked to write %d samples on %d channels\n",
-         pcm->length, pcm->channels);
+int audio_set_latency(unsigned int ms, mp3dec_error_t *error) {
+  audio.latency_ms = ms;
+  if (audio.initialized)
+    audio_set_buffer();
   return 1;
 }
 
-void audio_close(void) {
-  printf("Closing audio\n");
+static void audio_window(unsigned long long now) {
+  if (now < audio.window_usec + 1000000)
+    return;
+  audio.latency_usec = audio.window_latency_usec;
+  audio.wakeups = audio.window_wakeups * 1000000 / (now - audio.window_usec);
+  audio.window_usec = now;
+  audio.window_wakeups = 0;
+  audio.window_latency_usec = 0;
+}
+
+int audio_write(pcm_buffer_t *buf, mp3dec_error_t *error) {
+  unsigned long long now, room, period;
+
+  if (!audio.initialized)
+    audio_init();
+  if (buf->samplerate == 0) {
+    error_set(error, "Invalid samplerate");
+    return 0;
+  }
+
+  /* starting, or the buffer ran dry: the time starts over */
+  now = unix_time_usec();
+  if ((buf->samplerate != audio.samplerate) || (audio_empty_usec() < now)) {
+    if (!audio.paused && (buf->samplerate == audio.samplerate))
+      audio.underruns++;
+    audio.start_usec = now;
+    audio.samples = 0;
+    audio.samplerate = buf->samplerate;
+  }
+  audio.paused = 0;
+
+  /* the samples just written play after everything in the buffer */
+  audio.samples += buf->length;
+  if (audio_empty_usec() - now > audio.window_latency_usec)
+    audio.window_latency_usec = audio_empty_usec() - now;
+
+  /* over full, wait until a period has played */
+  period = audio.buffer_usec / AUDIO_NULL_PERIODS;
+  if (audio_empty_usec() > now + audio.buffer_usec) {
+    room = audio_empty_usec() - audio.buffer_usec + period;
+    unix_sleep_until_usec(room);
+    audio.window_wakeups++;
+
+    now = unix_time_usec();
+    if (now > room + AUDIO_NULL_SLACK_USEC) {
+      audio.late++;
+      if (now - room > audio.max_late_usec)
+	audio.max_late_usec = now - room;
+    }
+  }
+  audio_window(now);
+
+  return 1;
+}
+
+void audio_pause(void) {
+  audio.paused = 1;
+}
+
+void audio_stats(mp3dec_status_t *status) {
+  status->audio_underruns = audio.underruns;
+  status->audio_late = audio.late;
+  status->audio_max_late_usec = audio.max_late_usec;
+  status->audio_latency_usec = audio.latency_usec;
+  status->audio_wakeups = audio.wakeups;
+}
+
+int audio_close(mp3dec_error_t *error) {
+  audio.initialized = 0;
+  return 1;
 }
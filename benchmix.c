@@ -0,0 +1,108 @@
+/*
+ * benchmark the mixer: cost of mixing N streams per frame, the cost
+ * of every added stream, and of an equal-power crossfade
+ *
+ * (c) 2005 bl0rg.net
+ */
+
+#include <sys/time.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <mad.h>
+
+#include "mixer.h"
+
+#define FRAMES      20000
+#define SAMPLERATE  44100
+
+static double now(void) {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+/* mix FRAMES frames of n streams, every fourth frame ramps the gains */
+static double bench(mixer_t *mixer, struct mad_pcm *pcm,
+		    struct mad_pcm *out, unsigned int n) {
+  double start;
+  unsigned int frame, i;
+
+  start = now();
+  for (frame = 0; frame < FRAMES; frame++) {
+    if ((frame % 4) == 0) {
+      for (i = 0; i < n; i++)
+	mixer_set_gain(mixer, i, (frame % 8) ? 0.5f : 0.25f, 1152);
+    }
+    mixer_start(mixer, SAMPLERATE, 2, 1152);
+    for (i = 0; i < n; i++)
+      mixer_add(mixer, i, &pcm[i], 0, 0, 1152);
+    mixer_finish(mixer, out);
+  }
+  return now() - start;
+}
+
+/* two streams crossfading over 5 seconds, over and over */
+static double bench_fade(mixer_t *mixer, struct mad_pcm *pcm,
+			 struct mad_pcm *out) {
+  double start;
+  unsigned int frame;
+
+  start = now();
+  for (frame = 0; frame < FRAMES; frame++) {
+    if (!mixer_is_fading(mixer, 0)) {
+      mixer_set_gain(mixer, 0, 1.0f, 0);
+      mixer_set_gain(mixer, 1, 1.0f, 0);
+      mixer_fade(mixer, 0, 0, 5 * SAMPLERATE);
+      mixer_fade(mixer, 1, 1, 5 * SAMPLERATE);
+    }
+    mixer_start(mixer, SAMPLERATE, 2, 1152);
+    mixer_add(mixer, 0, &pcm[0], 0, 0, 1152);
+    mixer_add(mixer, 1, &pcm[1], 0, 0, 1152);
+    mixer_finish(mixer, out);
+  }
+  return now() - start;
+}
+
+int main(void) {
+  static mixer_t mixer;
+  static struct mad_pcm pcm[MIXER_MAX_INPUTS], out;
+  double audio_secs = FRAMES * 1152.0 / SAMPLERATE;
+  double last = 0;
+  unsigned int i, j, n;
+
+  srand(1);
+  for (i = 0; i < MIXER_MAX_INPUTS; i++) {
+    pcm[i].samplerate = SAMPLERATE;
+    pcm[i].channels = 2;
+    pcm[i].length = 1152;
+    for (j = 0; j < 1152; j++) {
+      pcm[i].samples[0][j] = (rand() % MAD_F_ONE) - MAD_F_ONE / 2;
+      pcm[i].samples[1][j] = (rand() % MAD_F_ONE) - MAD_F_ONE / 2;
+    }
+  }
+
+  mixer_init(&mixer);
+
+  printf("%8s %14s %14s %12s\n",
+	 "streams", "usec/frame", "usec/stream", "x realtime");
+  for (n = 1; n <= MIXER_MAX_INPUTS; n++) {
+    double secs = bench(&mixer, pcm, &out, n);
+    double per_frame = secs * 1000000.0 / FRAMES;
+
+    printf("%8u %14.3f %14.3f %12.0f\n",
+	   n, per_frame, per_frame - last, audio_secs / secs);
+    last = per_frame;
+  }
+
+  mixer_init(&mixer);
+  {
+    double secs = bench_fade(&mixer, pcm, &out);
+
+    printf("%8s %14.3f %14s %12.0f\n", "fade",
+	   secs * 1000000.0 / FRAMES, "", audio_secs / secs);
+  }
+
+  return 0;
+}
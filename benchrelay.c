@@ -0,0 +1,370 @@
+/*
+ * load test the mp3 relay: play a file to many listeners on
+ * socketpairs and report the cpu time of the relay per listener and
+ * frame. The file is sought and loaded again while one listener on
+ * local tcp with a small buffer is in the middle of a frame, and some
+ * listeners go away. The stream of that listener has to be made of
+ * whole frames of the file, with the garbage between them, and
+ * nothing else.
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+#include <netinet/in.h>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "maddec.h"
+#include "sync.h"
+
+#define LISTENERS      1000
+#define MAX_LISTENERS  4000
+#define CLOSED         10
+#define SLOW_BUFFER    1024
+#define HOLD           1.0         /* seconds, within the backlog */
+
+static double now(void) {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+static struct pollfd fds[MAX_LISTENERS];
+static int nfds;
+static double start_time;
+
+/* what the checked listener got */
+static unsigned char *stream;
+static unsigned long stream_len, stream_size;
+
+/* a connected pair of local tcp sockets with small buffers, set
+   before they connect. Unlike a unix socket, tcp takes part of a send
+   when its buffer is full, as a real listener does. */
+static int tcp_pair(int sv[2]) {
+  struct sockaddr_in addr;
+  socklen_t len = sizeof(addr);
+  int fd, size = SLOW_BUFFER;
+
+  fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (fd < 0)
+    return -1;
+  setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if ((bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) ||
+      (listen(fd, 1) < 0) ||
+      (getsockname(fd, (struct sockaddr *)&addr, &len) < 0)) {
+    close(fd);
+    return -1;
+  }
+  sv[1] = socket(AF_INET, SOCK_STREAM, 0);
+  if (sv[1] >= 0)
+    setsockopt(sv[1], SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+  if ((sv[1] < 0) ||
+      (connect(sv[1], (struct sockaddr *)&addr, sizeof(addr)) < 0)) {
+    if (sv[1] >= 0)
+      close(sv[1]);
+    close(fd);
+    return -1;
+  }
+  sv[0] = accept(fd, NULL, NULL);
+  close(fd);
+  return (sv[0] < 0) ? -1 : 0;
+}
+
+/* read from the listeners for a while, except the checked one when
+   it is held back to fill its buffer */
+static void listen_for(double seconds, int hold) {
+  unsigned char buf[64 * 1024];
+  double end = now() + seconds;
+  int i, n, len;
+
+  while (now() < end) {
+    n = poll(fds + hold, nfds - hold, 50);
+    for (i = hold; (n > 0) && (i < nfds); i++) {
+      if (!(fds[i].revents & (POLLIN | POLLHUP)))
+	continue;
+      len = read(fds[i].fd, buf, sizeof(buf));
+      if ((len > 0) && (i == 0)) {
+	if (len > stream_size - stream_len)
+	  len = stream_size - stream_len;
+	memcpy(stream + stream_len, buf, len);
+	stream_len += len;
+      }
+    }
+  }
+}
+
+/* hold the checked listener back until its buffer is full, then empty
+   it: the relay catches up with more frames at once than fit and stops
+   in the middle of one */
+static void fill_slow(void) {
+  unsigned char buf[64 * 1024];
+  int len;
+
+  listen_for(HOLD, 1);
+  len = read(fds[0].fd, buf, sizeof(buf));
+  if ((len > 0) && (len <= stream_size - stream_len)) {
+    memcpy(stream + stream_len, buf, len);
+    stream_len += len;
+  }
+  listen_for(0.1, 1);
+}
+
+static void report(mp3dec_relay_t *relay, char *what) {
+  static unsigned long long last_cpu = 0;
+  static double last_time = 0;
+  mp3dec_relay_status_t status;
+  double frames;
+
+  /* the frame goes back on a seek or a load, count the frames that
+     were due since the last report */
+  mp3dec_relay_status(relay, &status);
+  if (last_time == 0)
+    last_time = start_time;
+  frames = (now() - last_time) * status.frames / status.duration;
+  if (frames < 1)
+    frames = 1;
+  printf("%-8s frame %6lu listeners %4u dropped %3lu late %3lu "
+	 "%6.0f ns per listener frame\n", what, status.frame,
+	 status.listeners, status.dropped, status.late,
+	 (status.cpu_usec - last_cpu) * 1000.0 /
+	 frames / (status.listeners ? status.listeners : 1));
+  last_cpu = status.cpu_usec;
+  last_time = now();
+}
+
+/* the offsets in the file where a frame starts, and the end of the
+   last one, found the way the relay finds them */
+static unsigned char *index_frames(unsigned char *file, unsigned long size) {
+  unsigned char *starts = calloc(size + 1, 1);
+  unsigned long pos = 0, first = 0;
+  int found = 0;
+  long skip;
+
+  while ((starts != NULL) && (pos + 4 <= size)) {
+    unsigned int flen = sync_frame_length(file + pos);
+    sync_result_e ret = sync_check(file + pos, size - pos);
+
+    if ((ret == SYNC_VALID) ||
+	((flen > 1) && (pos + flen <= size) &&
+	 ((ret == SYNC_SHORT) ||
+	  (found && sync_match(file + pos, file + first))))) {
+      if (!found)
+	first = pos;
+      found = 1;
+      starts[pos] = 1;
+      pos += flen;
+      starts[pos] = 1;
+      continue;
+    }
+    skip = sync_find(file + pos + 1, size - pos - 1);
+    if (skip < 0)
+      break;
+    pos += skip + 1;
+  }
+  return starts;
+}
+
+/* where the stream at p goes on in the file, at the start of a frame */
+static long find_frame(unsigned char *file, unsigned long size,
+		       unsigned char *starts, unsigned long p) {
+  unsigned long f, len;
+
+  for (f = 0; f < size; f++) {
+    if (!starts[f])
+      continue;
+    len = stream_len - p;
+    if (len > size - f)
+      len = size - f;
+    if (len > 1024)
+      len = 1024;
+    if ((len > 0) && !memcmp(file + f, stream + p, len))
+      return f;
+  }
+  return -1;
+}
+
+/* walk the stream along the file. Where it jumps, the file has to be
+   at the end of a frame. Returns the frames that were cut, or -1 for
+   bytes that are not in the file. */
+static long check_stream(unsigned char *file, unsigned long size) {
+  unsigned char *starts = index_frames(file, size);
+  unsigned long p = 0, frame_p = 0;
+  long c, frame_c = 0, cuts = 0;
+
+  if (starts == NULL)
+    return -1;
+  c = find_frame(file, size, starts, 0);
+  while ((c >= 0) && (p < stream_len)) {
+    if (starts[c]) {
+      frame_p = p;
+      frame_c = c;
+    }
+    if ((c < size) && (stream[p] == file[c])) {
+      p++;
+      c++;
+      continue;
+    }
+    /* the headers of frames look alike, the jump may have been at the
+       start of the frame */
+    c = find_frame(file, size, starts, frame_p);
+    if ((c >= 0) && (c != frame_c)) {
+      p = frame_p;
+      continue;
+    }
+    c = frame_c + (p - frame_p);
+    if (!starts[c]) {
+      printf("frame cut at byte %lu of the stream, %ld of the file\n",
+	     p, c);
+      cuts++;
+    }
+    c = find_frame(file, size, starts, p);
+  }
+  free(starts);
+
+  if (c < 0) {
+    printf("byte %lu of the stream is not the start of a frame\n", p);
+    return -1;
+  }
+  return cuts;
+}
+
+int main(int argc, char *argv[]) {
+  mp3dec_relay_t *relay;
+  mp3dec_relay_status_t status;
+  unsigned char *file;
+  struct stat st;
+  int nlisteners = LISTENERS;
+  int fd, i, ret = 0;
+  long cuts;
+
+  if ((argc < 2) || (argc > 3)) {
+    fprintf(stderr, "Usage: ./benchrelay mp3file [listeners]\n");
+    return 1;
+  }
+  if (argc > 2)
+    nlisteners = atoi(argv[2]);
+  if ((nlisteners <= CLOSED) || (nlisteners > MAX_LISTENERS)) {
+    fprintf(stderr, "More than %d and at most %d listeners\n",
+	    CLOSED, MAX_LISTENERS);
+    return 1;
+  }
+
+  fd = open(argv[1], O_RDONLY);
+  if ((fd < 0) || (fstat(fd, &st) < 0)) {
+    perror(argv[1]);
+    return 1;
+  }
+  file = malloc(st.st_size);
+  if ((file == NULL) || (read(fd, file, st.st_size) != st.st_size)) {
+    perror(argv[1]);
+    return 1;
+  }
+  close(fd);
+  stream_size = 4 * st.st_size;
+  stream = malloc(stream_size);
+  if (stream == NULL) {
+    perror("malloc");
+    return 1;
+  }
+
+  relay = mp3dec_relay_new();
+  if (relay == NULL) {
+    printf("Could not start the relay\n");
+    return 1;
+  }
+  if (mp3dec_relay_load(relay, argv[1]) < 0) {
+    printf("Could not load: %s\n", mp3dec_relay_error(relay));
+    return 1;
+  }
+  mp3dec_relay_status(relay, &status);
+  printf("%lu frames, %.1f seconds\n", status.frames, status.duration);
+  if (status.duration < 8) {
+    printf("The file has to be longer than 8 seconds\n");
+    return 1;
+  }
+
+  /* the first listener is checked, over tcp with a buffer that fills
+     soon */
+  for (i = 0; i < nlisteners; i++) {
+    int sv[2];
+
+    if ((i == 0) ? (tcp_pair(sv) < 0) :
+	(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0)) {
+      perror("Could not connect a listener");
+      return 1;
+    }
+    if (mp3dec_relay_add(relay, sv[0]) < 0) {
+      printf("Could not add a listener: %s\n", mp3dec_relay_error(relay));
+      return 1;
+    }
+    fds[i].fd = sv[1];
+    fds[i].events = POLLIN;
+  }
+  nfds = nlisteners;
+
+  if (mp3dec_relay_play(relay) < 0) {
+    printf("Could not play: %s\n", mp3dec_relay_error(relay));
+    return 1;
+  }
+  start_time = now();
+  listen_for(2, 0);
+  report(relay, "play");
+
+  fill_slow();
+  if (mp3dec_relay_seek(relay, status.duration / 2) < 0) {
+    printf("Could not seek: %s\n", mp3dec_relay_error(relay));
+    return 1;
+  }
+  listen_for(2, 0);
+  report(relay, "seek");
+
+  fill_slow();
+  if ((mp3dec_relay_load(relay, argv[1]) < 0) ||
+      (mp3dec_relay_play(relay) < 0)) {
+    printf("Could not load again: %s\n", mp3dec_relay_error(relay));
+    return 1;
+  }
+  listen_for(2, 0);
+  report(relay, "load");
+
+  /* the last listeners go away */
+  for (i = nfds - CLOSED; i < nfds; i++)
+    close(fds[i].fd);
+  nfds -= CLOSED;
+  listen_for(1, 0);
+  report(relay, "closed");
+
+  mp3dec_relay_status(relay, &status);
+  mp3dec_relay_delete(relay);
+  listen_for(0.2, 0);
+
+  if (status.dropped < CLOSED) {
+    printf("FAIL: listeners that went away were not dropped\n");
+    ret = 1;
+  }
+  if (status.listeners != (unsigned int)nfds) {
+    printf("FAIL: %u of %d listeners left\n", status.listeners, nfds);
+    ret = 1;
+  }
+  cuts = check_stream(file, st.st_size);
+  printf("checked %lu bytes of one listener\n", stream_len);
+  if (cuts != 0) {
+    printf("FAIL: the stream is not made of whole frames\n");
+    ret = 1;
+  }
+
+  if (ret == 0)
+    printf("OK\n");
+  return ret;
+}
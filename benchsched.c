@@ -0,0 +1,126 @@
+/*
+ * jitter of the player next to busy processes: play a file against
+ * the paced null output with a small buffer while hogs keep every cpu
+ * busy, once as any other process and once with a real time priority,
+ * a pinned cpu and locked, prefaulted memory, and compare the late
+ * wakeups, underruns and page faults of both runs.
+ */
+
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "maddec.h"
+
+#define SECONDS    10
+#define BUFFER_MS  "20"
+#define MAX_HOGS   256
+
+static pid_t hogs[MAX_HOGS];
+
+static void start_hogs(int n) {
+  int i;
+
+  for (i = 0; i < n; i++) {
+    hogs[i] = fork();
+    if (hogs[i] == 0) {
+      volatile unsigned long spin = 0;
+      for (;;)
+	spin++;
+    }
+  }
+}
+
+static void stop_hogs(int n) {
+  int i;
+
+  for (i = 0; i < n; i++) {
+    if (hogs[i] > 0) {
+      kill(hogs[i], SIGKILL);
+      waitpid(hogs[i], NULL, 0);
+    }
+  }
+}
+
+static int run(char *name, char *filename, unsigned int seconds,
+	       mp3dec_options_t *options) {
+  mp3dec_state_t *state;
+  mp3dec_status_t start, end;
+
+  state = mp3dec_new();
+  if (state == NULL) {
+    printf("Could not start the player\n");
+    return -1;
+  }
+  if ((options != NULL) && (mp3dec_set_options(state, options) < 0)) {
+    printf("%-10s could not set the options: %s\n",
+	   name, mp3dec_error(state));
+    mp3dec_delete(state);
+    return -1;
+  }
+  if ((mp3dec_load(state, filename) < 0) || (mp3dec_play(state) < 0) ||
+      (mp3dec_status(state, &start) < 0)) {
+    printf("Could not play: %s\n", mp3dec_error(state));
+    mp3dec_delete(state);
+    return -1;
+  }
+
+  sleep(seconds);
+
+  if (mp3dec_status(state, &end) < 0) {
+    printf("Could not get status: %s\n", mp3dec_error(state));
+    mp3dec_delete(state);
+    return -1;
+  }
+  printf("%-10s %6lu %8lu %12.2f %7lu\n", name,
+	 end.audio_underruns - start.audio_underruns,
+	 end.audio_late - start.audio_late,
+	 end.audio_max_late_usec / 1000.0,
+	 end.process_faults - start.process_faults);
+  mp3dec_delete(state);
+  return 0;
+}
+
+int main(int argc, char *argv[]) {
+  unsigned int seconds = SECONDS;
+  mp3dec_options_t options;
+  int nhogs;
+
+  if ((argc < 2) || (argc > 4)) {
+    fprintf(stderr, "Usage: ./benchsched mp3file [seconds] [hogs]\n");
+    return 1;
+  }
+  if (argc > 2)
+    seconds = atoi(argv[2]);
+  nhogs = 2 * sysconf(_SC_NPROCESSORS_ONLN);
+  if (argc > 3)
+    nhogs = atoi(argv[3]);
+  if ((seconds == 0) || (nhogs < 0) || (nhogs > MAX_HOGS)) {
+    fprintf(stderr, "At least a second and at most %d hogs\n", MAX_HOGS);
+    return 1;
+  }
+
+  /* the simulated device runs dry after this */
+  setenv("MP3DEC_NULL_BUFFER_MS", BUFFER_MS, 0);
+
+  mp3dec_options_init(&options);
+  options.policy = MP3DEC_SCHED_FIFO;
+  options.priority = 50;
+  options.cpus = 1;
+  options.lock_memory = 1;
+  options.prefault = 1;
+
+  printf("%d hogs, %s ms buffer, %u seconds per run\n",
+	 nhogs, getenv("MP3DEC_NULL_BUFFER_MS"), seconds);
+  printf("options    underr     late  max late ms  faults\n");
+
+  start_hogs(nhogs);
+  run("default", argv[1], seconds, NULL);
+  run("realtime", argv[1], seconds, &options);
+  stop_hogs(nhogs);
+  return 0;
+}
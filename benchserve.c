@@ -0,0 +1,140 @@
+/*
+ * load test the pcm server: play a file, connect many local clients,
+ * some of which never read, and report the cpu time of the server per
+ * client and how many clients were disconnected for falling behind.
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+#include <netinet/in.h>
+
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "maddec.h"
+
+#define PORT      7777
+#define SECONDS   10
+#define MAX_CLIENTS 1000
+
+static double now(void) {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+/* slow clients get a small receive buffer, so that they fall behind
+   soon */
+static int connect_client(int slow) {
+  struct sockaddr_in addr;
+  int fd, size = 4096;
+
+  fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (fd < 0)
+    return -1;
+  if (slow)
+    setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(PORT);
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+int main(int argc, char *argv[]) {
+  static struct pollfd fds[MAX_CLIENTS];
+  static unsigned long long bytes[MAX_CLIENTS];
+  unsigned char buf[64 * 1024];
+  mp3dec_state_t *state;
+  mp3dec_status_t status;
+  unsigned long long total = 0;
+  int nclients, nslow, id, i, n, t;
+
+  if (argc != 4) {
+    fprintf(stderr, "Usage: ./benchserve mp3file clients slowclients\n");
+    return 1;
+  }
+  nclients = atoi(argv[2]);
+  nslow = atoi(argv[3]);
+  if ((nclients + nslow > MAX_CLIENTS) || (nclients < 0) || (nslow < 0)) {
+    fprintf(stderr, "At most %d clients\n", MAX_CLIENTS);
+    return 1;
+  }
+
+  state = mp3dec_new();
+  if (state == NULL) {
+    printf("Could not start the player\n");
+    return 1;
+  }
+  id = mp3dec_serve(state, PORT, 0);
+  if (id < 0) {
+    printf("Could not serve: %s\n", mp3dec_error(state));
+    return 1;
+  }
+  if ((mp3dec_load(state, argv[1]) < 0) || (mp3dec_play(state) < 0)) {
+    printf("Could not play: %s\n", mp3dec_error(state));
+    return 1;
+  }
+
+  /* the slow clients come last and are not polled */
+  for (i = 0; i < nclients + nslow; i++) {
+    fds[i].fd = connect_client(i >= nclients);
+    fds[i].events = POLLIN;
+    if (fds[i].fd < 0) {
+      perror("connect");
+      return 1;
+    }
+  }
+
+  for (t = 0; t < SECONDS; t++) {
+    unsigned long long start = total;
+    double end = now() + 1.0;
+
+    while (now() < end) {
+      n = poll(fds, nclients, 100);
+      for (i = 0; (n > 0) && (i < nclients); i++) {
+	int len;
+
+	if (!(fds[i].revents & POLLIN))
+	  continue;
+	len = read(fds[i].fd, buf, sizeof(buf));
+	if (len > 0) {
+	  bytes[i] += len;
+	  total += len;
+	}
+      }
+    }
+
+    if (mp3dec_status(state, &status) < 0) {
+      printf("Could not get status: %s\n", mp3dec_error(state));
+      return 1;
+    }
+    printf("clients %u evicted %lu server cpu %lu ns per client frame, "
+	   "%llu kbyte/s\n",
+	   status.sinks[id].clients, status.sinks[id].evicted,
+	   status.sinks[id].client_cpu_nsec, (total - start) / 1024);
+  }
+
+  for (i = 1; i < nclients; i++)
+    if (bytes[i] < bytes[0] / 2)
+      printf("client %d got %llu bytes, client 0 %llu\n",
+	     i, bytes[i], bytes[0]);
+
+  mp3dec_delete(state);
+
+  if (status.sinks[id].evicted < (unsigned long)nslow) {
+    printf("FAIL: slow clients were not disconnected\n");
+    return 1;
+  }
+  printf("OK\n");
+  return 0;
+}
@@ -1,13 +1,19 @@
+#define _GNU_SOURCE
+
 #include <sys/types.h>
 #include <sys/uio.h>
 #include <sys/ioctl.h>
 #include <sys/mman.h>
+#include <sys/resource.h>
 #include <sys/stat.h>
 
 #include <stdlib.h>
 
 #include <assert.h>
 #include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
 #include <stdio.h>
 #include <errno.h>
 #include <unistd.h>
@@ -19,14 +25,10 @@
 #include "maddec_internal.h"
 #include "error.h"
 #include "misc.h"
+#include "tags.h"
 
 #include "audio.h"
 
-static enum mad_flow mad_input(void *data, struct mad_stream *stream);
-static enum mad_flow mad_output(void *data, struct mad_header const *header, struct mad_pcm *pcm);
-static enum mad_flow mad_error(void *data, struct mad_stream *stream, struct mad_frame *frame);
-static int mp3dec_child_read_cmd(child_state_t *state);
-
 static const char *mp3dec_child_state_str(child_state_t *state) {
   switch (state->state) {
   case CHILD_NONE:
@@ -39,47 +41,71 @@ static const char *mp3dec_child_state_str(child_state_t *state) {
     return "CHILD_PAUSE";
   case CHILD_STOP:
     return "CHILD_STOP";
+  case CHILD_EXIT:
+    return "CHILD_EXIT";
   default:
     return "UNKNOWN";
   }
 }
 
+static decoder_t *mp3dec_child_current(child_state_t *state) {
+  return &state->decoders[state->cur];
+}
+
+static decoder_t *mp3dec_child_next(child_state_t *state) {
+  return &state->decoders[state->cur ^ 1];
+}
+
 /* initializing and stuff */
 static void mp3dec_child_reset(child_state_t *state,
 			       int cmd_fd, int response_fd) {
+  int i;
+
   state->cmd_fd = cmd_fd;
   state->response_fd = response_fd;
   
   error_reset(&state->error);
-  memset(state->filename, 0, sizeof(state->filename));
-  
+  error_reset(&state->last_error);
 
   state->state = CHILD_NONE;
 
-  state->mp3_fd = -1;
-  state->mp3len = 0;
-  state->mp3eof = 0;
-  memset(state->mp3data, 0, sizeof(state->mp3data));
+  decoder_init(&state->decoders[0]);
+  decoder_init(&state->decoders[1]);
+  state->cur = 0;
+  for (i = 0; i < CHILD_MAX_OVERLAYS; i++)
+    decoder_init(&state->overlays[i]);
+  queue_init(&state->queue);
+
+  state->crossfade_ms = 0;
+  state->crossfading = 0;
+  mixer_init(&state->mixer);
+  state->output_gain = MAD_F_ONE;
+  pcm_pool_init(&state->pool);
+  for (i = 0; i < SINK_MAX; i++)
+    sink_init(&state->sinks[i]);
 
-  mad_decoder_init(&state->decoder, state,
-		   mad_input, 0, 0,
-		   mad_output,
-		   mad_error, 0);
-  state->mad_initialized = 1;
+  state->quality = MP3DEC_QUALITY_FULL;
+  state->out_samplerate = state->out_channels = 0;
+  pcm_adapt_init(&state->adapt);
+
+  state->cpu_usec = state->cpu_frames = 0;
+  state->fade_cpu_usec = state->fade_cpu_frames = 0;
+  state->preview_cpu_usec = state->preview_cpu_frames = 0;
 }
 
 static void mp3dec_child_close(child_state_t *state) {
-  if (state->mad_initialized) {
-    mad_decoder_finish(&state->decoder);
-    state->mad_initialized = 0;
-  }
+  int i;
+
+  decoder_finish(&state->decoders[0]);
+  decoder_finish(&state->decoders[1]);
+  for (i = 0; i < CHILD_MAX_OVERLAYS; i++)
+    decoder_finish(&state->overlays[i]);
+  queue_clear(&state->queue);
+  for (i = 0; i < SINK_MAX; i++)
+    sink_stop(&state->sinks[i]);
 
   audio_close(&state->error);
-  
-  if (state->mp3_fd != -1) {
-    close(state->mp3_fd);
-    state->mp3_fd = -1;
-  }
+  pcm_pool_free(&state->pool);
 
   if (state->cmd_fd != -1) {
     close(state->cmd_fd);
@@ -92,138 +118,610 @@ static void mp3dec_child_close(child_state_t *state) {
   }
 }
 
-/*
- * The following utility routine performs simple rounding, clipping, and
- * scaling of MAD's high-resolution samples down to 16 bits. It does not
- * perform any dithering or noise shaping, which would be recommended to
- * obtain any exceptional audio quality. It is therefore not recommended to
- * use this routine if high-quality output is desired.
- */
-static inline
-signed int mad_scale(mad_fixed_t sample)
-{
-  /* round */
-  sample += (1L << (MAD_F_FRACBITS - 16));
-
-  /* clip */
-  if (sample >= MAD_F_ONE)
-    sample = MAD_F_ONE - 1;
-  else if (sample < -MAD_F_ONE)
-    sample = -MAD_F_ONE;
-
-  /* quantize */
-  return sample >> (MAD_F_FRACBITS + 1 - 16);
+/* the mixer is only used when something has to be mixed */
+static int mp3dec_child_mixing(child_state_t *state) {
+  int i;
+
+  if (state->crossfading || !mixer_is_unity(&state->mixer, CHILD_SLOT_MAIN))
+    return 1;
+  for (i = 0; i < CHILD_MAX_OVERLAYS; i++)
+    if (decoder_is_open(&state->overlays[i]))
+      return 1;
+  return 0;
 }
 
-static
-enum mad_flow mad_input(void *data, struct mad_stream *stream) {
-  child_state_t *state = data;
-  int ret;
+/* fill the length of the current frame from an overlay or the track
+   fading in. A file is waited for, one that is waiting for stream data
+   is silent for the rest of the frame, one that fails is closed. Returns 1 when the
+   decoder has reached its end, the caller decides what to do with it. */
+static int mp3dec_child_mix_decoder(child_state_t *state,
+				    decoder_t *overlay, int slot,
+				    struct mad_pcm *pcm) {
+  unsigned int done = 0;
+  mp3dec_error_t error;
 
-  if ((state->mp3eof) || (state->state != CHILD_PLAY)) {
-    return MAD_FLOW_STOP;
-  }
+  while (decoder_is_open(overlay) && (done < pcm->length)) {
+    struct mad_pcm *opcm = &overlay->synth.pcm;
+    unsigned int count;
 
-  if (unix_check_fd_read(state->cmd_fd)) {
-    if (mp3dec_child_read_cmd(state) < 0) {
-      state->state = CHILD_ERROR;
-      return MAD_FLOW_BREAK;
+    if (overlay->pcm_pos >= opcm->length) {
+      switch (decoder_frame(overlay, &error)) {
+      case DECODER_FRAME:
+      case DECODER_SKIP:
+	continue;
+      case DECODER_WAIT:
+	if (overlay->input.type != INPUT_READ)
+	  return 0;
+	input_wait(&overlay->input);
+	continue;
+      case DECODER_EOF:
+	return 1;
+      default:
+	fprintf(stderr, "error decoding %s: %s\n", overlay->input.name,
+		error_get(&error));
+	decoder_close(overlay);
+	return 0;
+      }
+    }
+
+    if (opcm->samplerate != pcm->samplerate) {
+      fprintf(stderr, "%s has a different samplerate (%u hz)\n",
+	      overlay->input.name, opcm->samplerate);
+      decoder_close(overlay);
+      return 0;
     }
+
+    count = opcm->length - overlay->pcm_pos;
+    if (count > pcm->length - done)
+      count = pcm->length - done;
+    mixer_add(&state->mixer, slot, opcm, overlay->pcm_pos, done, count);
+    overlay->pcm_pos += count;
+    done += count;
   }
 
-  if (stream->next_frame) {
-    memmove(state->mp3data, stream->next_frame,
-	    (state->mp3len = &state->mp3data[state->mp3len] - stream->next_frame));
-  } else {
-    state->mp3len = 0;
+  return 0;
+}
+
+/* the current track sets the pace, the track fading in and the
+   overlays are mixed on top. Overlays that end are closed, a track
+   that ends while fading in is flagged in next_ended. */
+static struct mad_pcm *mp3dec_child_mix(child_state_t *state,
+					struct mad_pcm *pcm,
+					int *next_ended) {
+  int i;
+
+  mixer_start(&state->mixer, pcm->samplerate, pcm->channels, pcm->length);
+  mixer_add(&state->mixer, CHILD_SLOT_MAIN, pcm, 0, 0, pcm->length);
+  if (state->crossfading)
+    *next_ended = mp3dec_child_mix_decoder(state, mp3dec_child_next(state),
+					   CHILD_SLOT_NEXT, pcm);
+  for (i = 0; i < CHILD_MAX_OVERLAYS; i++)
+    if (mp3dec_child_mix_decoder(state, &state->overlays[i],
+				 CHILD_SLOT_OVERLAY + i, pcm))
+      decoder_close(&state->overlays[i]);
+  mixer_finish(&state->mixer, &state->mix_pcm);
+
+  return &state->mix_pcm;
+}
+
+/* stop a crossfade that has not finished. The current track is back at
+   its gain, the next one has been partly played and is dropped. */
+static void mp3dec_child_cancel_fade(child_state_t *state) {
+  if (!state->crossfading)
+    return;
+
+  mixer_fade(&state->mixer, CHILD_SLOT_MAIN, 1, 0);
+  mixer_set_gain(&state->mixer, CHILD_SLOT_NEXT, 1.0f, 0);
+  mixer_fade(&state->mixer, CHILD_SLOT_NEXT, 1, 0);
+  decoder_close(mp3dec_child_next(state));
+  state->crossfading = 0;
+}
+
+/* move the head of the queue into the slot of the next track, or of
+   the current one when nothing is loaded. Tracks that cannot be opened
+   are dropped. */
+static void mp3dec_child_queue_fill(child_state_t *state) {
+  char name[QUEUE_NAME_SIZE];
+  decoder_t *decoder;
+  mp3dec_error_t error;
+  int fd;
+
+  while (state->queue.count > 0) {
+    if (!decoder_is_open(mp3dec_child_current(state)))
+      decoder = mp3dec_child_current(state);
+    else if (!decoder_is_open(mp3dec_child_next(state)))
+      decoder = mp3dec_child_next(state);
+    else
+      break;
+
+    fd = queue_pop(&state->queue, name, &error);
+    if ((fd < 0) || (decoder_open_fd(decoder, fd, name, &error) < 0)) {
+      fprintf(stderr, "dropping queued track: %s\n", error_get(&error));
+      continue;
+    }
+    if ((decoder == mp3dec_child_current(state)) &&
+	((state->state == CHILD_NONE) || (state->state == CHILD_ERROR)))
+      state->state = CHILD_STOP;
   }
 
-  assert(state->mp3_fd >= 0);
+  queue_prefetch(&state->queue);
+}
 
-  ret = unix_read(state->mp3_fd, state->mp3data + state->mp3len,
-		  sizeof(state->mp3data) - state->mp3len);
-  
-  if (ret < 0) {
-    error_printf_strerror(&state->error, "Could not read from \"%s\"",
-			  mp3dec_child_state_str(state));
-    state->state = CHILD_ERROR;
-    return MAD_FLOW_BREAK;
-    
-  } else if (ret == 0) {
-    assert(sizeof(state->mp3data) - state->mp3len >= MAD_BUFFER_GUARD);
+/* the next track becomes the current one, in the middle of its frame
+   if it has been fading in */
+static void mp3dec_child_switch_track(child_state_t *state) {
+  decoder_close(mp3dec_child_current(state));
+  state->cur ^= 1;
+
+  if (state->crossfading) {
+    mixer_move(&state->mixer, CHILD_SLOT_NEXT, CHILD_SLOT_MAIN);
+    state->crossfading = 0;
+  }
+  decoder_trim_pcm(mp3dec_child_current(state));
+  mp3dec_child_queue_fill(state);
+}
 
-    while (ret < MAD_BUFFER_GUARD)
-      state->mp3data[ret++] = 0;
+/* the track fading in is shorter than the fade and has played to its
+   end. The fade is over, the track that was fading out goes with it,
+   and the next frame moves on in the queue or stops at the end of the
+   short track. */
+static void mp3dec_child_end_fade(child_state_t *state) {
+  mp3dec_child_switch_track(state);
+  mixer_fade(&state->mixer, CHILD_SLOT_MAIN, 1, 0);
+}
 
-    state->mp3eof = 1;
+/* go on with the next track right away, fading in or not */
+static int mp3dec_child_skip(child_state_t *state) {
+  if (decoder_is_open(mp3dec_child_next(state))) {
+    mp3dec_child_switch_track(state);
+    return 0;
   }
-  
-  state->mp3len += ret;
 
-  assert(state->mp3len > MAD_BUFFER_GUARD);
-  
-  mad_stream_buffer(stream, state->mp3data, state->mp3len);
-  return MAD_FLOW_CONTINUE;
+  if (state->queue.count == 0) {
+    error_set(&state->error, "No track to skip to");
+    error_set_code(&state->error, MP3DEC_ERR_STATE);
+    return -1;
+  }
+  decoder_close(mp3dec_child_current(state));
+  mp3dec_child_queue_fill(state);
+  if (!decoder_is_open(mp3dec_child_current(state))) {
+    error_set(&state->error, "None of the queued tracks could be opened");
+    state->state = CHILD_NONE;
+    return -1;
+  }
+  return 0;
+}
+
+/* drop everything after the current track */
+static void mp3dec_child_clear_queue(child_state_t *state) {
+  mp3dec_child_cancel_fade(state);
+  decoder_close(mp3dec_child_next(state));
+  queue_clear(&state->queue);
 }
 
-static
-enum mad_flow mad_output(void *data, struct mad_header const *header,
-			 struct mad_pcm *pcm) {
-  child_state_t *state = data;
+/* start fading into the next track once the current one is within the
+   crossfade length of its end. The fade is as long as what is left of
+   the track, so that both curves end together with it. */
+static void mp3dec_child_check_fade(child_state_t *state) {
+  decoder_t *decoder = mp3dec_child_current(state);
+  unsigned long length;
+  long remaining;
+
+  if ((state->crossfade_ms == 0) || state->crossfading ||
+      !decoder_is_open(mp3dec_child_next(state)))
+    return;
+
+  remaining = decoder_remaining_samples(decoder);
+  length = (unsigned long)state->crossfade_ms *
+    decoder->synth.pcm.samplerate / 1000;
+  if ((remaining <= 0) || ((unsigned long)remaining > length))
+    return;
+
+  /* the next track starts out at the gain of the current one */
+  mixer_set_gain(&state->mixer, CHILD_SLOT_NEXT,
+		 state->mixer.inputs[CHILD_SLOT_MAIN].target, 0);
+  mixer_fade(&state->mixer, CHILD_SLOT_MAIN, 0, remaining);
+  mixer_fade(&state->mixer, CHILD_SLOT_NEXT, 1, remaining);
+  state->crossfading = 1;
+}
+
+/* keep the output at its format while decoding at reduced quality,
+   otherwise the output follows the decoded frames */
+static struct mad_pcm *mp3dec_child_adapt(child_state_t *state,
+					  struct mad_pcm *pcm) {
+  if ((pcm->samplerate == state->out_samplerate) &&
+      (pcm->channels == state->out_channels))
+    return pcm;
+
+  if ((state->quality != MP3DEC_QUALITY_FULL) &&
+      (state->out_samplerate != 0) &&
+      pcm_adapt(&state->adapt, pcm, state->out_samplerate,
+		state->out_channels, &state->adapt_pcm))
+    return &state->adapt_pcm;
+
+  state->out_samplerate = pcm->samplerate;
+  state->out_channels = pcm->channels;
+  return pcm;
+}
+
+static void mp3dec_child_set_quality(child_state_t *state,
+				     unsigned int quality) {
+  int i;
+
+  state->quality = quality;
+  decoder_set_quality(&state->decoders[0], quality);
+  decoder_set_quality(&state->decoders[1], quality);
+  for (i = 0; i < CHILD_MAX_OVERLAYS; i++)
+    decoder_set_quality(&state->overlays[i], quality);
+  pcm_adapt_init(&state->adapt);
+}
 
-  if (state->state != CHILD_PLAY) {
-    return MAD_FLOW_STOP;
+static void mp3dec_child_set_resync(child_state_t *state,
+				    unsigned long max_bytes,
+				    unsigned long max_count) {
+  int i;
+
+  decoder_set_resync(&state->decoders[0], max_bytes, max_count);
+  decoder_set_resync(&state->decoders[1], max_bytes, max_count);
+  for (i = 0; i < CHILD_MAX_OVERLAYS; i++)
+    decoder_set_resync(&state->overlays[i], max_bytes, max_count);
+}
+
+/* stack the decoder and the audio output may grow into */
+#define CHILD_PREFAULT_STACK (256 * 1024)
+
+static void mp3dec_child_prefault_stack(void) {
+  unsigned char stack[CHILD_PREFAULT_STACK];
+
+  unix_prefault(stack, sizeof(stack));
+}
+
+/* applied to the decoding thread and the threads started by it from
+   then on */
+static int mp3dec_child_set_options(child_state_t *state,
+				    mp3dec_options_t *options) {
+  struct sched_param param;
+  int ret, policy = SCHED_OTHER;
+
+  memset(&param, 0, sizeof(param));
+  if (options->policy != MP3DEC_SCHED_OTHER) {
+    policy = (options->policy == MP3DEC_SCHED_FIFO) ? SCHED_FIFO : SCHED_RR;
+    param.sched_priority = options->priority;
+  }
+  ret = pthread_setschedparam(pthread_self(), policy, &param);
+  if (ret != 0) {
+    errno = ret;
+    error_set_strerror(&state->error, "Could not set the scheduling policy");
+    return -1;
+  }
+  if ((policy == SCHED_OTHER) &&
+      (setpriority(PRIO_PROCESS, 0, options->nice) < 0)) {
+    error_set_strerror(&state->error, "Could not set the nice level");
+    return -1;
   }
 
-  if (unix_check_fd_read(state->cmd_fd)) {
-    if (mp3dec_child_read_cmd(state) < 0) {
-      state->state = CHILD_ERROR;
-      return MAD_FLOW_BREAK;
+  if (options->cpus != 0) {
+#ifdef __linux__
+    cpu_set_t set;
+    int i;
+
+    CPU_ZERO(&set);
+    for (i = 0; i < 64; i++)
+      if (options->cpus & (1ULL << i))
+	CPU_SET(i, &set);
+    if (sched_setaffinity(0, sizeof(set), &set) < 0) {
+      error_set_strerror(&state->error, "Could not set the cpu affinity");
+      return -1;
+    }
+#else
+    error_set(&state->error, "CPU affinity is not supported");
+    error_set_code(&state->error, MP3DEC_ERR_INVALID);
+    return -1;
+#endif
+  }
+
+  /* the tracks mapped from then on are read in whole */
+  if (options->lock_memory) {
+    if (mlockall(MCL_CURRENT | MCL_FUTURE) < 0) {
+      error_set_strerror(&state->error, "Could not lock the memory");
+      return -1;
+    }
+  } else {
+    munlockall();
+  }
+
+  if (options->prefault) {
+    unix_prefault(state, sizeof(*state));
+    unix_prefault(state->pool.mem, state->pool.buffer_size * PCM_POOL_SIZE);
+    mp3dec_child_prefault_stack();
+  }
+
+  return 0;
+}
+
+/* a slot for a new sink, or -1 */
+static int mp3dec_child_sink_slot(child_state_t *state) {
+  int i;
+
+  for (i = 0; i < SINK_MAX; i++)
+    if (!sink_is_running(&state->sinks[i]))
+      return i;
+
+  error_set(&state->error, "Too many sinks");
+  error_set_code(&state->error, MP3DEC_ERR_STATE);
+  return -1;
+}
+
+/* decode, mix and output one frame of the current track */
+static child_step_e mp3dec_child_play_frame(child_state_t *state) {
+  decoder_t *decoder = mp3dec_child_current(state);
+  struct mad_pcm *pcm;
+  pcm_buffer_t *buf;
+  int next_ended = 0;
+  int ret, i;
+
+  /* the rest of a frame of a track that has just faded in is played
+     before decoding the next one */
+  if (decoder->pcm_pos >= decoder->synth.pcm.length) {
+    switch (decoder_frame(decoder, &state->error)) {
+    case DECODER_FRAME:
+      break;
+    case DECODER_SKIP:
+      return CHILD_STEP_OK;
+    case DECODER_WAIT:
+      return CHILD_STEP_WAIT;
+    case DECODER_EOF:
+      if (!decoder_is_open(mp3dec_child_next(state)))
+	return CHILD_STEP_EOF;
+      mp3dec_child_switch_track(state);
+      return CHILD_STEP_OK;
+    default:
+      return CHILD_STEP_ERROR;
     }
+    mp3dec_child_check_fade(state);
   }
 
-  if (!audio_write(pcm, &state->error)) {
+  pcm = &decoder->synth.pcm;
+  if (mp3dec_child_mixing(state))
+    pcm = mp3dec_child_mix(state, pcm, &next_ended);
+  decoder->pcm_pos = decoder->synth.pcm.length;
+  pcm = mp3dec_child_adapt(state, pcm);
+
+  buf = pcm_pool_get(&state->pool);
+  if (buf == NULL) {
+    error_set(&state->error, "No free pcm staging buffer");
+    return CHILD_STEP_ERROR;
+  }
+  pcm_stage(pcm, state->output_gain, buf);
+  for (i = 0; i < SINK_MAX; i++)
+    if (sink_is_running(&state->sinks[i]))
+      sink_publish(&state->sinks[i], buf);
+  ret = audio_write(buf, &state->error);
+  pcm_pool_put(&state->pool, buf);
+  if (!ret) {
     error_prepend(&state->error, "Could not write pcm data to audio");
+    error_set_code(&state->error, MP3DEC_ERR_AUDIO);
+    return CHILD_STEP_ERROR;
+  }
+
+  if (state->crossfading) {
+    if (next_ended)
+      mp3dec_child_end_fade(state);
+    else if (!decoder_is_open(mp3dec_child_next(state)))
+      /* the track fading in failed, the current one plays on */
+      mp3dec_child_cancel_fade(state);
+    else if (!mixer_is_fading(&state->mixer, CHILD_SLOT_MAIN))
+      /* the estimate was too short, the rest of the track is silent */
+      mp3dec_child_switch_track(state);
+  }
+
+  return CHILD_STEP_OK;
+}
+
+/* decode and output a frame, keeping track of the cpu time it takes
+   at reduced quality, during a crossfade and otherwise */
+static child_step_e mp3dec_child_step(child_state_t *state) {
+  unsigned long long start = unix_thread_cpu_usec();
+  int crossfading = state->crossfading;
+  child_step_e ret;
+
+  ret = mp3dec_child_play_frame(state);
+  if (ret != CHILD_STEP_OK)
+    return ret;
+
+  if (state->quality != MP3DEC_QUALITY_FULL) {
+    state->preview_cpu_usec += unix_thread_cpu_usec() - start;
+    state->preview_cpu_frames++;
+  } else if (crossfading || state->crossfading) {
+    state->fade_cpu_usec += unix_thread_cpu_usec() - start;
+    state->fade_cpu_frames++;
+  } else {
+    state->cpu_usec += unix_thread_cpu_usec() - start;
+    state->cpu_frames++;
+  }
+
+  return ret;
+}
+
+/* switch to a new track, the decoder takes ownership of fd */
+static int mp3dec_child_load(child_state_t *state, int fd, char *name) {
+  mp3dec_child_cancel_fade(state);
+
+  if (decoder_open_fd(mp3dec_child_current(state), fd, name,
+		      &state->error) < 0) {
     state->state = CHILD_ERROR;
-    return MAD_FLOW_BREAK;
+    return -1;
   }
 
-  return MAD_FLOW_CONTINUE;
+  /* a running track is replaced, decoding restarts from scratch
+     on the new file without leaving the current state */
+  if ((state->state == CHILD_NONE) || (state->state == CHILD_ERROR))
+    state->state = CHILD_STOP;
+
+  return 0;
 }
 
-static
-enum mad_flow mad_error(void *data, struct mad_stream *stream,
-			struct mad_frame *frame) {
-  child_state_t *state = data;
+/* queue a track to follow the current one. Without a current track it
+   is loaded right away. */
+static int mp3dec_child_load_next(child_state_t *state, int fd,
+				  char *name) {
+  if (!decoder_is_open(mp3dec_child_current(state)))
+    return mp3dec_child_load(state, fd, name);
 
-  fprintf(stderr, "decoder error 0x%05x (%s) at byte offset %u\n",
-	  stream->error, mad_stream_errorstr(stream),
-	  stream->this_frame - state->mp3data);
+  mp3dec_child_cancel_fade(state);
+  return decoder_open_fd(mp3dec_child_next(state), fd, name, &state->error);
+}
 
-  /* XXX check maximum number of resyncs */
-  if (unix_check_fd_read(state->cmd_fd)) {
-    if (mp3dec_child_read_cmd(state) < 0) {
-      state->state = CHILD_ERROR;
-      return MAD_FLOW_BREAK;
-    }
+/* start an overlay in a free mixer slot, at unity gain */
+static int mp3dec_child_overlay(child_state_t *state, int fd, char *name) {
+  int i;
+
+  for (i = 0; i < CHILD_MAX_OVERLAYS; i++) {
+    if (!decoder_is_open(&state->overlays[i]))
+      break;
   }
-  
-  return MAD_FLOW_CONTINUE;
+  if (i == CHILD_MAX_OVERLAYS) {
+    error_set(&state->error, "All overlay slots are in use");
+    close(fd);
+    return -1;
+  }
+
+  if (decoder_open_fd(&state->overlays[i], fd, name, &state->error) < 0)
+    return -1;
+  mixer_set_gain(&state->mixer, CHILD_SLOT_OVERLAY + i, 1.0f, 0);
+
+  return CHILD_SLOT_OVERLAY + i;
+}
+
+/* wait for one of the descriptors without counting as hung. The
+   heartbeat is fresh before the supervisor sees the child busy. */
+static void mp3dec_child_idle(child_state_t *state, int fd1, int fd2) {
+  state->shared->idle = 1;
+  unix_wait_fd_read(fd1, fd2);
+  state->shared->heartbeat_usec = unix_time_usec();
+  __sync_synchronize();
+  state->shared->idle = 0;
+}
+
+/* where the current track is, so that a new child can take over from
+   here if this one dies */
+static void mp3dec_child_checkpoint(child_state_t *state) {
+  mp3dec_checkpoint_t *cp = &state->shared->checkpoint;
+  decoder_t *decoder = mp3dec_child_current(state);
+  const char *name = "";
+
+  if ((decoder->input.type == INPUT_READ) &&
+      strcmp(decoder->input.name, CHILD_FD_NAME))
+    name = decoder->input.name;
+
+  cp->seq++;
+  __sync_synchronize();
+  if (strcmp(cp->name, name))
+    strcpy(cp->name, name);
+  cp->position = decoder->position;
+  cp->state = state->state;
+  __sync_synchronize();
+  cp->seq++;
+}
+
+static void mp3dec_child_status(child_state_t *state,
+				mp3dec_status_t *status) {
+  struct rusage usage;
+  decoder_t *decoder;
+  int i;
+
+  memset(status, 0, sizeof(*status));
+
+  switch (state->state) {
+  case CHILD_PLAY:
+    status->state = MP3DEC_STATE_PLAY;
+    break;
+  case CHILD_PAUSE:
+    status->state = MP3DEC_STATE_PAUSE;
+    break;
+  case CHILD_ERROR:
+    status->state = MP3DEC_STATE_ERROR;
+    break;
+  case CHILD_STOP:
+    status->state = MP3DEC_STATE_STOP;
+    break;
+  default:
+    status->state = MP3DEC_STATE_NONE;
+    break;
+  }
+
+  decoder = mp3dec_child_current(state);
+  status->frames = decoder->frames;
+  status->position = decoder->position;
+  status->buffering = decoder->input.buffering;
+  status->buffered = decoder->input.jb_count;
+  status->underruns = decoder->input.underruns;
+  status->stalls = decoder->input.ra.stalls;
+  status->stall_usec = decoder->input.ra.stall_usec;
+
+  for (i = 0; i < CHILD_MAX_OVERLAYS; i++)
+    if (decoder_is_open(&state->overlays[i]))
+      status->overlays++;
+
+  status->next_loaded = decoder_is_open(mp3dec_child_next(state));
+  status->queued = state->queue.count;
+  status->crossfading = state->crossfading;
+  if (state->cpu_frames > 0)
+    status->cpu_usec = state->cpu_usec / state->cpu_frames;
+  if (state->fade_cpu_frames > 0)
+    status->crossfade_cpu_usec = state->fade_cpu_usec / state->fade_cpu_frames;
+
+  status->quality = state->quality;
+  if (state->preview_cpu_frames > 0)
+    status->preview_cpu_usec =
+      state->preview_cpu_usec / state->preview_cpu_frames;
+
+  status->pcm_allocs = state->pool.allocs;
+  memcpy(status->decode_errors, decoder->errors,
+	 sizeof(status->decode_errors));
+
+  status->resyncs = decoder->resyncs;
+  status->corrupt_bytes = decoder->corrupt_bytes;
+  status->nregions = decoder->nregions;
+  memcpy(status->regions, decoder->regions, sizeof(status->regions));
+
+  tags_cache_stats(&status->tag_cache_hits, &status->tag_cache_misses);
+  audio_stats(status);
+
+  if (getrusage(RUSAGE_SELF, &usage) == 0) {
+    status->process_cpu_usec =
+      (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000000ULL +
+      usage.ru_utime.tv_usec + usage.ru_stime.tv_usec;
+    status->process_faults = usage.ru_minflt + usage.ru_majflt;
+  }
+  status->process_rss_kb = unix_rss_kb();
+
+  for (i = 0; i < SINK_MAX; i++)
+    sink_stats(&state->sinks[i], &status->sinks[i]);
 }
 
 static int mp3dec_child_read_cmd(child_state_t *state) {
+  mp3dec_error_reply_t reply;
   mp3dec_cmd_e cmd;
   unsigned char buf[CMD_BUF_SIZE];
   unsigned int buflen;
+  int passed_fd;
   int ret;
 
-  printf("reading cmd\n");
-  ret = mp3dec_read_cmd(state->cmd_fd, &cmd,
-			buf, &buflen, sizeof(buf),
-			&state->error);
-  printf("read: %d, %d\n", ret, cmd);
+  ret = mp3dec_read_cmd_fd(state->cmd_fd, &cmd,
+			   buf, &buflen, sizeof(buf) - 1,
+			   &passed_fd, &state->error);
   if (ret < 0)
     return ret;
+  buf[buflen] = '\0';
+
+  /* only LOAD_FD, ADD_SINK and SERVE take ownership of a passed
+     descriptor */
+  if ((passed_fd != -1) && (cmd != MP3DEC_COMMAND_LOAD_FD) &&
+      (cmd != MP3DEC_COMMAND_ADD_SINK) && (cmd != MP3DEC_COMMAND_SERVE)) {
+    close(passed_fd);
+    passed_fd = -1;
+  }
 
   switch (cmd) {
   case MP3DEC_COMMAND_PLAY: {
@@ -233,12 +731,19 @@ static int mp3dec_child_read_cmd(child_state_t *state) {
     case CHILD_NONE:
       error_set(&state->error, "Cannot play: no track loaded");
       goto error;
-    case CHILD_PAUSE:
     case CHILD_STOP:
+      /* the last track played until the end, start it over */
+      if (mp3dec_child_current(state)->input.eof &&
+	  (decoder_rewind(mp3dec_child_current(state), &state->error) < 0)) {
+	state->state = CHILD_ERROR;
+	goto error;
+      }
       state->state = CHILD_PLAY;
-      mp3dec_write_cmd(state->response_fd, MP3DEC_RESPONSE_ACK, NULL, 0, &state->error);
-      mad_decoder_run(&state->decoder, MAD_DECODER_MODE_SYNC);
-      return 0;
+      goto ack;
+    case CHILD_PAUSE:
+    case CHILD_PLAY:
+      state->state = CHILD_PLAY;
+      goto ack;
     default:
       error_printf(&state->error, "Cannot play: unknown state (%d)",
 		   state->state);
@@ -253,14 +758,23 @@ static int mp3dec_child_read_cmd(child_state_t *state) {
     
     if (state->state == CHILD_PLAY) {
       state->state = CHILD_PAUSE;
-      mp3dec_write_cmd(state->response_fd, MP3DEC_RESPONSE_ACK, NULL, 0, &state->error);
-      while (state->state == CHILD_PAUSE) {
-	mp3dec_child_read_cmd(state);
-      }
-      return 0;
+      audio_pause();
+      goto ack;
     } else if (state->state == CHILD_PAUSE) {
       state->state = CHILD_PLAY;
       goto ack;
+    } else if ((state->state == CHILD_STOP) &&
+	       decoder_is_open(mp3dec_child_current(state))) {
+      /* cue a loaded track without playing a frame of it, as PLAY
+	 would start it over at the end */
+      if (mp3dec_child_current(state)->input.eof &&
+	  (decoder_rewind(mp3dec_child_current(state), &state->error) < 0)) {
+	state->state = CHILD_ERROR;
+	goto error;
+      }
+      state->state = CHILD_PAUSE;
+      audio_pause();
+      goto ack;
     } else {
       error_printf(&state->error, "Cannot pause when in state %s",
 		   mp3dec_child_state_str(state));
@@ -269,42 +783,347 @@ static int mp3dec_child_read_cmd(child_state_t *state) {
   }
 
   case MP3DEC_COMMAND_EXIT: {
-    mp3dec_write_cmd(state->response_fd, MP3DEC_RESPONSE_ACK, NULL, 0, &state->error);
-    mp3dec_child_close(state);
-    exit(0);
-    break;
+    state->state = CHILD_EXIT;
+    goto ack;
   }
 
   case MP3DEC_COMMAND_LOAD: {
-    if (state->mp3_fd != -1) {
-      close(state->mp3_fd);
-      state->mp3_fd = -1;
-    }
-    
-    assert(state->mp3_fd == -1);
-    state->mp3_fd = open(buf, O_RDONLY); /* XXX receive string correctly */
-    if (state->mp3_fd < 0) {
+    int fd = open((char *)buf, O_RDONLY);
+    if (fd < 0) {
       error_printf_strerror(&state->error, "Could not open \"%s\"", buf);
+      mp3dec_child_cancel_fade(state);
+      decoder_close(mp3dec_child_current(state));
       state->state = CHILD_ERROR;
       goto error;
-    } else {
-      if (state->state == CHILD_NONE)
-	state->state = CHILD_STOP;
-      strncpy(state->filename, buf, sizeof(state->filename));
-      state->filename[sizeof(state->filename) - 1] = '\0';
-      goto ack;
     }
-    break;
+    if (mp3dec_child_load(state, fd, (char *)buf) < 0)
+      goto error;
+    goto ack;
+  }
+
+  case MP3DEC_COMMAND_LOAD_FD: {
+    if (passed_fd == -1) {
+      error_set(&state->error, "No descriptor passed with LOAD_FD");
+      goto error;
+    }
+    if (mp3dec_child_load(state, passed_fd, CHILD_FD_NAME) < 0)
+      goto error;
+    goto ack;
+  }
+
+  case MP3DEC_COMMAND_LOAD_NEXT: {
+    int fd = open((char *)buf, O_RDONLY);
+    if (fd < 0) {
+      error_printf_strerror(&state->error, "Could not open \"%s\"", buf);
+      goto error;
+    }
+    if (mp3dec_child_load_next(state, fd, (char *)buf) < 0)
+      goto error;
+    goto ack;
+  }
+
+  case MP3DEC_COMMAND_ENQUEUE: {
+    /* the name is kept for later, it has to be exactly the string
+       that was sent, with its terminator */
+    if ((buflen < 2) || (strlen((char *)buf) != buflen - 1)) {
+      error_set(&state->error, "Invalid ENQUEUE arguments");
+      error_set_code(&state->error, MP3DEC_ERR_INVALID);
+      goto error;
+    }
+    if (queue_push(&state->queue, (char *)buf, &state->error) < 0)
+      goto error;
+    mp3dec_child_queue_fill(state);
+    goto ack;
+  }
+
+  case MP3DEC_COMMAND_CLEAR: {
+    mp3dec_child_clear_queue(state);
+    goto ack;
+  }
+
+  case MP3DEC_COMMAND_SKIP: {
+    if (mp3dec_child_skip(state) < 0)
+      goto error;
+    goto ack;
+  }
+
+  case MP3DEC_COMMAND_SEEK: {
+    unsigned long long offset;
+
+    if (buflen != sizeof(offset)) {
+      error_set(&state->error, "Invalid SEEK arguments");
+      goto error;
+    }
+    memcpy(&offset, buf, sizeof(offset));
+    if (!decoder_is_open(mp3dec_child_current(state))) {
+      error_set(&state->error, "Cannot seek: no track loaded");
+      error_set_code(&state->error, MP3DEC_ERR_STATE);
+      goto error;
+    }
+    mp3dec_child_cancel_fade(state);
+    if (decoder_seek(mp3dec_child_current(state), offset,
+		     &state->error) < 0)
+      goto error;
+    goto ack;
+  }
+
+  case MP3DEC_COMMAND_ADD_SINK: {
+    unsigned int policy, id;
+
+    if (passed_fd == -1) {
+      error_set(&state->error, "No descriptor passed with ADD_SINK");
+      goto error;
+    }
+    if (buflen == sizeof(policy))
+      memcpy(&policy, buf, sizeof(policy));
+    if ((buflen != sizeof(policy)) || (policy > MP3DEC_DROP_NEWEST)) {
+      close(passed_fd);
+      error_set(&state->error, "Invalid ADD_SINK arguments");
+      error_set_code(&state->error, MP3DEC_ERR_INVALID);
+      goto error;
+    }
+    ret = mp3dec_child_sink_slot(state);
+    if (ret < 0) {
+      close(passed_fd);
+      goto error;
+    }
+    id = ret;
+    if (sink_start_fd(&state->sinks[id], passed_fd, &state->pool, policy,
+		      &state->error) < 0)
+      goto error;
+    ret = mp3dec_write_cmd(state->response_fd, MP3DEC_RESPONSE_ACK,
+			   &id, sizeof(id), &state->error);
+    if (ret < 0) {
+      error_prepend(&state->error, "Could not send ADD_SINK");
+      return -1;
+    }
+    return 0;
+  }
+
+  case MP3DEC_COMMAND_SERVE: {
+    unsigned int flags, id;
+
+    if (passed_fd == -1) {
+      error_set(&state->error, "No descriptor passed with SERVE");
+      goto error;
+    }
+    if (buflen != sizeof(flags)) {
+      close(passed_fd);
+      error_set(&state->error, "Invalid SERVE arguments");
+      goto error;
+    }
+    memcpy(&flags, buf, sizeof(flags));
+    ret = mp3dec_child_sink_slot(state);
+    if (ret < 0) {
+      close(passed_fd);
+      goto error;
+    }
+    id = ret;
+    if (sink_start_server(&state->sinks[id], passed_fd, &state->pool,
+			  flags & MP3DEC_SERVE_WAV, &state->error) < 0)
+      goto error;
+    ret = mp3dec_write_cmd(state->response_fd, MP3DEC_RESPONSE_ACK,
+			   &id, sizeof(id), &state->error);
+    if (ret < 0) {
+      error_prepend(&state->error, "Could not send SERVE");
+      return -1;
+    }
+    return 0;
+  }
+
+  case MP3DEC_COMMAND_REMOVE_SINK: {
+    unsigned int id;
+
+    if (buflen != sizeof(id)) {
+      error_set(&state->error, "Invalid REMOVE_SINK arguments");
+      goto error;
+    }
+    memcpy(&id, buf, sizeof(id));
+    if ((id >= SINK_MAX) || !sink_is_running(&state->sinks[id])) {
+      error_set(&state->error, "No such sink");
+      error_set_code(&state->error, MP3DEC_ERR_INVALID);
+      goto error;
+    }
+    sink_stop(&state->sinks[id]);
+    goto ack;
+  }
+
+  case MP3DEC_COMMAND_CROSSFADE: {
+    if (buflen != sizeof(state->crossfade_ms)) {
+      error_set(&state->error, "Invalid CROSSFADE arguments");
+      goto error;
+    }
+    memcpy(&state->crossfade_ms, buf, sizeof(state->crossfade_ms));
+    goto ack;
+  }
+
+  case MP3DEC_COMMAND_REPLAYGAIN: {
+    mp3dec_replaygain_cmd_t rg;
+
+    if (buflen != sizeof(rg)) {
+      error_set(&state->error, "Invalid REPLAYGAIN arguments");
+      goto error;
+    }
+    memcpy(&rg, buf, sizeof(rg));
+    state->output_gain = pcm_gain(rg.gain_db, rg.peak);
+    goto ack;
+  }
+
+  case MP3DEC_COMMAND_QUALITY: {
+    unsigned int quality;
+
+    if (buflen != sizeof(quality)) {
+      error_set(&state->error, "Invalid QUALITY arguments");
+      goto error;
+    }
+    memcpy(&quality, buf, sizeof(quality));
+    mp3dec_child_set_quality(state, quality);
+    goto ack;
+  }
+
+  case MP3DEC_COMMAND_RESYNC: {
+    unsigned long args[2];
+
+    if (buflen != sizeof(args)) {
+      error_set(&state->error, "Invalid RESYNC arguments");
+      goto error;
+    }
+    memcpy(args, buf, sizeof(args));
+    mp3dec_child_set_resync(state, args[0], args[1]);
+    goto ack;
+  }
+
+  case MP3DEC_COMMAND_OPTIONS: {
+    mp3dec_options_t options;
+
+    if (buflen != sizeof(options)) {
+      error_set(&state->error, "Invalid OPTIONS arguments");
+      goto error;
+    }
+    memcpy(&options, buf, sizeof(options));
+    if (mp3dec_child_set_options(state, &options) < 0)
+      goto error;
+    goto ack;
+  }
+
+  case MP3DEC_COMMAND_LATENCY: {
+    unsigned int ms;
+
+    if (buflen != sizeof(ms)) {
+      error_set(&state->error, "Invalid LATENCY arguments");
+      goto error;
+    }
+    memcpy(&ms, buf, sizeof(ms));
+    if (!audio_set_latency(ms, &state->error)) {
+      error_set_code(&state->error, MP3DEC_ERR_AUDIO);
+      goto error;
+    }
+    goto ack;
   }
 
   case MP3DEC_COMMAND_STATUS: {
-    error_set(&state->error, "STATUS not supported");
-    goto error;
-    break;
+    mp3dec_status_t status;
+
+    mp3dec_child_status(state, &status);
+    ret = mp3dec_write_cmd(state->response_fd, MP3DEC_RESPONSE_ACK,
+			   &status, sizeof(status), &state->error);
+    if (ret < 0) {
+      error_prepend(&state->error, "Could not send STATUS");
+      return -1;
+    }
+    return 0;
+  }
+
+  case MP3DEC_COMMAND_METADATA: {
+    decoder_t *decoder = mp3dec_child_current(state);
+
+    if (!decoder_is_open(decoder)) {
+      error_set(&state->error, "No track loaded");
+      error_set_code(&state->error, MP3DEC_ERR_STATE);
+      goto error;
+    }
+    ret = mp3dec_write_cmd(state->response_fd, MP3DEC_RESPONSE_ACK,
+			   &decoder->input.metadata,
+			   sizeof(decoder->input.metadata), &state->error);
+    if (ret < 0) {
+      error_prepend(&state->error, "Could not send METADATA");
+      return -1;
+    }
+    return 0;
+  }
+
+  case MP3DEC_COMMAND_STREAM_BUFFER: {
+    unsigned long args[3];
+
+    if (buflen != sizeof(args)) {
+      error_set(&state->error, "Invalid STREAM_BUFFER arguments");
+      goto error;
+    }
+    memcpy(args, buf, sizeof(args));
+    if ((input_set_stream_buffer(&state->decoders[0].input,
+				 args[0], args[1], args[2],
+				 &state->error) < 0) ||
+	(input_set_stream_buffer(&state->decoders[1].input,
+				 args[0], args[1], args[2],
+				 &state->error) < 0))
+      goto error;
+    goto ack;
+  }
+
+  case MP3DEC_COMMAND_OVERLAY: {
+    int fd, slot;
+
+    fd = open((char *)buf, O_RDONLY);
+    if (fd < 0) {
+      error_printf_strerror(&state->error, "Could not open \"%s\"", buf);
+      goto error;
+    }
+    slot = mp3dec_child_overlay(state, fd, (char *)buf);
+    if (slot < 0)
+      goto error;
+    ret = mp3dec_write_cmd(state->response_fd, MP3DEC_RESPONSE_ACK,
+			   &slot, sizeof(slot), &state->error);
+    if (ret < 0) {
+      error_prepend(&state->error, "Could not send ACK");
+      return -1;
+    }
+    return 0;
+  }
+
+  case MP3DEC_COMMAND_GAIN: {
+    mp3dec_gain_cmd_t gain;
+    unsigned int samplerate;
+
+    if (buflen != sizeof(gain)) {
+      error_set(&state->error, "Invalid GAIN arguments");
+      goto error;
+    }
+    memcpy(&gain, buf, sizeof(gain));
+    if (gain.slot >= CHILD_SLOT_OVERLAY + CHILD_MAX_OVERLAYS) {
+      error_printf(&state->error, "No mixer slot %u", gain.slot);
+      goto error;
+    }
+
+    samplerate = mp3dec_child_current(state)->synth.pcm.samplerate;
+    if (samplerate == 0)
+      samplerate = 44100;
+    mixer_set_gain(&state->mixer, gain.slot, gain.gain,
+		   (unsigned long)gain.ramp_ms * samplerate / 1000);
+    goto ack;
+  }
+
+  case MP3DEC_COMMAND_ERROR: {
+    ret = mp3dec_write_cmd_string(state->response_fd, MP3DEC_RESPONSE_ACK,
+				  error_get(&state->last_error),
+				  &state->error);
+    if (ret < 0) {
+      error_prepend(&state->error, "Could not send the error");
+      return -1;
+    }
+    return 0;
   }
 
   case MP3DEC_COMMAND_PING: {
-    printf("pong\n");
     ret = mp3dec_write_cmd(state->response_fd, MP3DEC_RESPONSE_PONG,
 			   buf, buflen, &state->error);
     if (ret < 0) {
@@ -331,9 +1150,11 @@ static int mp3dec_child_read_cmd(child_state_t *state) {
   }
   
  error:
-  ret = mp3dec_write_cmd_string(state->response_fd, MP3DEC_RESPONSE_ERR,
-				error_get(&state->error),
-				&state->error);
+  /* the message is only put together if the parent asks for it */
+  error_copy(&state->last_error, &state->error);
+  reply.code = error_code(&state->error);
+  ret = mp3dec_write_cmd(state->response_fd, MP3DEC_RESPONSE_ERR,
+			 &reply, sizeof(reply), &state->error);
 
   if (ret < 0) {
     error_prepend(&state->error, "Could not send ERROR");
@@ -343,18 +1164,76 @@ static int mp3dec_child_read_cmd(child_state_t *state) {
   }
 }
 
-int mp3dec_child_main(int cmd_fd, int response_fd) {
-  child_state_t state;
-  mp3dec_child_reset(&state, cmd_fd, response_fd);
+int mp3dec_child_main(int cmd_fd, int response_fd, mp3dec_shared_t *shared) {
+  child_state_t *state;
+  void *mem;
+  int retval = 0;
 
-  for (;;) {
-    if (unix_check_fd_read(cmd_fd)) {
-      if (mp3dec_child_read_cmd(&state) < 0) {
-	fprintf(stderr, "error reading cmd\n");
-	return -1;
+  /* too large for the stack, and the mp3 and pcm buffers in it are
+     best kept on their own cache lines */
+  if (posix_memalign(&mem, PCM_CACHE_LINE, sizeof(child_state_t)) != 0) {
+    fprintf(stderr, "Could not allocate the child state\n");
+    return -1;
+  }
+  state = mem;
+
+  mp3dec_child_reset(state, cmd_fd, response_fd);
+  state->shared = shared;
+
+  /* a sink whose reader went away fails with EPIPE instead */
+  signal(SIGPIPE, SIG_IGN);
+  if (pcm_pool_alloc(&state->pool, audio_format(), PCM_MAX_CHANNELS,
+		     &state->error) < 0) {
+    fprintf(stderr, "%s\n", error_get(&state->error));
+    mp3dec_child_close(state);
+    free(state);
+    return -1;
+  }
+
+  while (state->state != CHILD_EXIT) {
+    shared->heartbeat_usec = unix_time_usec();
+
+    /* block for commands when there is nothing to decode, else check
+       for a pending command before every frame */
+    if ((state->state != CHILD_PLAY) || unix_check_fd_read(cmd_fd)) {
+      if (state->state != CHILD_PLAY)
+	mp3dec_child_idle(state, cmd_fd, -1);
+      if (mp3dec_child_read_cmd(state) < 0) {
+	fprintf(stderr, "error reading cmd: %s\n", error_get(&state->error));
+	retval = -1;
+	break;
       }
+      mp3dec_child_checkpoint(state);
+      continue;
+    }
+
+    switch (mp3dec_child_step(state)) {
+    case CHILD_STEP_OK:
+      break;
+
+    case CHILD_STEP_WAIT:
+      /* the stream input ran dry or a read is still in flight, sleep
+	 until either more data or a command arrives */
+      mp3dec_child_idle(state, cmd_fd,
+			input_wait_fd(&mp3dec_child_current(state)->input));
+      break;
+
+    case CHILD_STEP_EOF:
+      state->state = CHILD_STOP;
+      audio_pause();
+      break;
+
+    case CHILD_STEP_ERROR:
+      fprintf(stderr, "error decoding: %s\n", error_get(&state->error));
+      error_copy(&state->last_error, &state->error);
+      state->state = CHILD_ERROR;
+      audio_pause();
+      break;
     }
-    printf("again\n");
-    usleep(50 * 1000);
+    mp3dec_child_checkpoint(state);
   }
+
+  mp3dec_child_close(state);
+  free(state);
+  return retval;
 }
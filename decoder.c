@@ -0,0 +1,373 @@
+/*
+ * frame by frame decoding of a single track with the low-level libmad
+ * api, shared by the current track and the overlays of the child
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include <mad.h>
+
+#include "error.h"
+#include "misc.h"
+#include "input.h"
+#include "sync.h"
+#include "decoder.h"
+
+static void decoder_mad_init(decoder_t *decoder) {
+  mad_stream_init(&decoder->stream);
+  mad_frame_init(&decoder->frame);
+  mad_synth_init(&decoder->synth);
+  decoder->synth.pcm.length = 0;
+  mad_stream_options(&decoder->stream,
+		     (decoder->quality & MP3DEC_QUALITY_HALF_RATE) ?
+		     MAD_OPTION_HALFSAMPLERATE : 0);
+  decoder->mad_initialized = 1;
+}
+
+static void decoder_mad_finish(decoder_t *decoder) {
+  if (decoder->mad_initialized) {
+    mad_synth_finish(&decoder->synth);
+    mad_frame_finish(&decoder->frame);
+    mad_stream_finish(&decoder->stream);
+    decoder->mad_initialized = 0;
+  }
+}
+
+/* throw away the decoder state, so that the next step starts
+   decoding cleanly at the current input position */
+static void decoder_mad_reset(decoder_t *decoder) {
+  decoder_mad_finish(decoder);
+  decoder_mad_init(decoder);
+  decoder->frames = 0;
+  decoder->samples = 0;
+  decoder->bytes = 0;
+  decoder->pcm_pos = 0;
+  decoder->position = decoder->input.offset;
+  memset(decoder->errors, 0, sizeof(decoder->errors));
+  decoder->errors_total = decoder->errors_logged = 0;
+  decoder->error_log_usec = 0;
+  decoder->resyncing = 0;
+  decoder->resync_start = 0;
+  decoder->resyncs = 0;
+  decoder->nregions = 0;
+  decoder->corrupt_bytes = 0;
+}
+
+void decoder_init(decoder_t *decoder) {
+  input_init(&decoder->input);
+  decoder->mad_initialized = 0;
+  decoder->quality = MP3DEC_QUALITY_FULL;
+  decoder->resync_max_bytes = 0;
+  decoder->resync_max_count = 0;
+  decoder_mad_reset(decoder);
+}
+
+/* the input takes ownership of fd */
+int decoder_open_fd(decoder_t *decoder, int fd, char *name,
+		    mp3dec_error_t *error) {
+  if (input_open_fd(&decoder->input, fd, name, error) < 0)
+    return -1;
+  decoder_mad_reset(decoder);
+  return 0;
+}
+
+/* continue decoding at the byte offset of a frame in the file. Layer
+   III frames can use data of the frames before them, the first few
+   after a seek may be skipped as broken. */
+int decoder_seek(decoder_t *decoder, unsigned long long offset,
+		 mp3dec_error_t *error) {
+  if (input_seek(&decoder->input, offset, error) < 0)
+    return -1;
+  decoder_mad_reset(decoder);
+  return 0;
+}
+
+/* start the track again from the beginning */
+int decoder_rewind(decoder_t *decoder, mp3dec_error_t *error) {
+  if (input_rewind(&decoder->input, error) < 0)
+    return -1;
+  decoder_mad_reset(decoder);
+  return 0;
+}
+
+int decoder_is_open(decoder_t *decoder) {
+  return decoder->input.type != INPUT_NONE;
+}
+
+/* estimate the samples left in the track from the average bitrate so
+   far, -1 if that is not possible yet or the input is a stream */
+long decoder_remaining_samples(decoder_t *decoder) {
+  long remaining = input_remaining(&decoder->input, &decoder->stream);
+
+  if ((remaining < 0) || (decoder->bytes == 0))
+    return -1;
+
+  /* the samples of the frame that is still being played out */
+  return (long)(remaining * decoder->samples / decoder->bytes) +
+    (decoder->synth.pcm.length - decoder->pcm_pos);
+}
+
+/* takes effect with the next frame, libmad copies the stream options
+   into every frame it decodes */
+void decoder_set_quality(decoder_t *decoder, unsigned int quality) {
+  decoder->quality = quality;
+  mad_stream_options(&decoder->stream,
+		     (quality & MP3DEC_QUALITY_HALF_RATE) ?
+		     MAD_OPTION_HALFSAMPLERATE : 0);
+}
+
+/* give up on a track with more than max_count resyncs, or more than
+   max_bytes of garbage in one place. 0 means no limit. */
+void decoder_set_resync(decoder_t *decoder, unsigned long max_bytes,
+			unsigned long max_count) {
+  decoder->resync_max_bytes = max_bytes;
+  decoder->resync_max_count = max_count;
+}
+
+/* average both channels into the first one before the synthesis, which
+   then only runs the filterbank once */
+static void decoder_downmix(struct mad_frame *frame) {
+  unsigned int ns = MAD_NSBSAMPLES(&frame->header);
+  mad_fixed_t *left = &frame->sbsample[0][0][0];
+  mad_fixed_t const *right = &frame->sbsample[1][0][0];
+  unsigned int i;
+
+  for (i = 0; i < ns * 32; i++)
+    left[i] = (left[i] >> 1) + (right[i] >> 1);
+  frame->header.mode = MAD_MODE_SINGLE_CHANNEL;
+}
+
+/* move the samples not consumed yet to the start of synth.pcm */
+void decoder_trim_pcm(decoder_t *decoder) {
+  struct mad_pcm *pcm = &decoder->synth.pcm;
+  unsigned int ch;
+
+  if (decoder->pcm_pos == 0)
+    return;
+
+  if (decoder->pcm_pos >= pcm->length) {
+    pcm->length = 0;
+  } else {
+    for (ch = 0; ch < pcm->channels; ch++)
+      memmove(pcm->samples[ch], pcm->samples[ch] + decoder->pcm_pos,
+	      (pcm->length - decoder->pcm_pos) * sizeof(mad_fixed_t));
+    pcm->length -= decoder->pcm_pos;
+  }
+  decoder->pcm_pos = 0;
+}
+
+static mp3dec_decode_error_e decoder_error_kind(enum mad_error error) {
+  switch (error) {
+  case MAD_ERROR_LOSTSYNC:
+    return MP3DEC_DECODE_LOSTSYNC;
+  case MAD_ERROR_BADLAYER:
+  case MAD_ERROR_BADBITRATE:
+  case MAD_ERROR_BADSAMPLERATE:
+  case MAD_ERROR_BADEMPHASIS:
+  case MAD_ERROR_BADMODE:
+  case MAD_ERROR_BADFRAMELEN:
+    return MP3DEC_DECODE_HEADER;
+  case MAD_ERROR_BADCRC:
+    return MP3DEC_DECODE_CRC;
+  default:
+    return MP3DEC_DECODE_DATA;
+  }
+}
+
+/* count the error, a damaged file must not flood stderr */
+static void decoder_error(decoder_t *decoder) {
+  struct mad_stream *stream = &decoder->stream;
+  unsigned long long now;
+  unsigned long suppressed;
+
+  decoder->errors[decoder_error_kind(stream->error)]++;
+  decoder->errors_total++;
+
+  now = unix_time_usec();
+  if ((decoder->error_log_usec != 0) &&
+      (now - decoder->error_log_usec < DECODER_LOG_USEC))
+    return;
+
+  suppressed = decoder->errors_total - decoder->errors_logged - 1;
+  fprintf(stderr, "%s: decoder error 0x%04x (%s) at byte offset %u",
+	  decoder->input.name, stream->error, mad_stream_errorstr(stream),
+	  (unsigned int)(stream->this_frame - stream->buffer));
+  if (suppressed > 0)
+    fprintf(stderr, ", %lu more since the last message", suppressed);
+  fputc('\n', stderr);
+
+  decoder->error_log_usec = now;
+  decoder->errors_logged = decoder->errors_total;
+}
+
+static void decoder_region(decoder_t *decoder, unsigned long long offset,
+			   unsigned long long length) {
+  if (length == 0)
+    return;
+  if (decoder->nregions < MP3DEC_STATUS_REGIONS) {
+    decoder->regions[decoder->nregions].offset = offset;
+    decoder->regions[decoder->nregions].length = length;
+  }
+  decoder->nregions++;
+  decoder->corrupt_bytes += length;
+}
+
+/* libmad lost sync at this_frame, the garbage is skipped by
+   decoder_resync instead of libmad's byte by byte search */
+static int decoder_resync_start(decoder_t *decoder, mp3dec_error_t *error) {
+  struct mad_stream *stream = &decoder->stream;
+
+  decoder->resyncs++;
+  if ((decoder->resync_max_count > 0) &&
+      (decoder->resyncs > decoder->resync_max_count)) {
+    error_printf(error, "Gave up after %lu resyncs", decoder->resyncs - 1);
+    error_set_code(error, MP3DEC_ERR_DECODE);
+    return -1;
+  }
+
+  decoder->resyncing = 1;
+  decoder->resync_start = input_position(&decoder->input, stream,
+					 stream->this_frame);
+  return 0;
+}
+
+/*
+ * Look for the next frame from next_frame on. Returns 0 once one is
+ * found, next_frame then points to it. Returns 1 if the rest of the
+ * buffer is garbage, or the header after a candidate is not in the
+ * buffer yet, and the buffer has to be refilled first.
+ */
+static int decoder_resync(decoder_t *decoder, mp3dec_error_t *error) {
+  struct mad_stream *stream = &decoder->stream;
+  unsigned char const *p = stream->next_frame, *end = stream->bufend;
+  sync_result_e result = SYNC_INVALID;
+  unsigned long long pos;
+
+  for (;;) {
+    long i = sync_find(p, end - p);
+
+    if (i < 0) {
+      /* a sync word may start in the last byte */
+      if (end > p)
+	p = end - 1;
+      break;
+    }
+    p += i;
+
+    result = sync_check(p, end - p);
+    if (result == SYNC_INVALID) {
+      p++;
+      continue;
+    }
+    /* more data does not help at the end of the input, nor with a
+       frame longer than the buffer. libmad checks those itself. */
+    if ((result == SYNC_SHORT) && !decoder->input.eof &&
+	(p != stream->buffer))
+      result = SYNC_INVALID;
+    break;
+  }
+
+  pos = input_position(&decoder->input, stream, p);
+  if (decoder->input.eof && (pos > decoder->input.offset))
+    pos = decoder->input.offset;
+
+  if ((decoder->resync_max_bytes > 0) &&
+      (pos - decoder->resync_start > decoder->resync_max_bytes)) {
+    error_printf(error, "Gave up resyncing after %llu bytes of garbage",
+		 pos - decoder->resync_start);
+    error_set_code(error, MP3DEC_ERR_DECODE);
+    return -1;
+  }
+
+  stream->next_frame = p;
+  if (result == SYNC_INVALID) {
+    if (decoder->input.eof) {
+      decoder_region(decoder, decoder->resync_start,
+		     pos - decoder->resync_start);
+      decoder->resyncing = 0;
+    }
+    stream->error = MAD_ERROR_BUFLEN;
+    return 1;
+  }
+
+  /* a checked frame is taken as it is, anything else libmad checks */
+  stream->sync = (result == SYNC_VALID);
+  decoder_region(decoder, decoder->resync_start, pos - decoder->resync_start);
+  decoder->resyncing = 0;
+  return 0;
+}
+
+/*
+ * Decode exactly one frame into synth.pcm. This replaces the
+ * callbacks of mad_decoder_run, so that the child never nests into
+ * the decoder and commands are only handled between two frames. A
+ * recoverable decoding error also ends the step, so that a long
+ * stretch of garbage does not delay command handling.
+ */
+decoder_step_e decoder_frame(decoder_t *decoder, mp3dec_error_t *error) {
+  struct mad_stream *stream = &decoder->stream;
+
+  for (;;) {
+    if ((stream->buffer == NULL) || (stream->error == MAD_ERROR_BUFLEN)) {
+      int ret;
+
+      if (decoder->input.eof)
+	return DECODER_EOF;
+      ret = input_fill(&decoder->input, stream, error);
+      if (ret < 0)
+	return DECODER_ERROR;
+      else if (ret == INPUT_AGAIN)
+	return DECODER_WAIT;
+    }
+
+    /* at most one buffer of garbage per step */
+    if (decoder->resyncing) {
+      int ret = decoder_resync(decoder, error);
+      if (ret < 0)
+	return DECODER_ERROR;
+      else if (ret > 0)
+	return DECODER_SKIP;
+    }
+
+    if (mad_frame_decode(&decoder->frame, stream) == 0)
+      break;
+
+    if (MAD_RECOVERABLE(stream->error)) {
+      decoder_error(decoder);
+      if (!stream->sync && (decoder_resync_start(decoder, error) < 0))
+	return DECODER_ERROR;
+      return DECODER_SKIP;
+    } else if (stream->error != MAD_ERROR_BUFLEN) {
+      error_printf(error, "Unrecoverable decoder error 0x%04x (%s)",
+		   stream->error, mad_stream_errorstr(stream));
+      error_set_code(error, MP3DEC_ERR_DECODE);
+      return DECODER_ERROR;
+    }
+  }
+
+  if ((decoder->quality & MP3DEC_QUALITY_MONO) &&
+      (decoder->frame.header.mode != MAD_MODE_SINGLE_CHANNEL))
+    decoder_downmix(&decoder->frame);
+
+  mad_synth_frame(&decoder->synth, &decoder->frame);
+  decoder->frames++;
+  decoder->samples += decoder->synth.pcm.length;
+  decoder->bytes += stream->next_frame - stream->this_frame;
+  decoder->pcm_pos = 0;
+  decoder->position = input_position(&decoder->input, stream,
+				     stream->this_frame);
+
+  return DECODER_FRAME;
+}
+
+void decoder_close(decoder_t *decoder) {
+  input_close(&decoder->input);
+  decoder_mad_reset(decoder);
+}
+
+/* release everything, the decoder has to be initialized again */
+void decoder_finish(decoder_t *decoder) {
+  input_close(&decoder->input);
+  decoder_mad_finish(decoder);
+}
@@ -0,0 +1,69 @@
+#ifndef DECODER_H__
+#define DECODER_H__
+
+#include <mad.h>
+
+#include "maddec.h"
+#include "error.h"
+#include "input.h"
+
+#define DECODER_LOG_USEC 1000000
+
+typedef enum {
+  DECODER_FRAME = 0,   /* a frame was decoded into synth.pcm */
+  DECODER_SKIP,        /* recoverable error, no pcm for this step */
+  DECODER_WAIT,        /* the stream input has to wait for data */
+  DECODER_EOF,
+  DECODER_ERROR
+} decoder_step_e;
+
+/* one mp3 track decoded frame by frame */
+typedef struct decoder_s {
+  input_t input;
+
+  struct mad_stream stream;
+  struct mad_frame  frame;
+  struct mad_synth  synth;
+  int mad_initialized;
+
+  unsigned long frames;
+  unsigned long long samples;  /* decoded samples per channel */
+  unsigned long long bytes;    /* mp3 bytes of the decoded frames */
+  unsigned long long position;  /* file offset of the last frame */
+  unsigned int pcm_pos;   /* samples of synth.pcm already consumed */
+  unsigned int quality;   /* MP3DEC_QUALITY_* */
+
+  /* recoverable errors per kind. Only one message is logged per
+     DECODER_LOG_USEC, with the number of errors since the last one. */
+  unsigned long errors[MP3DEC_DECODE_ERRORS];
+  unsigned long errors_total, errors_logged;
+  unsigned long long error_log_usec;
+
+  /* looking for the next frame after garbage, which started at
+     resync_start in the file. A limit of 0 means no limit. */
+  int resyncing;
+  unsigned long long resync_start;
+  unsigned long resync_max_bytes, resync_max_count;
+  unsigned long resyncs;
+  mp3dec_region_t regions[MP3DEC_STATUS_REGIONS];
+  unsigned long nregions;
+  unsigned long long corrupt_bytes;
+} decoder_t;
+
+void decoder_init(decoder_t *decoder);
+int  decoder_open_fd(decoder_t *decoder, int fd, char *name,
+		     mp3dec_error_t *error);
+int  decoder_seek(decoder_t *decoder, unsigned long long offset,
+		  mp3dec_error_t *error);
+int  decoder_rewind(decoder_t *decoder, mp3dec_error_t *error);
+int  decoder_is_open(decoder_t *decoder);
+long decoder_remaining_samples(decoder_t *decoder);
+void decoder_trim_pcm(decoder_t *decoder);
+void decoder_set_quality(decoder_t *decoder, unsigned int quality);
+void decoder_set_resync(decoder_t *decoder, unsigned long max_bytes,
+			unsigned long max_count);
+decoder_step_e decoder_frame(decoder_t *decoder, mp3dec_error_t *error);
+void decoder_close(decoder_t *decoder);
+void decoder_finish(decoder_t *decoder);
+
+#endif /* DECODER_H__ */
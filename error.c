@@ -7,50 +7,110 @@
 
 /* error string handling */
 
-void error_reset(error_t *error) {
-  memset(error->strerror, 0, sizeof(error->strerror));
+void error_reset(mp3dec_error_t *error) {
+  error->code = MP3DEC_OK;
+  error->sys_errno = 0;
+  error->msg = "";
+  error->buf[0] = '\0';
+  error->depth = 0;
+  error->formatted = 0;
+  error->strerror[0] = '\0';
 }
 
-char *error_get(error_t *error) {
+static void error_start(mp3dec_error_t *error, mp3dec_errcode_e code,
+			int sys_errno) {
+  error->code = code;
+  error->sys_errno = sys_errno;
+  error->depth = 0;
+  error->formatted = 0;
+}
+
+/* context from the outside in, the message, then errno */
+char *error_get(mp3dec_error_t *error) {
+  unsigned int len = 0, i;
+
+  if (error->formatted)
+    return error->strerror;
+
+  error->strerror[0] = '\0';
+  for (i = error->depth; i > 0; i--)
+    len += snprintf(error->strerror + len, sizeof(error->strerror) - len,
+		    "%s: ", error->context[i - 1]);
+  if (len < sizeof(error->strerror))
+    len += snprintf(error->strerror + len, sizeof(error->strerror) - len,
+		    "%s", (error->msg != NULL) ? error->msg : "");
+  if ((error->sys_errno != 0) && (len < sizeof(error->strerror)))
+    snprintf(error->strerror + len, sizeof(error->strerror) - len,
+	     ": %s", strerror(error->sys_errno));
+
+  error->formatted = 1;
   return error->strerror;
 }
 
-void error_set(error_t *error, char *str) {
-  strncpy(error->strerror, str, sizeof(error->strerror) - 1);
-  error->strerror[sizeof(error->strerror) - 1] = '\0';
+mp3dec_errcode_e error_code(mp3dec_error_t *error) {
+  return error->code;
+}
+
+/* refine the code of the error just set */
+void error_set_code(mp3dec_error_t *error, mp3dec_errcode_e code) {
+  error->code = code;
+}
+
+void error_copy(mp3dec_error_t *dst, mp3dec_error_t *src) {
+  memcpy(dst, src, sizeof(*dst));
+  if (src->msg == src->buf)
+    dst->msg = dst->buf;
+}
+
+/* str is not copied, it has to be a constant */
+void error_set(mp3dec_error_t *error, char *str) {
+  error_start(error, MP3DEC_ERR_FAILED, 0);
+  error->msg = str;
 }
 
-void error_printf(error_t *error, const char *format, ...) {
+void error_printf(mp3dec_error_t *error, const char *format, ...) {
   va_list ap;
+  error_start(error, MP3DEC_ERR_FAILED, 0);
   va_start(ap, format);
-  vsnprintf(error->strerror, sizeof(error->strerror), format, ap);
+  vsnprintf(error->buf, sizeof(error->buf), format, ap);
   va_end(ap);
+  error->msg = error->buf;
 }
 
-void error_set_strerror(error_t *error, char *str) {
-  snprintf(error->strerror, sizeof(error->strerror), "%s: %s", str, strerror(errno));
+void error_set_strerror(mp3dec_error_t *error, char *str) {
+  error_start(error, MP3DEC_ERR_SYSTEM, errno);
+  error->msg = str;
 }
 
-void error_printf_strerror(error_t *error, const char *format, ...) {
+void error_printf_strerror(mp3dec_error_t *error, const char *format, ...) {
   va_list ap;
+  error_start(error, MP3DEC_ERR_SYSTEM, errno);
   va_start(ap, format);
-  vsnprintf(error->strerror, sizeof(error->strerror), format, ap);
-  error_append(error, strerror(errno));
+  vsnprintf(error->buf, sizeof(error->buf), format, ap);
   va_end(ap);
+  error->msg = error->buf;
 }
 
-void error_append(error_t *error, char *str) {
-  unsigned char buf[4096];
-  strncpy(buf, error->strerror, sizeof(buf) - 1);
-  buf[sizeof(buf) - 1] = '\0';
+void error_append(mp3dec_error_t *error, char *str) {
+  unsigned int len;
 
-  snprintf(error->strerror, sizeof(error->strerror), "%s: %s", buf, str);
+  if (error->msg != error->buf) {
+    strncpy(error->buf, error->msg, sizeof(error->buf) - 1);
+    error->buf[sizeof(error->buf) - 1] = '\0';
+    error->msg = error->buf;
+  }
+  len = strlen(error->buf);
+  snprintf(error->buf + len, sizeof(error->buf) - len, ": %s", str);
+  error->formatted = 0;
 }
 
-void error_prepend(error_t *error, char *str) {
-  unsigned char buf[4096];
-  strncpy(buf, error->strerror, sizeof(buf) - 1);
-  buf[sizeof(buf) - 1] = '\0';
+/* once the stack is full, the outermost context is dropped */
+void error_prepend(mp3dec_error_t *error, char *str) {
+  if (error->depth == ERROR_CONTEXT_DEPTH)
+    return;
 
-  snprintf(error->strerror, sizeof(error->strerror), "%s: %s", str, buf);
+  strncpy(error->context[error->depth], str, ERROR_CONTEXT_SIZE - 1);
+  error->context[error->depth][ERROR_CONTEXT_SIZE - 1] = '\0';
+  error->depth++;
+  error->formatted = 0;
 }
@@ -1,19 +1,37 @@
 #ifndef ERROR_H__
 #define ERROR_H__
 
+#include "maddec.h"
+
 #define ERROR_STRING_SIZE 256
 
+/* strings prepended on the way up, innermost first */
+#define ERROR_CONTEXT_DEPTH 4
+#define ERROR_CONTEXT_SIZE  64
+
+/* The parts of an error are only put together by error_get, setting
+   and passing on an error copies as little as possible. */
 typedef struct error_s {
+  mp3dec_errcode_e code;
+  int sys_errno;              /* of a failed system call, or 0 */
+  const char *msg;            /* constant, or buf */
+  char buf[ERROR_STRING_SIZE];
+  char context[ERROR_CONTEXT_DEPTH][ERROR_CONTEXT_SIZE];
+  unsigned int depth;
+  int formatted;
   char strerror[ERROR_STRING_SIZE];
-} error_t;
+} mp3dec_error_t;
 
-void error_reset(error_t *error);
-char *error_get(error_t *error);
-void error_set(error_t *error, char *str);
-void error_set_strerror(error_t *error, char *str);
-void error_append(error_t *error, char *str);
-void error_prepend(error_t *error, char *str);
-void error_printf(error_t *error, const char *format, ...);
-void error_printf_strerror(error_t *error, const char *format, ...);
+void error_reset(mp3dec_error_t *error);
+char *error_get(mp3dec_error_t *error);
+mp3dec_errcode_e error_code(mp3dec_error_t *error);
+void error_set_code(mp3dec_error_t *error, mp3dec_errcode_e code);
+void error_copy(mp3dec_error_t *dst, mp3dec_error_t *src);
+void error_set(mp3dec_error_t *error, char *str);
+void error_set_strerror(mp3dec_error_t *error, char *str);
+void error_append(mp3dec_error_t *error, char *str);
+void error_prepend(mp3dec_error_t *error, char *str);
+void error_printf(mp3dec_error_t *error, const char *format, ...);
+void error_printf_strerror(mp3dec_error_t *error, const char *format, ...);
 
 #endif /* ERROR_H__ */
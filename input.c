@@ -0,0 +1,449 @@
+/*
+ * mp3 input for the decoder child
+ *
+ * Tags at the start and the end of files and buffers are skipped from
+ * their headers, so that libmad only sees the audio, and their text
+ * is kept as the metadata of the track.
+ *
+ * Regular files are read ahead asynchronously and copied into a small
+ * buffer, sealed buffers (memfd)
+ * are mapped and handed to libmad in place. Pipes and sockets are
+ * read without blocking into a jitter buffer, so that bursty input
+ * does not stall the child.
+ */
+
+#define _GNU_SOURCE
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <mad.h>
+
+#include "error.h"
+#include "misc.h"
+#include "tags.h"
+#include "input.h"
+
+#define min(a, b) ((a) < (b) ? (a) : (b))
+
+void input_init(input_t *input) {
+  input->type = INPUT_NONE;
+  memset(input->name, 0, sizeof(input->name));
+  input->fd = -1;
+  input->seekable = 0;
+  input->start = 0;
+  input->end = 0;
+  input->offset = 0;
+  memset(&input->metadata, 0, sizeof(input->metadata));
+  readahead_init(&input->ra);
+  input->map = NULL;
+  input->maplen = 0;
+  input->len = 0;
+  input->eof = 0;
+
+  input->jb = NULL;
+  input->jb_size = INPUT_JB_SIZE;
+  input->jb_low = INPUT_JB_LOW;
+  input->jb_high = INPUT_JB_HIGH;
+  input->jb_start = 0;
+  input->jb_count = 0;
+  input->jb_eof = 0;
+  input->buffering = 0;
+  input->underruns = 0;
+}
+
+/* takes effect with the next stream that is opened */
+int input_set_stream_buffer(input_t *input, unsigned long size,
+			    unsigned long low, unsigned long high,
+			    mp3dec_error_t *error) {
+  if ((low == 0) || (low >= high) || (high > size)) {
+    error_set(error, "Invalid jitter buffer watermarks");
+    error_set_code(error, MP3DEC_ERR_INVALID);
+    return -1;
+  }
+  input->jb_size = size;
+  input->jb_low = low;
+  input->jb_high = high;
+  return 0;
+}
+
+/* a buffer can only be mapped safely if nobody can shrink it behind
+   our back */
+static int input_is_sealed(int fd) {
+#ifdef F_GET_SEALS
+  int seals = fcntl(fd, F_GET_SEALS);
+  if (seals < 0)
+    return 0;
+  return ((seals & (F_SEAL_SHRINK | F_SEAL_WRITE)) ==
+	  (F_SEAL_SHRINK | F_SEAL_WRITE));
+#else
+  return 0;
+#endif
+}
+
+/* takes ownership of fd, also when an error is returned */
+int input_open_fd(input_t *input, int fd, char *name, mp3dec_error_t *error) {
+  struct stat st;
+
+  input_close(input);
+
+  strncpy(input->name, name, sizeof(input->name));
+  input->name[sizeof(input->name) - 1] = '\0';
+  input->fd = fd;
+
+  if (fstat(fd, &st) < 0) {
+    error_printf_strerror(error, "Could not stat \"%s\"", input->name);
+    input_close(input);
+    return -1;
+  }
+
+  if (input_is_sealed(fd) && (st.st_size > 0)) {
+    input->map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (input->map == MAP_FAILED) {
+      input->map = NULL;
+      error_printf_strerror(error, "Could not map \"%s\"", input->name);
+      input_close(input);
+      return -1;
+    }
+    input->type = INPUT_MMAP;
+    input->maplen = st.st_size;
+    input->end = st.st_size;
+    input->seekable = 1;
+    input->start = 0;
+    tags_bounds_map(input->map, &input->start, &input->end,
+		    &input->metadata);
+  } else if (S_ISREG(st.st_mode)) {
+    off_t pos;
+
+    input->type = INPUT_READ;
+    input->seekable = 1;
+    /* a passed descriptor may already point at the audio data */
+    pos = lseek(fd, 0, SEEK_CUR);
+    input->start = (pos > 0) ? pos : 0;
+    input->end = st.st_size;
+    tags_bounds_file(fd, &st, &input->start, &input->end,
+		     &input->metadata);
+    if (readahead_open(&input->ra, fd, input->start, input->end,
+		       error) < 0) {
+      error_prepend(error, input->name);
+      input_close(input);
+      return -1;
+    }
+    /* the first frames are there as soon as the track is loaded */
+    readahead_wait(&input->ra);
+  } else {
+    input->jb = malloc(input->jb_size);
+    if (input->jb == NULL) {
+      error_set(error, "Could not allocate the jitter buffer");
+      error_set_code(error, MP3DEC_ERR_NOMEM);
+      input_close(input);
+      return -1;
+    }
+    input->type = INPUT_STREAM;
+    input->seekable = 0;
+    input->start = 0;
+    input->jb_start = 0;
+    input->jb_count = 0;
+    input->jb_eof = 0;
+    input->buffering = 1;
+    input->underruns = 0;
+  }
+
+  input->offset = input->start;
+  input->len = 0;
+  input->eof = 0;
+
+  return 0;
+}
+
+/* keep the bytes of the frame that libmad could not decode yet */
+static void input_keep_frame(input_t *input, struct mad_stream *stream) {
+  if (stream->next_frame) {
+    memmove(input->data, stream->next_frame,
+	    (input->len = &input->data[input->len] - stream->next_frame));
+  } else {
+    input->len = 0;
+  }
+}
+
+/* pad the end of the stream so that libmad decodes the last frame */
+static void input_pad_eof(input_t *input) {
+  assert(sizeof(input->data) - input->len >= MAD_BUFFER_GUARD);
+
+  memset(input->data + input->len, 0, MAD_BUFFER_GUARD);
+  input->len += MAD_BUFFER_GUARD;
+  input->eof = 1;
+}
+
+/* refill the mp3 buffer from the blocks read ahead. Files are read
+   with pread, so that a descriptor shared with the parent keeps its
+   file offset. Returns INPUT_AGAIN instead of waiting for the disk. */
+static int input_fill_read(input_t *input, struct mad_stream *stream,
+			   mp3dec_error_t *error) {
+  long ret = 0;
+
+  /* the frame is only kept once there is something to append */
+  if (!readahead_ready(&input->ra))
+    return INPUT_AGAIN;
+
+  input_keep_frame(input, stream);
+
+  while (input->len < sizeof(input->data)) {
+    ret = readahead_read(&input->ra, input->data + input->len,
+			 sizeof(input->data) - input->len, error);
+    if (ret <= 0)
+      break;
+    input->offset += ret;
+    input->len += ret;
+  }
+
+  if (ret == -1) {
+    error_prepend(error, input->name);
+    return -1;
+  } else if (ret == 0) {
+    input_pad_eof(input);
+  }
+
+  assert(input->len > MAD_BUFFER_GUARD);
+
+  mad_stream_buffer(stream, input->data, input->len);
+  return 0;
+}
+
+/* the audio in the mapping is decoded in place. libmad needs MAD_BUFFER_GUARD
+   bytes after the last frame, so the remaining tail is copied into the
+   mp3 buffer and padded once the mapping is used up. */
+static int input_fill_mmap(input_t *input, struct mad_stream *stream,
+			   mp3dec_error_t *error) {
+  unsigned long left = 0;
+
+  if (input->offset < input->end) {
+    mad_stream_buffer(stream, input->map + input->offset,
+		      input->end - input->offset);
+    input->offset = input->end;
+    return 0;
+  }
+
+  if (stream->next_frame)
+    left = input->map + input->end - stream->next_frame;
+  if (left > sizeof(input->data) - MAD_BUFFER_GUARD)
+    left = sizeof(input->data) - MAD_BUFFER_GUARD;
+
+  if (left > 0)
+    memcpy(input->data, stream->next_frame, left);
+  memset(input->data + left, 0, MAD_BUFFER_GUARD);
+  input->len = left + MAD_BUFFER_GUARD;
+  input->eof = 1;
+
+  mad_stream_buffer(stream, input->data, input->len);
+  return 0;
+}
+
+/* read whatever the stream has available without blocking */
+static int input_stream_read(input_t *input, mp3dec_error_t *error) {
+  while (!input->jb_eof && (input->jb_count < input->jb_size) &&
+	 unix_check_fd_read(input->fd)) {
+    unsigned long end = (input->jb_start + input->jb_count) % input->jb_size;
+    unsigned long space = min(input->jb_size - input->jb_count,
+			      input->jb_size - end);
+    int ret;
+
+    ret = read(input->fd, input->jb + end, space);
+    if (ret < 0) {
+      if ((errno == EINTR) || (errno == EAGAIN))
+	break;
+      error_printf_strerror(error, "Could not read from \"%s\"",
+			    input->name);
+      return -1;
+    } else if (ret == 0) {
+      input->jb_eof = 1;
+    } else {
+      input->jb_count += ret;
+    }
+  }
+
+  return 0;
+}
+
+/* feed the mp3 buffer from the jitter buffer. Incomplete frames stay
+   in the mp3 buffer until the rest arrives, libmad then continues
+   with the frame it could not decode before. */
+static int input_fill_stream(input_t *input, struct mad_stream *stream,
+			     mp3dec_error_t *error) {
+  unsigned long len;
+
+  if (input_stream_read(input, error) < 0)
+    return -1;
+
+  if (!input->jb_eof) {
+    if (input->buffering) {
+      if (input->jb_count < input->jb_high)
+	return INPUT_AGAIN;
+      input->buffering = 0;
+    } else if (input->jb_count < input->jb_low) {
+      input->underruns++;
+      input->buffering = 1;
+      return INPUT_AGAIN;
+    }
+  }
+
+  input_keep_frame(input, stream);
+
+  len = min(input->jb_count, sizeof(input->data) - input->len);
+  if (input->jb_start + len > input->jb_size) {
+    unsigned long block_length = input->jb_size - input->jb_start;
+    memcpy(input->data + input->len, input->jb + input->jb_start,
+	   block_length);
+    memcpy(input->data + input->len + block_length, input->jb,
+	   len - block_length);
+  } else {
+    memcpy(input->data + input->len, input->jb + input->jb_start, len);
+  }
+  input->jb_start = (input->jb_start + len) % input->jb_size;
+  input->jb_count -= len;
+  input->len += len;
+  input->offset += len;
+
+  if ((len == 0) && input->jb_eof)
+    input_pad_eof(input);
+
+  mad_stream_buffer(stream, input->data, input->len);
+  return 0;
+}
+
+/* returns INPUT_AGAIN if a stream has no data yet, wait for
+   input_wait_fd() to become readable then */
+int input_fill(input_t *input, struct mad_stream *stream,
+	       mp3dec_error_t *error) {
+  switch (input->type) {
+  case INPUT_READ:
+    return input_fill_read(input, stream, error);
+  case INPUT_MMAP:
+    return input_fill_mmap(input, stream, error);
+  case INPUT_STREAM:
+    return input_fill_stream(input, stream, error);
+  default:
+    error_set(error, "No input opened");
+    error_set_code(error, MP3DEC_ERR_STATE);
+    return -1;
+  }
+}
+
+int input_wait_fd(input_t *input) {
+  switch (input->type) {
+  case INPUT_READ:
+    return readahead_wait_fd(&input->ra);
+  case INPUT_STREAM:
+    return input->fd;
+  default:
+    return -1;
+  }
+}
+
+/* block until a file has data again. A stream may not have any for a
+   long time, it returns right away. */
+void input_wait(input_t *input) {
+  if (input->type == INPUT_READ)
+    readahead_wait(&input->ra);
+}
+
+/* bytes of the track that libmad has not decoded yet, or -1 for
+   streams */
+long input_remaining(input_t *input, struct mad_stream *stream) {
+  unsigned long buffered = 0;
+
+  if (stream->buffer != NULL)
+    buffered = stream->bufend - stream->next_frame;
+
+  switch (input->type) {
+  case INPUT_READ:
+  case INPUT_MMAP:
+    if (input->eof || (input->offset >= input->end))
+      return buffered;
+    return (input->end - input->offset) + buffered;
+  default:
+    return -1;
+  }
+}
+
+/* offset in the file resp. stream of ptr in the mp3 buffer. The
+   padding after the end is not part of the file. */
+unsigned long long input_position(input_t *input, struct mad_stream *stream,
+				  unsigned char const *ptr) {
+  unsigned long long end = input->offset;
+
+  if (input->eof)
+    end += MAD_BUFFER_GUARD;
+  return end - (stream->bufend - ptr);
+}
+
+/* continue reading at offset in the file, which has to be within the
+   audio. The caller has to reset the mad stream as well. */
+int input_seek(input_t *input, unsigned long long offset,
+	       mp3dec_error_t *error) {
+  if (!input->seekable) {
+    error_printf(error, "Cannot seek in \"%s\"", input->name);
+    error_set_code(error, MP3DEC_ERR_STATE);
+    return -1;
+  }
+  if ((offset < input->start) || (offset > input->end)) {
+    error_printf(error, "Offset %llu is outside the audio of \"%s\"",
+		 offset, input->name);
+    error_set_code(error, MP3DEC_ERR_INVALID);
+    return -1;
+  }
+  if ((input->type == INPUT_READ) &&
+      (readahead_seek(&input->ra, offset, error) < 0))
+    return -1;
+  input->offset = offset;
+  input->len = 0;
+  input->eof = 0;
+  return 0;
+}
+
+/* go back to the start of the stream */
+int input_rewind(input_t *input, mp3dec_error_t *error) {
+  return input_seek(input, input->start, error);
+}
+
+void input_close(input_t *input) {
+  /* before the descriptor goes away under the reads */
+  readahead_close(&input->ra);
+
+  if (input->map != NULL) {
+    munmap(input->map, input->maplen);
+    input->map = NULL;
+  }
+  input->maplen = 0;
+
+  if (input->fd != -1) {
+    close(input->fd);
+    input->fd = -1;
+  }
+
+  if (input->jb != NULL) {
+    free(input->jb);
+    input->jb = NULL;
+  }
+  input->jb_start = 0;
+  input->jb_count = 0;
+  input->jb_eof = 0;
+  input->buffering = 0;
+
+  input->type = INPUT_NONE;
+  input->seekable = 0;
+  input->start = 0;
+  input->end = 0;
+  input->offset = 0;
+  memset(&input->metadata, 0, sizeof(input->metadata));
+  input->len = 0;
+  input->eof = 0;
+}
@@ -0,0 +1,73 @@
+#ifndef INPUT_H__
+#define INPUT_H__
+
+#include <mad.h>
+
+#include "error.h"
+#include "readahead.h"
+
+#define INPUT_JB_SIZE  (64 * 1024)
+#define INPUT_JB_LOW   (4 * 1024)
+#define INPUT_JB_HIGH  (32 * 1024)
+
+/* returned by input_fill when a stream has to wait for more data */
+#define INPUT_AGAIN 1
+
+typedef enum {
+  INPUT_NONE = 0,
+  INPUT_READ,     /* regular file, read ahead into the mp3 buffer */
+  INPUT_MMAP,     /* sealed buffer, decoded in place */
+  INPUT_STREAM    /* pipe or socket, read through the jitter buffer */
+} input_type_e;
+
+typedef struct input_s {
+  input_type_e type;
+  char name[256];
+
+  int fd;
+  int seekable;
+  unsigned long start;   /* offset of the first byte of audio */
+  unsigned long end;     /* after the last byte of audio, files only */
+  unsigned long offset;  /* next byte to read resp. to hand to libmad */
+
+  /* from the tags, files and buffers only */
+  mp3dec_metadata_t metadata;
+
+  /* reads of regular files in flight */
+  readahead_t ra;
+
+  unsigned char *map;
+  unsigned long maplen;
+
+  unsigned char data[MAD_BUFFER_MDLEN];
+  unsigned int  len;
+  unsigned char eof;
+
+  /* jitter buffer for streams. Once it runs below the low watermark,
+     decoding waits until it is filled up to the high watermark. */
+  unsigned char *jb;
+  unsigned long jb_size, jb_low, jb_high;
+  unsigned long jb_start, jb_count;
+  unsigned char jb_eof;
+  int buffering;
+  unsigned long underruns;
+} input_t;
+
+void input_init(input_t *input);
+int  input_open_fd(input_t *input, int fd, char *name, mp3dec_error_t *error);
+int  input_set_stream_buffer(input_t *input, unsigned long size,
+			     unsigned long low, unsigned long high,
+			     mp3dec_error_t *error);
+int  input_fill(input_t *input, struct mad_stream *stream,
+		mp3dec_error_t *error);
+int  input_wait_fd(input_t *input);
+void input_wait(input_t *input);
+long input_remaining(input_t *input, struct mad_stream *stream);
+unsigned long long input_position(input_t *input, struct mad_stream *stream,
+				  unsigned char const *ptr);
+int  input_seek(input_t *input, unsigned long long offset,
+		mp3dec_error_t *error);
+int  input_rewind(input_t *input, mp3dec_error_t *error);
+void input_close(input_t *input);
+
+#endif /* INPUT_H__ */
@@ -0,0 +1,245 @@
+/*
+ * capacity test: run more and more players against the paced null
+ * output while sending them a mix of commands, and report the number
+ * of players the host sustains before the outputs miss deadlines
+ *
+ * For every number of players the latency of the commands, the missed
+ * deadlines, and the cpu time and memory per player are printed.
+ * Link with audio_null.o, $MP3DEC_NULL_BUFFER_MS sets the buffer of
+ * the simulated device.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "maddec.h"
+
+#define MAX_PLAYERS     256
+#define STEP            8
+#define STEP_SECONDS    10
+#define MISS_THRESHOLD  1.0   /* missed deadlines per player and minute */
+
+/* every player gets a command about once a second */
+#define COMMAND_USEC    (1000 * 1000)
+#define TICK_USEC       (10 * 1000)
+
+typedef struct player_s {
+  mp3dec_state_t *state;
+  unsigned long long next_usec;   /* of the next command */
+  int paused;
+
+  /* counters at the start of the step */
+  unsigned long misses;
+  unsigned long long cpu_usec;
+} player_t;
+
+static player_t players[MAX_PLAYERS];
+
+static unsigned long *latencies;
+static unsigned long nlatencies, max_latencies;
+
+static unsigned long long now_usec(void) {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec * 1000000ULL + tv.tv_usec;
+}
+
+static void record_latency(unsigned long usec) {
+  if (nlatencies == max_latencies) {
+    max_latencies = max_latencies ? max_latencies * 2 : 4096;
+    latencies = realloc(latencies, max_latencies * sizeof(*latencies));
+    if (latencies == NULL) {
+      fprintf(stderr, "Out of memory\n");
+      exit(1);
+    }
+  }
+  latencies[nlatencies++] = usec;
+}
+
+static int compare_latency(const void *a, const void *b) {
+  unsigned long x = *(const unsigned long *)a;
+  unsigned long y = *(const unsigned long *)b;
+  return (x > y) - (x < y);
+}
+
+static double percentile(double p) {
+  if (nlatencies == 0)
+    return 0;
+  return latencies[(unsigned long)(p * (nlatencies - 1))] / 1000.0;
+}
+
+static int start_player(player_t *player, char *filename) {
+  player->state = mp3dec_new();
+  if (player->state == NULL)
+    return -1;
+  if ((mp3dec_load(player->state, filename) < 0) ||
+      (mp3dec_play(player->state) < 0)) {
+    printf("Could not play: %s\n", mp3dec_error(player->state));
+    mp3dec_delete(player->state);
+    player->state = NULL;
+    return -1;
+  }
+  player->paused = 0;
+  player->next_usec = now_usec() + random() % COMMAND_USEC;
+  return 0;
+}
+
+/* mostly status, now and then a pause or its resume, a seek or a new
+   load of the file */
+static void send_command(player_t *player, char *filename,
+			 unsigned long long size) {
+  mp3dec_status_t status;
+  unsigned long long start = now_usec();
+  int ret, r = random() % 100;
+
+  status.state = MP3DEC_STATE_PLAY;
+  if (player->paused || (r < 10)) {
+    ret = mp3dec_pause(player->state);
+    player->paused = !player->paused;
+  } else if (r < 25) {
+    ret = mp3dec_seek(player->state, random() % size);
+  } else if (r < 30) {
+    ret = mp3dec_load(player->state, filename);
+    if (ret == 0)
+      ret = mp3dec_play(player->state);
+  } else {
+    ret = mp3dec_status(player->state, &status);
+  }
+  record_latency(now_usec() - start);
+  if (ret < 0)
+    printf("Command failed: %s\n", mp3dec_error(player->state));
+
+  /* a seek past the end or a track that ended stops the player */
+  if ((r >= 30) && (ret == 0) && (status.state == MP3DEC_STATE_STOP)) {
+    mp3dec_load(player->state, filename);
+    mp3dec_play(player->state);
+  }
+
+  player->next_usec = now_usec() + COMMAND_USEC / 2 + random() % COMMAND_USEC;
+}
+
+static int snapshot(player_t *player, unsigned long *misses,
+		    unsigned long long *cpu_usec, unsigned long *rss_kb) {
+  mp3dec_status_t status;
+
+  if (mp3dec_status(player->state, &status) < 0) {
+    printf("Could not get status: %s\n", mp3dec_error(player->state));
+    return -1;
+  }
+  *misses = status.audio_underruns + status.audio_late;
+  *cpu_usec = status.process_cpu_usec;
+  *rss_kb = status.process_rss_kb;
+  return 0;
+}
+
+int main(int argc, char *argv[]) {
+  unsigned int max = MAX_PLAYERS, step = STEP, seconds = STEP_SECONDS;
+  double threshold = MISS_THRESHOLD;
+  unsigned int n = 0, capacity = 0, i;
+  unsigned long long size;
+  struct stat st;
+  char *filename;
+
+  if ((argc < 2) || (argc > 6)) {
+    fprintf(stderr, "Usage: ./loadtest mp3file [max players] [step] "
+	    "[seconds per step] [misses per player and minute]\n");
+    return 1;
+  }
+  filename = argv[1];
+  if (argc > 2)
+    max = atoi(argv[2]);
+  if (argc > 3)
+    step = atoi(argv[3]);
+  if (argc > 4)
+    seconds = atoi(argv[4]);
+  if (argc > 5)
+    threshold = atof(argv[5]);
+  if ((max == 0) || (max > MAX_PLAYERS) || (step == 0) || (seconds == 0)) {
+    fprintf(stderr, "At most %d players, step and seconds above 0\n",
+	    MAX_PLAYERS);
+    return 1;
+  }
+  if (stat(filename, &st) < 0) {
+    perror(filename);
+    return 1;
+  }
+  size = st.st_size;
+
+  printf("players  cmd p50 ms  p99 ms  max ms  misses/min  cpu %%  rss kb\n");
+
+  while (n < max) {
+    unsigned long long end, rss = 0, cpu = 0;
+    unsigned long misses = 0;
+    double per_minute;
+
+    /* ramp up */
+    for (i = n; (i < n + step) && (i < max); i++) {
+      if (start_player(&players[i], filename) < 0) {
+	printf("Could not start player %u\n", i + 1);
+	max = i;
+	break;
+      }
+    }
+    if (i == n)
+      break;
+    n = i;
+
+    for (i = 0; i < n; i++) {
+      unsigned long rss_kb;
+
+      if (snapshot(&players[i], &players[i].misses, &players[i].cpu_usec,
+		   &rss_kb) < 0)
+	return 1;
+    }
+
+    nlatencies = 0;
+    end = now_usec() + seconds * 1000000ULL;
+    while (now_usec() < end) {
+      unsigned long long now = now_usec();
+
+      for (i = 0; i < n; i++)
+	if (players[i].next_usec <= now)
+	  send_command(&players[i], filename, size);
+      usleep(TICK_USEC);
+    }
+
+    for (i = 0; i < n; i++) {
+      unsigned long m, rss_kb;
+      unsigned long long c;
+
+      if (players[i].paused) {
+	mp3dec_pause(players[i].state);
+	players[i].paused = 0;
+      }
+      if (snapshot(&players[i], &m, &c, &rss_kb) < 0)
+	return 1;
+      misses += m - players[i].misses;
+      cpu += c - players[i].cpu_usec;
+      rss += rss_kb;
+    }
+
+    qsort(latencies, nlatencies, sizeof(*latencies), compare_latency);
+    per_minute = misses * 60.0 / seconds / n;
+    printf("%7u  %10.2f  %6.2f  %6.2f  %10.2f  %5.2f  %6llu\n",
+	   n, percentile(0.5), percentile(0.99), percentile(1.0),
+	   per_minute, cpu * 100.0 / (seconds * 1000000.0) / n, rss / n);
+    fflush(stdout);
+
+    if (per_minute > threshold)
+      break;
+    capacity = n;
+  }
+
+  printf("capacity: %u players at %.2f missed deadlines per player "
+	 "and minute\n", capacity, threshold);
+
+  for (i = 0; i < n; i++)
+    mp3dec_delete(players[i].state);
+  free(latencies);
+  return 0;
+}
@@ -0,0 +1,305 @@
+/*
+ * loudness analysis after EBU R128 / ITU-R BS.1770
+ *
+ * The decoded samples are K-weighted and their mean square collected
+ * in 400ms blocks overlapping by 75%. Block loudness goes into a
+ * histogram, so that the gated integrated loudness of an album is just
+ * the sum of the histograms of its tracks. The true peak is the peak
+ * of the signal interpolated 4 times.
+ */
+
+#include <math.h>
+#include <string.h>
+
+#include <mad.h>
+
+#include "loudness.h"
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+
+/* from mad_fixed_t to a float where 1.0 is full scale */
+#define LOUDNESS_SCALE (1.0f / (float)(1L << MAD_F_FRACBITS))
+
+void loudness_init(loudness_t *loudness) {
+  memset(loudness, 0, sizeof(*loudness));
+}
+
+/* the K-weighting filter for any samplerate, from the analog
+   prototypes behind the 48khz coefficients of BS.1770 */
+static void loudness_k_weighting(loudness_t *loudness) {
+  double rate = loudness->samplerate;
+  double f0, g, q, k, vh, vb, a0;
+
+  f0 = 1681.974450955533;
+  g = 3.999843853973347;
+  q = 0.7071752369554196;
+  k = tan(M_PI * f0 / rate);
+  vh = pow(10.0, g / 20.0);
+  vb = pow(vh, 0.4996667741545416);
+  a0 = 1.0 + k / q + k * k;
+  loudness->b[0][0] = (vh + vb * k / q + k * k) / a0;
+  loudness->b[0][1] = 2.0 * (k * k - vh) / a0;
+  loudness->b[0][2] = (vh - vb * k / q + k * k) / a0;
+  loudness->a[0][0] = 1.0;
+  loudness->a[0][1] = 2.0 * (k * k - 1.0) / a0;
+  loudness->a[0][2] = (1.0 - k / q + k * k) / a0;
+
+  f0 = 38.13547087602444;
+  q = 0.5003270373238773;
+  k = tan(M_PI * f0 / rate);
+  a0 = 1.0 + k / q + k * k;
+  loudness->b[1][0] = 1.0;
+  loudness->b[1][1] = -2.0;
+  loudness->b[1][2] = 1.0;
+  loudness->a[1][0] = 1.0;
+  loudness->a[1][1] = 2.0 * (k * k - 1.0) / a0;
+  loudness->a[1][2] = (1.0 - k / q + k * k) / a0;
+}
+
+/* windowed sinc interpolator, every phase normalised to unity gain */
+static void loudness_tp_filter(loudness_t *loudness) {
+  unsigned int l = loudness->oversample;
+  unsigned int n = l * LOUDNESS_TP_TAPS;
+  double center = (n - 1) / 2.0;
+  unsigned int p, j;
+
+  for (p = 0; p < l; p++) {
+    double sum = 0;
+
+    for (j = 0; j < LOUDNESS_TP_TAPS; j++) {
+      double x = (p + l * j - center) / l;
+      double w = 0.5 * (1.0 + cos(M_PI * (p + l * j - center) /
+				  (center + 1.0)));
+      double h = (x == 0) ? 1.0 : sin(M_PI * x) / (M_PI * x);
+
+      loudness->taps[p][j] = h * w;
+      sum += h * w;
+    }
+    for (j = 0; j < LOUDNESS_TP_TAPS; j++)
+      loudness->taps[p][j] /= sum;
+  }
+}
+
+/* (re)start the filters for a new format. The histogram and the peak
+   are kept, a track can change format in the middle. */
+void loudness_start(loudness_t *loudness, unsigned int samplerate,
+		    unsigned int channels) {
+  loudness->samplerate = samplerate;
+  loudness->channels = (channels > LOUDNESS_CHANNELS) ?
+    LOUDNESS_CHANNELS : channels;
+
+  loudness_k_weighting(loudness);
+  memset(loudness->z, 0, sizeof(loudness->z));
+
+  loudness->step_len = samplerate / 10;
+  loudness->step_pos = 0;
+  loudness->step_sum = 0;
+  loudness->nsteps = 0;
+
+  /* above 96khz the samples are close enough to the true peak */
+  loudness->oversample = (samplerate < 96000) ?
+    LOUDNESS_TP_MAX_OVERSAMPLE : 1;
+  loudness_tp_filter(loudness);
+  memset(loudness->tp_hist, 0, sizeof(loudness->tp_hist));
+  loudness->tp_pos = 0;
+}
+
+/* sum of squares of count K-weighted samples of one channel */
+static double loudness_filter(loudness_t *loudness, unsigned int ch,
+			      mad_fixed_t const *src, unsigned int count) {
+  double b00 = loudness->b[0][0], b01 = loudness->b[0][1];
+  double b02 = loudness->b[0][2], a01 = loudness->a[0][1];
+  double a02 = loudness->a[0][2];
+  double a11 = loudness->a[1][1], a12 = loudness->a[1][2];
+  double z00 = loudness->z[ch][0][0], z01 = loudness->z[ch][0][1];
+  double z10 = loudness->z[ch][1][0], z11 = loudness->z[ch][1][1];
+  double sum = 0;
+  unsigned int i;
+
+  /* two biquads in transposed direct form II */
+  for (i = 0; i < count; i++) {
+    double x = src[i] * LOUDNESS_SCALE;
+    double y = b00 * x + z00;
+
+    z00 = b01 * x - a01 * y + z01;
+    z01 = b02 * x - a02 * y;
+
+    x = y;
+    y = x + z10;
+    z10 = -2.0 * x - a11 * y + z11;
+    z11 = x - a12 * y;
+
+    sum += y * y;
+  }
+
+  loudness->z[ch][0][0] = z00;
+  loudness->z[ch][0][1] = z01;
+  loudness->z[ch][1][0] = z10;
+  loudness->z[ch][1][1] = z11;
+
+  return sum;
+}
+
+/* peak of count samples of one channel and of the values in between */
+static float loudness_peak(loudness_t *loudness, unsigned int ch,
+			   mad_fixed_t const *src, unsigned int count,
+			   float peak) {
+  float *hist = loudness->tp_hist[ch];
+  unsigned int pos = loudness->tp_pos;
+  unsigned int i, p, j;
+
+  for (i = 0; i < count; i++) {
+    float x = src[i] * LOUDNESS_SCALE;
+    float const *h;
+
+    /* every sample is stored twice, so that the last taps samples
+       are always contiguous at hist + pos */
+    pos = (pos == 0) ? LOUDNESS_TP_TAPS - 1 : pos - 1;
+    hist[pos] = hist[pos + LOUDNESS_TP_TAPS] = x;
+    h = hist + pos;
+
+    if (fabsf(x) > peak)
+      peak = fabsf(x);
+
+    if (loudness->oversample == 1)
+      continue;
+    for (p = 0; p < loudness->oversample; p++) {
+      float y = 0;
+
+      for (j = 0; j < LOUDNESS_TP_TAPS; j++)
+	y += loudness->taps[p][j] * h[j];
+      if (fabsf(y) > peak)
+	peak = fabsf(y);
+    }
+  }
+
+  return peak;
+}
+
+static void loudness_block(loudness_t *loudness) {
+  double z = (loudness->steps[0] + loudness->steps[1] +
+	      loudness->steps[2] + loudness->steps[3]) / 4.0;
+  double l;
+  int bin;
+
+  if (z <= 0)
+    return;
+
+  l = -0.691 + 10.0 * log10(z);
+  if (l < LOUDNESS_MIN)
+    return;
+
+  bin = (int)((l - LOUDNESS_MIN) * (LOUDNESS_BINS / (LOUDNESS_MAX -
+						     LOUDNESS_MIN)));
+  if (bin >= LOUDNESS_BINS)
+    bin = LOUDNESS_BINS - 1;
+  loudness->hist[bin]++;
+}
+
+void loudness_add(loudness_t *loudness, struct mad_pcm const *pcm) {
+  unsigned int done = 0;
+  unsigned int ch;
+
+  if ((pcm->samplerate != loudness->samplerate) ||
+      (pcm->channels != loudness->channels))
+    loudness_start(loudness, pcm->samplerate, pcm->channels);
+
+  while (done < pcm->length) {
+    unsigned int n = pcm->length - done;
+    float peak = loudness->peak;
+
+    if (n > loudness->step_len - loudness->step_pos)
+      n = loudness->step_len - loudness->step_pos;
+
+    for (ch = 0; ch < loudness->channels; ch++) {
+      loudness->step_sum +=
+	loudness_filter(loudness, ch, pcm->samples[ch] + done, n);
+      peak = loudness_peak(loudness, ch, pcm->samples[ch] + done, n, peak);
+    }
+    loudness->tp_pos = (loudness->tp_pos + LOUDNESS_TP_TAPS -
+			n % LOUDNESS_TP_TAPS) % LOUDNESS_TP_TAPS;
+    loudness->peak = peak;
+
+    loudness->step_pos += n;
+    done += n;
+
+    if (loudness->step_pos == loudness->step_len) {
+      loudness->steps[loudness->nsteps % 4] =
+	loudness->step_sum / loudness->step_len;
+      loudness->nsteps++;
+      if (loudness->nsteps >= 4)
+	loudness_block(loudness);
+      loudness->step_pos = 0;
+      loudness->step_sum = 0;
+    }
+  }
+
+  loudness->samples += pcm->length;
+}
+
+/* add the blocks and the peak of src, for album values. The length of
+   an album is counted at the samplerate of its first track. */
+void loudness_merge(loudness_t *dst, loudness_t const *src) {
+  unsigned int i;
+
+  if (dst->samplerate == 0)
+    dst->samplerate = src->samplerate;
+
+  for (i = 0; i < LOUDNESS_BINS; i++)
+    dst->hist[i] += src->hist[i];
+  if (src->peak > dst->peak)
+    dst->peak = src->peak;
+  dst->samples += src->samples;
+}
+
+static double loudness_bin_energy(unsigned int bin) {
+  double l = LOUDNESS_MIN +
+    (bin + 0.5) * ((LOUDNESS_MAX - LOUDNESS_MIN) / LOUDNESS_BINS);
+  return pow(10.0, (l + 0.691) / 10.0);
+}
+
+/* mean energy of the blocks from bin on, 0 if there are none */
+static double loudness_mean(loudness_t const *loudness, unsigned int from) {
+  double sum = 0;
+  unsigned long count = 0;
+  unsigned int i;
+
+  for (i = from; i < LOUDNESS_BINS; i++) {
+    if (loudness->hist[i] == 0)
+      continue;
+    sum += loudness->hist[i] * loudness_bin_energy(i);
+    count += loudness->hist[i];
+  }
+
+  return (count > 0) ? sum / count : 0;
+}
+
+/* gated integrated loudness in LUFS, LOUDNESS_MIN for silence */
+double loudness_integrated(loudness_t const *loudness) {
+  double z, threshold;
+  int bin;
+
+  /* relative gate, 10 LU below the loudness of the blocks above the
+     absolute gate */
+  z = loudness_mean(loudness, 0);
+  if (z <= 0)
+    return LOUDNESS_MIN;
+  threshold = -0.691 + 10.0 * log10(z) - 10.0;
+
+  bin = (int)ceil((threshold - LOUDNESS_MIN) *
+		  (LOUDNESS_BINS / (LOUDNESS_MAX - LOUDNESS_MIN)));
+  if (bin < 0)
+    bin = 0;
+  z = loudness_mean(loudness, bin);
+  if (z <= 0)
+    return LOUDNESS_MIN;
+
+  return -0.691 + 10.0 * log10(z);
+}
+
+/* linear true peak, 1.0 is full scale */
+double loudness_true_peak(loudness_t const *loudness) {
+  return loudness->peak;
+}
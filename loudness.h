@@ -0,0 +1,53 @@
+#ifndef LOUDNESS_H__
+#define LOUDNESS_H__
+
+#include <mad.h>
+
+#define LOUDNESS_CHANNELS  2
+
+/* block loudness histogram from -70 to +5 LUFS in steps of 0.01 LU */
+#define LOUDNESS_MIN       -70.0
+#define LOUDNESS_MAX       5.0
+#define LOUDNESS_BINS      7500
+
+/* true peak interpolation filter, taps per phase */
+#define LOUDNESS_TP_TAPS   12
+#define LOUDNESS_TP_MAX_OVERSAMPLE 4
+
+/* ReplayGain 2.0 reference level */
+#define LOUDNESS_REFERENCE -18.0
+
+typedef struct loudness_s {
+  unsigned int samplerate;
+  unsigned int channels;
+
+  /* K-weighting, a high shelf followed by a high pass */
+  double b[2][3], a[2][3];
+  double z[LOUDNESS_CHANNELS][2][2];
+
+  /* mean square of the last four 100ms steps, a 400ms block */
+  unsigned int step_len, step_pos;
+  double step_sum;
+  double steps[4];
+  unsigned long nsteps;
+  unsigned long hist[LOUDNESS_BINS];
+
+  /* polyphase interpolation for the true peak */
+  unsigned int oversample;
+  float taps[LOUDNESS_TP_MAX_OVERSAMPLE][LOUDNESS_TP_TAPS];
+  float tp_hist[LOUDNESS_CHANNELS][2 * LOUDNESS_TP_TAPS];
+  unsigned int tp_pos;
+  float peak;
+
+  unsigned long long samples;
+} loudness_t;
+
+void   loudness_init(loudness_t *loudness);
+void   loudness_start(loudness_t *loudness, unsigned int samplerate,
+		      unsigned int channels);
+void   loudness_add(loudness_t *loudness, struct mad_pcm const *pcm);
+void   loudness_merge(loudness_t *dst, loudness_t const *src);
+double loudness_integrated(loudness_t const *loudness);
+double loudness_true_peak(loudness_t const *loudness);
+
+#endif /* LOUDNESS_H__ */
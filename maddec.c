@@ -1,9 +1,20 @@
+#define _GNU_SOURCE
+
 #include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/poll.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
 #include <sys/uio.h>
 #include <sys/wait.h>
 
+#include <netinet/in.h>
+
 #include <stdlib.h>
 
+#include <pthread.h>
+#include <signal.h>
+
 #include <assert.h>
 #include <fcntl.h>
 #include <stdio.h>
@@ -20,20 +31,59 @@
 
 /* initializing and stuff */
 
-int mp3dec_child_main(int cmd_fd, int response_fd);
 static int mp3dec_start(mp3dec_state_t *state);
 static int mp3dec_exit(mp3dec_state_t *state);
+static void mp3dec_stop_supervisor(mp3dec_state_t *state);
+
+/* sent again to a child started by the supervisor */
+static const mp3dec_cmd_e mp3dec_setting_cmds[MP3DEC_SETTINGS] = {
+  MP3DEC_COMMAND_STREAM_BUFFER,
+  MP3DEC_COMMAND_CROSSFADE,
+  MP3DEC_COMMAND_REPLAYGAIN,
+  MP3DEC_COMMAND_QUALITY,
+  MP3DEC_COMMAND_RESYNC,
+  MP3DEC_COMMAND_OPTIONS,
+  MP3DEC_COMMAND_LATENCY
+};
 
 mp3dec_state_t *mp3dec_new(void) {
+  void *shared;
+  int i;
+
   mp3dec_state_t *state = malloc(sizeof(mp3dec_state_t));
   if (state == NULL)
     return NULL;
 
   error_reset(&state->error);
+  state->child_error = 0;
   state->child_pid = -1;
   state->cmd_fd = -1;
   state->response_fd = -1;
 
+  pthread_mutex_init(&state->lock, NULL);
+  for (i = 0; i < MP3DEC_SETTINGS + MP3DEC_GAIN_SETTINGS; i++) {
+    state->settings[i].cmd = (i < MP3DEC_SETTINGS) ?
+      mp3dec_setting_cmds[i] : MP3DEC_COMMAND_GAIN;
+    state->settings[i].len = 0;
+  }
+  state->supervising = 0;
+  state->stop_fd[0] = state->stop_fd[1] = -1;
+  state->pidfd = -1;
+  state->timeout_ms = 0;
+  state->respawns = 0;
+  state->recovery_usec = 0;
+  memset(&state->checkpoint, 0, sizeof(state->checkpoint));
+
+  /* survives the child, for the supervisor */
+  shared = mmap(NULL, sizeof(mp3dec_shared_t), PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (shared == MAP_FAILED) {
+    pthread_mutex_destroy(&state->lock);
+    free(state);
+    return NULL;
+  }
+  state->shared = shared;
+
   if (mp3dec_start(state) < 0) {
     mp3dec_delete(state);
     return NULL;
@@ -43,23 +93,57 @@ mp3dec_state_t *mp3dec_new(void) {
 }
 
 void mp3dec_delete(mp3dec_state_t *state) {
+  mp3dec_stop_supervisor(state);
+
   if (state->child_pid != -1) {
     mp3dec_exit(state);
     kill(state->child_pid, SIGTERM);
     waitpid(state->child_pid, NULL, 0);
   }
+  if (state->cmd_fd != -1)
+    close(state->cmd_fd);
+  if (state->response_fd != -1)
+    close(state->response_fd);
+  if (state->pidfd != -1)
+    close(state->pidfd);
+
+  munmap(state->shared, sizeof(mp3dec_shared_t));
+  pthread_mutex_destroy(&state->lock);
   free(state);
 }
 
-static int mp3dec_parent_cmd_ack(mp3dec_state_t *state,
-				 mp3dec_cmd_e cmd,
-				 void *data, unsigned int len) {
+/* only the code comes with the ERR response, the message stays in
+   the child until mp3dec_error asks for it */
+static void mp3dec_parent_child_error(mp3dec_state_t *state,
+				      unsigned char *buf, unsigned int len) {
+  mp3dec_error_reply_t reply;
+
+  error_set(&state->error, "Error from child");
+  if (len != sizeof(reply)) {
+    error_set_code(&state->error, MP3DEC_ERR_PROTOCOL);
+    return;
+  }
+  memcpy(&reply, buf, sizeof(reply));
+  error_set_code(&state->error, reply.code);
+  state->child_error = 1;
+}
+
+/* send a command and wait for the ACK. If reply is not NULL, the data
+   sent along with the ACK is copied to reply, and has to be exactly
+   reply_len bytes long. The caller holds the lock. */
+static int mp3dec_parent_cmd_locked(mp3dec_state_t *state,
+				    mp3dec_cmd_e cmd,
+				    void *data, unsigned int len,
+				    int pass_fd,
+				    void *reply, unsigned int reply_len) {
   mp3dec_cmd_e resp;
   unsigned char buf[CMD_BUF_SIZE];
   unsigned int buflen;
   
+  state->child_error = 0;
   if (state->child_pid == -1) {
     error_set(&state->error, "No child started");
+    error_set_code(&state->error, MP3DEC_ERR_NOCHILD);
     return -1;
   }
 
@@ -67,7 +151,8 @@ static int mp3dec_parent_cmd_ack(mp3dec_state_t *state,
   assert(state->response_fd != -1);
   assert(state->child_pid != -1);
 
-  if (mp3dec_write_cmd(state->cmd_fd, cmd, data, len, &state->error) < 0) {
+  if (mp3dec_write_cmd_fd(state->cmd_fd, cmd, data, len, pass_fd,
+			  &state->error) < 0) {
     error_prepend(&state->error, "Could not write command to child");
     return -1;
   }
@@ -77,17 +162,82 @@ static int mp3dec_parent_cmd_ack(mp3dec_state_t *state,
   }
 
   if (resp == MP3DEC_RESPONSE_ACK) {
+    if (reply != NULL) {
+      if (buflen != reply_len) {
+	error_printf(&state->error, "Unexpected reply length from child: %u",
+		     buflen);
+	error_set_code(&state->error, MP3DEC_ERR_PROTOCOL);
+	return -1;
+      }
+      memcpy(reply, buf, reply_len);
+    }
     return 0;
   } else if (resp == MP3DEC_RESPONSE_ERR) {
-    error_set(&state->error, "Error from child");
-    error_append(&state->error, buf); /* ensure that buf is a string XXX */
+    mp3dec_parent_child_error(state, buf, buflen);
     return -1;
   } else {
     error_set(&state->error, "Unknown response from child");
+    error_set_code(&state->error, MP3DEC_ERR_PROTOCOL);
     return -1;
   }
 }
 
+/* keep the arguments of a setting for a new child. The gain of a slot
+   is restored at once, without the ramp. */
+static void mp3dec_parent_remember(mp3dec_state_t *state, mp3dec_cmd_e cmd,
+				   void *data, unsigned int len) {
+  int i;
+
+  if (cmd == MP3DEC_COMMAND_GAIN) {
+    mp3dec_gain_cmd_t gain;
+
+    memcpy(&gain, data, sizeof(gain));
+    if (gain.slot >= MP3DEC_GAIN_SETTINGS)
+      return;
+    gain.ramp_ms = 0;
+    memcpy(state->settings[MP3DEC_SETTINGS + gain.slot].data, &gain,
+	   sizeof(gain));
+    state->settings[MP3DEC_SETTINGS + gain.slot].len = sizeof(gain);
+    return;
+  }
+
+  for (i = 0; i < MP3DEC_SETTINGS; i++) {
+    if ((state->settings[i].cmd == cmd) && (len <= MP3DEC_SETTING_SIZE)) {
+      memcpy(state->settings[i].data, data, len);
+      state->settings[i].len = len;
+    }
+  }
+}
+
+static int mp3dec_parent_cmd(mp3dec_state_t *state,
+			     mp3dec_cmd_e cmd,
+			     void *data, unsigned int len,
+			     int pass_fd,
+			     void *reply, unsigned int reply_len) {
+  int ret;
+
+  pthread_mutex_lock(&state->lock);
+  ret = mp3dec_parent_cmd_locked(state, cmd, data, len, pass_fd,
+				 reply, reply_len);
+  if (ret == 0)
+    mp3dec_parent_remember(state, cmd, data, len);
+  pthread_mutex_unlock(&state->lock);
+  return ret;
+}
+
+static int mp3dec_parent_cmd_fd_ack(mp3dec_state_t *state,
+				    mp3dec_cmd_e cmd,
+				    void *data, unsigned int len,
+				    int pass_fd) {
+  return mp3dec_parent_cmd(state, cmd, data, len, pass_fd, NULL, 0);
+}
+
+static int mp3dec_parent_cmd_ack(mp3dec_state_t *state,
+				 mp3dec_cmd_e cmd,
+				 void *data, unsigned int len) {
+  return mp3dec_parent_cmd_fd_ack(state, cmd, data, len, -1);
+}
+
 static int mp3dec_parent_null_cmd_ack(mp3dec_state_t *state,
 				      mp3dec_cmd_e cmd) {
   return mp3dec_parent_cmd_ack(state, cmd, NULL, 0);
@@ -97,6 +247,8 @@ int mp3dec_play(mp3dec_state_t *state) {
   return mp3dec_parent_null_cmd_ack(state, MP3DEC_COMMAND_PLAY);
 }
 
+/* toggles between playing and paused. A loaded track that is stopped
+   is paused at its position, without playing a frame of it. */
 int mp3dec_pause(mp3dec_state_t *state) {
   return mp3dec_parent_null_cmd_ack(state, MP3DEC_COMMAND_PAUSE);
 }
@@ -109,13 +261,322 @@ int mp3dec_load(mp3dec_state_t *state, char *filename) {
   return mp3dec_parent_cmd_ack(state, MP3DEC_COMMAND_LOAD, filename, strlen(filename) + 1);
 }
 
-int mp3dec_ping(mp3dec_state_t *state) {
- mp3dec_cmd_e resp;
+/* the child gets its own copy of fd, the caller keeps ownership. Regular
+   files are read with pread, so the file offset of fd is not moved and
+   decoding starts at the current offset. A memfd sealed against
+   shrinking and writing is mapped and decoded in place, without a
+   copy. */
+int mp3dec_load_fd(mp3dec_state_t *state, int fd) {
+  return mp3dec_parent_cmd_fd_ack(state, MP3DEC_COMMAND_LOAD_FD, NULL, 0, fd);
+}
+
+/* the player is another process and cannot see the caller's memory, so
+   buf is copied once into a sealed memfd, which the child maps and
+   decodes in place. Callers that want no copy at all write their data
+   into their own memfd, seal it and pass it to mp3dec_load_fd. */
+int mp3dec_load_buffer(mp3dec_state_t *state, unsigned char *buf,
+		       unsigned long len) {
+#ifdef MFD_ALLOW_SEALING
+  int fd, ret;
+  unsigned long done = 0;
+
+  state->child_error = 0;
+  fd = memfd_create("mp3dec", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+  if (fd < 0) {
+    error_set_strerror(&state->error, "Could not create memfd");
+    return -1;
+  }
+
+  while (done < len) {
+    unsigned int chunk = (len - done > (1 << 30)) ? (1 << 30) : len - done;
+    if (unix_write(fd, buf + done, chunk) != chunk) {
+      error_set_strerror(&state->error, "Could not write buffer to memfd");
+      close(fd);
+      return -1;
+    }
+    done += chunk;
+  }
+
+  if (fcntl(fd, F_ADD_SEALS,
+	    F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL) < 0) {
+    error_set_strerror(&state->error, "Could not seal memfd");
+    close(fd);
+    return -1;
+  }
+
+  ret = mp3dec_load_fd(state, fd);
+  close(fd);
+  return ret;
+#else
+  state->child_error = 0;
+  error_set(&state->error, "Loading from a buffer is not supported");
+  return -1;
+#endif
+}
+
+/* queue filename to follow the current track, with a crossfade if one
+   is set */
+int mp3dec_load_next(mp3dec_state_t *state, char *filename) {
+  return mp3dec_parent_cmd_ack(state, MP3DEC_COMMAND_LOAD_NEXT,
+			       filename, strlen(filename) + 1);
+}
+
+/* append filename to the tracks played after the next one. The first
+   few queued files are opened and read ahead while the current track
+   plays. */
+int mp3dec_enqueue(mp3dec_state_t *state, char *filename) {
+  return mp3dec_parent_cmd_ack(state, MP3DEC_COMMAND_ENQUEUE,
+			       filename, strlen(filename) + 1);
+}
+
+/* drop the next track and the queue, the current track plays on */
+int mp3dec_clear_queue(mp3dec_state_t *state) {
+  return mp3dec_parent_null_cmd_ack(state, MP3DEC_COMMAND_CLEAR);
+}
+
+/* switch to the next track now */
+int mp3dec_skip(mp3dec_state_t *state) {
+  return mp3dec_parent_null_cmd_ack(state, MP3DEC_COMMAND_SKIP);
+}
+
+/* length of the equal-power crossfade into the next track, 0 for a
+   gapless switch */
+int mp3dec_set_crossfade(mp3dec_state_t *state, unsigned int ms) {
+  return mp3dec_parent_cmd_ack(state, MP3DEC_COMMAND_CROSSFADE,
+			       &ms, sizeof(ms));
+}
+
+/* configure the jitter buffer used for pipes and sockets, takes effect
+   with the next load */
+int mp3dec_set_stream_buffer(mp3dec_state_t *state, unsigned long size,
+			     unsigned long low, unsigned long high) {
+  unsigned long args[3];
+
+  if ((low == 0) || (low >= high) || (high > size)) {
+    state->child_error = 0;
+    error_set(&state->error, "Watermarks have to satisfy 0 < low < high <= size");
+    error_set_code(&state->error, MP3DEC_ERR_INVALID);
+    return -1;
+  }
+
+  args[0] = size;
+  args[1] = low;
+  args[2] = high;
+  return mp3dec_parent_cmd_ack(state, MP3DEC_COMMAND_STREAM_BUFFER,
+			       args, sizeof(args));
+}
+
+/* play filename on top of the current track, returns the mixer slot
+   of the overlay */
+int mp3dec_overlay(mp3dec_state_t *state, char *filename) {
+  int slot;
+
+  if (mp3dec_parent_cmd(state, MP3DEC_COMMAND_OVERLAY,
+			filename, strlen(filename) + 1, -1,
+			&slot, sizeof(slot)) < 0)
+    return -1;
+  return slot;
+}
+
+/* ramp the gain of a mixer slot linearly to gain within ramp_ms */
+int mp3dec_set_gain(mp3dec_state_t *state, unsigned int slot,
+		    float gain, unsigned int ramp_ms) {
+  mp3dec_gain_cmd_t cmd;
+
+  cmd.slot = slot;
+  cmd.gain = gain;
+  cmd.ramp_ms = ramp_ms;
+  return mp3dec_parent_cmd_ack(state, MP3DEC_COMMAND_GAIN, &cmd, sizeof(cmd));
+}
+
+/* normalise the output by gain_db, as computed by mp3dec_analyze,
+   reduced where needed so that a track with the given linear peak does
+   not clip. Pass a peak of 0 to skip the clipping prevention. */
+int mp3dec_set_replaygain(mp3dec_state_t *state, float gain_db, float peak) {
+  mp3dec_replaygain_cmd_t cmd;
+
+  cmd.gain_db = gain_db;
+  cmd.peak = peak;
+  return mp3dec_parent_cmd_ack(state, MP3DEC_COMMAND_REPLAYGAIN,
+			       &cmd, sizeof(cmd));
+}
+
+/* trade quality for cpu time, for all tracks of this player. The
+   output keeps its samplerate and channels. */
+int mp3dec_set_quality(mp3dec_state_t *state, unsigned int quality) {
+  if (quality & ~(MP3DEC_QUALITY_HALF_RATE | MP3DEC_QUALITY_MONO)) {
+    state->child_error = 0;
+    error_printf(&state->error, "Unknown quality flags 0x%x", quality);
+    error_set_code(&state->error, MP3DEC_ERR_INVALID);
+    return -1;
+  }
+  return mp3dec_parent_cmd_ack(state, MP3DEC_COMMAND_QUALITY,
+			       &quality, sizeof(quality));
+}
+
+/* limits for skipping garbage between frames: the bytes skipped at
+   once, and how often per track. 0 means no limit. A track that goes
+   over one of them stops with an error. */
+int mp3dec_set_resync(mp3dec_state_t *state, unsigned long max_bytes,
+		      unsigned long max_count) {
+  unsigned long args[2];
+
+  args[0] = max_bytes;
+  args[1] = max_count;
+  return mp3dec_parent_cmd_ack(state, MP3DEC_COMMAND_RESYNC,
+			       args, sizeof(args));
+}
+
+void mp3dec_options_init(mp3dec_options_t *options) {
+  memset(options, 0, sizeof(*options));
+  options->policy = MP3DEC_SCHED_OTHER;
+}
+
+/* scheduling, cpu affinity and memory of the player process, applied
+   again to a child started by the supervisor. Real time priorities,
+   negative nice levels and locking more memory than RLIMIT_MEMLOCK
+   need privileges. */
+int mp3dec_set_options(mp3dec_state_t *state, mp3dec_options_t *options) {
+  if (((unsigned int)options->policy > MP3DEC_SCHED_RR) ||
+      ((options->policy != MP3DEC_SCHED_OTHER) &&
+       ((options->priority < 1) || (options->priority > 99))) ||
+      (options->nice < -20) || (options->nice > 19)) {
+    state->child_error = 0;
+    error_set(&state->error, "Invalid scheduling options");
+    error_set_code(&state->error, MP3DEC_ERR_INVALID);
+    return -1;
+  }
+  return mp3dec_parent_cmd_ack(state, MP3DEC_COMMAND_OPTIONS,
+			       options, sizeof(*options));
+}
+
+/* buffer ms of audio ahead of the device: small for cueing, large for
+   fewer wakeups. 0 is the default of the output. The status has the
+   latency the output achieved. */
+int mp3dec_set_latency(mp3dec_state_t *state, unsigned int ms) {
+  if (ms > MP3DEC_MAX_LATENCY_MS) {
+    state->child_error = 0;
+    error_printf(&state->error, "A latency of at most %d ms is supported",
+		 MP3DEC_MAX_LATENCY_MS);
+    error_set_code(&state->error, MP3DEC_ERR_INVALID);
+    return -1;
+  }
+  return mp3dec_parent_cmd_ack(state, MP3DEC_COMMAND_LATENCY,
+			       &ms, sizeof(ms));
+}
+
+/* continue playing at a file offset, as in the position of the status.
+   The offset is best that of a frame, otherwise the decoder has to
+   find the next one. */
+int mp3dec_seek(mp3dec_state_t *state, unsigned long long position) {
+  return mp3dec_parent_cmd_ack(state, MP3DEC_COMMAND_SEEK,
+			       &position, sizeof(position));
+}
+
+int mp3dec_status(mp3dec_state_t *state, mp3dec_status_t *status) {
+  if (mp3dec_parent_cmd(state, MP3DEC_COMMAND_STATUS, NULL, 0, -1,
+			status, sizeof(*status)) < 0)
+    return -1;
+  status->respawns = state->respawns;
+  status->recovery_usec = state->recovery_usec;
+  return 0;
+}
+
+/* the tags of the current track, as read when it was loaded. Pipes
+   and sockets have none. */
+int mp3dec_metadata(mp3dec_state_t *state, mp3dec_metadata_t *metadata) {
+  return mp3dec_parent_cmd(state, MP3DEC_COMMAND_METADATA, NULL, 0, -1,
+			   metadata, sizeof(*metadata));
+}
+
+/* write a copy of the output to fd from a thread of the player, as raw
+   pcm in the format of the output, or as a wav file when fd is a
+   regular file at its start. The child gets its own copy of fd. A sink
+   that falls behind drops frames by policy instead of slowing down the
+   output. Returns the id of the sink. */
+int mp3dec_add_sink_fd(mp3dec_state_t *state, int fd, mp3dec_drop_e policy) {
+  unsigned int arg = policy, id;
+
+  if (mp3dec_parent_cmd(state, MP3DEC_COMMAND_ADD_SINK, &arg, sizeof(arg),
+			fd, &id, sizeof(id)) < 0)
+    return -1;
+  return id;
+}
+
+/* record the output to a wav file */
+int mp3dec_record(mp3dec_state_t *state, char *filename,
+		  mp3dec_drop_e policy) {
+  int fd, ret;
+
+  state->child_error = 0;
+  fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    error_printf_strerror(&state->error, "Could not open \"%s\"", filename);
+    return -1;
+  }
+  ret = mp3dec_add_sink_fd(state, fd, policy);
+  close(fd);
+  return ret;
+}
+
+/* stop a sink, frames it has not written yet are lost */
+int mp3dec_remove_sink(mp3dec_state_t *state, unsigned int id) {
+  return mp3dec_parent_cmd_ack(state, MP3DEC_COMMAND_REMOVE_SINK,
+			       &id, sizeof(id));
+}
+
+/* serve the output to the clients that connect to the listening socket
+   fd, raw or as a wav stream. The child gets its own copy of fd.
+   Returns the id of the sink. */
+int mp3dec_serve_fd(mp3dec_state_t *state, int fd, unsigned int flags) {
+  unsigned int id;
+
+  if (mp3dec_parent_cmd(state, MP3DEC_COMMAND_SERVE, &flags, sizeof(flags),
+			fd, &id, sizeof(id)) < 0)
+    return -1;
+  return id;
+}
+
+/* the same on a tcp port of the loopback interface */
+int mp3dec_serve(mp3dec_state_t *state, unsigned short port,
+		 unsigned int flags) {
+  struct sockaddr_in addr;
+  int fd, ret, on = 1;
+
+  state->child_error = 0;
+  fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (fd < 0) {
+    error_set_strerror(&state->error, "Could not create socket");
+    return -1;
+  }
+  setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if ((bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) ||
+      (listen(fd, SOMAXCONN) < 0)) {
+    error_printf_strerror(&state->error, "Could not listen on port %u",
+			  port);
+    close(fd);
+    return -1;
+  }
+
+  ret = mp3dec_serve_fd(state, fd, flags);
+  close(fd);
+  return ret;
+}
+
+static int mp3dec_parent_ping(mp3dec_state_t *state) {
+  mp3dec_cmd_e resp;
   unsigned char buf[CMD_BUF_SIZE];
   unsigned int buflen;
   
+  state->child_error = 0;
   if (state->child_pid == -1) {
     error_set(&state->error, "No child started");
+    error_set_code(&state->error, MP3DEC_ERR_NOCHILD);
     return -1;
   }
 
@@ -135,25 +596,36 @@ int mp3dec_ping(mp3dec_state_t *state) {
   if (resp == MP3DEC_RESPONSE_PONG) {
     return 0;
   } else if (resp == MP3DEC_RESPONSE_ERR) {
-    error_set(&state->error, "Error from child");
-    error_append(&state->error, buf); /* ensure that buf is a string XXX */
+    mp3dec_parent_child_error(state, buf, buflen);
     return -1;
   } else {
     printf("got response %x\n", resp);
     error_set(&state->error, "Unknown response from child");
+    error_set_code(&state->error, MP3DEC_ERR_PROTOCOL);
     return -1;
   }
 }
 
+int mp3dec_ping(mp3dec_state_t *state) {
+  int ret;
+
+  pthread_mutex_lock(&state->lock);
+  ret = mp3dec_parent_ping(state);
+  pthread_mutex_unlock(&state->lock);
+  return ret;
+}
+
+/* the caller holds the lock, or is the only thread using state */
 static int mp3dec_start(mp3dec_state_t *state) {
   int ret;
   int retval = 0;
   int cmd_fd[2]      = { -1, -1 };
   int response_fd[2] = { -1, -1 };
 
-  ret = pipe(cmd_fd);
+  /* a unix socket, so that descriptors can be passed to the child */
+  ret = socketpair(AF_UNIX, SOCK_STREAM, 0, cmd_fd);
   if (ret < 0) {
-    error_set_strerror(&state->error, "Could not open command pipe");
+    error_set_strerror(&state->error, "Could not open command socket");
     retval = -1;
     goto error;
   }
@@ -164,6 +636,9 @@ static int mp3dec_start(mp3dec_state_t *state) {
     goto error;
   }
 
+  memset(state->shared, 0, sizeof(*state->shared));
+  state->shared->heartbeat_usec = unix_time_usec();
+
   ret = fork();
   if (ret < 0) {
     error_set_strerror(&state->error, "Could not fork");
@@ -177,7 +652,7 @@ static int mp3dec_start(mp3dec_state_t *state) {
     response_fd[0] = -1;
     close(cmd_fd[1]);
     cmd_fd[1] = -1;
-    mp3dec_child_main(cmd_fd[0], response_fd[1]);
+    mp3dec_child_main(cmd_fd[0], response_fd[1], state->shared);
     close(response_fd[1]);
     close(cmd_fd[0]);
     exit(0);
@@ -194,9 +669,19 @@ static int mp3dec_start(mp3dec_state_t *state) {
 
     state->cmd_fd = cmd_fd[1];
     state->response_fd = response_fd[0];
+#ifdef SO_NOSIGPIPE
+    {
+      int on = 1;
+      setsockopt(state->cmd_fd, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on));
+    }
+#endif
+#ifdef SYS_pidfd_open
+    state->pidfd = syscall(SYS_pidfd_open, state->child_pid, 0);
+#endif
 
-    if (mp3dec_ping(state) != 0) {
+    if (mp3dec_parent_ping(state) != 0) {
       error_prepend(&state->error, "Could not PING child");
+      retval = -1;
       goto error;
     }
 
@@ -211,6 +696,10 @@ static int mp3dec_start(mp3dec_state_t *state) {
     state->cmd_fd = -1;
     state->response_fd = -1;
   }
+  if (state->pidfd != -1) {
+    close(state->pidfd);
+    state->pidfd = -1;
+  }
   
   if (cmd_fd[0] != -1) {
     close(cmd_fd[0]);
@@ -232,6 +721,294 @@ static int mp3dec_start(mp3dec_state_t *state) {
   return retval;
 }
 
+/* supervision. A dead child is noticed through its pidfd, or by
+   polling where there is none, a hung one by its heartbeat. It is
+   replaced by a new child, which gets the settings of the old one and
+   continues the track from the last checkpoint. */
+
+#define MP3DEC_SUPERVISE_MIN_MS  10
+#define MP3DEC_SUPERVISE_MAX_MS  100
+#define MP3DEC_RESTART_MAX_MS    10000
+
+/* copy the checkpoint unless the child is writing it */
+static int mp3dec_parent_checkpoint(mp3dec_state_t *state) {
+  mp3dec_checkpoint_t *cp = &state->shared->checkpoint;
+  unsigned int seq = cp->seq;
+
+  if (seq & 1)
+    return -1;
+  __sync_synchronize();
+  memcpy(&state->checkpoint, cp, sizeof(state->checkpoint));
+  __sync_synchronize();
+  return (cp->seq == seq) ? 0 : -1;
+}
+
+/* whether the child has exited, without reaping it */
+static int mp3dec_parent_child_exited(mp3dec_state_t *state) {
+  siginfo_t info;
+
+  if (state->child_pid == -1)
+    return 1;
+  memset(&info, 0, sizeof(info));
+  if (waitid(P_PID, state->child_pid, &info,
+	     WEXITED | WNOHANG | WNOWAIT) < 0)
+    return (errno == ECHILD);
+  return (info.si_pid == state->child_pid);
+}
+
+/* busy for longer than the timeout, say blocked writing to the audio
+   device */
+static int mp3dec_parent_child_hung(mp3dec_state_t *state) {
+  unsigned long long now, beat;
+
+  if ((state->timeout_ms == 0) || state->shared->idle)
+    return 0;
+  beat = state->shared->heartbeat_usec;
+  now = unix_time_usec();
+  return (now > beat) &&
+    (now - beat > (unsigned long long)state->timeout_ms * 1000);
+}
+
+static void mp3dec_parent_stop_child(mp3dec_state_t *state) {
+  if (state->child_pid != -1) {
+    kill(state->child_pid, SIGKILL);
+    waitpid(state->child_pid, NULL, 0);
+    state->child_pid = -1;
+  }
+  if (state->cmd_fd != -1) {
+    close(state->cmd_fd);
+    state->cmd_fd = -1;
+  }
+  if (state->response_fd != -1) {
+    close(state->response_fd);
+    state->response_fd = -1;
+  }
+  if (state->pidfd != -1) {
+    close(state->pidfd);
+    state->pidfd = -1;
+  }
+}
+
+/* load the track of the checkpoint and bring it back to where it was */
+static int mp3dec_parent_restore(mp3dec_state_t *state,
+				 mp3dec_checkpoint_t *cp) {
+  unsigned long long position = cp->position;
+
+  if (mp3dec_parent_cmd_locked(state, MP3DEC_COMMAND_LOAD, cp->name,
+			       strlen(cp->name) + 1, -1, NULL, 0) < 0)
+    return -1;
+  if ((position > 0) &&
+      (mp3dec_parent_cmd_locked(state, MP3DEC_COMMAND_SEEK, &position,
+				sizeof(position), -1, NULL, 0) < 0))
+    return -1;
+
+  /* a paused track is cued straight from STOP, passing through PLAY
+     would play a frame of it */
+  if (cp->state == CHILD_PLAY)
+    return mp3dec_parent_cmd_locked(state, MP3DEC_COMMAND_PLAY, NULL, 0,
+				    -1, NULL, 0);
+  if (cp->state == CHILD_PAUSE)
+    return mp3dec_parent_cmd_locked(state, MP3DEC_COMMAND_PAUSE, NULL, 0,
+				    -1, NULL, 0);
+  return 0;
+}
+
+/* the error of the caller is kept, a failed restart is only logged.
+   Returns -1 if no new child could be started. */
+static int mp3dec_parent_respawn(mp3dec_state_t *state) {
+  unsigned long long start = unix_time_usec();
+  mp3dec_error_t saved;
+  int i, ret = 0;
+
+  pthread_mutex_lock(&state->lock);
+  error_copy(&saved, &state->error);
+
+  mp3dec_parent_stop_child(state);
+  /* the child is gone, unless it died while writing the checkpoint
+     this one is complete */
+  mp3dec_parent_checkpoint(state);
+
+  if (mp3dec_start(state) < 0) {
+    fprintf(stderr, "could not restart the player: %s\n",
+	    error_get(&state->error));
+    ret = -1;
+    goto out;
+  }
+
+  for (i = 0; i < MP3DEC_SETTINGS + MP3DEC_GAIN_SETTINGS; i++) {
+    mp3dec_setting_t *setting = &state->settings[i];
+    if ((setting->len > 0) &&
+	(mp3dec_parent_cmd_locked(state, setting->cmd, setting->data,
+				  setting->len, -1, NULL, 0) < 0))
+      fprintf(stderr, "could not restore a setting of the player\n");
+  }
+
+  if ((state->checkpoint.name[0] != '\0') &&
+      (mp3dec_parent_restore(state, &state->checkpoint) < 0))
+    fprintf(stderr, "could not restore \"%s\" in the player\n",
+	    state->checkpoint.name);
+
+  state->respawns++;
+  state->recovery_usec = unix_time_usec() - start;
+
+ out:
+  error_copy(&state->error, &saved);
+  state->child_error = 0;
+  pthread_mutex_unlock(&state->lock);
+  return ret;
+}
+
+static void *mp3dec_supervisor(void *arg) {
+  mp3dec_state_t *state = arg;
+  struct pollfd pfd[2];
+  unsigned int failures = 0;   /* restarts that failed in a row */
+  int interval, n, ret;
+
+  for (;;) {
+    interval = state->timeout_ms / 4;
+    if (interval < MP3DEC_SUPERVISE_MIN_MS)
+      interval = MP3DEC_SUPERVISE_MIN_MS;
+    if ((interval > MP3DEC_SUPERVISE_MAX_MS) || (state->timeout_ms == 0))
+      interval = MP3DEC_SUPERVISE_MAX_MS;
+    /* while the player cannot be started, try again less and less
+       often instead of on every poll */
+    if (failures > 0) {
+      interval = MP3DEC_SUPERVISE_MAX_MS << ((failures < 8) ? failures : 8);
+      if (interval > MP3DEC_RESTART_MAX_MS)
+	interval = MP3DEC_RESTART_MAX_MS;
+    }
+
+    pfd[0].fd = state->stop_fd[0];
+    pfd[0].events = POLLIN;
+    pfd[0].revents = 0;
+    pfd[1].fd = state->pidfd;
+    pfd[1].events = POLLIN;
+    pfd[1].revents = 0;
+    n = (state->pidfd != -1) ? 2 : 1;
+
+    ret = poll(pfd, n, interval);
+    if ((ret < 0) && (errno != EINTR))
+      break;
+    if (pfd[0].revents)
+      break;
+
+    if (mp3dec_parent_child_exited(state)) {
+      if (failures == 0)
+	fprintf(stderr, "the player died, restarting it\n");
+    } else if (mp3dec_parent_child_hung(state)) {
+      fprintf(stderr, "the player hangs, restarting it\n");
+      /* a command waiting for it fails and releases the lock */
+      kill(state->child_pid, SIGKILL);
+    } else {
+      mp3dec_parent_checkpoint(state);
+      continue;
+    }
+    if (mp3dec_parent_respawn(state) < 0)
+      failures++;
+    else
+      failures = 0;
+  }
+
+  return NULL;
+}
+
+/* watch the player and restart it when it dies or does not get through
+   its main loop within timeout_ms, 0 only watches for it dying. The
+   new player continues the current track where the old one was, if it
+   was loaded from a file by name, with the settings and the gains of
+   the mixer slots. The track queued with mp3dec_load_next, the queue,
+   the overlays and the sinks are not restored, they have to be set up
+   again. Can be called again to change the timeout. */
+int mp3dec_supervise(mp3dec_state_t *state, unsigned int timeout_ms) {
+  pthread_mutex_lock(&state->lock);
+  state->child_error = 0;
+  state->timeout_ms = timeout_ms;
+  if (state->supervising) {
+    pthread_mutex_unlock(&state->lock);
+    return 0;
+  }
+
+  if (pipe(state->stop_fd) < 0) {
+    error_set_strerror(&state->error, "Could not open the supervisor pipe");
+    pthread_mutex_unlock(&state->lock);
+    return -1;
+  }
+  mp3dec_parent_checkpoint(state);
+  if (pthread_create(&state->supervisor, NULL, mp3dec_supervisor,
+		     state) != 0) {
+    error_set(&state->error, "Could not start the supervisor");
+    close(state->stop_fd[0]);
+    close(state->stop_fd[1]);
+    state->stop_fd[0] = state->stop_fd[1] = -1;
+    pthread_mutex_unlock(&state->lock);
+    return -1;
+  }
+  state->supervising = 1;
+  pthread_mutex_unlock(&state->lock);
+  return 0;
+}
+
+static void mp3dec_stop_supervisor(mp3dec_state_t *state) {
+  if (!state->supervising)
+    return;
+
+  unix_write(state->stop_fd[1], (unsigned char *)"", 1);
+  pthread_join(state->supervisor, NULL);
+  close(state->stop_fd[0]);
+  close(state->stop_fd[1]);
+  state->stop_fd[0] = state->stop_fd[1] = -1;
+  state->supervising = 0;
+}
+
+static void mp3dec_parent_fetch_error(mp3dec_state_t *state) {
+  mp3dec_cmd_e resp;
+  char buf[CMD_BUF_SIZE];
+  unsigned int buflen;
+  mp3dec_error_t error;
+
+  if (state->child_pid == -1)
+    return;
+
+  if ((mp3dec_write_cmd(state->cmd_fd, MP3DEC_COMMAND_ERROR,
+			NULL, 0, &error) < 0) ||
+      (mp3dec_read_cmd(state->response_fd, &resp, buf, &buflen,
+		       sizeof(buf) - 1, &error) < 0) ||
+      (resp != MP3DEC_RESPONSE_ACK))
+    return;
+
+  buf[buflen] = '\0';
+  error_append(&state->error, buf);
+}
+
 char *mp3dec_error(mp3dec_state_t *state) {
+  if (state->child_error) {
+    pthread_mutex_lock(&state->lock);
+    state->child_error = 0;
+    mp3dec_parent_fetch_error(state);
+    pthread_mutex_unlock(&state->lock);
+  }
   return error_get(&state->error);
 }
+
+mp3dec_errcode_e mp3dec_error_code(mp3dec_state_t *state) {
+  return error_code(&state->error);
+}
+
+const char *mp3dec_errcode_name(mp3dec_errcode_e code) {
+  static const char *names[MP3DEC_ERR_CODES] = {
+    "no error",
+    "failed",
+    "system call failed",
+    "out of memory",
+    "invalid argument",
+    "not possible in this state",
+    "player not running",
+    "protocol error",
+    "decoder error",
+    "audio output error"
+  };
+
+  if ((unsigned int)code >= MP3DEC_ERR_CODES)
+    return "unknown error";
+  return names[code];
+}
@@ -4,14 +4,400 @@
 struct mp3dec_state_s;
 typedef struct mp3dec_state_s mp3dec_state_t;
 
+/* what went wrong, the message is only built when it is asked for */
+typedef enum {
+  MP3DEC_OK = 0,
+  MP3DEC_ERR_FAILED,         /* anything not covered below */
+  MP3DEC_ERR_SYSTEM,         /* a system call failed, see the message */
+  MP3DEC_ERR_NOMEM,
+  MP3DEC_ERR_INVALID,        /* bad argument */
+  MP3DEC_ERR_STATE,          /* not possible in the current state */
+  MP3DEC_ERR_NOCHILD,        /* the player is not running */
+  MP3DEC_ERR_PROTOCOL,       /* unexpected response from the player */
+  MP3DEC_ERR_DECODE,         /* unrecoverable decoder error */
+  MP3DEC_ERR_AUDIO,
+  MP3DEC_ERR_CODES
+} mp3dec_errcode_e;
+
+/* recoverable decoder errors, counted per kind */
+typedef enum {
+  MP3DEC_DECODE_LOSTSYNC = 0,
+  MP3DEC_DECODE_HEADER,      /* invalid layer, bitrate, samplerate ... */
+  MP3DEC_DECODE_CRC,
+  MP3DEC_DECODE_DATA,        /* damaged side info or huffman data */
+  MP3DEC_DECODE_ERRORS
+} mp3dec_decode_error_e;
+
+typedef enum {
+  MP3DEC_STATE_STOP = 0,
+  MP3DEC_STATE_PLAY,
+  MP3DEC_STATE_ERROR,
+  MP3DEC_STATE_PAUSE,
+  MP3DEC_STATE_NONE
+} mp3dec_play_state_e;
+
+/* bytes of a file that are not mp3 frames */
+typedef struct mp3dec_region_s {
+  unsigned long long offset;
+  unsigned long long length;
+} mp3dec_region_t;
+
+#define MP3DEC_STATUS_REGIONS 8
+
+/* from the ID3v2 tags of a track, or its ID3v1 tag. Text is utf-8
+   and empty when it is not tagged. */
+#define MP3DEC_METADATA_TEXT  128
+#define MP3DEC_METADATA_SHORT 16
+
+typedef struct mp3dec_metadata_s {
+  char title[MP3DEC_METADATA_TEXT];
+  char artist[MP3DEC_METADATA_TEXT];
+  char album[MP3DEC_METADATA_TEXT];
+  char genre[MP3DEC_METADATA_TEXT];   /* "(n)" for an ID3v1 genre */
+  char date[MP3DEC_METADATA_SHORT];   /* the year, or a v2.4 date */
+  char track[MP3DEC_METADATA_SHORT];  /* "n" or "n/total" */
+} mp3dec_metadata_t;
+
+/* what a sink that falls behind loses when its queue is full */
+typedef enum {
+  MP3DEC_DROP_OLDEST = 0,    /* the frames it has not written yet */
+  MP3DEC_DROP_NEWEST         /* the frames played from then on */
+} mp3dec_drop_e;
+
+#define MP3DEC_STATUS_SINKS 4
+
+typedef struct mp3dec_sink_status_s {
+  int active;
+  int failed;                /* a write failed, it drops everything */
+  unsigned int queued;       /* frames waiting to be written */
+  unsigned long written;
+  unsigned long dropped;
+
+  /* servers only: clients connected and disconnected for falling
+     behind, and cpu time per frame sent to a client */
+  unsigned int clients;
+  unsigned long evicted;
+  unsigned long client_cpu_nsec;
+} mp3dec_sink_status_t;
+
+typedef struct mp3dec_status_s {
+  mp3dec_play_state_e state;
+  unsigned long frames;      /* frames decoded since the track was loaded */
+  unsigned long long position; /* file offset of the frame playing */
+
+  /* pipes and sockets only */
+  int buffering;             /* waiting for the jitter buffer to fill up */
+  unsigned long buffered;    /* bytes in the jitter buffer */
+  unsigned long underruns;   /* times the jitter buffer ran low */
+
+  /* files only, times and total time decoding waited for a read */
+  unsigned long stalls;
+  unsigned long long stall_usec;
+
+  unsigned int overlays;     /* overlays currently playing */
+
+  int next_loaded;           /* a track is queued with mp3dec_load_next */
+  unsigned int queued;       /* tracks in the queue after that one */
+  int crossfading;           /* both tracks are being decoded */
+
+  /* decoding and mixing cpu time per output frame, on its own and
+     while crossfading */
+  unsigned long cpu_usec;
+  unsigned long crossfade_cpu_usec;
+
+  /* the same at reduced quality, the saving is cpu_usec minus this */
+  unsigned int quality;
+  unsigned long preview_cpu_usec;
+
+  /* allocations of output buffers since the player started, does not
+     grow while playing */
+  unsigned long pcm_allocs;
+
+  /* recoverable decoder errors of the current track */
+  unsigned long decode_errors[MP3DEC_DECODE_ERRORS];
+
+  /* garbage skipped to find the next frame, the first
+     MP3DEC_STATUS_REGIONS regions of it */
+  unsigned long resyncs;
+  unsigned long long corrupt_bytes;
+  unsigned long nregions;
+  mp3dec_region_t regions[MP3DEC_STATUS_REGIONS];
+
+  /* loads of regular files whose tags were cached resp. read */
+  unsigned long tag_cache_hits;
+  unsigned long tag_cache_misses;
+
+  /* players started again by the supervisor, and how long it took
+     the last time until the track played on */
+  unsigned long respawns;
+  unsigned long long recovery_usec;
+
+  /* times the audio output ran dry while playing, and woke up more
+     than a millisecond late with the null output */
+  unsigned long audio_underruns;
+  unsigned long audio_late;
+  unsigned long audio_max_late_usec;
+
+  /* how long until what the player decodes is heard, as the output
+     achieved it for the latency target, and how often per second the
+     output wakes the player up */
+  unsigned long audio_latency_usec;
+  unsigned int audio_wakeups;
+
+  /* cpu time, resident memory now and page faults of the player
+     process */
+  unsigned long long process_cpu_usec;
+  unsigned long process_rss_kb;
+  unsigned long process_faults;
+
+  /* the sinks by their id */
+  mp3dec_sink_status_t sinks[MP3DEC_STATUS_SINKS];
+} mp3dec_status_t;
+
+/* cheaper decoding for previews, combined with | */
+#define MP3DEC_QUALITY_FULL      0
+#define MP3DEC_QUALITY_HALF_RATE 1   /* synthesize at half the samplerate */
+#define MP3DEC_QUALITY_MONO      2   /* mix down to mono before synthesis */
+
+/* scheduling of the player process, for hosts where other work
+   competes with the decoder */
+typedef enum {
+  MP3DEC_SCHED_OTHER = 0,    /* time sharing, at the nice level */
+  MP3DEC_SCHED_FIFO,         /* real time, at the priority */
+  MP3DEC_SCHED_RR
+} mp3dec_sched_e;
+
+typedef struct mp3dec_options_s {
+  mp3dec_sched_e policy;
+  int priority;              /* 1 to 99 for FIFO and RR */
+  int nice;                  /* for OTHER, below 0 needs privileges */
+  unsigned long long cpus;   /* bit n allows cpu n, 0 for all */
+  int lock_memory;           /* mlockall, so that it is never paged out */
+  int prefault;              /* touch the buffers and stack up front */
+} mp3dec_options_t;
+
+/* mixer slot of the current track, overlays get the slots after it */
+#define MP3DEC_SLOT_MAIN 0
+
 mp3dec_state_t *mp3dec_new(void);
 void mp3dec_delete(mp3dec_state_t *state);
 
+/* the defaults of mp3dec_new, where nothing is changed */
+void mp3dec_options_init(mp3dec_options_t *options);
+int mp3dec_set_options(mp3dec_state_t *state, mp3dec_options_t *options);
+
 int mp3dec_play(mp3dec_state_t *state);
 int mp3dec_pause(mp3dec_state_t *state);
 int mp3dec_load(mp3dec_state_t *state, char *filename);
+int mp3dec_load_fd(mp3dec_state_t *state, int fd);
+int mp3dec_load_buffer(mp3dec_state_t *state, unsigned char *buf,
+		       unsigned long len);
+int mp3dec_load_next(mp3dec_state_t *state, char *filename);
+int mp3dec_enqueue(mp3dec_state_t *state, char *filename);
+int mp3dec_clear_queue(mp3dec_state_t *state);
+int mp3dec_skip(mp3dec_state_t *state);
+int mp3dec_seek(mp3dec_state_t *state, unsigned long long position);
+int mp3dec_supervise(mp3dec_state_t *state, unsigned int timeout_ms);
+int mp3dec_set_crossfade(mp3dec_state_t *state, unsigned int ms);
 int mp3dec_ping(mp3dec_state_t *state);
+int mp3dec_status(mp3dec_state_t *state, mp3dec_status_t *status);
+int mp3dec_metadata(mp3dec_state_t *state, mp3dec_metadata_t *metadata);
+int mp3dec_set_stream_buffer(mp3dec_state_t *state, unsigned long size,
+			     unsigned long low, unsigned long high);
+int mp3dec_overlay(mp3dec_state_t *state, char *filename);
+int mp3dec_set_gain(mp3dec_state_t *state, unsigned int slot,
+		    float gain, unsigned int ramp_ms);
+int mp3dec_set_replaygain(mp3dec_state_t *state, float gain_db, float peak);
+int mp3dec_set_quality(mp3dec_state_t *state, unsigned int quality);
+int mp3dec_set_resync(mp3dec_state_t *state, unsigned long max_bytes,
+		      unsigned long max_count);
+
+/* audio buffered ahead of the device */
+#define MP3DEC_MAX_LATENCY_MS 10000
+
+int mp3dec_set_latency(mp3dec_state_t *state, unsigned int ms);
 
+/* copies of the output to a descriptor or a wav file, returning the id
+   of the sink. A wav file fails when the samplerate or the channels of
+   the output change, what was recorded until then is kept. */
+int mp3dec_add_sink_fd(mp3dec_state_t *state, int fd, mp3dec_drop_e policy);
+int mp3dec_record(mp3dec_state_t *state, char *filename,
+		  mp3dec_drop_e policy);
+int mp3dec_remove_sink(mp3dec_state_t *state, unsigned int id);
+
+/* serve the output to clients on the box, as a sink */
+#define MP3DEC_SERVE_WAV 1   /* start every client with a wav header */
+
+int mp3dec_serve(mp3dec_state_t *state, unsigned short port,
+		 unsigned int flags);
+int mp3dec_serve_fd(mp3dec_state_t *state, int fd, unsigned int flags);
+
+/* the message of an error in the player is fetched from it */
 char *mp3dec_error(mp3dec_state_t *state);
+mp3dec_errcode_e mp3dec_error_code(mp3dec_state_t *state);
+const char *mp3dec_errcode_name(mp3dec_errcode_e code);
+
+/* in-process decoding, without child or audio output */
+
+typedef enum {
+  MP3DEC_FORMAT_S16 = 0,     /* native endian signed 16 bit */
+  MP3DEC_FORMAT_S32,         /* native endian signed 32 bit */
+  MP3DEC_FORMAT_FLOAT        /* float, -1.0 to 1.0 */
+} mp3dec_format_e;
+
+struct mp3dec_stream_s;
+typedef struct mp3dec_stream_s mp3dec_stream_t;
+
+mp3dec_stream_t *mp3dec_stream_new(void);
+void mp3dec_stream_delete(mp3dec_stream_t *stream);
+void mp3dec_stream_reset(mp3dec_stream_t *stream);
+
+long mp3dec_stream_push(mp3dec_stream_t *stream,
+			unsigned char *data, unsigned long len);
+int  mp3dec_stream_finish(mp3dec_stream_t *stream);
+long mp3dec_stream_pull(mp3dec_stream_t *stream, void *pcm_out,
+			unsigned long max_samples, mp3dec_format_e format);
+void mp3dec_stream_format(mp3dec_stream_t *stream,
+			  unsigned int *samplerate, unsigned int *channels);
+void mp3dec_stream_set_replaygain(mp3dec_stream_t *stream,
+				  float gain_db, float peak);
+
+char *mp3dec_stream_error(mp3dec_stream_t *stream);
+mp3dec_errcode_e mp3dec_stream_error_code(mp3dec_stream_t *stream);
+
+/* loudness analysis, EBU R128 and ReplayGain 2.0 */
+
+typedef struct mp3dec_loudness_s {
+  double integrated;         /* gated loudness in LUFS, -70 for silence */
+  double true_peak;          /* in dBTP */
+  double gain;               /* ReplayGain in dB, to -18 LUFS */
+  double peak;               /* linear true peak, 1.0 is full scale */
+  double seconds;            /* length of the decoded audio */
+} mp3dec_loudness_t;
+
+struct mp3dec_analysis_s;
+typedef struct mp3dec_analysis_s mp3dec_analysis_t;
+
+mp3dec_analysis_t *mp3dec_analysis_new(void);
+void mp3dec_analysis_delete(mp3dec_analysis_t *analysis);
+void mp3dec_analysis_reset(mp3dec_analysis_t *analysis);
+
+int  mp3dec_analyze(mp3dec_analysis_t *analysis, char *filename,
+		    mp3dec_loudness_t *track);
+void mp3dec_analysis_album(mp3dec_analysis_t *analysis,
+			   mp3dec_loudness_t *album);
+
+char *mp3dec_analysis_error(mp3dec_analysis_t *analysis);
+mp3dec_errcode_e mp3dec_analysis_error_code(mp3dec_analysis_t *analysis);
+
+/* waveform summaries, a file made for mmap: the header, the level
+   table, then the points of every level at its offset. Every bucket
+   has one point per channel, values are scaled to 16 bits. All fields
+   are in native byte order, check the magic. */
+
+#define MP3DEC_WAVEFORM_MAGIC    0x4657504d   /* "MPWF" little endian */
+#define MP3DEC_WAVEFORM_VERSION  1
+#define MP3DEC_WAVEFORM_LEVELS   3            /* 256, 4096, 65536 */
+
+typedef struct mp3dec_waveform_point_s {
+  signed short min;
+  signed short max;
+  signed short rms;
+} mp3dec_waveform_point_t;
+
+typedef struct mp3dec_waveform_level_s {
+  unsigned int bucket;       /* samples per bucket */
+  unsigned int reserved;
+  unsigned long long count;  /* buckets, the last one can be partial */
+  unsigned long long offset; /* of the first point from the file start */
+} mp3dec_waveform_level_t;
+
+typedef struct mp3dec_waveform_header_s {
+  unsigned int magic;
+  unsigned int version;
+  unsigned int samplerate;
+  unsigned int channels;
+  unsigned long long samples;  /* per channel */
+  unsigned int levels;
+  unsigned int reserved;
+  mp3dec_waveform_level_t level[MP3DEC_WAVEFORM_LEVELS];
+} mp3dec_waveform_header_t;
+
+int mp3dec_waveform(mp3dec_analysis_t *analysis, char *filename,
+		    char *output, mp3dec_waveform_header_t *header);
+
+/* frame statistics from the frame headers alone */
+
+#define MP3DEC_SCAN_BITRATES  32
+#define MP3DEC_SCAN_REGIONS   32
+
+typedef enum {
+  MP3DEC_MODE_SINGLE_CHANNEL = 0,
+  MP3DEC_MODE_DUAL_CHANNEL,
+  MP3DEC_MODE_JOINT_STEREO,
+  MP3DEC_MODE_STEREO
+} mp3dec_mode_e;
+
+typedef struct mp3dec_scan_s {
+  unsigned long frames;
+  unsigned long long samples;  /* per channel */
+  double seconds;
+  unsigned long long bytes;    /* of mp3 frames */
+  double kbps;                 /* average bitrate */
+
+  /* of the first frame, with the number of frames that differ */
+  unsigned int layer;
+  unsigned int samplerate;
+  mp3dec_mode_e mode;
+  unsigned long samplerate_changes;
+  unsigned long mode_changes;
+
+  /* frames per bitrate, free format counts as 0 kbps */
+  struct {
+    unsigned int kbps;
+    unsigned long frames;
+  } bitrates[MP3DEC_SCAN_BITRATES];
+  unsigned int nbitrates;
+
+  /* data between frames that is not a frame, the first
+     MP3DEC_SCAN_REGIONS of them */
+  mp3dec_region_t regions[MP3DEC_SCAN_REGIONS];
+  unsigned long nregions;
+  unsigned long long corrupt_bytes;
+} mp3dec_scan_t;
+
+int mp3dec_scan(mp3dec_analysis_t *analysis, char *filename,
+		mp3dec_scan_t *scan);
+
+/* relaying the mp3 frames of a file to sockets in real time, without
+   decoding them */
+
+struct mp3dec_relay_s;
+typedef struct mp3dec_relay_s mp3dec_relay_t;
+
+typedef struct mp3dec_relay_status_s {
+  int playing;
+  unsigned long frames;        /* in the file */
+  unsigned long frame;         /* next one due */
+  double seconds;              /* of the next frame */
+  double duration;
+  unsigned int listeners;
+  unsigned long dropped;       /* listeners that fell behind or went away */
+  unsigned long late;          /* wakeups more than a frame too late */
+  unsigned long long cpu_usec; /* of the relay thread */
+} mp3dec_relay_status_t;
+
+mp3dec_relay_t *mp3dec_relay_new(void);
+void mp3dec_relay_delete(mp3dec_relay_t *relay);
+int  mp3dec_relay_load(mp3dec_relay_t *relay, char *filename);
+int  mp3dec_relay_play(mp3dec_relay_t *relay);
+int  mp3dec_relay_pause(mp3dec_relay_t *relay);
+int  mp3dec_relay_seek(mp3dec_relay_t *relay, double seconds);
+int  mp3dec_relay_add(mp3dec_relay_t *relay, int fd);
+void mp3dec_relay_status(mp3dec_relay_t *relay,
+			 mp3dec_relay_status_t *status);
+
+char *mp3dec_relay_error(mp3dec_relay_t *relay);
+mp3dec_errcode_e mp3dec_relay_error_code(mp3dec_relay_t *relay);
 
 #endif /* MP3_DECODE_H__ */
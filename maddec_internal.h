@@ -1,13 +1,26 @@
 #ifndef MADDEC_INTERNAL_H__
 #define MADDEC_INTERNAL_H__
 
+#include <sys/types.h>
+
+#include <pthread.h>
+
 #include <mad.h>
 
 #include "error.h"
 #include "audio.h"
+#include "input.h"
+#include "decoder.h"
+#include "mixer.h"
+#include "pcm.h"
+#include "queue.h"
+#include "sink.h"
 
 #define CMD_BUF_SIZE      1024
 
+/* name of tracks loaded from a passed descriptor */
+#define CHILD_FD_NAME     "<descriptor>"
+
 typedef enum {
   MP3DEC_COMMAND_PLAY = 0,
   MP3DEC_COMMAND_PAUSE,
@@ -15,43 +28,178 @@ typedef enum {
   MP3DEC_COMMAND_LOAD,
   MP3DEC_COMMAND_STATUS,
   MP3DEC_COMMAND_PING,
+  MP3DEC_COMMAND_LOAD_FD,
+  MP3DEC_COMMAND_STREAM_BUFFER,
+  MP3DEC_COMMAND_OVERLAY,
+  MP3DEC_COMMAND_GAIN,
+  MP3DEC_COMMAND_LOAD_NEXT,
+  MP3DEC_COMMAND_CROSSFADE,
+  MP3DEC_COMMAND_REPLAYGAIN,
+  MP3DEC_COMMAND_QUALITY,
+  MP3DEC_COMMAND_ERROR,
+  MP3DEC_COMMAND_RESYNC,
+  MP3DEC_COMMAND_METADATA,
+  MP3DEC_COMMAND_ENQUEUE,
+  MP3DEC_COMMAND_CLEAR,
+  MP3DEC_COMMAND_SKIP,
+  MP3DEC_COMMAND_SEEK,
+  MP3DEC_COMMAND_ADD_SINK,
+  MP3DEC_COMMAND_REMOVE_SINK,
+  MP3DEC_COMMAND_SERVE,
+  MP3DEC_COMMAND_OPTIONS,
+  MP3DEC_COMMAND_LATENCY,
 
   MP3DEC_RESPONSE_PONG,
   MP3DEC_RESPONSE_ACK,
   MP3DEC_RESPONSE_ERR,
 } mp3dec_cmd_e;
 
+/* where the child is, to start a new one at the same place. Written
+   by the child with a sequence number that is odd while it is being
+   updated. Only tracks loaded from a file by name can be restored. */
+typedef struct mp3dec_checkpoint_s {
+  volatile unsigned int seq;
+  char name[256];
+  unsigned long long position;   /* file offset of the frame playing */
+  int state;                     /* child_state_e */
+} mp3dec_checkpoint_t;
+
+/* shared between the parent and the child, mapped before the fork */
+typedef struct mp3dec_shared_s {
+  /* time of the last pass through the main loop of the child, which
+     does not count while it is idle waiting for a command or data */
+  volatile unsigned long long heartbeat_usec;
+  volatile int idle;
+
+  mp3dec_checkpoint_t checkpoint;
+} mp3dec_shared_t;
+
+/* mixer inputs, the current track and the overlays after it, then
+   the next track while it fades in */
+#define CHILD_SLOT_MAIN      0
+#define CHILD_SLOT_OVERLAY   1
+#define CHILD_MAX_OVERLAYS   4
+#define CHILD_SLOT_NEXT      (CHILD_SLOT_OVERLAY + CHILD_MAX_OVERLAYS)
+
+/* commands whose arguments are sent again to a new child */
+#define MP3DEC_SETTING_SIZE 32
+
+typedef struct mp3dec_setting_s {
+  mp3dec_cmd_e cmd;
+  unsigned int len;            /* 0 while it has not been set */
+  unsigned char data[MP3DEC_SETTING_SIZE];
+} mp3dec_setting_t;
+
+#define MP3DEC_SETTINGS 7
+
+/* GAIN is kept for every slot it can be set for, after the others */
+#define MP3DEC_GAIN_SETTINGS (CHILD_SLOT_OVERLAY + CHILD_MAX_OVERLAYS)
+
 struct mp3dec_state_s {
   pid_t child_pid;
   int cmd_fd;
   int response_fd;
-  error_t error;
+  mp3dec_error_t error;
+  int child_error;     /* the message is still in the child */
+
+  /* held for every exchange with the child, and while it is replaced */
+  pthread_mutex_t lock;
+  mp3dec_shared_t *shared;
+  mp3dec_setting_t settings[MP3DEC_SETTINGS + MP3DEC_GAIN_SETTINGS];
+
+  /* see mp3dec_supervise */
+  int supervising;
+  pthread_t supervisor;
+  int stop_fd[2];
+  int pidfd;           /* -1 where pidfd_open is not available */
+  unsigned int timeout_ms;
+  mp3dec_checkpoint_t checkpoint;   /* the last complete one */
+  unsigned long respawns;
+  unsigned long long recovery_usec;
 };
 
+/* sent with MP3DEC_RESPONSE_ERR, the message is fetched with
+   MP3DEC_COMMAND_ERROR */
+typedef struct mp3dec_error_reply_s {
+  unsigned int code;
+} mp3dec_error_reply_t;
+
+typedef struct mp3dec_gain_cmd_s {
+  unsigned int slot;
+  float gain;
+  unsigned int ramp_ms;
+} mp3dec_gain_cmd_t;
+
+typedef struct mp3dec_replaygain_cmd_s {
+  float gain_db;
+  float peak;
+} mp3dec_replaygain_cmd_t;
+
 typedef enum {
   CHILD_STOP = 0,
   CHILD_PLAY,
   CHILD_ERROR,
   CHILD_PAUSE,
-  CHILD_NONE
+  CHILD_NONE,
+  CHILD_EXIT
 } child_state_e;
 
+/* result of a single decoding step in the child */
+typedef enum {
+  CHILD_STEP_OK = 0,
+  CHILD_STEP_WAIT,
+  CHILD_STEP_EOF,
+  CHILD_STEP_ERROR
+} child_step_e;
+
 typedef struct child_state_s {
   int cmd_fd, response_fd;
   child_state_e state;
 
-  struct mad_decoder decoder;
-  int mad_initialized;
+  /* the current track and the one queued after it, swapped when the
+     current one ends */
+  decoder_t decoders[2];
+  int cur;
+  decoder_t overlays[CHILD_MAX_OVERLAYS];
+
+  /* tracks after the next one, moved into its slot as it frees up */
+  queue_t queue;
+
+  unsigned int crossfade_ms;
+  int crossfading;
+
+  mixer_t mixer;
+  struct mad_pcm mix_pcm;
 
-  char filename[256];
-  
-  int mp3_fd;
-  unsigned char mp3data[MAD_BUFFER_MDLEN];
-  unsigned int  mp3len;
-  unsigned char mp3eof;
+  /* applied when converting for the audio output */
+  mad_fixed_t output_gain;
 
-  error_t error;
+  /* frames converted for the output, allocated once at startup */
+  pcm_pool_t pool;
+
+  /* copies of the output, fed references to the same buffers */
+  sink_t sinks[SINK_MAX];
+
+  /* frames decoded at reduced quality are brought back to the format
+     the output was last opened with */
+  unsigned int quality;
+  unsigned int out_samplerate, out_channels;
+  pcm_adapt_t adapt;
+  struct mad_pcm adapt_pcm;
+
+  /* cpu time spent per output frame */
+  unsigned long long cpu_usec, cpu_frames;
+  unsigned long long fade_cpu_usec, fade_cpu_frames;
+  unsigned long long preview_cpu_usec, preview_cpu_frames;
+
+  mp3dec_error_t error;
+  mp3dec_error_t last_error;   /* of the last ERR response or failed step */
+
+  /* heartbeat and checkpoint for the supervisor in the parent */
+  mp3dec_shared_t *shared;
 } child_state_t;
 
+int mp3dec_child_main(int cmd_fd, int response_fd, mp3dec_shared_t *shared);
+
 #endif /* MADDEC_INTERNAL_H__ */
 
@@ -37,8 +37,22 @@ static enum mad_flow mad_input(void *data,
 static enum mad_flow mad_output(void *data,
                                 struct mad_header const *header,
                                 struct mad_pcm *pcm) {
-  error_t error;
-  if (!audio_write(pcm, &error)) {
+  static pcm_pool_t pool;
+  pcm_buffer_t *buf;
+  mp3dec_error_t error;
+  int ret;
+
+  if ((pool.mem == NULL) &&
+      (pcm_pool_alloc(&pool, audio_format(), PCM_MAX_CHANNELS, &error) < 0)) {
+    printf("%s\n", error_get(&error));
+    return MAD_FLOW_BREAK;
+  }
+
+  buf = pcm_pool_get(&pool);
+  pcm_stage(pcm, MAD_F_ONE, buf);
+  ret = audio_write(buf, &error);
+  pcm_pool_put(&pool, buf);
+  if (!ret) {
     printf("Could not write pcm data: %s\n", error_get(&error));
     return MAD_FLOW_BREAK;
   }
@@ -79,7 +93,7 @@ static void mad_decode(unsigned char *data, unsigned long size) {
   mad_decoder_run(&decoder, MAD_DECODER_MODE_SYNC);
   mad_decoder_finish(&decoder);
 
-  error_t error;
+  mp3dec_error_t error;
   if (!audio_close(&error)) {
     printf("Could not close audio: %s\n", error_get(&error));
   }
@@ -1,13 +1,26 @@
 #include <sys/poll.h>
 #include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
 
 #include <assert.h>
+#include <fcntl.h>
+#include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 #include <errno.h>
 
+#ifdef __APPLE__
+#include <mach/mach.h>
+#endif
+
 #include "misc.h"
 
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
 /* ahh, the joys of unix */
 int unix_read(int fd, unsigned char *buf, unsigned int len) {
   int ret;
@@ -36,6 +49,32 @@ int unix_read(int fd, unsigned char *buf, unsigned int len) {
   return total;
 }
 
+int unix_pread(int fd, unsigned char *buf, unsigned int len,
+	       unsigned long offset) {
+  int ret;
+  unsigned char *ptr = buf;
+  unsigned int left = len, total = 0;
+
+  while (left > 0) {
+    ret = pread(fd, ptr, left, offset + total);
+    if (ret < 0) {
+      if (errno != EINTR)
+	return -1;
+      continue;
+    }
+
+    if (ret == 0)
+      return total;
+
+    assert(ret <= left);
+    total += ret;
+    left -= ret;
+    ptr += ret;
+  }
+
+  return total;
+}
+
 int unix_write(int fd, unsigned char *buf, unsigned int len) {
   int ret;
   unsigned char *ptr = buf;
@@ -63,6 +102,27 @@ int unix_write(int fd, unsigned char *buf, unsigned int len) {
   return total;
 }
 
+/* a peer that has gone away is reported as EPIPE instead of killing
+   the process with SIGPIPE. Pipes are written to as usual. */
+int unix_send(int fd, unsigned char *buf, unsigned int len) {
+  unsigned int total = 0;
+  int ret;
+
+  while (total < len) {
+    ret = send(fd, buf + total, len - total, MSG_NOSIGNAL);
+    if (ret < 0) {
+      if (errno == EINTR)
+	continue;
+      if ((errno == ENOTSOCK) && (total == 0))
+	return unix_write(fd, buf, len);
+      return -1;
+    }
+    total += ret;
+  }
+
+  return total;
+}
+
 int unix_check_fd_read(int fd) {
   struct pollfd pfd[1];
   int ret;
@@ -77,22 +137,221 @@ int unix_check_fd_read(int fd) {
   if (ret < 0)
     return ret;
   //  printf("revents: %x\n", pfd[0].revents);
+  /* a hangup means the next read returns EOF */
   if ((pfd[0].revents & POLLIN) ||
-      (pfd[0].revents & POLLERR))
+      (pfd[0].revents & POLLERR) ||
+      (pfd[0].revents & POLLHUP))
     return 1;
   else
     return 0;
 }
 
+/* write buf to a unix socket, passing fd along with the first byte */
+int unix_send_fd(int sock, unsigned char *buf, unsigned int len, int fd) {
+  struct msghdr msg;
+  struct iovec iov;
+  struct cmsghdr *cmsg;
+  unsigned char control[CMSG_SPACE(sizeof(int))];
+  int ret, ret2;
+
+  assert(len > 0);
+
+  memset(&msg, 0, sizeof(msg));
+  memset(control, 0, sizeof(control));
+  iov.iov_base = buf;
+  iov.iov_len = len;
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+
+  cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+  memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+
+  do {
+    ret = sendmsg(sock, &msg, MSG_NOSIGNAL);
+  } while ((ret < 0) && (errno == EINTR));
+  if (ret <= 0)
+    return ret;
+
+  if (ret < len) {
+    ret2 = unix_send(sock, buf + ret, len - ret);
+    if (ret2 < 0)
+      return -1;
+    ret += ret2;
+  }
+
+  return ret;
+}
+
+/* read len bytes from a unix socket, *fd is set to a descriptor passed
+   along with them or to -1 */
+int unix_recv_fd(int sock, unsigned char *buf, unsigned int len, int *fd) {
+  struct msghdr msg;
+  struct iovec iov;
+  struct cmsghdr *cmsg;
+  unsigned char control[CMSG_SPACE(sizeof(int))];
+  int ret, ret2;
+
+  *fd = -1;
+
+  memset(&msg, 0, sizeof(msg));
+  iov.iov_base = buf;
+  iov.iov_len = len;
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+
+  do {
+    ret = recvmsg(sock, &msg, 0);
+  } while ((ret < 0) && (errno == EINTR));
+  if (ret <= 0)
+    return ret;
+
+  for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL;
+       cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+    if ((cmsg->cmsg_level == SOL_SOCKET) &&
+	(cmsg->cmsg_type == SCM_RIGHTS))
+      memcpy(fd, CMSG_DATA(cmsg), sizeof(int));
+  }
+
+  if (ret < len) {
+    ret2 = unix_read(sock, buf + ret, len - ret);
+    if (ret2 < 0) {
+      if (*fd != -1) {
+	close(*fd);
+	*fd = -1;
+      }
+      return -1;
+    }
+    ret += ret2;
+  }
+
+  return ret;
+}
+
+/* block until one of the descriptors is readable, fd2 may be -1 */
+int unix_wait_fd_read(int fd1, int fd2) {
+  struct pollfd pfd[2];
+  int ret;
+
+  pfd[0].fd = fd1;
+  pfd[0].events = POLLIN | POLLERR;
+  pfd[0].revents = 0;
+  pfd[1].fd = fd2;
+  pfd[1].events = POLLIN | POLLERR;
+  pfd[1].revents = 0;
+
+  do {
+    ret = poll(pfd, (fd2 == -1) ? 1 : 2, -1);
+  } while ((ret < 0) && (errno == EINTR));
+
+  return ret;
+}
+
+/* cpu time used by the calling thread, 0 where it cannot be measured */
+unsigned long long unix_thread_cpu_usec(void) {
+#ifdef CLOCK_THREAD_CPUTIME_ID
+  struct timespec ts;
+
+  if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts) < 0)
+    return 0;
+  return (unsigned long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#else
+  return 0;
+#endif
+}
+
+/* monotonic wall clock time */
+unsigned long long unix_time_usec(void) {
+  struct timespec ts;
+
+  if (clock_gettime(CLOCK_MONOTONIC, &ts) < 0)
+    return 0;
+  return (unsigned long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* sleep until unix_time_usec() reaches usec */
+void unix_sleep_until_usec(unsigned long long usec) {
+#ifdef TIMER_ABSTIME
+  struct timespec ts;
+
+  ts.tv_sec = usec / 1000000;
+  ts.tv_nsec = (usec % 1000000) * 1000;
+  while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+    ;
+#else
+  unsigned long long now = unix_time_usec();
+
+  if (usec > now)
+    usleep(usec - now);
+#endif
+}
+
+/* resident memory of the process now, 0 where it cannot be measured */
+unsigned long unix_rss_kb(void) {
+#if defined(__linux__)
+  char buf[64], *p;
+  int fd, len;
+
+  /* the size of the process, then its resident pages */
+  fd = open("/proc/self/statm", O_RDONLY);
+  if (fd < 0)
+    return 0;
+  len = unix_read(fd, (unsigned char *)buf, sizeof(buf) - 1);
+  close(fd);
+  if (len <= 0)
+    return 0;
+  buf[len] = '\0';
+  strtoul(buf, &p, 10);
+  return strtoul(p, NULL, 10) * (sysconf(_SC_PAGESIZE) / 1024);
+#elif defined(__APPLE__)
+  mach_task_basic_info_data_t info;
+  mach_msg_type_number_t count = MACH_TASK_BASIC_INFO_COUNT;
+
+  if (task_info(mach_task_self(), MACH_TASK_BASIC_INFO,
+		(task_info_t)&info, &count) != KERN_SUCCESS)
+    return 0;
+  return info.resident_size / 1024;
+#else
+  return 0;
+#endif
+}
+
+/* write every page of mem, so that it is mapped and copied from the
+   parent before it is needed */
+void unix_prefault(void *mem, unsigned long len) {
+  volatile unsigned char *ptr = mem;
+  unsigned long page = sysconf(_SC_PAGESIZE);
+  unsigned long i;
+
+  for (i = 0; i < len; i += page)
+    ptr[i] = ptr[i];
+  if (len > 0)
+    ptr[len - 1] = ptr[len - 1];
+}
+
 int mp3dec_write_cmd(int fd, mp3dec_cmd_e cmd,
 		     void *data, unsigned int len,
-		     error_t *error) {
+		     mp3dec_error_t *error) {
+  return mp3dec_write_cmd_fd(fd, cmd, data, len, -1, error);
+}
+
+/* fd has to be a unix socket if pass_fd is not -1 */
+int mp3dec_write_cmd_fd(int fd, mp3dec_cmd_e cmd,
+			void *data, unsigned int len, int pass_fd,
+			mp3dec_error_t *error) {
   unsigned char buf[CMD_BUF_SIZE];
   unsigned char *ptr = buf;
   unsigned int cmd_len = 0;
   
   if (len > sizeof(buf) - 3) {
     error_set(error, "Data buffer is too big for a command");
+    error_set_code(error, MP3DEC_ERR_INVALID);
     return -1;
   }
   
@@ -105,7 +364,12 @@ int mp3dec_write_cmd(int fd, mp3dec_cmd_e cmd,
   }
   cmd_len = ptr - buf;
   /* XXX timeout?? */
-  if (unix_write(fd, buf, cmd_len) != cmd_len) {
+  if (pass_fd != -1) {
+    if (unix_send_fd(fd, buf, cmd_len, pass_fd) != cmd_len) {
+      error_set_strerror(error, "Could not pass descriptor to socket");
+      return -1;
+    }
+  } else if (unix_send(fd, buf, cmd_len) != cmd_len) {
     error_set_strerror(error, "Could not write command to pipe");
     return -1;
   }
@@ -113,18 +377,33 @@ int mp3dec_write_cmd(int fd, mp3dec_cmd_e cmd,
   return 0;
 }
 
-int mp3dec_write_cmd_string(int fd, mp3dec_cmd_e cmd, char *string, error_t *error) {
+int mp3dec_write_cmd_string(int fd, mp3dec_cmd_e cmd, char *string,
+			    mp3dec_error_t *error) {
   return mp3dec_write_cmd(fd, cmd, string, strlen(string) + 1, error);
 }
 
 int mp3dec_read_cmd(int fd, mp3dec_cmd_e *cmd,
 		    void *data, unsigned int *len, unsigned int max_len,
-		    error_t *error) {
+		    mp3dec_error_t *error) {
+  return mp3dec_read_cmd_fd(fd, cmd, data, len, max_len, NULL, error);
+}
+
+/* if passed_fd is not NULL, fd has to be a unix socket and
+   *passed_fd is set to the descriptor sent with the command, or -1.
+   The caller owns the passed descriptor. */
+int mp3dec_read_cmd_fd(int fd, mp3dec_cmd_e *cmd,
+		       void *data, unsigned int *len, unsigned int max_len,
+		       int *passed_fd, mp3dec_error_t *error) {
   unsigned char buf[CMD_BUF_SIZE];
   unsigned char *ptr = buf;
+  int ret;
 
   assert(CMD_BUF_SIZE >= 3);
-  if (unix_read(fd, ptr, 3) != 3) {
+  if (passed_fd != NULL)
+    ret = unix_recv_fd(fd, ptr, 3, passed_fd);
+  else
+    ret = unix_read(fd, ptr, 3);
+  if (ret != 3) {
     error_set_strerror(error, "Could not read command header from pipe");
     return -1;
   }
@@ -136,22 +415,30 @@ int mp3dec_read_cmd(int fd, mp3dec_cmd_e *cmd,
   if (*len > 0) {
     if (*len > (CMD_BUF_SIZE - 3)) {
       error_set(error, "Data buffer is too big for a command");
-      return -1;
+      error_set_code(error, MP3DEC_ERR_PROTOCOL);
+      goto error;
     }
     if (unix_read(fd, ptr, *len) != *len) {
       error_set_strerror(error, "Could not read command data buffer from pipe");
-      return -1;
+      goto error;
     }
   }
 
   if (data != NULL) {
     if (*len > max_len) {
       error_set(error, "Data buffer is too big for the given buffer");
-      return -1;
+      error_set_code(error, MP3DEC_ERR_PROTOCOL);
+      goto error;
     }
     memcpy(data, ptr, *len);
   }
 
   return 0;
-}
 
+ error:
+  if ((passed_fd != NULL) && (*passed_fd != -1)) {
+    close(*passed_fd);
+    *passed_fd = -1;
+  }
+  return -1;
+}
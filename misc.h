@@ -5,15 +5,33 @@
 #include "maddec_internal.h"
 
 int unix_read(int fd, unsigned char *buf, unsigned int len);
+int unix_pread(int fd, unsigned char *buf, unsigned int len,
+	       unsigned long offset);
 int unix_write(int fd, unsigned char *buf, unsigned int len);
+int unix_send(int fd, unsigned char *buf, unsigned int len);
 int unix_check_fd_read(int fd);
+int unix_wait_fd_read(int fd1, int fd2);
+int unix_send_fd(int sock, unsigned char *buf, unsigned int len, int fd);
+int unix_recv_fd(int sock, unsigned char *buf, unsigned int len, int *fd);
+unsigned long long unix_thread_cpu_usec(void);
+unsigned long long unix_time_usec(void);
+void unix_sleep_until_usec(unsigned long long usec);
+unsigned long unix_rss_kb(void);
+void unix_prefault(void *mem, unsigned long len);
 
 int mp3dec_write_cmd(int fd, mp3dec_cmd_e cmd,
 		     void *data, unsigned int len,
-		     error_t *error);
-int mp3dec_write_cmd_string(int fd, mp3dec_cmd_e cmd, char *string, error_t *error);
+		     mp3dec_error_t *error);
+int mp3dec_write_cmd_fd(int fd, mp3dec_cmd_e cmd,
+			void *data, unsigned int len, int pass_fd,
+			mp3dec_error_t *error);
+int mp3dec_write_cmd_string(int fd, mp3dec_cmd_e cmd, char *string,
+			    mp3dec_error_t *error);
 int mp3dec_read_cmd(int fd, mp3dec_cmd_e *cmd,
 		    void *data, unsigned int *len, unsigned int max_len,
-		    error_t *error);
+		    mp3dec_error_t *error);
+int mp3dec_read_cmd_fd(int fd, mp3dec_cmd_e *cmd,
+		       void *data, unsigned int *len, unsigned int max_len,
+		       int *passed_fd, mp3dec_error_t *error);
 
 #endif /* MISC_H__ */
@@ -0,0 +1,338 @@
+/*
+ * mix several decoded streams into one
+ *
+ * Every input is scaled by its own gain, which can ramp linearly to a
+ * new value, and summed into a float accumulator. The sum is soft
+ * clipped above MIXER_KNEE and converted back to mad_fixed_t, so that
+ * the result can go to the audio output like any decoded frame.
+ *
+ * For crossfades an input can additionally fade in or out along an
+ * equal-power curve, so that the loudness stays constant while two
+ * uncorrelated tracks overlap.
+ */
+
+#include <assert.h>
+#include <math.h>
+#include <string.h>
+
+#include <mad.h>
+
+#include "mixer.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+/* from mad_fixed_t to a float where 1.0 is full scale */
+#define MIXER_SCALE (1.0f / (float)(1L << MAD_F_FRACBITS))
+
+#define MIXER_HALF_PI 1.57079632679489661923f
+
+static void mixer_input_reset(mixer_input_t *in) {
+  in->gain = 1.0f;
+  in->target = 1.0f;
+  in->step = 0.0f;
+  in->ramp = 0;
+  in->fade_in = 0;
+  in->phase = 0.0f;
+  in->dphase = 0.0f;
+  in->fade = 0;
+}
+
+void mixer_init(mixer_t *mixer) {
+  unsigned int i;
+
+  for (i = 0; i < MIXER_MAX_INPUTS; i++)
+    mixer_input_reset(&mixer->inputs[i]);
+  memset(mixer->acc, 0, sizeof(mixer->acc));
+  mixer->samplerate = 0;
+  mixer->channels = 0;
+  mixer->length = 0;
+}
+
+/* ramp to gain over the next ramp samples of this input */
+void mixer_set_gain(mixer_t *mixer, unsigned int input,
+		    float gain, unsigned int ramp) {
+  mixer_input_t *in;
+
+  assert(input < MIXER_MAX_INPUTS);
+  in = &mixer->inputs[input];
+
+  in->target = gain;
+  if (ramp == 0) {
+    in->gain = gain;
+    in->step = 0.0f;
+    in->ramp = 0;
+  } else {
+    in->step = (gain - in->gain) / ramp;
+    in->ramp = ramp;
+  }
+}
+
+/* fade the input in or out over the next length samples. A finished
+   fade out leaves the input at gain 0, a length of 0 cancels a running
+   fade without touching the gain. */
+void mixer_fade(mixer_t *mixer, unsigned int input,
+		int fade_in, unsigned int length) {
+  mixer_input_t *in;
+
+  assert(input < MIXER_MAX_INPUTS);
+  in = &mixer->inputs[input];
+
+  in->fade_in = fade_in;
+  in->phase = 0.0f;
+  in->fade = length;
+  in->dphase = (length > 0) ? MIXER_HALF_PI / length : 0.0f;
+}
+
+int mixer_is_fading(mixer_t *mixer, unsigned int input) {
+  return mixer->inputs[input].fade > 0;
+}
+
+/* hand the gain, ramp and fade of one input over to another, the old
+   input is back at unity */
+void mixer_move(mixer_t *mixer, unsigned int from, unsigned int to) {
+  assert((from < MIXER_MAX_INPUTS) && (to < MIXER_MAX_INPUTS));
+
+  mixer->inputs[to] = mixer->inputs[from];
+  mixer_input_reset(&mixer->inputs[from]);
+}
+
+/* an input at unity gain can bypass the mixer */
+int mixer_is_unity(mixer_t *mixer, unsigned int input) {
+  return (mixer->inputs[input].ramp == 0) &&
+    (mixer->inputs[input].fade == 0) &&
+    (mixer->inputs[input].gain == 1.0f);
+}
+
+void mixer_start(mixer_t *mixer, unsigned int samplerate,
+		 unsigned int channels, unsigned int length) {
+  assert(length <= MIXER_MAX_LENGTH);
+  assert((channels == 1) || (channels == 2));
+
+  mixer->samplerate = samplerate;
+  mixer->channels = channels;
+  mixer->length = length;
+  memset(mixer->acc[0], 0, length * sizeof(float));
+  if (channels == 2)
+    memset(mixer->acc[1], 0, length * sizeof(float));
+}
+
+/* acc += src * gain */
+static void mixer_add_const(float *acc, mad_fixed_t const *src,
+			    float gain, unsigned int count) {
+  unsigned int i = 0;
+
+#ifdef __SSE2__
+  __m128 g = _mm_set1_ps(gain);
+  for (; i + 4 <= count; i += 4) {
+    __m128 x = _mm_cvtepi32_ps(_mm_loadu_si128((__m128i const *)(src + i)));
+    _mm_storeu_ps(acc + i, _mm_add_ps(_mm_loadu_ps(acc + i),
+				      _mm_mul_ps(x, g)));
+  }
+#endif
+
+  for (; i < count; i++)
+    acc[i] += src[i] * gain;
+}
+
+/* acc += src * gain, where gain grows by step every sample */
+static void mixer_add_ramp(float *acc, mad_fixed_t const *src,
+			   float gain, float step, unsigned int count) {
+  unsigned int i = 0;
+
+#ifdef __SSE2__
+  __m128 g = _mm_set_ps(gain + 3 * step, gain + 2 * step,
+			gain + step, gain);
+  __m128 s = _mm_set1_ps(4 * step);
+  for (; i + 4 <= count; i += 4) {
+    __m128 x = _mm_cvtepi32_ps(_mm_loadu_si128((__m128i const *)(src + i)));
+    _mm_storeu_ps(acc + i, _mm_add_ps(_mm_loadu_ps(acc + i),
+				      _mm_mul_ps(x, g)));
+    g = _mm_add_ps(g, s);
+  }
+#endif
+
+  for (; i < count; i++)
+    acc[i] += src[i] * (gain + i * step);
+}
+
+/* acc += src * (gain + i * step) * w(phase + i * dphase), w being sin
+   when fading in and cos when fading out. The curve is not evaluated
+   per sample but rotated along with the phase, every call starts again
+   from sinf/cosf so the rounding errors cannot pile up. */
+static void mixer_add_fade(float *acc, mad_fixed_t const *src,
+			   float gain, float step, int fade_in,
+			   float phase, float dphase, unsigned int count) {
+  unsigned int i = 0;
+  float s, c, rs, rc;
+
+#ifdef __SSE2__
+  if (count >= 4) {
+    __m128 g = _mm_set_ps(gain + 3 * step, gain + 2 * step,
+			  gain + step, gain);
+    __m128 gs = _mm_set1_ps(4 * step);
+    __m128 vs = _mm_set_ps(sinf(phase + 3 * dphase), sinf(phase + 2 * dphase),
+			   sinf(phase + dphase), sinf(phase));
+    __m128 vc = _mm_set_ps(cosf(phase + 3 * dphase), cosf(phase + 2 * dphase),
+			   cosf(phase + dphase), cosf(phase));
+    __m128 r4s = _mm_set1_ps(sinf(4 * dphase));
+    __m128 r4c = _mm_set1_ps(cosf(4 * dphase));
+
+    for (; i + 4 <= count; i += 4) {
+      __m128 x = _mm_cvtepi32_ps(_mm_loadu_si128((__m128i const *)(src + i)));
+      __m128 w = fade_in ? vs : vc;
+      __m128 ns;
+
+      _mm_storeu_ps(acc + i, _mm_add_ps(_mm_loadu_ps(acc + i),
+					_mm_mul_ps(x, _mm_mul_ps(g, w))));
+      g = _mm_add_ps(g, gs);
+
+      /* rotate every lane by 4 * dphase */
+      ns = _mm_add_ps(_mm_mul_ps(vs, r4c), _mm_mul_ps(vc, r4s));
+      vc = _mm_sub_ps(_mm_mul_ps(vc, r4c), _mm_mul_ps(vs, r4s));
+      vs = ns;
+    }
+  }
+#endif
+
+  s = sinf(phase + i * dphase);
+  c = cosf(phase + i * dphase);
+  rs = sinf(dphase);
+  rc = cosf(dphase);
+  for (; i < count; i++) {
+    float ns;
+
+    acc[i] += src[i] * (gain + i * step) * (fade_in ? s : c);
+    ns = s * rc + c * rs;
+    c = c * rc - s * rs;
+    s = ns;
+  }
+}
+
+/* mix count samples of pcm, starting at src_offset, into the output
+   at dst_offset. A mono input goes to both output channels, of a
+   stereo input into a mono output only the left channel is used. */
+void mixer_add(mixer_t *mixer, unsigned int input,
+	       struct mad_pcm const *pcm, unsigned int src_offset,
+	       unsigned int dst_offset, unsigned int count) {
+  mixer_input_t *in;
+  unsigned int ch;
+
+  assert(input < MIXER_MAX_INPUTS);
+  assert(dst_offset + count <= mixer->length);
+  in = &mixer->inputs[input];
+
+  while (count > 0) {
+    unsigned int n = count;
+
+    if (in->fade > 0) {
+      float step = 0.0f;
+
+      if (n > in->fade)
+	n = in->fade;
+      if (in->ramp > 0) {
+	if (n > in->ramp)
+	  n = in->ramp;
+	step = in->step;
+      }
+      for (ch = 0; ch < mixer->channels; ch++) {
+	unsigned int src_ch = (ch < pcm->channels) ? ch : pcm->channels - 1;
+	mixer_add_fade(mixer->acc[ch] + dst_offset,
+		       pcm->samples[src_ch] + src_offset,
+		       in->gain * MIXER_SCALE, step * MIXER_SCALE,
+		       in->fade_in, in->phase, in->dphase, n);
+      }
+      if (in->ramp > 0) {
+	in->ramp -= n;
+	in->gain = (in->ramp == 0) ? in->target : in->gain + n * in->step;
+      }
+      in->fade -= n;
+      in->phase += n * in->dphase;
+      if ((in->fade == 0) && !in->fade_in) {
+	/* faded out for good */
+	in->gain = in->target = 0.0f;
+	in->ramp = 0;
+      }
+    } else if (in->ramp > 0) {
+      if (n > in->ramp)
+	n = in->ramp;
+      for (ch = 0; ch < mixer->channels; ch++) {
+	unsigned int src_ch = (ch < pcm->channels) ? ch : pcm->channels - 1;
+	mixer_add_ramp(mixer->acc[ch] + dst_offset,
+		       pcm->samples[src_ch] + src_offset,
+		       in->gain * MIXER_SCALE, in->step * MIXER_SCALE, n);
+      }
+      in->ramp -= n;
+      in->gain = (in->ramp == 0) ? in->target : in->gain + n * in->step;
+    } else if (in->gain != 0.0f) {
+      for (ch = 0; ch < mixer->channels; ch++) {
+	unsigned int src_ch = (ch < pcm->channels) ? ch : pcm->channels - 1;
+	mixer_add_const(mixer->acc[ch] + dst_offset,
+			pcm->samples[src_ch] + src_offset,
+			in->gain * MIXER_SCALE, n);
+      }
+    }
+
+    src_offset += n;
+    dst_offset += n;
+    count -= n;
+  }
+}
+
+/* soft clip and convert back to mad_fixed_t. Below the knee samples
+   pass unchanged, above it |x| = k + (1 - k) * u / (1 + u) with
+   u = (|x| - k) / (1 - k), which is continuous in slope and never
+   reaches full scale. */
+static void mixer_clip(float const *acc, mad_fixed_t *out,
+		       unsigned int count) {
+  const float k = MIXER_KNEE;
+  const float one = (float)(1L << MAD_F_FRACBITS);
+  unsigned int i = 0;
+
+#ifdef __SSE2__
+  const __m128 sign = _mm_set1_ps(-0.0f);
+  const __m128 vk = _mm_set1_ps(k);
+  const __m128 vr = _mm_set1_ps(1.0f - k);
+  const __m128 vr_inv = _mm_set1_ps(1.0f / (1.0f - k));
+  const __m128 v1 = _mm_set1_ps(1.0f);
+  const __m128 vone = _mm_set1_ps(one);
+  const __m128 zero = _mm_setzero_ps();
+
+  for (; i + 4 <= count; i += 4) {
+    __m128 x = _mm_loadu_ps(acc + i);
+    __m128 s = _mm_and_ps(x, sign);
+    __m128 a = _mm_andnot_ps(sign, x);
+    __m128 u = _mm_mul_ps(_mm_max_ps(_mm_sub_ps(a, vk), zero), vr_inv);
+    __m128 y = _mm_add_ps(_mm_min_ps(a, vk),
+			  _mm_mul_ps(vr, _mm_div_ps(u, _mm_add_ps(v1, u))));
+    y = _mm_or_ps(y, s);
+    _mm_storeu_si128((__m128i *)(out + i),
+		     _mm_cvtps_epi32(_mm_mul_ps(y, vone)));
+  }
+#endif
+
+  for (; i < count; i++) {
+    float x = acc[i];
+    float a = (x < 0) ? -x : x;
+
+    if (a > k) {
+      float u = (a - k) / (1.0f - k);
+      a = k + (1.0f - k) * u / (1.0f + u);
+      x = (x < 0) ? -a : a;
+    }
+    /* round like _mm_cvtps_epi32, to the nearest in the current mode */
+    out[i] = (mad_fixed_t)lrintf(x * one);
+  }
+}
+
+void mixer_finish(mixer_t *mixer, struct mad_pcm *out) {
+  unsigned int ch;
+
+  out->samplerate = mixer->samplerate;
+  out->channels = mixer->channels;
+  out->length = mixer->length;
+
+  for (ch = 0; ch < mixer->channels; ch++)
+    mixer_clip(mixer->acc[ch], out->samples[ch], mixer->length);
+}
@@ -0,0 +1,50 @@
+#ifndef MIXER_H__
+#define MIXER_H__
+
+#include <mad.h>
+
+#define MIXER_MAX_INPUTS  8
+#define MIXER_MAX_LENGTH  1152
+
+/* samples above the knee are compressed smoothly towards full scale */
+#define MIXER_KNEE        0.75f
+
+typedef struct mixer_input_s {
+  float gain;
+  float target;
+  float step;          /* gain change per sample while ramping */
+  unsigned int ramp;   /* samples left in the ramp */
+
+  /* equal-power fade on top of the gain, sin(phase) fading in and
+     cos(phase) fading out, phase going from 0 to pi/2 */
+  int fade_in;
+  float phase;
+  float dphase;
+  unsigned int fade;   /* samples left in the fade */
+} mixer_input_t;
+
+typedef struct mixer_s {
+  mixer_input_t inputs[MIXER_MAX_INPUTS];
+
+  float acc[2][MIXER_MAX_LENGTH] __attribute__((aligned(16)));
+  unsigned int samplerate;
+  unsigned int channels;
+  unsigned int length;
+} mixer_t;
+
+void mixer_init(mixer_t *mixer);
+void mixer_set_gain(mixer_t *mixer, unsigned int input,
+		    float gain, unsigned int ramp);
+void mixer_fade(mixer_t *mixer, unsigned int input,
+		int fade_in, unsigned int length);
+int  mixer_is_fading(mixer_t *mixer, unsigned int input);
+void mixer_move(mixer_t *mixer, unsigned int from, unsigned int to);
+int  mixer_is_unity(mixer_t *mixer, unsigned int input);
+void mixer_start(mixer_t *mixer, unsigned int samplerate,
+		 unsigned int channels, unsigned int length);
+void mixer_add(mixer_t *mixer, unsigned int input,
+	       struct mad_pcm const *pcm, unsigned int src_offset,
+	       unsigned int dst_offset, unsigned int count);
+void mixer_finish(mixer_t *mixer, struct mad_pcm *out);
+
+#endif /* MIXER_H__ */
@@ -1,44 +1,59 @@
 (in-package :mp3dec)
 
 (defconstant +buf-size+ 4096)
-(defconstant +error-string-size+ 256)
-
-(def-struct mp3-state
-  (channels :int)
-  (little-endian :int)
-  (pcm-l (:array :short #.(* 100 +buf-size+)))
-  (pcm-r (:array :short #.(* 100 +buf-size+)))
-  (pcmlen :unsigned-int)
-  (strerror (:array :char #.+error-string-size+))
-  (snd-fd :int)
-  (mp3-fd :int)
-  (initialized :int)
-  (lame-initialized :int))
-
-(def-foreign-type mp3-state-ptr (* mp3-state))
-
-(def-function ("mp3dec_error" mp3dec-error)
-    ((state mp3-state-ptr))
-  :returning :cstring
+(defconstant +pcm-size+ (* 2 1152 4))
+
+(defconstant +format-s16+ 0)
+(defconstant +format-s32+ 1)
+(defconstant +format-float+ 2)
+
+(def-foreign-type mp3dec-stream-ptr :pointer-void)
+
+(def-function ("mp3dec_stream_new" mp3dec-stream-new)
+    ()
+  :returning mp3dec-stream-ptr
   :module "mp3dec")
 
-(def-function ("mp3dec_reset" mp3dec-reset)
-    ((state mp3-state-ptr))
+(def-function ("mp3dec_stream_delete" mp3dec-stream-delete)
+    ((stream mp3dec-stream-ptr))
   :returning :void
   :module "mp3dec")
 
-(def-function ("mp3dec_close" mp3dec-close)
-    ((state mp3-state-ptr))
+(def-function ("mp3dec_stream_reset" mp3dec-stream-reset)
+    ((stream mp3dec-stream-ptr))
   :returning :void
   :module "mp3dec")
 
-(def-function ("mp3dec_decode_data" mp3dec-decode-data)
-    ((state mp3-state-ptr)
+(def-function ("mp3dec_stream_error" mp3dec-stream-error)
+    ((stream mp3dec-stream-ptr))
+  :returning :cstring
+  :module "mp3dec")
+
+(def-function ("mp3dec_stream_error_code" mp3dec-stream-error-code)
+    ((stream mp3dec-stream-ptr))
+  :returning :int
+  :module "mp3dec")
+
+(def-function ("mp3dec_stream_push" mp3dec-stream-push)
+    ((stream mp3dec-stream-ptr)
      (buf (* :unsigned-char))
-     (len :unsigned-int))
+     (len :unsigned-long))
+  :returning :long
+  :module "mp3dec")
+
+(def-function ("mp3dec_stream_finish" mp3dec-stream-finish)
+    ((stream mp3dec-stream-ptr))
   :returning :int
   :module "mp3dec")
 
+(def-function ("mp3dec_stream_pull" mp3dec-stream-pull)
+    ((stream mp3dec-stream-ptr)
+     (pcm-out :pointer-void)
+     (max-samples :unsigned-long)
+     (format :int))
+  :returning :long
+  :module "mp3dec")
+
 (def-array-pointer bap :unsigned-char)
 
 (defmacro with-safe-alloc ((var alloc free) &rest body)
@@ -46,30 +61,55 @@
     (unwind-protect
 	 (progn (setf ,var ,alloc)
 		,@body)
-      (when ,var ,free))))
+      (when (and ,var (not (null-pointer-p ,var)))
+	,free))))
 
-(defun play-file (pathname)
-  (with-foreign-object (state 'mp3-state)
-    (mp3dec-reset state)
-    (unwind-protect
-	 (with-open-file (s pathname :direction :input
-			    :element-type '(unsigned-byte 8))
-	   (let ((arr (make-array 4096 :initial-element 0
-				  :element-type '(unsigned-byte 8))))
-	     (with-safe-alloc (buf (allocate-foreign-object
-				    :unsigned-char +buf-size+)
-				   (free-foreign-object buf))
-	       (do ((read (read-sequence arr s)
-			  (read-sequence arr s)))
-		   ((or (null read)
-			(= 0 read)) t)
-		 (dotimes (i read)
-		   (setf (deref-array buf 'bap i) (aref arr i)))
-		 (let ((ret (mp3dec-decode-data state buf read)))
-		   #+cmu
-		   (mp:process-yield)
-		   (when (= ret -1)
-		     (error (mp3dec-error state))))))))
-      (progn
-	(warn "Closing mp3 state")
-	(mp3dec-close state)))))
+(defun pull-all (stream pcm fn)
+  "Pull all the available PCM samples and call FN with the foreign
+buffer and the number of 16 bit samples in it."
+  (do ((count (mp3dec-stream-pull stream pcm +pcm-size+ +format-s16+)
+	      (mp3dec-stream-pull stream pcm +pcm-size+ +format-s16+)))
+      ((<= count 0)
+       (when (= count -1)
+	 (error (mp3dec-stream-error stream))))
+    (funcall fn pcm count)))
+
+(defun push-all (stream buf len pcm fn)
+  (do ((offset 0))
+      ((>= offset len))
+    (let ((ret (mp3dec-stream-push stream
+				   (make-pointer (+ (pointer-address buf) offset)
+						 :unsigned-char)
+				   (- len offset))))
+      (when (= ret -1)
+	(error (mp3dec-stream-error stream)))
+      (incf offset ret)
+      (pull-all stream pcm fn))))
+
+(defun decode-file (pathname fn)
+  "Decode the mp3 file at PATHNAME in-process, calling FN with a
+foreign buffer of interleaved 16 bit samples and the sample count."
+  (with-safe-alloc (stream (mp3dec-stream-new) (mp3dec-stream-delete stream))
+    (when (null-pointer-p stream)
+      (error "Could not allocate the mp3 stream"))
+    (with-open-file (s pathname :direction :input
+		       :element-type '(unsigned-byte 8))
+      (let ((arr (make-array +buf-size+ :initial-element 0
+			     :element-type '(unsigned-byte 8))))
+	(with-safe-alloc (buf (allocate-foreign-object
+			       :unsigned-char +buf-size+)
+			      (free-foreign-object buf))
+	  (with-safe-alloc (pcm (allocate-foreign-object
+				 :short +pcm-size+)
+				(free-foreign-object pcm))
+	    (do ((read (read-sequence arr s)
+		       (read-sequence arr s)))
+		((or (null read)
+		     (= 0 read)) t)
+	      (dotimes (i read)
+		(setf (deref-array buf 'bap i) (aref arr i)))
+	      (push-all stream buf read pcm fn)
+	      #+cmu
+	      (mp:process-yield))
+	    (mp3dec-stream-finish stream)
+	    (pull-all stream pcm fn)))))))
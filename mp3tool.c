@@ -0,0 +1,193 @@
+/*
+ * offline tools on top of libmaddec
+ *
+ * mp3tool loudness file...   R128 loudness and ReplayGain per track,
+ *                            and for all files as an album
+ * mp3tool waveform file out  min/max/rms summary for drawing waveforms
+ * mp3tool scan file...       frame statistics from the headers alone
+ *
+ * (c) 2005 bl0rg.net
+ */
+
+#include <sys/time.h>
+
+#include <stdio.h>
+#include <string.h>
+
+#include "maddec.h"
+
+static double now(void) {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+static void print_loudness(char *name, mp3dec_loudness_t *l, double secs) {
+  printf("%-32s %8.2f %8.2f %+8.2f %8.6f %10.0f\n", name,
+	 l->integrated, l->true_peak, l->gain, l->peak,
+	 (secs > 0) ? l->seconds / secs : 0);
+}
+
+static int cmd_loudness(int argc, char *argv[]) {
+  mp3dec_analysis_t *analysis;
+  mp3dec_loudness_t track, album;
+  double start, total = 0;
+  int i, ret = 0;
+
+  analysis = mp3dec_analysis_new();
+  if (analysis == NULL) {
+    fprintf(stderr, "Could not allocate analysis\n");
+    return 1;
+  }
+
+  printf("%-32s %8s %8s %8s %8s %10s\n",
+	 "file", "LUFS", "dBTP", "gain", "peak", "x realtime");
+  for (i = 0; i < argc; i++) {
+    double secs;
+
+    start = now();
+    if (mp3dec_analyze(analysis, argv[i], &track) < 0) {
+      fprintf(stderr, "Could not analyze %s: %s\n", argv[i],
+	      mp3dec_analysis_error(analysis));
+      ret = 1;
+      continue;
+    }
+    secs = now() - start;
+    total += secs;
+    print_loudness(argv[i], &track, secs);
+  }
+
+  if (argc > 1) {
+    mp3dec_analysis_album(analysis, &album);
+    print_loudness("album", &album, total);
+  }
+
+  mp3dec_analysis_delete(analysis);
+  return ret;
+}
+
+static int cmd_waveform(int argc, char *argv[]) {
+  mp3dec_analysis_t *analysis;
+  mp3dec_waveform_header_t header;
+  double start, secs, audio_secs;
+  int i;
+
+  if (argc != 2) {
+    fprintf(stderr, "usage: mp3tool waveform file output\n");
+    return 1;
+  }
+
+  analysis = mp3dec_analysis_new();
+  if (analysis == NULL) {
+    fprintf(stderr, "Could not allocate analysis\n");
+    return 1;
+  }
+
+  start = now();
+  if (mp3dec_waveform(analysis, argv[0], argv[1], &header) < 0) {
+    fprintf(stderr, "Could not summarize %s: %s\n", argv[0],
+	    mp3dec_analysis_error(analysis));
+    mp3dec_analysis_delete(analysis);
+    return 1;
+  }
+  secs = now() - start;
+  audio_secs = (header.samplerate > 0) ?
+    (double)header.samples / header.samplerate : 0;
+
+  for (i = 0; i < header.levels; i++)
+    printf("%8u samples/bucket %10llu buckets\n",
+	   header.level[i].bucket, header.level[i].count);
+  printf("%.1f secs of audio in %.3f secs, %.0f x realtime\n",
+	 audio_secs, secs, (secs > 0) ? audio_secs / secs : 0);
+
+  mp3dec_analysis_delete(analysis);
+  return 0;
+}
+
+static const char *mode_str(mp3dec_mode_e mode) {
+  switch (mode) {
+  case MP3DEC_MODE_SINGLE_CHANNEL:
+    return "mono";
+  case MP3DEC_MODE_DUAL_CHANNEL:
+    return "dual channel";
+  case MP3DEC_MODE_JOINT_STEREO:
+    return "joint stereo";
+  case MP3DEC_MODE_STEREO:
+    return "stereo";
+  default:
+    return "unknown";
+  }
+}
+
+static int cmd_scan(int argc, char *argv[]) {
+  mp3dec_analysis_t *analysis;
+  mp3dec_scan_t scan;
+  unsigned long long bytes = 0;
+  double start, secs;
+  int i, ret = 0;
+  unsigned int j;
+
+  analysis = mp3dec_analysis_new();
+  if (analysis == NULL) {
+    fprintf(stderr, "Could not allocate analysis\n");
+    return 1;
+  }
+
+  start = now();
+  for (i = 0; i < argc; i++) {
+    if (mp3dec_scan(analysis, argv[i], &scan) < 0) {
+      fprintf(stderr, "Could not scan: %s\n",
+	      mp3dec_analysis_error(analysis));
+      ret = 1;
+      continue;
+    }
+    bytes += scan.bytes + scan.corrupt_bytes;
+
+    printf("%s:\n", argv[i]);
+    printf("  layer %u, %u hz, %s, %lu frames, %.3f secs, %.1f kbps\n",
+	   scan.layer, scan.samplerate, mode_str(scan.mode),
+	   scan.frames, scan.seconds, scan.kbps);
+    if (scan.samplerate_changes || scan.mode_changes)
+      printf("  %lu frames change the samplerate, %lu the mode\n",
+	     scan.samplerate_changes, scan.mode_changes);
+    for (j = 0; j < scan.nbitrates; j++)
+      printf("  %4u kbps: %lu frames\n",
+	     scan.bitrates[j].kbps, scan.bitrates[j].frames);
+    for (j = 0; (j < scan.nregions) && (j < MP3DEC_SCAN_REGIONS); j++)
+      printf("  corrupt: %llu bytes at %llu\n",
+	     scan.regions[j].length, scan.regions[j].offset);
+    if (scan.nregions > MP3DEC_SCAN_REGIONS)
+      printf("  ... %lu corrupt regions, %llu bytes\n",
+	     scan.nregions, scan.corrupt_bytes);
+  }
+  secs = now() - start;
+  if (secs > 0)
+    printf("%llu bytes in %.3f secs, %.1f MB/s\n",
+	   bytes, secs, bytes / secs / (1024 * 1024));
+
+  mp3dec_analysis_delete(analysis);
+  return ret;
+}
+
+static void usage(void) {
+  fprintf(stderr, "usage: mp3tool loudness file...\n"
+	  "       mp3tool waveform file output\n"
+	  "       mp3tool scan file...\n");
+}
+
+int main(int argc, char *argv[]) {
+  if (argc < 3) {
+    usage();
+    return 1;
+  }
+
+  if (!strcmp(argv[1], "loudness"))
+    return cmd_loudness(argc - 2, argv + 2);
+  if (!strcmp(argv[1], "waveform"))
+    return cmd_waveform(argc - 2, argv + 2);
+  if (!strcmp(argv[1], "scan"))
+    return cmd_scan(argc - 2, argv + 2);
+
+  usage();
+  return 1;
+}
@@ -2,4 +2,4 @@
 
 (defpackage :mp3dec
   (:use :cl :uffi)
-  (:export :mp3dec-play-file))
+  (:export :decode-file))
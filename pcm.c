@@ -0,0 +1,260 @@
+/*
+ * conversion of mad_fixed_t samples to interleaved pcm
+ *
+ * The playback gain is applied in the same pass, so that normalised
+ * output costs one multiply per sample and no extra pass.
+ */
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <mad.h>
+
+#include "maddec.h"
+#include "error.h"
+#include "pcm.h"
+
+unsigned int pcm_format_width(mp3dec_format_e format) {
+  switch (format) {
+  case MP3DEC_FORMAT_S16:
+    return sizeof(signed short);
+  case MP3DEC_FORMAT_S32:
+    return sizeof(signed int);
+  case MP3DEC_FORMAT_FLOAT:
+    return sizeof(float);
+  default:
+    return 0;
+  }
+}
+
+/* a gain of gain_db as mad_fixed_t, reduced so that a track with the
+   given linear peak does not clip. Without a peak (0) only the range of
+   mad_fixed_t limits the gain. */
+mad_fixed_t pcm_gain(float gain_db, float peak) {
+  double gain = pow(10.0, gain_db / 20.0);
+  double max = (double)(1L << (31 - MAD_F_FRACBITS)) - 0.01;
+
+  if ((peak > 0) && (gain * peak > 1.0))
+    gain = 1.0 / peak;
+  if (gain > max)
+    gain = max;
+
+  return mad_f_tofixed(gain);
+}
+
+static inline
+mad_fixed_t pcm_apply(mad_fixed_t sample, mad_fixed_t gain) {
+  return (gain == MAD_F_ONE) ? sample : mad_f_mul(sample, gain);
+}
+
+static inline
+mad_fixed_t mad_clip(mad_fixed_t sample) {
+  if (sample >= MAD_F_ONE)
+    return MAD_F_ONE - 1;
+  else if (sample < -MAD_F_ONE)
+    return -MAD_F_ONE;
+  else
+    return sample;
+}
+
+void pcm_adapt_init(pcm_adapt_t *adapt) {
+  adapt->last[0] = adapt->last[1] = 0;
+}
+
+/* bring a frame synthesized at half the samplerate or in mono back to
+   the format of the output, so that the output keeps running with the
+   same parameters. Doubling the samplerate interpolates linearly, a
+   mono frame goes to both channels. Returns 0 if in cannot be
+   adapted. */
+int pcm_adapt(pcm_adapt_t *adapt, struct mad_pcm const *in,
+	      unsigned int samplerate, unsigned int channels,
+	      struct mad_pcm *out) {
+  unsigned int ch, i;
+  int twice;
+
+  if (in->samplerate == samplerate)
+    twice = 0;
+  else if (in->samplerate * 2 == samplerate)
+    twice = 1;
+  else
+    return 0;
+  if ((in->channels != channels) && (in->channels != 1))
+    return 0;
+
+  out->samplerate = samplerate;
+  out->channels = channels;
+  out->length = twice ? in->length * 2 : in->length;
+
+  for (ch = 0; ch < channels; ch++) {
+    unsigned int src_ch = (ch < in->channels) ? ch : 0;
+    mad_fixed_t const *src = in->samples[src_ch];
+    mad_fixed_t *dst = out->samples[ch];
+
+    if (!twice) {
+      memcpy(dst, src, in->length * sizeof(mad_fixed_t));
+      continue;
+    }
+
+    /* half a sample late, to interpolate without looking ahead */
+    dst[0] = (adapt->last[ch] >> 1) + (src[0] >> 1);
+    dst[1] = src[0];
+    for (i = 1; i < in->length; i++) {
+      dst[2 * i] = (src[i - 1] >> 1) + (src[i] >> 1);
+      dst[2 * i + 1] = src[i];
+    }
+    if (in->length > 0)
+      adapt->last[ch] = src[in->length - 1];
+  }
+
+  return 1;
+}
+
+/* convert count samples per channel, starting at offset, into
+   interleaved samples of the given format, scaled by gain */
+void pcm_convert(struct mad_pcm const *pcm,
+		 unsigned int offset, unsigned int count,
+		 mad_fixed_t gain, mp3dec_format_e format, void *out) {
+  mad_fixed_t const *left_ch, *right_ch;
+  unsigned int i;
+
+  left_ch  = pcm->samples[0] + offset;
+  right_ch = pcm->samples[1] + offset;
+
+  switch (format) {
+  case MP3DEC_FORMAT_S16: {
+    signed short *ptr = out;
+    if (pcm->channels == 2) {
+      for (i = 0; i < count; i++) {
+	*ptr++ = mad_scale(pcm_apply(*left_ch++, gain));
+	*ptr++ = mad_scale(pcm_apply(*right_ch++, gain));
+      }
+    } else {
+      for (i = 0; i < count; i++)
+	*ptr++ = mad_scale(pcm_apply(*left_ch++, gain));
+    }
+    break;
+  }
+
+  case MP3DEC_FORMAT_S32: {
+    signed int *ptr = out;
+    const signed int scale = 1 << (31 - MAD_F_FRACBITS);
+    if (pcm->channels == 2) {
+      for (i = 0; i < count; i++) {
+	*ptr++ = mad_clip(pcm_apply(*left_ch++, gain)) * scale;
+	*ptr++ = mad_clip(pcm_apply(*right_ch++, gain)) * scale;
+      }
+    } else {
+      for (i = 0; i < count; i++)
+	*ptr++ = mad_clip(pcm_apply(*left_ch++, gain)) * scale;
+    }
+    break;
+  }
+
+  case MP3DEC_FORMAT_FLOAT: {
+    float *ptr = out;
+    const float scale = 1.0 / (float)(1L << MAD_F_FRACBITS);
+    if (pcm->channels == 2) {
+      for (i = 0; i < count; i++) {
+	*ptr++ = mad_clip(pcm_apply(*left_ch++, gain)) * scale;
+	*ptr++ = mad_clip(pcm_apply(*right_ch++, gain)) * scale;
+      }
+    } else {
+      for (i = 0; i < count; i++)
+	*ptr++ = mad_clip(pcm_apply(*left_ch++, gain)) * scale;
+    }
+    break;
+  }
+  }
+}
+
+/* convert a whole frame into a staging buffer of the pool */
+void pcm_stage(struct mad_pcm const *pcm, mad_fixed_t gain,
+	       pcm_buffer_t *buf) {
+  unsigned int length = pcm->length;
+
+  if (length > PCM_MAX_SAMPLES)
+    length = PCM_MAX_SAMPLES;
+
+  pcm_convert(pcm, 0, length, gain, buf->format, buf->data);
+  buf->length = length;
+  buf->channels = pcm->channels;
+  buf->samplerate = pcm->samplerate;
+}
+
+void pcm_pool_init(pcm_pool_t *pool) {
+  memset(pool, 0, sizeof(*pool));
+}
+
+/* every buffer holds the largest frame with channels channels in
+   format, rounded up to whole cache lines so that no two buffers share
+   one */
+int pcm_pool_alloc(pcm_pool_t *pool, mp3dec_format_e format,
+		   unsigned int channels, mp3dec_error_t *error) {
+  unsigned long size;
+  void *mem;
+  unsigned int i;
+
+  pcm_pool_free(pool);
+
+  size = PCM_MAX_SAMPLES * channels * pcm_format_width(format);
+  size = (size + PCM_CACHE_LINE - 1) & ~(unsigned long)(PCM_CACHE_LINE - 1);
+
+  if (posix_memalign(&mem, PCM_CACHE_LINE, size * PCM_POOL_SIZE) != 0) {
+    error_set(error, "Could not allocate the pcm staging buffers");
+    error_set_code(error, MP3DEC_ERR_NOMEM);
+    return -1;
+  }
+  pool->mem = mem;
+  pool->allocs++;
+  pool->buffer_size = size;
+  pool->format = format;
+
+  for (i = 0; i < PCM_POOL_SIZE; i++) {
+    pcm_buffer_t *buf = &pool->buffers[i];
+
+    buf->data = pool->mem + i * size;
+    buf->format = format;
+    buf->length = buf->channels = buf->samplerate = 0;
+    buf->refs = 0;
+  }
+
+  return 0;
+}
+
+/* a buffer with one reference, NULL when every buffer is still held.
+   Only one thread takes buffers, any thread can put them. */
+pcm_buffer_t *pcm_pool_get(pcm_pool_t *pool) {
+  unsigned int i;
+
+  if (pool->mem == NULL)
+    return NULL;
+
+  for (i = 0; i < PCM_POOL_SIZE; i++) {
+    if (__sync_bool_compare_and_swap(&pool->buffers[i].refs, 0, 1))
+      return &pool->buffers[i];
+  }
+
+  pool->exhausted++;
+  return NULL;
+}
+
+/* another holder of buf, which has to put it as well */
+void pcm_buffer_ref(pcm_buffer_t *buf) {
+  __sync_add_and_fetch(&buf->refs, 1);
+}
+
+void pcm_pool_put(pcm_pool_t *pool, pcm_buffer_t *buf) {
+  __sync_sub_and_fetch(&buf->refs, 1);
+}
+
+void pcm_pool_free(pcm_pool_t *pool) {
+  unsigned int i;
+
+  free(pool->mem);
+  pool->mem = NULL;
+  for (i = 0; i < PCM_POOL_SIZE; i++) {
+    pool->buffers[i].data = NULL;
+    pool->buffers[i].refs = 0;
+  }
+}
@@ -0,0 +1,88 @@
+#ifndef PCM_H__
+#define PCM_H__
+
+#include <mad.h>
+
+#include "maddec.h"
+#include "error.h"
+
+/* the largest frame libmad synthesizes */
+#define PCM_MAX_SAMPLES  1152
+#define PCM_MAX_CHANNELS 2
+#define PCM_CACHE_LINE   64
+
+/* staging buffers per pool, enough for the output and a full queue
+   plus the buffer being written for each of the sinks */
+#define PCM_POOL_SIZE    40
+
+/*
+ * The following utility routine performs simple rounding, clipping, and
+ * scaling of MAD's high-resolution samples down to 16 bits. It does not
+ * perform any dithering or noise shaping, which would be recommended to
+ * obtain any exceptional audio quality. It is therefore not recommended to
+ * use this routine if high-quality output is desired.
+ */
+static inline
+signed int mad_scale(mad_fixed_t sample)
+{
+  /* round */
+  sample += (1L << (MAD_F_FRACBITS - 16));
+
+  /* clip */
+  if (sample >= MAD_F_ONE)
+    sample = MAD_F_ONE - 1;
+  else if (sample < -MAD_F_ONE)
+    sample = -MAD_F_ONE;
+
+  /* quantize */
+  return sample >> (MAD_F_FRACBITS + 1 - 16);
+}
+
+/* last input sample per channel, for interpolating across frames */
+typedef struct pcm_adapt_s {
+  mad_fixed_t last[2];
+} pcm_adapt_t;
+
+/* a frame converted to the format of an output. The data is cache
+   line aligned and owned by the pool. It is shared read-only by the
+   output and the sinks, and goes back to the pool when the last of
+   them puts it. */
+typedef struct pcm_buffer_s {
+  void *data;
+  unsigned int length;       /* samples per channel */
+  unsigned int channels;
+  unsigned int samplerate;
+  mp3dec_format_e format;
+  volatile int refs;
+} pcm_buffer_t;
+
+/* all buffers are allocated up front and reused for every frame */
+typedef struct pcm_pool_s {
+  pcm_buffer_t buffers[PCM_POOL_SIZE];
+  unsigned char *mem;
+  unsigned long buffer_size;
+  mp3dec_format_e format;
+  unsigned long allocs;      /* allocations, never grows after init */
+  unsigned long exhausted;   /* pcm_pool_get found no free buffer */
+} pcm_pool_t;
+
+unsigned int pcm_format_width(mp3dec_format_e format);
+void pcm_pool_init(pcm_pool_t *pool);
+int  pcm_pool_alloc(pcm_pool_t *pool, mp3dec_format_e format,
+		    unsigned int channels, mp3dec_error_t *error);
+pcm_buffer_t *pcm_pool_get(pcm_pool_t *pool);
+void pcm_buffer_ref(pcm_buffer_t *buf);
+void pcm_pool_put(pcm_pool_t *pool, pcm_buffer_t *buf);
+void pcm_pool_free(pcm_pool_t *pool);
+void pcm_adapt_init(pcm_adapt_t *adapt);
+int  pcm_adapt(pcm_adapt_t *adapt, struct mad_pcm const *in,
+	       unsigned int samplerate, unsigned int channels,
+	       struct mad_pcm *out);
+mad_fixed_t pcm_gain(float gain_db, float peak);
+void pcm_convert(struct mad_pcm const *pcm,
+		 unsigned int offset, unsigned int count,
+		 mad_fixed_t gain, mp3dec_format_e format, void *out);
+void pcm_stage(struct mad_pcm const *pcm, mad_fixed_t gain,
+	       pcm_buffer_t *buf);
+
+#endif /* PCM_H__ */
@@ -0,0 +1,142 @@
+/*
+ * play queue of the child
+ *
+ * The first few tracks after the next one are opened early and the
+ * kernel is asked to read their start, and the end where the tags
+ * are, so that switching tracks on network storage only touches
+ * pages that are already in the cache.
+ */
+
+#define _GNU_SOURCE
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "error.h"
+#include "queue.h"
+
+/* the ID3v1 and APE tags at the end of the file */
+#define QUEUE_WARM_TAIL (8 * 1024)
+
+void queue_init(queue_t *queue) {
+  unsigned int i;
+
+  for (i = 0; i < QUEUE_SIZE; i++)
+    queue->entries[i].fd = -1;
+  queue->head = 0;
+  queue->count = 0;
+}
+
+static queue_entry_t *queue_entry(queue_t *queue, unsigned int i) {
+  return &queue->entries[(queue->head + i) % QUEUE_SIZE];
+}
+
+int queue_push(queue_t *queue, char *name, mp3dec_error_t *error) {
+  queue_entry_t *entry;
+
+  if (queue->count == QUEUE_SIZE) {
+    error_set(error, "The queue is full");
+    error_set_code(error, MP3DEC_ERR_STATE);
+    return -1;
+  }
+  if (strlen(name) >= QUEUE_NAME_SIZE) {
+    error_set(error, "Filename too long for the queue");
+    error_set_code(error, MP3DEC_ERR_INVALID);
+    return -1;
+  }
+
+  entry = queue_entry(queue, queue->count);
+  strcpy(entry->name, name);
+  entry->fd = -1;
+  queue->count++;
+  return 0;
+}
+
+/* ask the kernel to read len bytes at offset in the background */
+static void queue_warm(int fd, off_t offset, off_t len) {
+#if defined(POSIX_FADV_WILLNEED)
+  posix_fadvise(fd, offset, len, POSIX_FADV_WILLNEED);
+#elif defined(F_RDADVISE)
+  struct radvisory ra;
+
+  ra.ra_offset = offset;
+  ra.ra_count = len;
+  fcntl(fd, F_RDADVISE, &ra);
+#endif
+}
+
+static void queue_open(queue_entry_t *entry) {
+  struct stat st;
+  off_t tail;
+
+  if (entry->fd != -1)
+    return;
+  entry->fd = open(entry->name, O_RDONLY);
+  if (entry->fd < 0)
+    return;
+
+  if ((fstat(entry->fd, &st) < 0) || !S_ISREG(st.st_mode))
+    return;
+  queue_warm(entry->fd, 0, QUEUE_WARM_SIZE);
+  tail = st.st_size - QUEUE_WARM_TAIL;
+  if (tail > QUEUE_WARM_SIZE)
+    queue_warm(entry->fd, tail, QUEUE_WARM_TAIL);
+}
+
+/* open and read ahead the entries that are played soon. An entry that
+   cannot be opened is tried again when it is popped, and fails then. */
+void queue_prefetch(queue_t *queue) {
+  unsigned int i;
+
+  for (i = 0; (i < queue->count) && (i < QUEUE_PREFETCH); i++)
+    queue_open(queue_entry(queue, i));
+}
+
+/* the descriptor of the first entry, whose name is copied to name,
+   or -1. The caller owns the descriptor. */
+int queue_pop(queue_t *queue, char *name, mp3dec_error_t *error) {
+  queue_entry_t *entry;
+  int fd;
+
+  if (queue->count == 0) {
+    error_set(error, "The queue is empty");
+    error_set_code(error, MP3DEC_ERR_STATE);
+    return -1;
+  }
+
+  entry = queue_entry(queue, 0);
+  strcpy(name, entry->name);
+  fd = entry->fd;
+  entry->fd = -1;
+  queue->head = (queue->head + 1) % QUEUE_SIZE;
+  queue->count--;
+
+  if (fd < 0) {
+    fd = open(name, O_RDONLY);
+    if (fd < 0) {
+      error_printf_strerror(error, "Could not open \"%s\"", name);
+      return -1;
+    }
+  }
+  return fd;
+}
+
+void queue_clear(queue_t *queue) {
+  unsigned int i;
+
+  for (i = 0; i < queue->count; i++) {
+    queue_entry_t *entry = queue_entry(queue, i);
+    if (entry->fd != -1) {
+      close(entry->fd);
+      entry->fd = -1;
+    }
+  }
+  queue->head = 0;
+  queue->count = 0;
+}
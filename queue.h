@@ -0,0 +1,31 @@
+#ifndef QUEUE_H__
+#define QUEUE_H__
+
+#include "error.h"
+
+/* tracks waiting to be played after the next one */
+#define QUEUE_SIZE      64
+#define QUEUE_NAME_SIZE 256
+
+/* entries at the head that are opened and read ahead, and how much of
+   their start is read */
+#define QUEUE_PREFETCH  3
+#define QUEUE_WARM_SIZE (256 * 1024)
+
+typedef struct queue_entry_s {
+  char name[QUEUE_NAME_SIZE];
+  int fd;                  /* -1 until the entry is prefetched */
+} queue_entry_t;
+
+typedef struct queue_s {
+  queue_entry_t entries[QUEUE_SIZE];
+  unsigned int head, count;
+} queue_t;
+
+void queue_init(queue_t *queue);
+int  queue_push(queue_t *queue, char *name, mp3dec_error_t *error);
+int  queue_pop(queue_t *queue, char *name, mp3dec_error_t *error);
+void queue_prefetch(queue_t *queue);
+void queue_clear(queue_t *queue);
+
+#endif /* QUEUE_H__ */
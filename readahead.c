@@ -0,0 +1,485 @@
+/*
+ * asynchronous read-ahead for regular files
+ *
+ * Up to RA_BLOCKS large reads are kept in flight ahead of the decoder,
+ * which copies out of the oldest one and never waits for the disk. A
+ * block that is used up is submitted again for the next part of the
+ * file. The reads go through io_uring where it is available, else
+ * through a small pool of threads shared by all inputs. Every time the
+ * decoder catches up with the reads, the blocks get larger.
+ */
+
+#include <sys/types.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifdef HAVE_LIBURING
+#include <sys/eventfd.h>
+#endif
+
+#include "error.h"
+#include "misc.h"
+#include "readahead.h"
+
+#define min(a, b) ((a) < (b) ? (a) : (b))
+
+/* the thread pool, started on first use in every process */
+static pthread_mutex_t ra_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t ra_work = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t ra_done = PTHREAD_COND_INITIALIZER;
+static ra_block_t *ra_queue_head = NULL, *ra_queue_tail = NULL;
+static pid_t ra_pool_pid = 0;
+static pthread_once_t ra_atfork_once = PTHREAD_ONCE_INIT;
+
+static void ra_notify(readahead_t *ra) {
+  unsigned char c = 0;
+
+  /* a full pipe already wakes up the decoder */
+  if (write(ra->notify[1], &c, 1) < 0)
+    return;
+}
+
+static void *ra_worker(void *arg) {
+  pthread_mutex_lock(&ra_lock);
+  for (;;) {
+    ra_block_t *block;
+    int ret, err;
+
+    while (ra_queue_head == NULL)
+      pthread_cond_wait(&ra_work, &ra_lock);
+
+    block = ra_queue_head;
+    ra_queue_head = block->next;
+    if (ra_queue_head == NULL)
+      ra_queue_tail = NULL;
+    block->state = RA_RUNNING;
+    pthread_mutex_unlock(&ra_lock);
+
+    ret = unix_pread(block->ra->fd, block->buf, block->want, block->offset);
+    err = errno;
+
+    pthread_mutex_lock(&ra_lock);
+    if (ret < 0) {
+      block->error = err;
+      block->len = 0;
+    } else {
+      block->len = ret;
+    }
+    block->state = RA_DONE;
+    pthread_cond_broadcast(&ra_done);
+    ra_notify(block->ra);
+  }
+
+  return NULL;
+}
+
+/* no worker holds the lock while the process forks */
+static void ra_atfork_prepare(void) {
+  pthread_mutex_lock(&ra_lock);
+}
+
+static void ra_atfork_parent(void) {
+  pthread_mutex_unlock(&ra_lock);
+}
+
+/* the waiters on the condition variables and the queued reads belong
+   to workers that do not exist in the child */
+static void ra_atfork_child(void) {
+  pthread_mutex_init(&ra_lock, NULL);
+  pthread_cond_init(&ra_work, NULL);
+  pthread_cond_init(&ra_done, NULL);
+  ra_queue_head = ra_queue_tail = NULL;
+  ra_pool_pid = 0;
+}
+
+static void ra_atfork_register(void) {
+  pthread_atfork(ra_atfork_prepare, ra_atfork_parent, ra_atfork_child);
+}
+
+/* threads do not survive fork, a child starts its own pool */
+static int ra_pool_start(mp3dec_error_t *error) {
+  pthread_attr_t attr;
+  pthread_t thread;
+  int i, ret = 0;
+
+  pthread_once(&ra_atfork_once, ra_atfork_register);
+  pthread_mutex_lock(&ra_lock);
+  if (ra_pool_pid == getpid())
+    goto out;
+
+  ra_queue_head = ra_queue_tail = NULL;
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+  for (i = 0; i < RA_THREADS; i++) {
+    if (pthread_create(&thread, &attr, ra_worker, NULL) != 0) {
+      error_set(error, "Could not start the read-ahead threads");
+      ret = -1;
+      break;
+    }
+  }
+  pthread_attr_destroy(&attr);
+
+  /* a partial pool still works */
+  if (i > 0) {
+    ra_pool_pid = getpid();
+    ret = 0;
+  }
+
+ out:
+  pthread_mutex_unlock(&ra_lock);
+  return ret;
+}
+
+void readahead_init(readahead_t *ra) {
+  unsigned int i;
+
+  memset(ra, 0, sizeof(*ra));
+  ra->fd = -1;
+  ra->notify[0] = ra->notify[1] = -1;
+  for (i = 0; i < RA_BLOCKS; i++)
+    ra->blocks[i].ra = ra;
+}
+
+/* request the next part of the file into block, which is idle. At the
+   end of the file the block stays idle. */
+static int ra_submit(readahead_t *ra, ra_block_t *block,
+		     mp3dec_error_t *error) {
+  unsigned long want = min(ra->block_size, ra->end - ra->next);
+
+  if (want == 0)
+    return 0;
+
+  if (block->size < want) {
+    unsigned char *buf = realloc(block->buf, want);
+    if (buf == NULL) {
+      error_set(error, "Could not allocate read-ahead buffer");
+      error_set_code(error, MP3DEC_ERR_NOMEM);
+      return -1;
+    }
+    block->buf = buf;
+    block->size = want;
+  }
+
+  block->offset = ra->next;
+  block->want = want;
+  block->len = 0;
+  block->error = 0;
+  block->next = NULL;
+  ra->next += want;
+
+#ifdef HAVE_LIBURING
+  if (ra->uring) {
+    struct io_uring_sqe *sqe = io_uring_get_sqe(&ra->ring);
+
+    if (sqe != NULL) {
+      io_uring_prep_read(sqe, ra->fd, block->buf, want, block->offset);
+      io_uring_sqe_set_data(sqe, block);
+      block->state = RA_RUNNING;
+      if (io_uring_submit(&ra->ring) >= 0)
+	return 0;
+    }
+    error_set(error, "Could not submit read");
+    block->state = RA_IDLE;
+    return -1;
+  }
+#endif
+
+  pthread_mutex_lock(&ra_lock);
+  block->state = RA_QUEUED;
+  if (ra_queue_tail != NULL)
+    ra_queue_tail->next = block;
+  else
+    ra_queue_head = block;
+  ra_queue_tail = block;
+  pthread_cond_signal(&ra_work);
+  pthread_mutex_unlock(&ra_lock);
+
+  return 0;
+}
+
+#ifdef HAVE_LIBURING
+/* collect finished reads, the rest of a short read is requested again */
+static void ra_reap(readahead_t *ra, int wait) {
+  struct io_uring_cqe *cqe;
+
+  while (((wait ? io_uring_wait_cqe(&ra->ring, &cqe) :
+	   io_uring_peek_cqe(&ra->ring, &cqe)) == 0) && (cqe != NULL)) {
+    ra_block_t *block = io_uring_cqe_get_data(cqe);
+    int res = cqe->res;
+
+    io_uring_cqe_seen(&ra->ring, cqe);
+
+    if (res < 0) {
+      block->error = -res;
+      block->state = RA_DONE;
+    } else {
+      block->len += res;
+      if ((res > 0) && (block->len < block->want)) {
+	struct io_uring_sqe *sqe = io_uring_get_sqe(&ra->ring);
+
+	if (sqe != NULL) {
+	  io_uring_prep_read(sqe, ra->fd, block->buf + block->len,
+			     block->want - block->len,
+			     block->offset + block->len);
+	  io_uring_sqe_set_data(sqe, block);
+	  io_uring_submit(&ra->ring);
+	  continue;
+	}
+      }
+      block->state = RA_DONE;
+    }
+    if (wait)
+      return;
+  }
+}
+#endif
+
+static ra_block_state_e ra_state(readahead_t *ra, ra_block_t *block) {
+  ra_block_state_e state;
+
+#ifdef HAVE_LIBURING
+  if (ra->uring) {
+    ra_reap(ra, 0);
+    return block->state;
+  }
+#endif
+
+  pthread_mutex_lock(&ra_lock);
+  state = block->state;
+  pthread_mutex_unlock(&ra_lock);
+  return state;
+}
+
+/* wait for all reads of ra, queued ones are dropped */
+static void ra_cancel(readahead_t *ra) {
+  unsigned int i;
+
+#ifdef HAVE_LIBURING
+  if (ra->uring) {
+    for (i = 0; i < RA_BLOCKS; i++) {
+      while (ra->blocks[i].state == RA_RUNNING)
+	ra_reap(ra, 1);
+      ra->blocks[i].state = RA_IDLE;
+    }
+    return;
+  }
+#endif
+
+  pthread_mutex_lock(&ra_lock);
+  for (i = 0; i < RA_BLOCKS; i++) {
+    ra_block_t *block = &ra->blocks[i];
+
+    if (block->state == RA_QUEUED) {
+      ra_block_t **p = &ra_queue_head;
+
+      ra_queue_tail = NULL;
+      while (*p != NULL) {
+	if (*p == block)
+	  *p = block->next;
+	else
+	  p = &(*p)->next;
+      }
+      for (ra_queue_tail = ra_queue_head;
+	   (ra_queue_tail != NULL) && (ra_queue_tail->next != NULL);
+	   ra_queue_tail = ra_queue_tail->next)
+	;
+    }
+    while (block->state == RA_RUNNING)
+      pthread_cond_wait(&ra_done, &ra_lock);
+    block->state = RA_IDLE;
+  }
+  pthread_mutex_unlock(&ra_lock);
+}
+
+static void ra_drain(readahead_t *ra) {
+  unsigned char buf[64];
+
+  while (read(ra->notify[0], buf, sizeof(buf)) > 0)
+    ;
+}
+
+static int ra_start(readahead_t *ra, unsigned long offset,
+		    mp3dec_error_t *error) {
+  unsigned int i;
+
+  ra->next = offset;
+  ra->head = 0;
+  ra->pos = 0;
+  for (i = 0; i < RA_BLOCKS; i++) {
+    if (ra_submit(ra, &ra->blocks[i], error) < 0)
+      return -1;
+  }
+  return 0;
+}
+
+/* does not take ownership of fd */
+int readahead_open(readahead_t *ra, int fd, unsigned long start,
+		   unsigned long end, mp3dec_error_t *error) {
+  readahead_close(ra);
+
+  ra->fd = fd;
+  ra->end = end;
+  ra->block_size = RA_MIN_BLOCK;
+  ra->stall_start = 0;
+
+#ifdef HAVE_LIBURING
+  ra->notify[0] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if ((ra->notify[0] >= 0) &&
+      (io_uring_queue_init(RA_BLOCKS * 2, &ra->ring, 0) == 0)) {
+    if (io_uring_register_eventfd(&ra->ring, ra->notify[0]) == 0) {
+      ra->uring = 1;
+      goto submit;
+    }
+    io_uring_queue_exit(&ra->ring);
+  }
+  if (ra->notify[0] >= 0)
+    close(ra->notify[0]);
+  ra->notify[0] = -1;
+#endif
+
+  if (pipe(ra->notify) < 0) {
+    error_set_strerror(error, "Could not create read-ahead pipe");
+    ra->notify[0] = ra->notify[1] = -1;
+    return -1;
+  }
+  fcntl(ra->notify[0], F_SETFL, O_NONBLOCK);
+  fcntl(ra->notify[1], F_SETFL, O_NONBLOCK);
+  fcntl(ra->notify[0], F_SETFD, FD_CLOEXEC);
+  fcntl(ra->notify[1], F_SETFD, FD_CLOEXEC);
+
+  if (ra_pool_start(error) < 0) {
+    readahead_close(ra);
+    return -1;
+  }
+
+#ifdef HAVE_LIBURING
+ submit:
+#endif
+  if (ra_start(ra, start, error) < 0) {
+    readahead_close(ra);
+    return -1;
+  }
+  return 0;
+}
+
+/* whether readahead_read returns without waiting. While it does not,
+   the time counts as a stall and the next blocks are made larger. */
+int readahead_ready(readahead_t *ra) {
+  ra_block_t *block = &ra->blocks[ra->head];
+  ra_block_state_e state;
+
+  ra_drain(ra);
+  state = ra_state(ra, block);
+
+  if ((state == RA_DONE) || (state == RA_IDLE)) {
+    if (ra->stall_start != 0) {
+      ra->stall_usec += unix_time_usec() - ra->stall_start;
+      ra->stall_start = 0;
+    }
+    return 1;
+  }
+
+  if (ra->stall_start == 0) {
+    ra->stall_start = unix_time_usec();
+    ra->stalls++;
+    if (ra->block_size < RA_MAX_BLOCK)
+      ra->block_size *= 2;
+  }
+  return 0;
+}
+
+/* copy up to len bytes, returns 0 at the end of the file and RA_AGAIN
+   if the data is not there yet */
+long readahead_read(readahead_t *ra, unsigned char *buf, unsigned long len,
+		    mp3dec_error_t *error) {
+  ra_block_t *block = &ra->blocks[ra->head];
+  unsigned long n;
+
+  if (!readahead_ready(ra))
+    return RA_AGAIN;
+  if (block->state == RA_IDLE)
+    return 0;
+
+  if (block->error != 0) {
+    errno = block->error;
+    error_set_strerror(error, "Could not read ahead");
+    return -1;
+  }
+
+  n = min(len, block->len - ra->pos);
+  memcpy(buf, block->buf + ra->pos, n);
+  ra->pos += n;
+
+  if (ra->pos == block->len) {
+    block->state = RA_IDLE;
+    ra->pos = 0;
+    ra->head = (ra->head + 1) % RA_BLOCKS;
+    if (ra_submit(ra, block, error) < 0)
+      return -1;
+  }
+
+  return n;
+}
+
+int readahead_seek(readahead_t *ra, unsigned long offset,
+		   mp3dec_error_t *error) {
+  ra_cancel(ra);
+  ra_drain(ra);
+  return ra_start(ra, offset, error);
+}
+
+int readahead_wait_fd(readahead_t *ra) {
+  return ra->notify[0];
+}
+
+/* block until the next block has been read. This is not a stall, the
+   caller has nothing else to do and the blocks keep their size. */
+void readahead_wait(readahead_t *ra) {
+  ra_block_t *block = &ra->blocks[ra->head];
+
+#ifdef HAVE_LIBURING
+  if (ra->uring) {
+    while (block->state == RA_RUNNING)
+      ra_reap(ra, 1);
+    return;
+  }
+#endif
+
+  pthread_mutex_lock(&ra_lock);
+  while ((block->state == RA_QUEUED) || (block->state == RA_RUNNING))
+    pthread_cond_wait(&ra_done, &ra_lock);
+  pthread_mutex_unlock(&ra_lock);
+}
+
+void readahead_close(readahead_t *ra) {
+  unsigned int i;
+
+  if (ra->fd != -1)
+    ra_cancel(ra);
+
+#ifdef HAVE_LIBURING
+  if (ra->uring) {
+    io_uring_queue_exit(&ra->ring);
+    ra->uring = 0;
+  }
+#endif
+
+  for (i = 0; i < RA_BLOCKS; i++) {
+    free(ra->blocks[i].buf);
+    ra->blocks[i].buf = NULL;
+    ra->blocks[i].size = 0;
+    ra->blocks[i].state = RA_IDLE;
+  }
+
+  for (i = 0; i < 2; i++) {
+    if (ra->notify[i] != -1)
+      close(ra->notify[i]);
+    ra->notify[i] = -1;
+  }
+  ra->fd = -1;
+}
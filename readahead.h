@@ -0,0 +1,83 @@
+#ifndef READAHEAD_H__
+#define READAHEAD_H__
+
+#include <pthread.h>
+
+#ifdef HAVE_LIBURING
+#include <liburing.h>
+#endif
+
+#include "error.h"
+
+/* blocks in flight or waiting to be consumed */
+#define RA_BLOCKS      3
+#define RA_MIN_BLOCK   (64 * 1024)
+#define RA_MAX_BLOCK   (1024 * 1024)
+
+/* worker threads shared by all inputs when io_uring is not available */
+#define RA_THREADS     4
+
+/* returned by readahead_read when the next block is still being read */
+#define RA_AGAIN       -2
+
+typedef enum {
+  RA_IDLE = 0,
+  RA_QUEUED,       /* waiting for a worker thread */
+  RA_RUNNING,      /* being read */
+  RA_DONE
+} ra_block_state_e;
+
+struct readahead_s;
+
+typedef struct ra_block_s {
+  struct readahead_s *ra;
+  ra_block_state_e state;
+
+  unsigned char *buf;
+  unsigned long size;      /* allocated */
+  unsigned long want;      /* bytes requested */
+  unsigned long offset;    /* of buf[0] in the file */
+  unsigned long len;       /* bytes read */
+  int error;               /* errno of a failed read */
+
+  struct ra_block_s *next; /* in the queue of the thread pool */
+} ra_block_t;
+
+typedef struct readahead_s {
+  int fd;
+  unsigned long next;      /* file offset of the next block to submit */
+  unsigned long end;
+  unsigned long block_size;
+
+  /* consumed in order, head is the block being copied out */
+  ra_block_t blocks[RA_BLOCKS];
+  unsigned int head;
+  unsigned long pos;
+
+  /* readable when a block is done */
+  int notify[2];
+
+#ifdef HAVE_LIBURING
+  int uring;
+  struct io_uring ring;
+#endif
+
+  /* time the decoder had to wait for a block */
+  unsigned long long stall_start;
+  unsigned long stalls;
+  unsigned long long stall_usec;
+} readahead_t;
+
+void readahead_init(readahead_t *ra);
+int  readahead_open(readahead_t *ra, int fd, unsigned long start,
+		    unsigned long end, mp3dec_error_t *error);
+int  readahead_ready(readahead_t *ra);
+long readahead_read(readahead_t *ra, unsigned char *buf, unsigned long len,
+		    mp3dec_error_t *error);
+int  readahead_seek(readahead_t *ra, unsigned long offset,
+		    mp3dec_error_t *error);
+int  readahead_wait_fd(readahead_t *ra);
+void readahead_wait(readahead_t *ra);
+void readahead_close(readahead_t *ra);
+
+#endif /* READAHEAD_H__ */
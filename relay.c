@@ -0,0 +1,653 @@
+/*
+ * relay of mp3 frames without decoding
+ *
+ * Listeners that take mp3 get the frames of a file as they are. The
+ * file is mapped once and indexed by its frame headers. A thread
+ * sends the frames to every listener as they become due by their
+ * duration, straight from the page cache with sendfile. Nothing is
+ * decoded or copied, so one core serves thousands of listeners.
+ */
+
+#define _GNU_SOURCE
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "maddec.h"
+#include "error.h"
+#include "misc.h"
+#include "sync.h"
+#include "tags.h"
+
+/* frames a listener can fall behind before it is disconnected */
+#define RELAY_BACKLOG   64
+
+#define RELAY_INDEX_INITIAL 1024
+#define RELAY_LISTENERS_INITIAL 64
+
+typedef struct relay_frame_s {
+  unsigned long long offset;
+  unsigned long long sample;   /* of the first sample of the frame */
+} relay_frame_t;
+
+typedef struct relay_listener_s {
+  int fd;
+  unsigned long long pos;      /* next byte of the file to send */
+
+  /* after a seek or a load the frame being sent is finished first, up
+     to end, then sending goes on at resume. After a load that frame is
+     in the old file. */
+  int seeking;
+  int old;
+  unsigned long long end, resume;
+} relay_listener_t;
+
+struct mp3dec_relay_s {
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  int stop;
+  int playing;
+
+  int fd;
+  unsigned char *map;
+  unsigned long size;
+
+  /* the file loaded before, until the listeners finish their frame */
+  int old_fd;
+  unsigned char *old_map;
+  unsigned long old_size;
+
+  /* one entry past the last frame, at the end of its data */
+  relay_frame_t *frames;
+  unsigned long nframes;
+  unsigned int samplerate;
+
+  unsigned long next;          /* first frame not due yet */
+  unsigned long long base_usec;  /* when the first frame was due */
+
+  relay_listener_t *listeners;
+  unsigned int nlisteners, max_listeners;
+
+  unsigned long dropped;
+  unsigned long late;
+  unsigned long long cpu_usec;
+
+  mp3dec_error_t error;
+};
+
+static unsigned long long relay_frame_usec(mp3dec_relay_t *relay,
+					   unsigned long frame) {
+  return relay->frames[frame].sample * 1000000 / relay->samplerate;
+}
+
+/* length of the last frame, the sentinel is at the end of it */
+static unsigned long long relay_last_frame_usec(mp3dec_relay_t *relay) {
+  return relay_frame_usec(relay, relay->nframes) -
+    relay_frame_usec(relay, relay->nframes - 1);
+}
+
+static void relay_drop(mp3dec_relay_t *relay, unsigned int i) {
+  close(relay->listeners[i].fd);
+  relay->listeners[i] = relay->listeners[--relay->nlisteners];
+}
+
+/* send up to len bytes of the file, or the old one, at pos without
+   blocking */
+static long relay_sendfile(mp3dec_relay_t *relay, int fd, int old,
+			   unsigned long long pos, unsigned long len) {
+  long ret;
+#ifdef __linux__
+  off_t off = pos;
+
+  ret = sendfile(fd, old ? relay->old_fd : relay->fd, &off, len);
+  if ((ret < 0) && (errno == EPIPE)) {
+    /* SIGPIPE is blocked in the relay thread, take it off again */
+    struct timespec zero = { 0, 0 };
+    sigset_t set;
+
+    sigemptyset(&set);
+    sigaddset(&set, SIGPIPE);
+    sigtimedwait(&set, NULL, &zero);
+  }
+#else
+  ret = send(fd, (old ? relay->old_map : relay->map) + pos, len,
+	     MSG_DONTWAIT);
+#endif
+  return ret;
+}
+
+/* bring a listener up to the frames that are due. Returns -1 when it
+   has to be dropped. */
+static int relay_send(mp3dec_relay_t *relay, relay_listener_t *listener) {
+  unsigned long long limit = relay->frames[relay->next].offset;
+  long ret;
+
+  if (!listener->seeking && (relay->next > RELAY_BACKLOG) &&
+      (listener->pos < relay->frames[relay->next - RELAY_BACKLOG].offset))
+    return -1;
+
+  for (;;) {
+    unsigned long long target = listener->seeking ? listener->end : limit;
+
+    while (listener->pos < target) {
+      ret = relay_sendfile(relay, listener->fd,
+			   listener->seeking && listener->old,
+			   listener->pos, target - listener->pos);
+      if (ret < 0)
+	return ((errno == EAGAIN) || (errno == EWOULDBLOCK)) ? 0 : -1;
+      if (ret == 0)
+	return -1;
+      listener->pos += ret;
+    }
+
+    if (!listener->seeking)
+      return 0;
+    listener->seeking = 0;
+    listener->old = 0;
+    listener->pos = listener->resume;
+  }
+}
+
+static void relay_release_old(mp3dec_relay_t *relay) {
+  if (relay->old_map != NULL)
+    munmap(relay->old_map, relay->old_size);
+  if (relay->old_fd != -1)
+    close(relay->old_fd);
+  relay->old_map = NULL;
+  relay->old_fd = -1;
+}
+
+static void relay_send_all(mp3dec_relay_t *relay) {
+  unsigned int i = 0;
+  int old = 0;
+
+  while (i < relay->nlisteners) {
+    if (relay_send(relay, &relay->listeners[i]) < 0) {
+      relay_drop(relay, i);
+      relay->dropped++;
+    } else {
+      old |= relay->listeners[i].old;
+      i++;
+    }
+  }
+
+  if (!old && (relay->old_fd != -1))
+    relay_release_old(relay);
+}
+
+/* move next past the frames due at now */
+static void relay_due(mp3dec_relay_t *relay, unsigned long long now) {
+  unsigned long first = relay->next;
+
+  while ((relay->next < relay->nframes) &&
+	 (relay->base_usec + relay_frame_usec(relay, relay->next) <= now))
+    relay->next++;
+
+  /* woke up after the frame following the first due one was due too */
+  if ((first + 1 < relay->next) &&
+      (relay->base_usec + relay_frame_usec(relay, first + 1) < now))
+    relay->late++;
+}
+
+/* after the last frame was due: whether every listener got the whole
+   track. Listeners still behind a backlog of frames later are dropped,
+   as they would be while playing. */
+static int relay_flushed(mp3dec_relay_t *relay, unsigned long long now) {
+  unsigned long long end = relay->frames[relay->nframes].offset;
+  unsigned long long cutoff;
+  unsigned int i = 0;
+  int pending = 0;
+
+  if (relay->nframes == 0)
+    return 1;
+  cutoff = relay->base_usec + relay_frame_usec(relay, relay->nframes) +
+    RELAY_BACKLOG * relay_last_frame_usec(relay);
+
+  while (i < relay->nlisteners) {
+    relay_listener_t *listener = &relay->listeners[i];
+
+    if (listener->seeking || (listener->pos < end)) {
+      if (now >= cutoff) {
+	relay_drop(relay, i);
+	relay->dropped++;
+	continue;
+      }
+      pending = 1;
+    }
+    i++;
+  }
+  return !pending;
+}
+
+static void *relay_thread(void *arg) {
+  mp3dec_relay_t *relay = arg;
+  unsigned long long deadline;
+  sigset_t set;
+
+  /* a listener that goes away fails with EPIPE instead */
+  sigemptyset(&set);
+  sigaddset(&set, SIGPIPE);
+  pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+  pthread_mutex_lock(&relay->lock);
+  while (!relay->stop) {
+    if (!relay->playing) {
+      pthread_cond_wait(&relay->cond, &relay->lock);
+      continue;
+    }
+
+    relay_due(relay, unix_time_usec());
+    relay_send_all(relay);
+    relay->cpu_usec = unix_thread_cpu_usec();
+    if (relay->next == relay->nframes) {
+      if (relay_flushed(relay, unix_time_usec())) {
+	relay->playing = 0;
+	continue;
+      }
+      /* listeners that were behind get the rest a frame at a time */
+      deadline = unix_time_usec() + relay_last_frame_usec(relay);
+    } else {
+      deadline = relay->base_usec + relay_frame_usec(relay, relay->next);
+    }
+    pthread_mutex_unlock(&relay->lock);
+    unix_sleep_until_usec(deadline);
+    pthread_mutex_lock(&relay->lock);
+  }
+  pthread_mutex_unlock(&relay->lock);
+
+  return NULL;
+}
+
+mp3dec_relay_t *mp3dec_relay_new(void) {
+  mp3dec_relay_t *relay = malloc(sizeof(mp3dec_relay_t));
+  if (relay == NULL)
+    return NULL;
+
+  memset(relay, 0, sizeof(*relay));
+  relay->fd = -1;
+  relay->old_fd = -1;
+  error_reset(&relay->error);
+  pthread_mutex_init(&relay->lock, NULL);
+  pthread_cond_init(&relay->cond, NULL);
+  if (pthread_create(&relay->thread, NULL, relay_thread, relay) != 0) {
+    pthread_cond_destroy(&relay->cond);
+    pthread_mutex_destroy(&relay->lock);
+    free(relay);
+    return NULL;
+  }
+  return relay;
+}
+
+static void relay_unload(mp3dec_relay_t *relay) {
+  if (relay->map != NULL)
+    munmap(relay->map, relay->size);
+  if (relay->fd != -1)
+    close(relay->fd);
+  free(relay->frames);
+  relay->map = NULL;
+  relay->fd = -1;
+  relay->frames = NULL;
+  relay->nframes = 0;
+  relay->next = 0;
+  relay->playing = 0;
+}
+
+void mp3dec_relay_delete(mp3dec_relay_t *relay) {
+  pthread_mutex_lock(&relay->lock);
+  relay->stop = 1;
+  pthread_cond_signal(&relay->cond);
+  pthread_mutex_unlock(&relay->lock);
+  pthread_join(relay->thread, NULL);
+
+  while (relay->nlisteners > 0)
+    relay_drop(relay, 0);
+  free(relay->listeners);
+  relay_unload(relay);
+  relay_release_old(relay);
+  pthread_cond_destroy(&relay->cond);
+  pthread_mutex_destroy(&relay->lock);
+  free(relay);
+}
+
+static int relay_add_frame(mp3dec_relay_t *relay, unsigned long *max,
+			   unsigned long long offset,
+			   unsigned long long sample) {
+  if (relay->nframes + 1 >= *max) {
+    relay_frame_t *frames;
+
+    frames = realloc(relay->frames, *max * 2 * sizeof(relay_frame_t));
+    if (frames == NULL) {
+      error_set(&relay->error, "Could not allocate the frame index");
+      error_set_code(&relay->error, MP3DEC_ERR_NOMEM);
+      return -1;
+    }
+    relay->frames = frames;
+    *max *= 2;
+  }
+
+  relay->frames[relay->nframes].offset = offset;
+  relay->frames[relay->nframes].sample = sample;
+  relay->nframes++;
+  return 0;
+}
+
+/* index the frames between the tags. Garbage between frames stays in
+   the data that is sent, free format streams are not supported. */
+static int relay_index(mp3dec_relay_t *relay) {
+  unsigned long start = 0, end = relay->size, pos, max;
+  unsigned long long samples = 0, last = 0;
+
+  tags_bounds_map(relay->map, &start, &end, NULL);
+
+  max = RELAY_INDEX_INITIAL;
+  relay->frames = malloc(max * sizeof(relay_frame_t));
+  if (relay->frames == NULL) {
+    error_set(&relay->error, "Could not allocate the frame index");
+    error_set_code(&relay->error, MP3DEC_ERR_NOMEM);
+    return -1;
+  }
+
+  pos = start;
+  while (pos + 4 <= end) {
+    unsigned char *p = relay->map + pos;
+    unsigned int flen = sync_frame_length(p);
+    sync_result_e ret = sync_check(p, end - pos);
+    long skip;
+
+    /* once the stream is known a frame needs no next header to check,
+       as the last one and one followed by garbage */
+    if ((ret == SYNC_VALID) ||
+	((flen > 1) && (pos + flen <= end) &&
+	 ((ret == SYNC_SHORT) ||
+	  ((relay->nframes > 0) &&
+	   sync_match(p, relay->map + relay->frames[0].offset))))) {
+      if (relay->nframes == 0)
+	relay->samplerate = sync_frame_samplerate(p);
+      if (relay_add_frame(relay, &max, pos, samples) < 0)
+	return -1;
+      samples += sync_frame_samples(p);
+      pos += flen;
+      last = pos;
+      continue;
+    }
+
+    skip = sync_find(p + 1, end - pos - 1);
+    if (skip < 0)
+      break;
+    pos += skip + 1;
+  }
+
+  if (relay->nframes == 0) {
+    error_set(&relay->error, "No mp3 frames found");
+    error_set_code(&relay->error, MP3DEC_ERR_DECODE);
+    return -1;
+  }
+  relay->frames[relay->nframes].offset = last;
+  relay->frames[relay->nframes].sample = samples;
+  return 0;
+}
+
+/* the offset where the frame that a listener at pos is sending ends,
+   pos itself at the start of a frame */
+static unsigned long long relay_frame_end(mp3dec_relay_t *relay,
+					  unsigned long long pos) {
+  unsigned long lo = 0, hi = relay->nframes, mid;
+
+  while (hi - lo > 1) {
+    mid = (lo + hi) / 2;
+    if (relay->frames[mid].offset <= pos)
+      lo = mid;
+    else
+      hi = mid;
+  }
+  return relay->frames[(relay->frames[lo].offset == pos) ? lo : lo + 1].offset;
+}
+
+/* listeners in the middle of a frame of the loaded file finish it from
+   there once a new one is loaded. A file is only kept for one load,
+   listeners still behind in the one before are dropped. */
+static void relay_retire(mp3dec_relay_t *relay) {
+  unsigned int i = 0;
+  int old = 0;
+
+  if (relay->nframes == 0)
+    return;
+
+  while (i < relay->nlisteners) {
+    relay_listener_t *listener = &relay->listeners[i];
+
+    if (listener->old) {
+      relay_drop(relay, i);
+      relay->dropped++;
+      continue;
+    }
+    if (!listener->seeking)
+      listener->end = relay_frame_end(relay, listener->pos);
+    listener->seeking = (listener->pos < listener->end);
+    listener->old = listener->seeking;
+    old |= listener->old;
+    i++;
+  }
+
+  relay_release_old(relay);
+  if (old) {
+    relay->old_fd = relay->fd;
+    relay->old_map = relay->map;
+    relay->old_size = relay->size;
+    relay->fd = -1;
+    relay->map = NULL;
+  }
+}
+
+/* index filename and stop relaying the previous one. Listeners stay
+   connected and get the new file from its start once it plays, after
+   the frame they are sending. */
+int mp3dec_relay_load(mp3dec_relay_t *relay, char *filename) {
+  struct stat st;
+  unsigned int i;
+  int ret = -1;
+
+  pthread_mutex_lock(&relay->lock);
+  relay_retire(relay);
+  relay_unload(relay);
+
+  relay->fd = open(filename, O_RDONLY);
+  if (relay->fd < 0) {
+    error_printf_strerror(&relay->error, "Could not open \"%s\"", filename);
+    goto out;
+  }
+  if ((fstat(relay->fd, &st) < 0) || (st.st_size == 0)) {
+    error_printf(&relay->error, "Could not stat \"%s\" or it is empty",
+		 filename);
+    goto out;
+  }
+  relay->size = st.st_size;
+  relay->map = mmap(NULL, relay->size, PROT_READ, MAP_SHARED, relay->fd, 0);
+  if (relay->map == MAP_FAILED) {
+    relay->map = NULL;
+    error_set_strerror(&relay->error, "Could not map file");
+    goto out;
+  }
+  madvise(relay->map, relay->size, MADV_SEQUENTIAL);
+
+  if (relay_index(relay) < 0) {
+    error_prepend(&relay->error, filename);
+    goto out;
+  }
+
+  for (i = 0; i < relay->nlisteners; i++) {
+    relay_listener_t *listener = &relay->listeners[i];
+
+    if (listener->seeking)
+      listener->resume = relay->frames[0].offset;
+    else
+      listener->pos = relay->frames[0].offset;
+  }
+  ret = 0;
+
+ out:
+  if (ret < 0)
+    relay_unload(relay);
+  pthread_mutex_unlock(&relay->lock);
+  return ret;
+}
+
+static int relay_loaded(mp3dec_relay_t *relay) {
+  if (relay->nframes == 0) {
+    error_set(&relay->error, "No file loaded");
+    error_set_code(&relay->error, MP3DEC_ERR_STATE);
+    return 0;
+  }
+  return 1;
+}
+
+/* relay from the current frame on, or from the start after the end */
+int mp3dec_relay_play(mp3dec_relay_t *relay) {
+  pthread_mutex_lock(&relay->lock);
+  if (!relay_loaded(relay)) {
+    pthread_mutex_unlock(&relay->lock);
+    return -1;
+  }
+  if (!relay->playing) {
+    if (relay->next == relay->nframes)
+      relay->next = 0;
+    relay->base_usec = unix_time_usec() - relay_frame_usec(relay, relay->next);
+    relay->playing = 1;
+    pthread_cond_signal(&relay->cond);
+  }
+  pthread_mutex_unlock(&relay->lock);
+  return 0;
+}
+
+int mp3dec_relay_pause(mp3dec_relay_t *relay) {
+  pthread_mutex_lock(&relay->lock);
+  relay->playing = 0;
+  pthread_mutex_unlock(&relay->lock);
+  return 0;
+}
+
+/* go on at the frame playing at seconds. Listeners finish the frame
+   they are sending first. */
+int mp3dec_relay_seek(mp3dec_relay_t *relay, double seconds) {
+  unsigned long long sample;
+  unsigned long lo, hi, mid;
+  unsigned int i;
+
+  pthread_mutex_lock(&relay->lock);
+  if (!relay_loaded(relay) || (seconds < 0)) {
+    if (seconds < 0) {
+      error_set(&relay->error, "Cannot seek before the start");
+      error_set_code(&relay->error, MP3DEC_ERR_INVALID);
+    }
+    pthread_mutex_unlock(&relay->lock);
+    return -1;
+  }
+
+  /* the last frame starting at or before sample */
+  sample = seconds * relay->samplerate;
+  lo = 0;
+  hi = relay->nframes;
+  while (hi - lo > 1) {
+    mid = (lo + hi) / 2;
+    if (relay->frames[mid].sample <= sample)
+      lo = mid;
+    else
+      hi = mid;
+  }
+  relay->next = lo;
+  relay->base_usec = unix_time_usec() - relay_frame_usec(relay, lo);
+
+  for (i = 0; i < relay->nlisteners; i++) {
+    relay_listener_t *listener = &relay->listeners[i];
+
+    if (!listener->seeking)
+      listener->end = relay_frame_end(relay, listener->pos);
+    listener->resume = relay->frames[relay->next].offset;
+    listener->seeking = 1;
+  }
+  pthread_mutex_unlock(&relay->lock);
+  return 0;
+}
+
+/* relay to the connected socket fd from the frame playing now on. The
+   relay owns fd from here on and closes it when the listener goes
+   away or falls behind. */
+int mp3dec_relay_add(mp3dec_relay_t *relay, int fd) {
+  relay_listener_t *listener;
+
+  pthread_mutex_lock(&relay->lock);
+  if (relay->nlisteners == relay->max_listeners) {
+    unsigned int max = relay->max_listeners ?
+      relay->max_listeners * 2 : RELAY_LISTENERS_INITIAL;
+    relay_listener_t *listeners;
+
+    listeners = realloc(relay->listeners, max * sizeof(relay_listener_t));
+    if (listeners == NULL) {
+      pthread_mutex_unlock(&relay->lock);
+      close(fd);
+      error_set(&relay->error, "Could not allocate the listener");
+      error_set_code(&relay->error, MP3DEC_ERR_NOMEM);
+      return -1;
+    }
+    relay->listeners = listeners;
+    relay->max_listeners = max;
+  }
+
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+#ifdef SO_NOSIGPIPE
+  {
+    int on = 1;
+    setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on));
+  }
+#endif
+
+  listener = &relay->listeners[relay->nlisteners++];
+  listener->fd = fd;
+  listener->pos = (relay->nframes > 0) ?
+    relay->frames[relay->next].offset : 0;
+  listener->seeking = 0;
+  listener->old = 0;
+  pthread_mutex_unlock(&relay->lock);
+  return 0;
+}
+
+void mp3dec_relay_status(mp3dec_relay_t *relay,
+			 mp3dec_relay_status_t *status) {
+  pthread_mutex_lock(&relay->lock);
+  memset(status, 0, sizeof(*status));
+  status->playing = relay->playing;
+  status->frames = relay->nframes;
+  status->frame = relay->next;
+  if (relay->nframes > 0) {
+    status->seconds = relay_frame_usec(relay, relay->next) / 1000000.0;
+    status->duration = relay_frame_usec(relay, relay->nframes) / 1000000.0;
+  }
+  status->listeners = relay->nlisteners;
+  status->dropped = relay->dropped;
+  status->late = relay->late;
+  status->cpu_usec = relay->cpu_usec;
+  pthread_mutex_unlock(&relay->lock);
+}
+
+char *mp3dec_relay_error(mp3dec_relay_t *relay) {
+  return error_get(&relay->error);
+}
+
+mp3dec_errcode_e mp3dec_relay_error_code(mp3dec_relay_t *relay) {
+  return error_code(&relay->error);
+}
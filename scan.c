@@ -0,0 +1,161 @@
+/*
+ * header-only scan of a whole file
+ *
+ * The file is mapped and walked with mad_header_decode, nothing is
+ * decoded or synthesized. Everything between two frames that is not a
+ * frame is reported as a corrupt region.
+ */
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <string.h>
+#include <unistd.h>
+
+#include <mad.h>
+
+#include "maddec.h"
+#include "error.h"
+#include "tags.h"
+#include "scan.h"
+
+/* the largest frame, free format layer III at 640 kbps and 8 khz */
+#define SCAN_MAX_FRAME 8192
+
+static void scan_region(mp3dec_scan_t *scan, unsigned long long offset,
+			unsigned long long length) {
+  if (scan->nregions < MP3DEC_SCAN_REGIONS) {
+    scan->regions[scan->nregions].offset = offset;
+    scan->regions[scan->nregions].length = length;
+  }
+  scan->nregions++;
+  scan->corrupt_bytes += length;
+}
+
+static void scan_frame(mp3dec_scan_t *scan, struct mad_header const *header,
+		       unsigned long len) {
+  unsigned int nsamples = 32 * MAD_NSBSAMPLES(header);
+  unsigned int kbps = header->bitrate / 1000;
+  unsigned int i;
+
+  if (scan->frames == 0) {
+    scan->layer = header->layer;
+    scan->samplerate = header->samplerate;
+    scan->mode = (mp3dec_mode_e)header->mode;
+  } else {
+    if (header->samplerate != scan->samplerate)
+      scan->samplerate_changes++;
+    if ((mp3dec_mode_e)header->mode != scan->mode)
+      scan->mode_changes++;
+  }
+
+  scan->frames++;
+  scan->samples += nsamples;
+  scan->seconds += (double)nsamples / header->samplerate;
+  scan->bytes += len;
+
+  for (i = 0; i < scan->nbitrates; i++) {
+    if (scan->bitrates[i].kbps == kbps)
+      break;
+  }
+  if (i == scan->nbitrates) {
+    if (i == MP3DEC_SCAN_BITRATES)
+      return;
+    scan->bitrates[i].kbps = kbps;
+    scan->bitrates[i].frames = 0;
+    scan->nbitrates++;
+  }
+  scan->bitrates[i].frames++;
+}
+
+/* walk the frames of len bytes at buf, which start at offset base in
+   the file */
+static void scan_buffer(unsigned char const *buf, unsigned long len,
+			unsigned long long base, mp3dec_scan_t *scan) {
+  unsigned char tail[SCAN_MAX_FRAME + MAD_BUFFER_GUARD];
+  unsigned long long expected = base, end = base + len;
+  unsigned long tail_len = 0;
+  struct mad_stream stream;
+  struct mad_header header;
+
+  mad_stream_init(&stream);
+  mad_header_init(&header);
+  mad_stream_buffer(&stream, buf, len);
+
+  for (;;) {
+    unsigned long long offset;
+    unsigned long flen;
+
+    if (mad_header_decode(&header, &stream) == -1) {
+      if (MAD_RECOVERABLE(stream.error))
+	continue;
+      if ((stream.error != MAD_ERROR_BUFLEN) || (tail_len > 0))
+	break;
+
+      /* libmad wants MAD_BUFFER_GUARD bytes after the last frame,
+	 copy the end of the file and pad it */
+      tail_len = stream.bufend - stream.next_frame;
+      if ((tail_len == 0) || (tail_len > SCAN_MAX_FRAME))
+	break;
+      base = end - tail_len;
+      memcpy(tail, stream.next_frame, tail_len);
+      memset(tail + tail_len, 0, MAD_BUFFER_GUARD);
+      mad_stream_buffer(&stream, tail, tail_len + MAD_BUFFER_GUARD);
+      continue;
+    }
+
+    offset = base + (stream.this_frame - stream.buffer);
+    flen = stream.next_frame - stream.this_frame;
+
+    /* a frame cut off by the end of the file */
+    if (offset + flen > end)
+      break;
+
+    if (offset > expected)
+      scan_region(scan, expected, offset - expected);
+    expected = offset + flen;
+
+    scan_frame(scan, &header, flen);
+  }
+
+  if (expected < end)
+    scan_region(scan, expected, end - expected);
+
+  mad_header_finish(&header);
+  mad_stream_finish(&stream);
+}
+
+int scan_fd(int fd, mp3dec_scan_t *scan, mp3dec_error_t *error) {
+  unsigned char *map;
+  unsigned long len, start;
+  struct stat st;
+
+  memset(scan, 0, sizeof(*scan));
+
+  if (fstat(fd, &st) < 0) {
+    error_set_strerror(error, "Could not stat file");
+    return -1;
+  }
+  len = st.st_size;
+  if (len == 0)
+    return 0;
+
+  map = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (map == MAP_FAILED) {
+    error_set_strerror(error, "Could not map file");
+    return -1;
+  }
+  madvise(map, len, MADV_SEQUENTIAL);
+
+  /* tags are not frames, but not corrupt either */
+  start = 0;
+  tags_bounds_map(map, &start, &len, NULL);
+
+  scan_buffer(map + start, len - start, start, scan);
+  if (scan->seconds > 0)
+    scan->kbps = scan->bytes * 8 / scan->seconds / 1000;
+
+  munmap(map, st.st_size);
+  return 0;
+}
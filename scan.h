@@ -0,0 +1,9 @@
+#ifndef SCAN_H__
+#define SCAN_H__
+
+#include "maddec.h"
+#include "error.h"
+
+int scan_fd(int fd, mp3dec_scan_t *scan, mp3dec_error_t *error);
+
+#endif /* SCAN_H__ */
@@ -0,0 +1,425 @@
+/*
+ * pcm server sink
+ *
+ * Clients on the box connect to a listening socket and get the frames
+ * played from then on, as raw pcm or as a wav stream. Each frame is
+ * copied once into a ring shared by all clients, every client has a
+ * cursor into it. One thread serves all of them from epoll with non
+ * blocking sockets, gathering the frames a client is behind into a
+ * single send. A client that falls behind by more than the ring is
+ * disconnected.
+ */
+
+#define _GNU_SOURCE
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#ifdef __linux__
+#include <sys/epoll.h>
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "misc.h"
+#include "sink.h"
+
+#ifdef __linux__
+
+/* frames kept for the clients, about 1.5 seconds, and clients per
+   server */
+#define SERVER_RING     64
+#define SERVER_CLIENTS  1024
+
+/* socket buffer of a client, a client further behind than it and the
+   ring is disconnected */
+#define SERVER_SNDBUF   (64 * 1024)
+
+/* frames gathered into one send, and events handled per wakeup */
+#define SERVER_IOV      16
+#define SERVER_EVENTS   64
+
+/* epoll ids besides the clients */
+#define SERVER_ID_LISTEN  SERVER_CLIENTS
+#define SERVER_ID_WAKE    (SERVER_CLIENTS + 1)
+
+typedef struct server_frame_s {
+  unsigned char *data;
+  unsigned int len;
+} server_frame_t;
+
+typedef struct server_client_s {
+  int fd;                    /* -1 for a free slot */
+  unsigned long long frame;  /* next frame to send */
+  unsigned int offset;       /* of it already sent */
+  unsigned int header;       /* bytes of the wav header left to send */
+  int blocked;               /* the socket is full, wait for EPOLLOUT */
+} server_client_t;
+
+typedef struct server_s {
+  int listen_fd, epoll_fd;
+  int wake[2];
+  int wav;
+  pthread_t thread;
+  int stop;
+
+  pthread_mutex_t lock;
+  unsigned char *mem;
+  server_frame_t ring[SERVER_RING];
+  unsigned long long head;   /* frames put into the ring */
+  unsigned char header[SINK_WAV_HEADER];
+
+  server_client_t clients[SERVER_CLIENTS];
+  unsigned int nclients;
+  unsigned long evicted;
+
+  /* cpu time of the thread, and frames sent to a client */
+  unsigned long long cpu_usec;
+  unsigned long long sends;
+} server_t;
+
+static void server_close_client(server_t *server, server_client_t *client) {
+  close(client->fd);
+  client->fd = -1;
+  server->nclients--;
+}
+
+static void server_accept(server_t *server) {
+  struct epoll_event ev;
+  unsigned int i;
+  int fd, size = SERVER_SNDBUF;
+
+  for (;;) {
+    fd = accept4(server->listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (fd < 0)
+      return;
+    setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+
+    for (i = 0; i < SERVER_CLIENTS; i++)
+      if (server->clients[i].fd == -1)
+	break;
+    if (i == SERVER_CLIENTS) {
+      close(fd);
+      continue;
+    }
+
+    /* edge triggered, EPOLLOUT is only reported after a send filled
+       the socket */
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    ev.data.u32 = i;
+    if (epoll_ctl(server->epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+      close(fd);
+      continue;
+    }
+
+    server->clients[i].fd = fd;
+    server->clients[i].frame = server->head;
+    server->clients[i].offset = 0;
+    server->clients[i].header = server->wav ? SINK_WAV_HEADER : 0;
+    server->clients[i].blocked = 0;
+    server->nclients++;
+  }
+}
+
+/* send what the client is behind, called with the lock held */
+static void server_flush(server_t *server, server_client_t *client) {
+  struct iovec iov[SERVER_IOV + 1];
+  struct msghdr msg;
+  unsigned long long frame;
+  unsigned int n = 0;
+  ssize_t len;
+
+  if (client->frame + SERVER_RING < server->head) {
+    server->evicted++;
+    server_close_client(server, client);
+    return;
+  }
+  if (client->blocked)
+    return;
+
+  /* the header waits for the format of the first frame */
+  if (client->header > 0) {
+    if (server->head == 0)
+      return;
+    iov[n].iov_base = server->header + SINK_WAV_HEADER - client->header;
+    iov[n].iov_len = client->header;
+    n++;
+  }
+  for (frame = client->frame;
+       (frame < server->head) && (frame < client->frame + SERVER_IOV);
+       frame++) {
+    server_frame_t *f = &server->ring[frame % SERVER_RING];
+    unsigned int skip = (frame == client->frame) ? client->offset : 0;
+
+    iov[n].iov_base = f->data + skip;
+    iov[n].iov_len = f->len - skip;
+    n++;
+  }
+  if (n == 0)
+    return;
+
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = iov;
+  msg.msg_iovlen = n;
+  len = sendmsg(client->fd, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+  if (len < 0) {
+    if ((errno == EAGAIN) || (errno == EWOULDBLOCK))
+      client->blocked = 1;
+    else
+      server_close_client(server, client);
+    return;
+  }
+
+  if (client->header > 0) {
+    if ((size_t)len < client->header) {
+      client->header -= len;
+      client->blocked = 1;
+      return;
+    }
+    len -= client->header;
+    client->header = 0;
+  }
+  while ((len > 0) && (client->frame < server->head)) {
+    server_frame_t *f = &server->ring[client->frame % SERVER_RING];
+    unsigned int left = f->len - client->offset;
+
+    if ((size_t)len < left) {
+      client->offset += len;
+      client->blocked = 1;
+      return;
+    }
+    len -= left;
+    client->offset = 0;
+    client->frame++;
+    server->sends++;
+  }
+
+  /* stopped at SERVER_IOV frames, the socket may take more */
+  if (client->frame < server->head)
+    server_flush(server, client);
+}
+
+static void server_flush_all(server_t *server) {
+  unsigned int i;
+
+  for (i = 0; i < SERVER_CLIENTS; i++)
+    if (server->clients[i].fd != -1)
+      server_flush(server, &server->clients[i]);
+}
+
+/* clients are not expected to send anything, a read of 0 is the end */
+static void server_client_event(server_t *server, server_client_t *client,
+				unsigned int events) {
+  unsigned char buf[256];
+  ssize_t len;
+
+  if (events & (EPOLLERR | EPOLLHUP | EPOLLRDHUP)) {
+    server_close_client(server, client);
+    return;
+  }
+  if (events & EPOLLIN) {
+    while ((len = read(client->fd, buf, sizeof(buf))) > 0)
+      ;
+    if ((len == 0) || ((errno != EAGAIN) && (errno != EWOULDBLOCK))) {
+      server_close_client(server, client);
+      return;
+    }
+  }
+  if (events & EPOLLOUT) {
+    client->blocked = 0;
+    server_flush(server, client);
+  }
+}
+
+static void *server_thread(void *arg) {
+  server_t *server = arg;
+  struct epoll_event events[SERVER_EVENTS];
+  unsigned char buf[64];
+  int i, n;
+
+  for (;;) {
+    n = epoll_wait(server->epoll_fd, events, SERVER_EVENTS, -1);
+    if ((n < 0) && (errno != EINTR))
+      break;
+
+    pthread_mutex_lock(&server->lock);
+    if (server->stop) {
+      pthread_mutex_unlock(&server->lock);
+      break;
+    }
+    for (i = 0; i < n; i++) {
+      unsigned int id = events[i].data.u32;
+
+      if (id == SERVER_ID_LISTEN) {
+	server_accept(server);
+      } else if (id == SERVER_ID_WAKE) {
+	while (read(server->wake[0], buf, sizeof(buf)) > 0)
+	  ;
+	server_flush_all(server);
+      } else if (server->clients[id].fd != -1) {
+	server_client_event(server, &server->clients[id], events[i].events);
+      }
+    }
+    server->cpu_usec = unix_thread_cpu_usec();
+    pthread_mutex_unlock(&server->lock);
+  }
+
+  return NULL;
+}
+
+static void server_wakeup(server_t *server) {
+  unsigned char c = 0;
+
+  /* a full pipe already wakes the thread */
+  write(server->wake[1], &c, 1);
+}
+
+static int server_write(sink_t *sink, pcm_buffer_t *buf,
+			mp3dec_error_t *error) {
+  server_t *server = sink->priv;
+  server_frame_t *f;
+
+  pthread_mutex_lock(&server->lock);
+  if (server->head == 0)
+    sink_wav_header(server->header, buf, 0xffffffffUL);
+  f = &server->ring[server->head % SERVER_RING];
+  f->len = buf->length * buf->channels * pcm_format_width(buf->format);
+  memcpy(f->data, buf->data, f->len);
+  server->head++;
+  pthread_mutex_unlock(&server->lock);
+
+  server_wakeup(server);
+  return 0;
+}
+
+static void server_free(server_t *server) {
+  unsigned int i;
+
+  for (i = 0; i < SERVER_CLIENTS; i++)
+    if (server->clients[i].fd != -1)
+      close(server->clients[i].fd);
+  if (server->epoll_fd != -1)
+    close(server->epoll_fd);
+  if (server->wake[0] != -1) {
+    close(server->wake[0]);
+    close(server->wake[1]);
+  }
+  close(server->listen_fd);
+  pthread_mutex_destroy(&server->lock);
+  free(server->mem);
+  free(server);
+}
+
+static void server_close(sink_t *sink) {
+  server_t *server = sink->priv;
+
+  pthread_mutex_lock(&server->lock);
+  server->stop = 1;
+  pthread_mutex_unlock(&server->lock);
+  server_wakeup(server);
+  pthread_join(server->thread, NULL);
+  server_free(server);
+}
+
+static void server_stats(sink_t *sink, mp3dec_sink_status_t *status) {
+  server_t *server = sink->priv;
+
+  pthread_mutex_lock(&server->lock);
+  status->clients = server->nclients;
+  status->evicted = server->evicted;
+  if (server->sends > 0)
+    status->client_cpu_nsec = server->cpu_usec * 1000 / server->sends;
+  pthread_mutex_unlock(&server->lock);
+}
+
+static const sink_ops_t server_ops = {
+  server_write,
+  server_close,
+  server_stats
+};
+
+static int server_watch(server_t *server, int fd, unsigned int id) {
+  struct epoll_event ev;
+
+  ev.events = EPOLLIN;
+  ev.data.u32 = id;
+  return epoll_ctl(server->epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+int sink_start_server(sink_t *sink, int fd, pcm_pool_t *pool, int wav,
+		      mp3dec_error_t *error) {
+  server_t *server;
+  void *mem;
+  unsigned int i;
+
+  server = malloc(sizeof(*server));
+  if ((server == NULL) ||
+      (posix_memalign(&mem, PCM_CACHE_LINE,
+		      SERVER_RING * pool->buffer_size) != 0)) {
+    free(server);
+    close(fd);
+    error_set(error, "Could not allocate the server");
+    error_set_code(error, MP3DEC_ERR_NOMEM);
+    return -1;
+  }
+
+  memset(server, 0, sizeof(*server));
+  server->mem = mem;
+  for (i = 0; i < SERVER_RING; i++)
+    server->ring[i].data = server->mem + i * pool->buffer_size;
+  for (i = 0; i < SERVER_CLIENTS; i++)
+    server->clients[i].fd = -1;
+  server->listen_fd = fd;
+  server->wav = wav;
+  server->wake[0] = server->wake[1] = -1;
+  pthread_mutex_init(&server->lock, NULL);
+
+  server->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  if (server->epoll_fd < 0) {
+    error_set_strerror(error, "Could not create epoll instance");
+    goto error;
+  }
+  if (pipe2(server->wake, O_NONBLOCK | O_CLOEXEC) < 0) {
+    server->wake[0] = server->wake[1] = -1;
+    error_set_strerror(error, "Could not create wakeup pipe");
+    goto error;
+  }
+  if ((fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) < 0) ||
+      (server_watch(server, fd, SERVER_ID_LISTEN) < 0) ||
+      (server_watch(server, server->wake[0], SERVER_ID_WAKE) < 0)) {
+    error_set_strerror(error, "Could not watch the server sockets");
+    goto error;
+  }
+
+  if (pthread_create(&server->thread, NULL, server_thread, server) != 0) {
+    error_set(error, "Could not start the server thread");
+    goto error;
+  }
+
+  /* frames are dropped by the clients, not by the sink */
+  if (sink_start(sink, &server_ops, server, -1, pool,
+		 MP3DEC_DROP_OLDEST, error) < 0)
+    return -1;
+  return 0;
+
+ error:
+  server_free(server);
+  return -1;
+}
+
+#else
+
+int sink_start_server(sink_t *sink, int fd, pcm_pool_t *pool, int wav,
+		      mp3dec_error_t *error) {
+  close(fd);
+  error_set(error, "The server is not supported on this system");
+  return -1;
+}
+
+#endif
@@ -0,0 +1,305 @@
+/*
+ * fan-out of the played frames to sinks
+ *
+ * Every frame is converted once into a staging buffer of the pool.
+ * The output and each sink hold a reference to it instead of a copy,
+ * and it goes back to the pool when the last of them is done. Sinks
+ * write on their own threads from a short queue, so a slow one loses
+ * frames by its drop policy instead of holding up the output or the
+ * other sinks.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "misc.h"
+#include "sink.h"
+
+void sink_init(sink_t *sink) {
+  memset(sink, 0, sizeof(*sink));
+  sink->fd = -1;
+  error_reset(&sink->error);
+}
+
+int sink_is_running(sink_t *sink) {
+  return sink->running;
+}
+
+static void *sink_thread(void *arg) {
+  sink_t *sink = arg;
+  pcm_buffer_t *buf;
+  int ret;
+
+  pthread_mutex_lock(&sink->lock);
+  for (;;) {
+    while ((sink->count == 0) && !sink->stop)
+      pthread_cond_wait(&sink->cond, &sink->lock);
+    if (sink->stop)
+      break;
+
+    buf = sink->queue[sink->head];
+    sink->head = (sink->head + 1) % SINK_QUEUE;
+    sink->count--;
+    pthread_mutex_unlock(&sink->lock);
+
+    ret = sink->ops->write(sink, buf, &sink->error);
+    pcm_pool_put(sink->pool, buf);
+
+    pthread_mutex_lock(&sink->lock);
+    if (ret < 0) {
+      fprintf(stderr, "sink failed: %s\n", error_get(&sink->error));
+      sink->failed = 1;
+      while (sink->count > 0) {
+	pcm_pool_put(sink->pool, sink->queue[sink->head]);
+	sink->head = (sink->head + 1) % SINK_QUEUE;
+	sink->count--;
+      }
+      break;
+    }
+    sink->written++;
+  }
+  pthread_mutex_unlock(&sink->lock);
+
+  return NULL;
+}
+
+/* run a sink of the kind ops on its own thread. The sink owns fd and
+   priv from here on, also when an error is returned. */
+int sink_start(sink_t *sink, sink_ops_t const *ops, void *priv, int fd,
+	       pcm_pool_t *pool, mp3dec_drop_e policy, mp3dec_error_t *error) {
+  sink_init(sink);
+  sink->ops = ops;
+  sink->priv = priv;
+  sink->fd = fd;
+  sink->pool = pool;
+  sink->policy = policy;
+
+  pthread_mutex_init(&sink->lock, NULL);
+  pthread_cond_init(&sink->cond, NULL);
+  if (pthread_create(&sink->thread, NULL, sink_thread, sink) != 0) {
+    error_set(error, "Could not start the sink thread");
+    pthread_cond_destroy(&sink->cond);
+    pthread_mutex_destroy(&sink->lock);
+    sink->ops->close(sink);
+    sink_init(sink);
+    return -1;
+  }
+  sink->running = 1;
+  return 0;
+}
+
+/* queue buf for the sink, which takes its own reference. A full queue
+   loses its oldest or the new frame. Never blocks on the sink. */
+void sink_publish(sink_t *sink, pcm_buffer_t *buf) {
+  pcm_buffer_t *old = NULL;
+
+  pthread_mutex_lock(&sink->lock);
+  if (sink->failed) {
+    sink->dropped++;
+    pthread_mutex_unlock(&sink->lock);
+    return;
+  }
+
+  if (sink->count == SINK_QUEUE) {
+    sink->dropped++;
+    if (sink->policy == MP3DEC_DROP_NEWEST) {
+      pthread_mutex_unlock(&sink->lock);
+      return;
+    }
+    old = sink->queue[sink->head];
+    sink->head = (sink->head + 1) % SINK_QUEUE;
+    sink->count--;
+  }
+
+  pcm_buffer_ref(buf);
+  sink->queue[(sink->head + sink->count) % SINK_QUEUE] = buf;
+  sink->count++;
+  pthread_cond_signal(&sink->cond);
+  pthread_mutex_unlock(&sink->lock);
+
+  if (old != NULL)
+    pcm_pool_put(sink->pool, old);
+}
+
+void sink_stats(sink_t *sink, mp3dec_sink_status_t *status) {
+  memset(status, 0, sizeof(*status));
+  if (!sink->running)
+    return;
+
+  pthread_mutex_lock(&sink->lock);
+  status->active = 1;
+  status->failed = sink->failed;
+  status->written = sink->written;
+  status->dropped = sink->dropped;
+  status->queued = sink->count;
+  pthread_mutex_unlock(&sink->lock);
+
+  if (sink->ops->stats != NULL)
+    sink->ops->stats(sink, status);
+}
+
+/* stop the thread after the frame it is writing, the frames still
+   queued are dropped */
+void sink_stop(sink_t *sink) {
+  if (!sink->running)
+    return;
+
+  pthread_mutex_lock(&sink->lock);
+  sink->stop = 1;
+  pthread_cond_signal(&sink->cond);
+  pthread_mutex_unlock(&sink->lock);
+  pthread_join(sink->thread, NULL);
+
+  while (sink->count > 0) {
+    pcm_pool_put(sink->pool, sink->queue[sink->head]);
+    sink->head = (sink->head + 1) % SINK_QUEUE;
+    sink->count--;
+  }
+
+  sink->ops->close(sink);
+  pthread_cond_destroy(&sink->cond);
+  pthread_mutex_destroy(&sink->lock);
+  sink_init(sink);
+}
+
+/* descriptor sinks. A regular file gets a wav header, whose sizes are
+   filled in when the sink is stopped. The samples are written in host
+   byte order, which is what wav wants on the little endian machines
+   this runs on. */
+
+typedef struct sink_fd_s {
+  int wav;
+  int header;                /* written */
+  unsigned long long bytes;
+
+  /* of the header, a wav file cannot change its format */
+  unsigned int samplerate, channels;
+  mp3dec_format_e format;
+} sink_fd_t;
+
+static void sink_le16(unsigned char *p, unsigned int v) {
+  p[0] = v & 0xff;
+  p[1] = (v >> 8) & 0xff;
+}
+
+static void sink_le32(unsigned char *p, unsigned long v) {
+  p[0] = v & 0xff;
+  p[1] = (v >> 8) & 0xff;
+  p[2] = (v >> 16) & 0xff;
+  p[3] = (v >> 24) & 0xff;
+}
+
+/* a wav header for the frames of buf, with data bytes following */
+void sink_wav_header(unsigned char *h, pcm_buffer_t *buf,
+		     unsigned long data) {
+  unsigned int width = pcm_format_width(buf->format);
+  unsigned long riff = 0xffffffffUL;
+
+  /* streams that never end get the largest sizes there are */
+  if (data <= riff - (SINK_WAV_HEADER - 8))
+    riff = SINK_WAV_HEADER - 8 + data;
+
+  memcpy(h, "RIFF", 4);
+  sink_le32(h + 4, riff);
+  memcpy(h + 8, "WAVEfmt ", 8);
+  sink_le32(h + 16, 16);
+  sink_le16(h + 20, (buf->format == MP3DEC_FORMAT_FLOAT) ? 3 : 1);
+  sink_le16(h + 22, buf->channels);
+  sink_le32(h + 24, buf->samplerate);
+  sink_le32(h + 28, buf->samplerate * buf->channels * width);
+  sink_le16(h + 32, buf->channels * width);
+  sink_le16(h + 34, width * 8);
+  memcpy(h + 36, "data", 4);
+  sink_le32(h + 40, data);
+}
+
+static int sink_fd_write(sink_t *sink, pcm_buffer_t *buf,
+			 mp3dec_error_t *error) {
+  sink_fd_t *f = sink->priv;
+  unsigned int len = buf->length * buf->channels *
+    pcm_format_width(buf->format);
+
+  if (f->wav && !f->header) {
+    unsigned char h[SINK_WAV_HEADER];
+
+    sink_wav_header(h, buf, 0);
+    if (unix_write(sink->fd, h, sizeof(h)) != sizeof(h)) {
+      error_set_strerror(error, "Could not write the wav header");
+      return -1;
+    }
+    f->header = 1;
+    f->samplerate = buf->samplerate;
+    f->channels = buf->channels;
+    f->format = buf->format;
+  } else if (f->wav && ((buf->samplerate != f->samplerate) ||
+			(buf->channels != f->channels) ||
+			(buf->format != f->format))) {
+    error_printf(error, "The output changed to %u hz, %u channels, "
+		 "the wav file is %u hz, %u channels", buf->samplerate,
+		 buf->channels, f->samplerate, f->channels);
+    error_set_code(error, MP3DEC_ERR_STATE);
+    return -1;
+  }
+
+  if (unix_send(sink->fd, buf->data, len) != (int)len) {
+    error_set_strerror(error, "Could not write to the sink");
+    return -1;
+  }
+  f->bytes += len;
+  return 0;
+}
+
+static void sink_fd_close(sink_t *sink) {
+  sink_fd_t *f = sink->priv;
+  unsigned char size[4];
+
+  /* the sizes stop at 4 GiB, readers take the rest of the file as
+     data as they do for streams */
+  if (f->wav && f->header) {
+    unsigned long long riff = SINK_WAV_HEADER - 8 + f->bytes;
+    unsigned long long data = f->bytes;
+
+    if (riff > 0xffffffffULL)
+      riff = 0xffffffffULL;
+    if (data > 0xffffffffULL)
+      data = 0xffffffffULL;
+    sink_le32(size, riff);
+    pwrite(sink->fd, size, 4, 4);
+    sink_le32(size, data);
+    pwrite(sink->fd, size, 4, 40);
+  }
+  close(sink->fd);
+  free(f);
+}
+
+static const sink_ops_t sink_fd_ops = {
+  sink_fd_write,
+  sink_fd_close,
+  NULL
+};
+
+int sink_start_fd(sink_t *sink, int fd, pcm_pool_t *pool,
+		  mp3dec_drop_e policy, mp3dec_error_t *error) {
+  struct stat st;
+  sink_fd_t *f;
+
+  f = malloc(sizeof(*f));
+  if (f == NULL) {
+    error_set(error, "Could not allocate the sink");
+    error_set_code(error, MP3DEC_ERR_NOMEM);
+    close(fd);
+    return -1;
+  }
+  f->wav = (fstat(fd, &st) == 0) && S_ISREG(st.st_mode) &&
+    (lseek(fd, 0, SEEK_CUR) == 0);
+  f->header = 0;
+  f->bytes = 0;
+
+  return sink_start(sink, &sink_fd_ops, f, fd, pool, policy, error);
+}
@@ -0,0 +1,71 @@
+#ifndef SINK_H__
+#define SINK_H__
+
+#include <pthread.h>
+
+#include "maddec.h"
+#include "error.h"
+#include "pcm.h"
+
+/* sinks per player, and frames each one can fall behind the output */
+#define SINK_MAX    MP3DEC_STATUS_SINKS
+#define SINK_QUEUE  8
+
+struct sink_s;
+
+#define SINK_WAV_HEADER 44
+
+/* a kind of sink. write is called on the thread of the sink, close
+   after the thread has stopped. stats, if any, adds to the status of
+   the sink from the player. */
+typedef struct sink_ops_s {
+  int  (*write)(struct sink_s *sink, pcm_buffer_t *buf, mp3dec_error_t *error);
+  void (*close)(struct sink_s *sink);
+  void (*stats)(struct sink_s *sink, mp3dec_sink_status_t *status);
+} sink_ops_t;
+
+/* a consumer of the frames played, on its own thread. Frames are
+   shared with the output through their references, a sink that does
+   not keep up loses frames by its drop policy. */
+typedef struct sink_s {
+  sink_ops_t const *ops;
+  void *priv;                /* of the kind of sink */
+  int fd;
+  mp3dec_drop_e policy;
+  pcm_pool_t *pool;
+
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  int running;
+  int stop;
+
+  pcm_buffer_t *queue[SINK_QUEUE];
+  unsigned int head, count;
+
+  unsigned long written;
+  unsigned long dropped;
+  int failed;                /* write failed, the sink only drops now */
+  mp3dec_error_t error;
+} sink_t;
+
+void sink_init(sink_t *sink);
+int  sink_start(sink_t *sink, sink_ops_t const *ops, void *priv, int fd,
+		pcm_pool_t *pool, mp3dec_drop_e policy, mp3dec_error_t *error);
+int  sink_is_running(sink_t *sink);
+void sink_publish(sink_t *sink, pcm_buffer_t *buf);
+void sink_stats(sink_t *sink, mp3dec_sink_status_t *status);
+void sink_stop(sink_t *sink);
+
+void sink_wav_header(unsigned char *h, pcm_buffer_t *buf,
+		     unsigned long data);
+
+/* raw pcm to a pipe or socket, a wav file to a regular file */
+int  sink_start_fd(sink_t *sink, int fd, pcm_pool_t *pool,
+		   mp3dec_drop_e policy, mp3dec_error_t *error);
+
+/* clients accepted on the listening socket fd, see server.c */
+int  sink_start_server(sink_t *sink, int fd, pcm_pool_t *pool, int wav,
+		       mp3dec_error_t *error);
+
+#endif /* SINK_H__ */
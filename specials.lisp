@@ -17,7 +17,7 @@ libmp3dec.so")
 (defvar *shared-library-drive-letters* '("C" "D" "E" "F" "G")
   "The list of drive letters (used by Wintendo) used when looking for
 libmp3dec.so.")
-(defvar *mp3dec-supporting-libraries* '("c" "m" "mp3lame")
+(defvar *mp3dec-supporting-libraries* '("c" "m" "mad")
   "The libraries which are needed by libmp3dec.so. Only needed for
 Python-based Lisps like CMUCL, SBCL, or SCL.")
 
@@ -0,0 +1,229 @@
+/*
+ * synchronous push/pull decoding in the calling thread
+ *
+ * mp3 data is pushed into a fixed buffer, pcm is pulled into buffers
+ * owned by the caller. Nothing is allocated after mp3dec_stream_new.
+ */
+
+#include <sys/types.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <mad.h>
+
+#include "maddec.h"
+#include "error.h"
+#include "pcm.h"
+
+#define STREAM_BUF_SIZE (16 * 1024)
+
+#define min(a, b) ((a) < (b) ? (a) : (b))
+
+struct mp3dec_stream_s {
+  struct mad_stream stream;
+  struct mad_frame  frame;
+  struct mad_synth  synth;
+
+  unsigned char buf[STREAM_BUF_SIZE + MAD_BUFFER_GUARD];
+  unsigned long len;
+  int eof;
+
+  /* next sample of synth.pcm to hand out */
+  unsigned int pcm_pos;
+  mad_fixed_t gain;
+
+  mp3dec_error_t error;
+};
+
+static void mp3dec_stream_init(mp3dec_stream_t *stream) {
+  mad_stream_init(&stream->stream);
+  mad_frame_init(&stream->frame);
+  mad_synth_init(&stream->synth);
+  stream->synth.pcm.length = 0;
+  stream->synth.pcm.channels = 0;
+  stream->synth.pcm.samplerate = 0;
+
+  stream->len = 0;
+  stream->eof = 0;
+  stream->pcm_pos = 0;
+  stream->gain = MAD_F_ONE;
+  error_reset(&stream->error);
+}
+
+static void mp3dec_stream_finish_mad(mp3dec_stream_t *stream) {
+  mad_synth_finish(&stream->synth);
+  mad_frame_finish(&stream->frame);
+  mad_stream_finish(&stream->stream);
+}
+
+mp3dec_stream_t *mp3dec_stream_new(void) {
+  mp3dec_stream_t *stream = malloc(sizeof(mp3dec_stream_t));
+  if (stream == NULL)
+    return NULL;
+
+  mp3dec_stream_init(stream);
+  return stream;
+}
+
+void mp3dec_stream_delete(mp3dec_stream_t *stream) {
+  mp3dec_stream_finish_mad(stream);
+  free(stream);
+}
+
+/* drop all buffered data and decoder state, to start a new file */
+void mp3dec_stream_reset(mp3dec_stream_t *stream) {
+  mp3dec_stream_finish_mad(stream);
+  mp3dec_stream_init(stream);
+}
+
+/* move the undecoded bytes to the start of the buffer and hand the
+   buffer to libmad again */
+static void mp3dec_stream_compact(mp3dec_stream_t *stream) {
+  if (stream->stream.buffer != NULL) {
+    unsigned long used = stream->stream.next_frame - stream->buf;
+    if (used > 0) {
+      memmove(stream->buf, stream->buf + used, stream->len - used);
+      stream->len -= used;
+    }
+  }
+  mad_stream_buffer(&stream->stream, stream->buf, stream->len);
+}
+
+/* returns the number of bytes taken, which is less than len when the
+   buffer is full. Pull pcm and push the rest again. */
+long mp3dec_stream_push(mp3dec_stream_t *stream,
+			unsigned char *data, unsigned long len) {
+  unsigned long n;
+
+  if (stream->eof) {
+    error_set(&stream->error, "Cannot push data after the end of the stream");
+    error_set_code(&stream->error, MP3DEC_ERR_STATE);
+    return -1;
+  }
+
+  mp3dec_stream_compact(stream);
+  n = min(len, STREAM_BUF_SIZE - stream->len);
+  memcpy(stream->buf + stream->len, data, n);
+  stream->len += n;
+  mad_stream_buffer(&stream->stream, stream->buf, stream->len);
+
+  return n;
+}
+
+/* no more data will be pushed, pad the buffer so that the last frame
+   can be decoded */
+int mp3dec_stream_finish(mp3dec_stream_t *stream) {
+  if (stream->eof)
+    return 0;
+
+  mp3dec_stream_compact(stream);
+  memset(stream->buf + stream->len, 0, MAD_BUFFER_GUARD);
+  stream->len += MAD_BUFFER_GUARD;
+  mad_stream_buffer(&stream->stream, stream->buf, stream->len);
+  stream->eof = 1;
+
+  return 0;
+}
+
+/* decode the next frame, returns 0 when more data is needed */
+static int mp3dec_stream_decode(mp3dec_stream_t *stream) {
+  if (stream->stream.buffer == NULL)
+    return 0;
+
+  for (;;) {
+    if (mad_frame_decode(&stream->frame, &stream->stream) == 0)
+      break;
+
+    if (MAD_RECOVERABLE(stream->stream.error))
+      continue;
+    else if (stream->stream.error == MAD_ERROR_BUFLEN)
+      return 0;
+
+    error_printf(&stream->error, "Unrecoverable decoder error 0x%04x (%s)",
+		 stream->stream.error, mad_stream_errorstr(&stream->stream));
+    error_set_code(&stream->error, MP3DEC_ERR_DECODE);
+    return -1;
+  }
+
+  mad_synth_frame(&stream->synth, &stream->frame);
+  stream->pcm_pos = 0;
+
+  return 1;
+}
+
+/*
+ * Write up to max_samples interleaved samples to pcm_out, and return
+ * the number of samples written. 0 means that more data has to be
+ * pushed (or that the stream is over after mp3dec_stream_finish).
+ * A call never mixes samples of different sample rates or channel
+ * counts, check mp3dec_stream_format after each call.
+ */
+long mp3dec_stream_pull(mp3dec_stream_t *stream, void *pcm_out,
+			unsigned long max_samples, mp3dec_format_e format) {
+  struct mad_pcm *pcm = &stream->synth.pcm;
+  unsigned int width = pcm_format_width(format);
+  unsigned char *ptr = pcm_out;
+  unsigned long written = 0;
+  unsigned int samplerate = 0, channels = 0;
+
+  if (width == 0) {
+    error_set(&stream->error, "Unknown pcm format");
+    error_set_code(&stream->error, MP3DEC_ERR_INVALID);
+    return -1;
+  }
+
+  for (;;) {
+    if (stream->pcm_pos < pcm->length) {
+      unsigned long count;
+
+      if ((written > 0) &&
+	  ((pcm->samplerate != samplerate) || (pcm->channels != channels)))
+	break;
+      samplerate = pcm->samplerate;
+      channels = pcm->channels;
+
+      count = min(pcm->length - stream->pcm_pos,
+		  (max_samples - written) / channels);
+      if (count == 0)
+	break;
+
+      pcm_convert(pcm, stream->pcm_pos, count, stream->gain, format, ptr);
+      stream->pcm_pos += count;
+      written += count * channels;
+      ptr += count * channels * width;
+      continue;
+    }
+
+    switch (mp3dec_stream_decode(stream)) {
+    case -1:
+      return -1;
+    case 0:
+      return written;
+    }
+  }
+
+  return written;
+}
+
+/* scale the pulled samples by gain_db, limited so that peak does not
+   clip, until the next reset */
+void mp3dec_stream_set_replaygain(mp3dec_stream_t *stream,
+				  float gain_db, float peak) {
+  stream->gain = pcm_gain(gain_db, peak);
+}
+
+/* format of the samples returned by the last pull */
+void mp3dec_stream_format(mp3dec_stream_t *stream,
+			  unsigned int *samplerate, unsigned int *channels) {
+  *samplerate = stream->synth.pcm.samplerate;
+  *channels = stream->synth.pcm.channels;
+}
+
+char *mp3dec_stream_error(mp3dec_stream_t *stream) {
+  return error_get(&stream->error);
+}
+
+mp3dec_errcode_e mp3dec_stream_error_code(mp3dec_stream_t *stream) {
+  return error_code(&stream->error);
+}
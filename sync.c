@@ -0,0 +1,155 @@
+/*
+ * frame sync search
+ *
+ * libmad looks for the 11 bit sync word one byte at a time, and every
+ * false sync word in garbage costs a failed header decode. Here the
+ * sync words are found 16 bytes at a time, and a candidate only counts
+ * when its header is valid and the header of the next frame matches.
+ */
+
+#include <string.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "sync.h"
+
+/* kbps by [lsf][layer - 1][index] */
+static const unsigned short sync_bitrates[2][3][15] = {
+  { { 0, 32, 64, 96, 128, 160, 192, 224, 256, 288, 320, 352, 384, 416, 448 },
+    { 0, 32, 48, 56, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320, 384 },
+    { 0, 32, 40, 48, 56, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320 } },
+  { { 0, 32, 48, 56, 64, 80, 96, 112, 128, 144, 160, 176, 192, 224, 256 },
+    { 0, 8, 16, 24, 32, 40, 48, 56, 64, 80, 96, 112, 128, 144, 160 },
+    { 0, 8, 16, 24, 32, 40, 48, 56, 64, 80, 96, 112, 128, 144, 160 } }
+};
+
+static const unsigned int sync_samplerates[3] = { 44100, 48000, 32000 };
+
+/* offset of the first possible sync word in buf, or -1 */
+long sync_find(unsigned char const *buf, unsigned long len) {
+  unsigned long i = 0;
+
+  if (len < 2)
+    return -1;
+
+#ifdef __SSE2__
+  {
+    const __m128i ff = _mm_set1_epi8((char)0xff);
+    const __m128i e0 = _mm_set1_epi8((char)0xe0);
+
+    /* a sync word starts at i if buf[i] is 0xff and buf[i + 1] has the
+       top three bits set */
+    for (; i + 17 <= len; i += 16) {
+      __m128i a = _mm_loadu_si128((__m128i const *)(buf + i));
+      __m128i b = _mm_loadu_si128((__m128i const *)(buf + i + 1));
+      int mask = _mm_movemask_epi8(_mm_and_si128(
+	_mm_cmpeq_epi8(a, ff),
+	_mm_cmpeq_epi8(_mm_and_si128(b, e0), e0)));
+
+      if (mask)
+	return i + __builtin_ctz(mask);
+    }
+  }
+#endif
+
+  for (; i + 1 < len; i++) {
+    if ((buf[i] == 0xff) && ((buf[i + 1] & 0xe0) == 0xe0))
+      return i;
+  }
+  return -1;
+}
+
+/* bytes of the frame whose header is at p, 0 if the header is invalid
+   and 1 for free format */
+unsigned int sync_frame_length(unsigned char const *p) {
+  unsigned int version, layer, index, sr_index, lsf;
+  unsigned int bitrate, samplerate, pad;
+
+  if ((p[0] != 0xff) || ((p[1] & 0xe0) != 0xe0))
+    return 0;
+
+  version = (p[1] >> 3) & 3;         /* 0 is MPEG 2.5, 1 reserved */
+  layer = 4 - ((p[1] >> 1) & 3);     /* 4 is reserved */
+  index = p[2] >> 4;
+  sr_index = (p[2] >> 2) & 3;
+  pad = (p[2] >> 1) & 1;
+
+  if ((version == 1) || (layer == 4) || (index == 15) || (sr_index == 3) ||
+      ((p[3] & 3) == 2))
+    return 0;
+  if (index == 0)
+    return 1;
+
+  lsf = (version != 3);
+  bitrate = sync_bitrates[lsf][layer - 1][index] * 1000;
+  samplerate = sync_samplerates[sr_index];
+  if (lsf)
+    samplerate /= 2;
+  if (version == 0)
+    samplerate /= 2;
+
+  if (layer == 1)
+    return (12 * bitrate / samplerate + pad) * 4;
+  return ((((layer == 3) && lsf) ? 72 : 144) * bitrate / samplerate) + pad;
+}
+
+/* samples per channel of the frame whose header at p is valid */
+unsigned int sync_frame_samples(unsigned char const *p) {
+  unsigned int version = (p[1] >> 3) & 3;
+  unsigned int layer = 4 - ((p[1] >> 1) & 3);
+
+  if (layer == 1)
+    return 384;
+  if ((layer == 3) && (version != 3))
+    return 576;
+  return 1152;
+}
+
+/* and its samplerate */
+unsigned int sync_frame_samplerate(unsigned char const *p) {
+  unsigned int version = (p[1] >> 3) & 3;
+  unsigned int samplerate = sync_samplerates[(p[2] >> 2) & 3];
+
+  if (version != 3)
+    samplerate /= 2;
+  if (version == 0)
+    samplerate /= 2;
+  return samplerate;
+}
+
+/* version, layer and samplerate stay the same within a stream */
+#define SYNC_STREAM_MASK 0xfffe0c00UL
+
+static unsigned long sync_word(unsigned char const *p) {
+  return ((unsigned long)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+/* whether the headers at p and q are of the same stream */
+int sync_match(unsigned char const *p, unsigned char const *q) {
+  return (sync_word(p) & SYNC_STREAM_MASK) == (sync_word(q) & SYNC_STREAM_MASK);
+}
+
+/* whether the len bytes at p start with a frame */
+sync_result_e sync_check(unsigned char const *p, unsigned long len) {
+  unsigned int flen;
+
+  if (len < 4)
+    return SYNC_SHORT;
+
+  flen = sync_frame_length(p);
+  if (flen == 0)
+    return SYNC_INVALID;
+  if (flen == 1)
+    return SYNC_FREE;
+
+  if (flen + 4 > len)
+    return SYNC_SHORT;
+  if ((sync_frame_length(p + flen) < 2) ||
+      ((sync_word(p) & SYNC_STREAM_MASK) !=
+       (sync_word(p + flen) & SYNC_STREAM_MASK)))
+    return SYNC_INVALID;
+
+  return SYNC_VALID;
+}
@@ -0,0 +1,19 @@
+#ifndef SYNC_H__
+#define SYNC_H__
+
+/* result of sync_check */
+typedef enum {
+  SYNC_VALID = 0,   /* a header, followed by a matching one */
+  SYNC_INVALID,
+  SYNC_SHORT,       /* the next header is not in the buffer yet */
+  SYNC_FREE         /* free format, the length is not in the header */
+} sync_result_e;
+
+long sync_find(unsigned char const *buf, unsigned long len);
+unsigned int sync_frame_length(unsigned char const *p);
+unsigned int sync_frame_samples(unsigned char const *p);
+unsigned int sync_frame_samplerate(unsigned char const *p);
+sync_result_e sync_check(unsigned char const *p, unsigned long len);
+int sync_match(unsigned char const *p, unsigned char const *q);
+
+#endif /* SYNC_H__ */
@@ -0,0 +1,711 @@
+/*
+ * tags before and after the audio
+ *
+ * ID3v2 tags at the start, and APEv2, ID3v1 and appended ID3v2 tags
+ * at the end are found from their headers and footers alone, so that
+ * decoding starts at the first frame however large the cover art is.
+ * The text frames of the ID3 tags are picked up on the way, other
+ * frames are skipped without being read.
+ *
+ * Regular files go through a cache of the files loaded last, keyed by
+ * their identity, so that loading a file again reads no tags at all.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "misc.h"
+#include "tags.h"
+
+#define TAGS_ID3V2_HEADER  10
+#define TAGS_ID3V1_SIZE    128
+#define TAGS_APE_FOOTER    32
+
+/* the same tag is not looked for more than a few times in a row */
+#define TAGS_MAX           8
+
+/* frames are parsed out of a window of the file, text frames are
+   only read up to TAGS_TEXT_MAX bytes */
+#define TAGS_WINDOW        4096
+#define TAGS_TEXT_MAX      512
+
+#define TAGS_CACHE_SIZE    128
+#define TAGS_CACHE_BUCKETS 64
+
+/* the times of a stat with nanoseconds */
+#ifdef __APPLE__
+#define TAGS_ST_MTIM(st) ((st)->st_mtimespec)
+#define TAGS_ST_CTIM(st) ((st)->st_ctimespec)
+#else
+#define TAGS_ST_MTIM(st) ((st)->st_mtim)
+#define TAGS_ST_CTIM(st) ((st)->st_ctim)
+#endif
+
+/* the file is read either through a mapping or with pread */
+typedef struct tags_reader_s {
+  int fd;
+  unsigned char const *map;
+
+  unsigned char window[TAGS_WINDOW];
+  unsigned long win_offset, win_len;
+} tags_reader_t;
+
+static void tags_reader_init(tags_reader_t *reader, int fd,
+			     unsigned char const *map) {
+  reader->fd = fd;
+  reader->map = map;
+  reader->win_offset = 0;
+  reader->win_len = 0;
+}
+
+/* len bytes at offset, read up to limit at once, or NULL */
+static unsigned char const *tags_peek(tags_reader_t *reader,
+				      unsigned long offset, unsigned long len,
+				      unsigned long limit) {
+  unsigned long want;
+  int ret;
+
+  if ((len > TAGS_WINDOW) || (offset + len > limit))
+    return NULL;
+  if (reader->map != NULL)
+    return reader->map + offset;
+
+  if ((offset >= reader->win_offset) &&
+      (offset + len <= reader->win_offset + reader->win_len))
+    return reader->window + (offset - reader->win_offset);
+
+  want = limit - offset;
+  if (want > TAGS_WINDOW)
+    want = TAGS_WINDOW;
+  ret = unix_pread(reader->fd, reader->window, want, offset);
+  if (ret < 0) {
+    reader->win_len = 0;
+    return NULL;
+  }
+  reader->win_offset = offset;
+  reader->win_len = ret;
+  if ((unsigned long)ret < len)
+    return NULL;
+  return reader->window;
+}
+
+static int tags_read(tags_reader_t *reader, unsigned char *buf,
+		     unsigned int len, unsigned long offset) {
+  if (reader->map != NULL) {
+    memcpy(buf, reader->map + offset, len);
+    return 0;
+  }
+  return (unix_pread(reader->fd, buf, len, offset) == len) ? 0 : -1;
+}
+
+static unsigned long tags_syncsafe(unsigned char const *p) {
+  return ((unsigned long)p[0] << 21) | (p[1] << 14) | (p[2] << 7) | p[3];
+}
+
+static unsigned long tags_be32(unsigned char const *p) {
+  return ((unsigned long)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+static unsigned long tags_le32(unsigned char const *p) {
+  return (unsigned long)p[0] | (p[1] << 8) | (p[2] << 16) |
+    ((unsigned long)p[3] << 24);
+}
+
+/* size of the ID3v2 tag with header h, 0 if h is none. With the
+   unsynchronisation flag the size already counts the inserted bytes,
+   a v2.4 footer adds another 10 bytes. */
+static unsigned long tags_id3v2_size(unsigned char const *h,
+				     char const *magic) {
+  unsigned long size;
+
+  if (memcmp(h, magic, 3) || (h[3] < 2) || (h[3] > 4) || (h[4] == 0xff) ||
+      ((h[6] | h[7] | h[8] | h[9]) & 0x80))
+    return 0;
+  size = tags_syncsafe(h + 6);
+
+  size += TAGS_ID3V2_HEADER;
+  if ((h[3] == 4) && (h[5] & 0x10))
+    size += TAGS_ID3V2_HEADER;
+  return size;
+}
+
+/* size of the APEv2 tag with footer f, 0 if f is none. The size in
+   the footer does not count the header. */
+static unsigned long tags_ape_size(unsigned char const *f) {
+  unsigned long size;
+
+  if (memcmp(f, "APETAGEX", 8))
+    return 0;
+  size = tags_le32(f + 12);
+  if (size < TAGS_APE_FOOTER)
+    return 0;
+  if (tags_le32(f + 20) & 0x80000000UL)
+    size += TAGS_APE_FOOTER;
+  return size;
+}
+
+/* append the code point c to the utf-8 string dst of size bytes,
+   0 if it does not fit */
+static int tags_put(char *dst, unsigned int size, unsigned int *len,
+		    unsigned long c) {
+  unsigned char *p = (unsigned char *)dst + *len;
+  unsigned int n = (c < 0x80) ? 1 : (c < 0x800) ? 2 : (c < 0x10000) ? 3 : 4;
+
+  if (*len + n >= size)
+    return 0;
+  switch (n) {
+  case 1:
+    p[0] = c;
+    break;
+  case 2:
+    p[0] = 0xc0 | (c >> 6);
+    p[1] = 0x80 | (c & 0x3f);
+    break;
+  case 3:
+    p[0] = 0xe0 | (c >> 12);
+    p[1] = 0x80 | ((c >> 6) & 0x3f);
+    p[2] = 0x80 | (c & 0x3f);
+    break;
+  default:
+    p[0] = 0xf0 | (c >> 18);
+    p[1] = 0x80 | ((c >> 12) & 0x3f);
+    p[2] = 0x80 | ((c >> 6) & 0x3f);
+    p[3] = 0x80 | (c & 0x3f);
+    break;
+  }
+  *len += n;
+  return 1;
+}
+
+/* next code point of a utf-8 string, invalid bytes become '?' */
+static unsigned long tags_utf8(unsigned char const **p,
+			       unsigned char const *end) {
+  unsigned char const *s = *p;
+  unsigned long c = *s++;
+  unsigned int n = 0;
+
+  if (c >= 0xf0)
+    n = 3, c &= 0x07;
+  else if (c >= 0xe0)
+    n = 2, c &= 0x0f;
+  else if (c >= 0xc0)
+    n = 1, c &= 0x1f;
+  else if (c >= 0x80)
+    c = '?';
+
+  for (; n > 0; n--) {
+    if ((s == end) || ((*s & 0xc0) != 0x80)) {
+      c = '?';
+      break;
+    }
+    c = (c << 6) | (*s++ & 0x3f);
+  }
+  *p = s;
+  return c;
+}
+
+/* convert an ID3v2 text in encoding enc (latin-1, utf-16 with BOM,
+   utf-16be, utf-8) to utf-8, up to the first NUL. Only the first of
+   several values is kept, and trailing spaces are dropped. */
+static void tags_text(char *dst, unsigned int size, unsigned int enc,
+		      unsigned char const *p, unsigned long len) {
+  unsigned char const *end = p + len;
+  unsigned int out = 0;
+  int big_endian = (enc == 2);
+
+  if ((enc == 1) && (len >= 2)) {
+    if ((p[0] == 0xfe) && (p[1] == 0xff))
+      big_endian = 1, p += 2;
+    else if ((p[0] == 0xff) && (p[1] == 0xfe))
+      p += 2;
+  }
+
+  while (p < end) {
+    unsigned long c;
+
+    switch (enc) {
+    case 1:
+    case 2:
+      if (end - p < 2)
+	goto done;
+      c = big_endian ? (p[0] << 8) | p[1] : p[0] | (p[1] << 8);
+      p += 2;
+      if ((c >= 0xd800) && (c < 0xdc00) && (end - p >= 2)) {
+	unsigned long lo = big_endian ? (p[0] << 8) | p[1] : p[0] | (p[1] << 8);
+	if ((lo >= 0xdc00) && (lo < 0xe000)) {
+	  c = 0x10000 + ((c - 0xd800) << 10) + (lo - 0xdc00);
+	  p += 2;
+	}
+      }
+      if ((c >= 0xd800) && (c < 0xe000))
+	c = '?';
+      break;
+    case 3:
+      c = tags_utf8(&p, end);
+      break;
+    default:
+      c = *p++;
+      break;
+    }
+
+    if ((c == 0) || !tags_put(dst, size, &out, c))
+      break;
+  }
+
+ done:
+  while ((out > 0) && (dst[out - 1] == ' '))
+    out--;
+  dst[out] = '\0';
+}
+
+/* text frames that go into the metadata, by ID3v2.2 and later id */
+static const struct {
+  char id22[4];
+  char id[5];
+  size_t offset;
+  size_t size;
+} tags_frames[] = {
+  { "TT2", "TIT2", offsetof(mp3dec_metadata_t, title),
+    MP3DEC_METADATA_TEXT },
+  { "TP1", "TPE1", offsetof(mp3dec_metadata_t, artist),
+    MP3DEC_METADATA_TEXT },
+  { "TAL", "TALB", offsetof(mp3dec_metadata_t, album),
+    MP3DEC_METADATA_TEXT },
+  { "TCO", "TCON", offsetof(mp3dec_metadata_t, genre),
+    MP3DEC_METADATA_TEXT },
+  { "TYE", "TYER", offsetof(mp3dec_metadata_t, date),
+    MP3DEC_METADATA_SHORT },
+  { "TYE", "TDRC", offsetof(mp3dec_metadata_t, date),
+    MP3DEC_METADATA_SHORT },
+  { "TRK", "TRCK", offsetof(mp3dec_metadata_t, track),
+    MP3DEC_METADATA_SHORT }
+};
+
+/* the field of frame id that is still empty, or NULL */
+static char *tags_field(mp3dec_metadata_t *metadata, unsigned int version,
+			unsigned char const *id, size_t *size) {
+  unsigned int i;
+
+  for (i = 0; i < sizeof(tags_frames) / sizeof(tags_frames[0]); i++) {
+    char *field;
+
+    if ((version == 2) ? memcmp(id, tags_frames[i].id22, 3) :
+	memcmp(id, tags_frames[i].id, 4))
+      continue;
+    field = (char *)metadata + tags_frames[i].offset;
+    if (field[0] != '\0')
+      return NULL;
+    *size = tags_frames[i].size;
+    return field;
+  }
+  return NULL;
+}
+
+/* the text frames of the ID3v2 tag of size bytes at offset. Tags
+   unsynchronised as a whole before v2.4 are left out, as their frame
+   sizes do not count the inserted bytes. */
+static void tags_id3v2_parse(tags_reader_t *reader, unsigned long offset,
+			     unsigned long size, mp3dec_metadata_t *metadata) {
+  unsigned char text[TAGS_TEXT_MAX];
+  unsigned char const *p;
+  unsigned long pos, end, fsize;
+  unsigned int version, flags, hlen;
+
+  end = offset + size;
+  p = tags_peek(reader, offset, TAGS_ID3V2_HEADER, end);
+  if (p == NULL)
+    return;
+  version = p[3];
+  flags = p[5];
+  if ((version == 4) && (flags & 0x10))
+    end -= TAGS_ID3V2_HEADER;
+  if ((version < 4) && (flags & 0x80))
+    return;
+
+  pos = offset + TAGS_ID3V2_HEADER;
+  if (flags & 0x40) {
+    /* compression in v2.2 */
+    if (version == 2)
+      return;
+    p = tags_peek(reader, pos, 4, end);
+    if (p == NULL)
+      return;
+    pos += (version == 3) ? 4 + tags_be32(p) : tags_syncsafe(p);
+  }
+
+  hlen = (version == 2) ? 6 : 10;
+  while (pos + hlen <= end) {
+    unsigned long skip = 0, len, i, j;
+    unsigned int fflags = 0;
+    size_t field_size;
+    char *field;
+
+    p = tags_peek(reader, pos, hlen, end);
+    if ((p == NULL) || (p[0] == 0))   /* padding */
+      break;
+    if (version == 2)
+      fsize = (p[3] << 16) | (p[4] << 8) | p[5];
+    else if (version == 3)
+      fsize = tags_be32(p + 4);
+    else
+      fsize = tags_syncsafe(p + 4);
+    if (version > 2)
+      fflags = p[9];
+    field = tags_field(metadata, version, p, &field_size);
+    pos += hlen;
+    if (fsize > end - pos)
+      break;
+
+    /* compressed or encrypted frames are not decoded, grouping and
+       the data length come before the text */
+    if ((version == 3) && (fflags & 0xc0))
+      field = NULL;
+    if ((version == 4) && (fflags & 0x0c))
+      field = NULL;
+    if ((version == 3) && (fflags & 0x20))
+      skip++;
+    if ((version == 4) && (fflags & 0x40))
+      skip++;
+    if ((version == 4) && (fflags & 0x01))
+      skip += 4;
+
+    if ((field != NULL) && (fsize > skip + 1)) {
+      len = fsize - skip;
+      if (len > TAGS_TEXT_MAX)
+	len = TAGS_TEXT_MAX;
+      p = tags_peek(reader, pos + skip, len, end);
+      if (p != NULL) {
+	/* v2.4 frames are unsynchronised one by one */
+	for (i = j = 0; i < len; i++) {
+	  text[j++] = p[i];
+	  if ((version == 4) && (fflags & 0x02) && (p[i] == 0xff) &&
+	      (i + 1 < len) && (p[i + 1] == 0))
+	    i++;
+	}
+	tags_text(field, field_size, text[0], text + 1, j - 1);
+      }
+    }
+    pos += fsize;
+  }
+}
+
+/* an ID3v1 field, space or NUL padded latin-1 */
+static void tags_id3v1_text(char *dst, unsigned int size,
+			    unsigned char const *p, unsigned long len) {
+  if (dst[0] == '\0')
+    tags_text(dst, size, 0, p, len);
+}
+
+/* the ID3v1 tag at offset fills in what the ID3v2 tags left empty.
+   The genre is only a number there, it is given as "(n)" like the
+   references to it in ID3v2.3 genres. */
+static void tags_id3v1_parse(tags_reader_t *reader, unsigned long offset,
+			     mp3dec_metadata_t *metadata) {
+  unsigned char const *p;
+
+  p = tags_peek(reader, offset, TAGS_ID3V1_SIZE, offset + TAGS_ID3V1_SIZE);
+  if (p == NULL)
+    return;
+
+  tags_id3v1_text(metadata->title, sizeof(metadata->title), p + 3, 30);
+  tags_id3v1_text(metadata->artist, sizeof(metadata->artist), p + 33, 30);
+  tags_id3v1_text(metadata->album, sizeof(metadata->album), p + 63, 30);
+  tags_id3v1_text(metadata->date, sizeof(metadata->date), p + 93, 4);
+  /* ID3v1.1 puts the track number at the end of the comment */
+  if ((metadata->track[0] == '\0') && (p[125] == 0) && (p[126] != 0))
+    snprintf(metadata->track, sizeof(metadata->track), "%u", p[126]);
+  if ((metadata->genre[0] == '\0') && (p[127] != 0xff))
+    snprintf(metadata->genre, sizeof(metadata->genre), "(%u)", p[127]);
+}
+
+static void tags_bounds(tags_reader_t *reader,
+			unsigned long *start, unsigned long *end,
+			mp3dec_metadata_t *metadata) {
+  unsigned char buf[TAGS_APE_FOOTER];
+  unsigned long s = *start, e = *end, size, id3v1 = 0;
+  int i, has_id3v1 = 0;
+
+  if (metadata != NULL)
+    memset(metadata, 0, sizeof(*metadata));
+
+  /* tags at the start, sometimes more than one */
+  for (i = 0; i < TAGS_MAX; i++) {
+    if ((e - s < TAGS_ID3V2_HEADER) ||
+	(tags_read(reader, buf, TAGS_ID3V2_HEADER, s) < 0))
+      break;
+    size = tags_id3v2_size(buf, "ID3");
+    if ((size != 0) && (size <= e - s) && (metadata != NULL))
+      tags_id3v2_parse(reader, s, size, metadata);
+    if ((size == 0) && (e - s >= TAGS_APE_FOOTER) &&
+	(tags_read(reader, buf, TAGS_APE_FOOTER, s) == 0) &&
+	!memcmp(buf, "APETAGEX", 8))
+      size = tags_le32(buf + 12) + TAGS_APE_FOOTER;
+    if ((size == 0) || (size > e - s))
+      break;
+    s += size;
+  }
+
+  /* tags at the end, in any order */
+  for (i = 0; i < TAGS_MAX; i++) {
+    if ((e - s >= TAGS_ID3V1_SIZE) &&
+	(tags_read(reader, buf, 3, e - TAGS_ID3V1_SIZE) == 0) &&
+	!memcmp(buf, "TAG", 3)) {
+      e -= TAGS_ID3V1_SIZE;
+      if (!has_id3v1) {
+	id3v1 = e;
+	has_id3v1 = 1;
+      }
+      continue;
+    }
+
+    if ((e - s < TAGS_APE_FOOTER) ||
+	(tags_read(reader, buf, TAGS_APE_FOOTER, e - TAGS_APE_FOOTER) < 0))
+      break;
+    size = tags_ape_size(buf);
+    if (size == 0) {
+      size = tags_id3v2_size(buf + TAGS_APE_FOOTER - TAGS_ID3V2_HEADER,
+			     "3DI");
+      if ((size != 0) && (size <= e - s) && (metadata != NULL))
+	tags_id3v2_parse(reader, e - size, size, metadata);
+    }
+    if ((size == 0) || (size > e - s))
+      break;
+    e -= size;
+  }
+
+  /* the ID3v2 tags take precedence */
+  if (has_id3v1 && (metadata != NULL))
+    tags_id3v1_parse(reader, id3v1, metadata);
+
+  *start = s;
+  *end = e;
+}
+
+void tags_bounds_fd(int fd, unsigned long *start, unsigned long *end,
+		    mp3dec_metadata_t *metadata) {
+  tags_reader_t reader;
+
+  tags_reader_init(&reader, fd, NULL);
+  tags_bounds(&reader, start, end, metadata);
+}
+
+void tags_bounds_map(unsigned char const *map,
+		     unsigned long *start, unsigned long *end,
+		     mp3dec_metadata_t *metadata) {
+  tags_reader_t reader;
+
+  tags_reader_init(&reader, -1, map);
+  tags_bounds(&reader, start, end, metadata);
+}
+
+/* the files loaded last, in a hash table and a list from the most to
+   the least recently used one. Entries are linked by index, -1 ends
+   a list. A file that changes gets a new ctime and is not found, the
+   times are compared to the nanosecond for rewrites within a second. */
+typedef struct tags_cache_entry_s {
+  dev_t dev;
+  ino_t ino;
+  off_t size;
+  struct timespec mtime, ctime;
+  unsigned long offset;    /* where the audio was looked for */
+
+  unsigned long start, end;
+  mp3dec_metadata_t metadata;
+
+  int hash_next;
+  int prev, next;
+} tags_cache_entry_t;
+
+static struct {
+  pthread_mutex_t lock;
+  int initialized;
+  tags_cache_entry_t entries[TAGS_CACHE_SIZE];
+  unsigned int used;
+  int buckets[TAGS_CACHE_BUCKETS];
+  int head, tail;
+  unsigned long hits, misses;
+} tags_cache = { PTHREAD_MUTEX_INITIALIZER, 0 };
+
+static pthread_once_t tags_atfork_once = PTHREAD_ONCE_INIT;
+
+/* no other thread holds the lock while the process forks */
+static void tags_atfork_prepare(void) {
+  pthread_mutex_lock(&tags_cache.lock);
+}
+
+static void tags_atfork_parent(void) {
+  pthread_mutex_unlock(&tags_cache.lock);
+}
+
+/* the entries are consistent, only the lock is not ours in the child */
+static void tags_atfork_child(void) {
+  pthread_mutex_init(&tags_cache.lock, NULL);
+}
+
+static void tags_atfork_register(void) {
+  pthread_atfork(tags_atfork_prepare, tags_atfork_parent,
+		 tags_atfork_child);
+}
+
+static void tags_cache_lock(void) {
+  pthread_once(&tags_atfork_once, tags_atfork_register);
+  pthread_mutex_lock(&tags_cache.lock);
+}
+
+static unsigned int tags_cache_hash(struct stat *st) {
+  return ((unsigned long)st->st_ino * 31 + (unsigned long)st->st_dev) %
+    TAGS_CACHE_BUCKETS;
+}
+
+static int tags_cache_same_time(struct timespec *a, struct timespec *b) {
+  return (a->tv_sec == b->tv_sec) && (a->tv_nsec == b->tv_nsec);
+}
+
+static int tags_cache_match(tags_cache_entry_t *entry, struct stat *st,
+			    unsigned long offset) {
+  return (entry->ino == st->st_ino) && (entry->dev == st->st_dev) &&
+    (entry->size == st->st_size) &&
+    tags_cache_same_time(&entry->mtime, &TAGS_ST_MTIM(st)) &&
+    tags_cache_same_time(&entry->ctime, &TAGS_ST_CTIM(st)) &&
+    (entry->offset == offset);
+}
+
+static void tags_cache_unlink(int i) {
+  tags_cache_entry_t *entry = &tags_cache.entries[i];
+
+  if (entry->prev != -1)
+    tags_cache.entries[entry->prev].next = entry->next;
+  else
+    tags_cache.head = entry->next;
+  if (entry->next != -1)
+    tags_cache.entries[entry->next].prev = entry->prev;
+  else
+    tags_cache.tail = entry->prev;
+}
+
+static void tags_cache_push(int i) {
+  tags_cache_entry_t *entry = &tags_cache.entries[i];
+
+  entry->prev = -1;
+  entry->next = tags_cache.head;
+  if (tags_cache.head != -1)
+    tags_cache.entries[tags_cache.head].prev = i;
+  else
+    tags_cache.tail = i;
+  tags_cache.head = i;
+}
+
+static void tags_cache_unhash(int i) {
+  tags_cache_entry_t *entry = &tags_cache.entries[i];
+  struct stat st;
+  int *link;
+
+  st.st_ino = entry->ino;
+  st.st_dev = entry->dev;
+  for (link = &tags_cache.buckets[tags_cache_hash(&st)]; *link != -1;
+       link = &tags_cache.entries[*link].hash_next) {
+    if (*link == i) {
+      *link = entry->hash_next;
+      return;
+    }
+  }
+}
+
+static int tags_cache_lookup(struct stat *st, unsigned long offset) {
+  int i;
+
+  if (!tags_cache.initialized) {
+    for (i = 0; i < TAGS_CACHE_BUCKETS; i++)
+      tags_cache.buckets[i] = -1;
+    tags_cache.head = tags_cache.tail = -1;
+    tags_cache.initialized = 1;
+  }
+
+  for (i = tags_cache.buckets[tags_cache_hash(st)]; i != -1;
+       i = tags_cache.entries[i].hash_next) {
+    if (tags_cache_match(&tags_cache.entries[i], st, offset))
+      return i;
+  }
+  return -1;
+}
+
+/* a free entry, or the least recently used one */
+static int tags_cache_insert(struct stat *st, unsigned long offset) {
+  tags_cache_entry_t *entry;
+  unsigned int bucket = tags_cache_hash(st);
+  int i;
+
+  if (tags_cache.used < TAGS_CACHE_SIZE) {
+    i = tags_cache.used++;
+  } else {
+    i = tags_cache.tail;
+    tags_cache_unlink(i);
+    tags_cache_unhash(i);
+  }
+
+  entry = &tags_cache.entries[i];
+  entry->dev = st->st_dev;
+  entry->ino = st->st_ino;
+  entry->size = st->st_size;
+  entry->mtime = TAGS_ST_MTIM(st);
+  entry->ctime = TAGS_ST_CTIM(st);
+  entry->offset = offset;
+  entry->hash_next = tags_cache.buckets[bucket];
+  tags_cache.buckets[bucket] = i;
+  tags_cache_push(i);
+  return i;
+}
+
+/* tags_bounds_fd for the regular file fd with stat st, from the cache
+   if it was loaded before */
+void tags_bounds_file(int fd, struct stat *st,
+		      unsigned long *start, unsigned long *end,
+		      mp3dec_metadata_t *metadata) {
+  tags_cache_entry_t *entry;
+  mp3dec_metadata_t found;
+  unsigned long offset = *start;
+  int i;
+
+  tags_cache_lock();
+  i = tags_cache_lookup(st, offset);
+  if (i != -1) {
+    tags_cache.hits++;
+    tags_cache_unlink(i);
+    tags_cache_push(i);
+    entry = &tags_cache.entries[i];
+    *start = entry->start;
+    *end = entry->end;
+    if (metadata != NULL)
+      *metadata = entry->metadata;
+    pthread_mutex_unlock(&tags_cache.lock);
+    return;
+  }
+  tags_cache.misses++;
+  pthread_mutex_unlock(&tags_cache.lock);
+
+  /* the file is read without holding the lock */
+  tags_bounds_fd(fd, start, end, &found);
+  if (metadata != NULL)
+    *metadata = found;
+
+  tags_cache_lock();
+  if (tags_cache_lookup(st, offset) == -1) {
+    entry = &tags_cache.entries[tags_cache_insert(st, offset)];
+    entry->start = *start;
+    entry->end = *end;
+    entry->metadata = found;
+  }
+  pthread_mutex_unlock(&tags_cache.lock);
+}
+
+void tags_cache_stats(unsigned long *hits, unsigned long *misses) {
+  tags_cache_lock();
+  *hits = tags_cache.hits;
+  *misses = tags_cache.misses;
+  pthread_mutex_unlock(&tags_cache.lock);
+}
@@ -0,0 +1,20 @@
+#ifndef TAGS_H__
+#define TAGS_H__
+
+#include <sys/stat.h>
+
+#include "maddec.h"
+
+/* narrow [*start, *end) of a file down to the audio between the tags,
+   and fill in metadata from them if it is not NULL */
+void tags_bounds_fd(int fd, unsigned long *start, unsigned long *end,
+		    mp3dec_metadata_t *metadata);
+void tags_bounds_map(unsigned char const *map,
+		     unsigned long *start, unsigned long *end,
+		     mp3dec_metadata_t *metadata);
+void tags_bounds_file(int fd, struct stat *st,
+		      unsigned long *start, unsigned long *end,
+		      mp3dec_metadata_t *metadata);
+void tags_cache_stats(unsigned long *hits, unsigned long *misses);
+
+#endif /* TAGS_H__ */
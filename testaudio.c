@@ -7,7 +7,9 @@
 #include "audio.h"
 
 int main(void) {
-  error_t error;
+  mp3dec_error_t error;
+  pcm_pool_t pool;
+  pcm_buffer_t *buf;
 
   struct mad_pcm pcm;
   int i;
@@ -20,16 +22,27 @@ int main(void) {
   pcm.samplerate = 44100;
   pcm.length = 1152;
 
+  pcm_pool_init(&pool);
+  if (pcm_pool_alloc(&pool, audio_format(), pcm.channels, &error) < 0) {
+    printf("%s\n", error_get(&error));
+    return 1;
+  }
+
   for (i = 0; i < 100; i++) {
     printf("playing frame %d\n", i);
     int ret;
-    ret = audio_write(&pcm, &error);
+    buf = pcm_pool_get(&pool);
+    pcm_stage(&pcm, MAD_F_ONE, buf);
+    ret = audio_write(buf, &error);
+    pcm_pool_put(&pool, buf);
     if (!ret) {
       printf("Could not play frame %d: %s\n", i, error_get(&error));
       return 1;
     }
   }
 
+  pcm_pool_free(&pool);
+
   int ret = audio_close(&error);
   if (!ret) {
     printf("Could not close audio: %s\n", error_get(&error));
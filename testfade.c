@@ -0,0 +1,103 @@
+/*
+ * test a crossfade into a track that is shorter than the fade: the
+ * short track ends while it is still fading in. With a track queued
+ * after it the player goes on with that one, without one it stops at
+ * the end of the short track. It must never go into the error state.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "maddec.h"
+
+#define CROSSFADE_MS 5000
+#define POLLS        600
+
+/* play until the fade is over, then until the player settles on the
+   track after the short one or stops */
+static int run(char *name, char *longfile, char *shortfile, int queue,
+	       unsigned int crossfade_ms) {
+  mp3dec_state_t *state;
+  mp3dec_status_t status;
+  unsigned long fade_frames = 0;
+  int faded = 0, settled = 0;
+  int i;
+
+  state = mp3dec_new();
+  if (state == NULL) {
+    printf("Could not start the player\n");
+    return -1;
+  }
+  if ((mp3dec_set_crossfade(state, crossfade_ms) < 0) ||
+      (mp3dec_load(state, longfile) < 0) ||
+      (mp3dec_load_next(state, shortfile) < 0) ||
+      (queue && (mp3dec_enqueue(state, longfile) < 0)) ||
+      (mp3dec_play(state) < 0)) {
+    printf("%s: could not play: %s\n", name, mp3dec_error(state));
+    mp3dec_delete(state);
+    return -1;
+  }
+
+  for (i = 0; (i < POLLS) && !settled; i++) {
+    usleep(50 * 1000);
+    if (mp3dec_status(state, &status) < 0) {
+      printf("%s: could not get status: %s\n", name, mp3dec_error(state));
+      mp3dec_delete(state);
+      return -1;
+    }
+    if (status.state == MP3DEC_STATE_ERROR) {
+      printf("%s: FAIL: the player went into error state: %s\n",
+	     name, mp3dec_error(state));
+      mp3dec_delete(state);
+      return -1;
+    }
+    if (status.crossfading) {
+      faded = 1;
+      fade_frames = status.frames;
+      continue;
+    }
+    if (!faded)
+      continue;
+
+    /* the track after the short one counts its frames from scratch */
+    if (queue)
+      settled = (status.state == MP3DEC_STATE_PLAY) &&
+	(status.frames < fade_frames);
+    else
+      settled = (status.state == MP3DEC_STATE_STOP);
+  }
+  mp3dec_delete(state);
+
+  if (!faded) {
+    printf("%s: FAIL: the tracks were not crossfaded\n", name);
+    return -1;
+  }
+  if (!settled) {
+    printf("%s: FAIL: the player did not %s after the short track\n",
+	   name, queue ? "go on with the queue" : "stop");
+    return -1;
+  }
+  printf("%s: OK\n", name);
+  return 0;
+}
+
+int main(int argc, char *argv[]) {
+  unsigned int crossfade_ms = CROSSFADE_MS;
+  int ret = 0;
+
+  if ((argc < 3) || (argc > 4)) {
+    fprintf(stderr, "Usage: ./testfade mp3file shortmp3file [crossfade ms]\n"
+	    "shortmp3file has to be shorter than the crossfade, mp3file "
+	    "a bit longer\n");
+    return 1;
+  }
+  if (argc > 3)
+    crossfade_ms = atoi(argv[3]);
+
+  if (run("queue", argv[1], argv[2], 1, crossfade_ms) < 0)
+    ret = 1;
+  if (run("stop", argv[1], argv[2], 0, crossfade_ms) < 0)
+    ret = 1;
+  return ret;
+}
@@ -0,0 +1,164 @@
+/*
+ * test the streaming input: feed an mp3 file to the player through a
+ * socketpair with a throttled writer, stall the writer once to force
+ * an underrun and check that playback recovers.
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "maddec.h"
+
+/* a bit faster than a 128 kbit/s stream plays, so that the buffer
+   fills, then a stall longer than everything queued can last */
+#define CHUNK_SIZE   1024
+#define CHUNK_DELAY  (50 * 1000)
+#define STALL_AFTER  (96 * 1024)
+#define STALL_TIME   (6 * 1000 * 1000)
+#define SOCK_BUFFER  4096
+
+/* write the file in small chunks, roughly at 20 kbyte/s, and stop
+   for a while once */
+static void throttled_writer(int sock, char *filename) {
+  unsigned char buf[CHUNK_SIZE];
+  unsigned long total = 0;
+  int stalled = 0;
+  int fd, ret;
+
+  fd = open(filename, O_RDONLY);
+  if (fd < 0) {
+    perror("open");
+    exit(1);
+  }
+
+  while ((ret = read(fd, buf, sizeof(buf))) > 0) {
+    if (write(sock, buf, ret) != ret)
+      break;
+    total += ret;
+    usleep(CHUNK_DELAY);
+    if (!stalled && (total >= STALL_AFTER)) {
+      printf("writer: stalling after %lu bytes\n", total);
+      usleep(STALL_TIME);
+      stalled = 1;
+    }
+  }
+
+  close(fd);
+  close(sock);
+  exit(0);
+}
+
+int main(int argc, char *argv[]) {
+  mp3dec_state_t *state;
+  mp3dec_status_t status;
+  unsigned long last_frames = 0;
+  unsigned long underrun_frames = 0;
+  int underrun_seen = 0;
+  int sock[2];
+  pid_t writer;
+  int i;
+
+  if (argc != 2) {
+    fprintf(stderr, "Usage: ./teststream mp3file\n");
+    return 1;
+  }
+
+  state = mp3dec_new();
+  if (state == NULL) {
+    printf("Could not start the player\n");
+    return 1;
+  }
+
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, sock) < 0) {
+    perror("socketpair");
+    return 1;
+  }
+  /* keep the socket from queueing much beyond the stream buffer */
+  {
+    int size = SOCK_BUFFER;
+    setsockopt(sock[1], SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+    setsockopt(sock[0], SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+  }
+  /* the player reads streams without blocking, like a real listener */
+  if (fcntl(sock[0], F_SETFL, fcntl(sock[0], F_GETFL) | O_NONBLOCK) < 0) {
+    perror("fcntl");
+    return 1;
+  }
+
+  writer = fork();
+  if (writer < 0) {
+    perror("fork");
+    return 1;
+  }
+  if (writer == 0) {
+    close(sock[0]);
+    throttled_writer(sock[1], argv[1]);
+  }
+  close(sock[1]);
+
+  if (mp3dec_set_stream_buffer(state, 64 * 1024, 8 * 1024, 32 * 1024) < 0) {
+    printf("Could not set the stream buffer: %s\n", mp3dec_error(state));
+    return 1;
+  }
+  if (mp3dec_load_fd(state, sock[0]) < 0) {
+    printf("Could not load the socket: %s\n", mp3dec_error(state));
+    return 1;
+  }
+  close(sock[0]);
+  if (mp3dec_play(state) < 0) {
+    printf("Could not play: %s\n", mp3dec_error(state));
+    return 1;
+  }
+
+  for (i = 0; i < 200; i++) {
+    usleep(100 * 1000);
+    if (mp3dec_status(state, &status) < 0) {
+      printf("Could not get status: %s\n", mp3dec_error(state));
+      return 1;
+    }
+    printf("frames %lu buffered %lu buffering %d underruns %lu\n",
+	   status.frames, status.buffered, status.buffering,
+	   status.underruns);
+    if (status.state == MP3DEC_STATE_ERROR) {
+      printf("Player went into error state\n");
+      return 1;
+    }
+    if (status.frames < last_frames) {
+      printf("Frame count went backwards\n");
+      return 1;
+    }
+    last_frames = status.frames;
+    /* only frames played after the underrun show a recovery */
+    if ((status.underruns > 0) && !underrun_seen) {
+      underrun_frames = status.frames;
+      underrun_seen = 1;
+    }
+    if (underrun_seen && !status.buffering &&
+	(status.frames > underrun_frames))
+      break;
+  }
+
+  kill(writer, SIGTERM);
+  waitpid(writer, NULL, 0);
+  mp3dec_delete(state);
+
+  if (status.underruns == 0) {
+    printf("FAIL: the stall was not signalled as an underrun\n");
+    return 1;
+  }
+  if (status.buffering || (status.frames <= underrun_frames)) {
+    printf("FAIL: playback did not recover after the underrun\n");
+    return 1;
+  }
+
+  printf("OK\n");
+  return 0;
+}
@@ -0,0 +1,109 @@
+/*
+ * test the frame flags of ID3v2.3 and ID3v2.4 tags: a title frame is
+ * built with each flag set and parsed. Status flags never change the
+ * text, grouping and the data length are skipped, compressed and
+ * encrypted frames are left out.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "tags.h"
+
+#define AUDIO_SIZE 1024
+
+typedef struct tags_case_s {
+  char *name;
+  unsigned int version;
+  unsigned char status, format;
+  char *expect;
+} tags_case_t;
+
+static tags_case_t cases[] = {
+  { "v2.3 no flags",          3, 0x00, 0x00, "Title" },
+  { "v2.3 tag alter",         3, 0x80, 0x00, "Title" },
+  { "v2.3 file alter",        3, 0x40, 0x00, "Title" },
+  { "v2.3 read only",         3, 0x20, 0x00, "Title" },
+  { "v2.3 compression",       3, 0x00, 0x80, "" },
+  { "v2.3 encryption",        3, 0x00, 0x40, "" },
+  { "v2.3 grouping",          3, 0x00, 0x20, "Title" },
+  { "v2.4 no flags",          4, 0x00, 0x00, "Title" },
+  { "v2.4 tag alter",         4, 0x40, 0x00, "Title" },
+  { "v2.4 file alter",        4, 0x20, 0x00, "Title" },
+  { "v2.4 read only",         4, 0x10, 0x00, "Title" },
+  { "v2.4 grouping",          4, 0x00, 0x40, "Title" },
+  { "v2.4 compression",       4, 0x00, 0x08, "" },
+  { "v2.4 encryption",        4, 0x00, 0x04, "" },
+  { "v2.4 unsynchronisation", 4, 0x00, 0x02, "Ti\xc3\xbftle" },
+  { "v2.4 data length",       4, 0x00, 0x01, "Title" },
+  { "v2.4 everything readable", 4, 0x70, 0x43, "Ti\xc3\xbftle" }
+};
+
+static void put_size(unsigned char *p, unsigned long size, int syncsafe) {
+  int shift = syncsafe ? 7 : 8;
+
+  p[0] = (size >> (3 * shift)) & 0xff;
+  p[1] = (size >> (2 * shift)) & 0xff;
+  p[2] = (size >> shift) & 0xff;
+  p[3] = size & ((1 << shift) - 1);
+}
+
+/* a tag with a single TIT2 frame, followed by some audio */
+static unsigned long build(tags_case_t *c, unsigned char *buf) {
+  unsigned char *frame = buf + 10, *data = frame + 10;
+  unsigned long len = 0;
+
+  memset(buf, 0, 10 + 10 + 64 + AUDIO_SIZE);
+  memcpy(buf, "ID3", 3);
+  buf[3] = c->version;
+
+  memcpy(frame, "TIT2", 4);
+  frame[8] = c->status;
+  frame[9] = c->format;
+
+  if ((c->version == 3) && (c->format & 0x20))
+    data[len++] = 0x01;                  /* group id */
+  if ((c->version == 4) && (c->format & 0x40))
+    data[len++] = 0x01;                  /* group id */
+  if ((c->version == 4) && (c->format & 0x01)) {
+    put_size(data + len, 7, 1);          /* data length */
+    len += 4;
+  }
+  data[len++] = 0;                       /* latin-1 */
+  if ((c->version == 4) && (c->format & 0x02)) {
+    memcpy(data + len, "Ti\xff\x00tle", 7);
+    len += 7;
+  } else {
+    memcpy(data + len, "Title", 5);
+    len += 5;
+  }
+
+  put_size(frame + 4, len, c->version == 4);
+  put_size(buf + 6, 10 + len, 1);
+
+  /* where the audio starts */
+  memset(data + len, 0xff, AUDIO_SIZE);
+  return 10 + 10 + len + AUDIO_SIZE;
+}
+
+int main(void) {
+  unsigned char buf[10 + 10 + 64 + AUDIO_SIZE];
+  mp3dec_metadata_t metadata;
+  unsigned int i, failed = 0;
+
+  for (i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+    unsigned long start = 0, end = build(&cases[i], buf);
+
+    tags_bounds_map(buf, &start, &end, &metadata);
+    if (strcmp(metadata.title, cases[i].expect)) {
+      printf("FAIL: %s: title \"%s\" instead of \"%s\"\n", cases[i].name,
+	     metadata.title, cases[i].expect);
+      failed++;
+    }
+  }
+
+  if (failed)
+    return 1;
+  printf("OK\n");
+  return 0;
+}
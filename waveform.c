@@ -0,0 +1,298 @@
+/*
+ * multi-resolution waveform summaries
+ *
+ * The decoded samples are reduced to min, max and sum of squares per
+ * bucket of the finest level. Every coarser level is built from the
+ * buckets of the one below, so the samples are only looked at once.
+ */
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <mad.h>
+
+#include "maddec.h"
+#include "error.h"
+#include "misc.h"
+#include "waveform.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+/* from mad_fixed_t to a float where 1.0 is full scale */
+#define WAVEFORM_SCALE (1.0f / (float)(1L << MAD_F_FRACBITS))
+
+static const unsigned int waveform_buckets[MP3DEC_WAVEFORM_LEVELS] = {
+  256, 4096, 65536
+};
+
+static void waveform_acc_reset(waveform_level_t *level) {
+  unsigned int ch;
+
+  for (ch = 0; ch < WAVEFORM_CHANNELS; ch++) {
+    level->acc[ch].min = 0;
+    level->acc[ch].max = 0;
+    level->acc[ch].sumsq = 0;
+  }
+  level->fill = 0;
+}
+
+void waveform_init(waveform_t *waveform) {
+  unsigned int i;
+
+  waveform->samplerate = 0;
+  waveform->channels = 0;
+  waveform->samples = 0;
+
+  for (i = 0; i < MP3DEC_WAVEFORM_LEVELS; i++) {
+    waveform_level_t *level = &waveform->levels[i];
+
+    level->bucket = waveform_buckets[i];
+    waveform_acc_reset(level);
+    level->points = NULL;
+    level->count = 0;
+    level->size = 0;
+  }
+}
+
+void waveform_finish(waveform_t *waveform) {
+  unsigned int i;
+
+  for (i = 0; i < MP3DEC_WAVEFORM_LEVELS; i++) {
+    free(waveform->levels[i].points);
+    waveform->levels[i].points = NULL;
+  }
+}
+
+/* min, max and sum of squares of count samples, in mad_fixed_t units */
+static void waveform_reduce(mad_fixed_t const *src, unsigned int count,
+			    float *min, float *max, double *sumsq) {
+  float lo = src[0], hi = src[0];
+  float sq = 0;
+  unsigned int i = 0;
+
+#ifdef __SSE2__
+  if (count >= 4) {
+    __m128 vlo = _mm_cvtepi32_ps(_mm_loadu_si128((__m128i const *)src));
+    __m128 vhi = vlo;
+    __m128 vsq = _mm_setzero_ps();
+    float tmp[4];
+
+    for (; i + 4 <= count; i += 4) {
+      __m128 x = _mm_cvtepi32_ps(_mm_loadu_si128((__m128i const *)(src + i)));
+      vlo = _mm_min_ps(vlo, x);
+      vhi = _mm_max_ps(vhi, x);
+      x = _mm_mul_ps(x, _mm_set1_ps(WAVEFORM_SCALE));
+      vsq = _mm_add_ps(vsq, _mm_mul_ps(x, x));
+    }
+
+    _mm_storeu_ps(tmp, vlo);
+    lo = tmp[0];
+    lo = (tmp[1] < lo) ? tmp[1] : lo;
+    lo = (tmp[2] < lo) ? tmp[2] : lo;
+    lo = (tmp[3] < lo) ? tmp[3] : lo;
+    _mm_storeu_ps(tmp, vhi);
+    hi = tmp[0];
+    hi = (tmp[1] > hi) ? tmp[1] : hi;
+    hi = (tmp[2] > hi) ? tmp[2] : hi;
+    hi = (tmp[3] > hi) ? tmp[3] : hi;
+    _mm_storeu_ps(tmp, vsq);
+    sq = tmp[0] + tmp[1] + tmp[2] + tmp[3];
+  }
+#endif
+
+  for (; i < count; i++) {
+    float x = src[i];
+
+    lo = (x < lo) ? x : lo;
+    hi = (x > hi) ? x : hi;
+    x *= WAVEFORM_SCALE;
+    sq += x * x;
+  }
+
+  *min = lo * WAVEFORM_SCALE;
+  *max = hi * WAVEFORM_SCALE;
+  *sumsq = sq;
+}
+
+static signed short waveform_scale(float x) {
+  x *= 32767.0f;
+  if (x > 32767.0f)
+    return 32767;
+  if (x < -32768.0f)
+    return -32768;
+  return (signed short)lrintf(x);
+}
+
+static void waveform_acc_add(waveform_acc_t *acc, int first,
+			     float min, float max, double sumsq) {
+  if (first || (min < acc->min))
+    acc->min = min;
+  if (first || (max > acc->max))
+    acc->max = max;
+  acc->sumsq += sumsq;
+}
+
+/* close the current bucket of level i and pass it on to the next
+   level */
+static int waveform_emit(waveform_t *waveform, unsigned int i,
+			 mp3dec_error_t *error) {
+  waveform_level_t *level = &waveform->levels[i];
+  mp3dec_waveform_point_t *p;
+  unsigned int ch;
+
+  if (level->count == level->size) {
+    unsigned long size = (level->size > 0) ? level->size * 2 : 1024;
+
+    p = realloc(level->points,
+		size * waveform->channels * sizeof(mp3dec_waveform_point_t));
+    if (p == NULL) {
+      error_set(error, "Could not allocate waveform buckets");
+      error_set_code(error, MP3DEC_ERR_NOMEM);
+      return -1;
+    }
+    level->points = p;
+    level->size = size;
+  }
+
+  p = level->points + level->count * waveform->channels;
+  for (ch = 0; ch < waveform->channels; ch++) {
+    waveform_acc_t *acc = &level->acc[ch];
+
+    p[ch].min = waveform_scale(acc->min);
+    p[ch].max = waveform_scale(acc->max);
+    p[ch].rms = waveform_scale(sqrt(acc->sumsq / level->fill));
+
+    if (i + 1 < MP3DEC_WAVEFORM_LEVELS)
+      waveform_acc_add(&waveform->levels[i + 1].acc[ch],
+		       waveform->levels[i + 1].fill == 0,
+		       acc->min, acc->max, acc->sumsq);
+  }
+  level->count++;
+
+  if (i + 1 < MP3DEC_WAVEFORM_LEVELS) {
+    waveform_level_t *next = &waveform->levels[i + 1];
+
+    next->fill += level->fill;
+    if (next->fill == next->bucket) {
+      if (waveform_emit(waveform, i + 1, error) < 0)
+	return -1;
+    }
+  }
+
+  waveform_acc_reset(level);
+  return 0;
+}
+
+/* the format of the first frame is kept. A mono frame goes to both
+   channels, of a stereo frame in a mono waveform the left channel. */
+int waveform_add(waveform_t *waveform, struct mad_pcm const *pcm,
+		 mp3dec_error_t *error) {
+  waveform_level_t *level = &waveform->levels[0];
+  unsigned int done = 0;
+  unsigned int ch;
+
+  if (waveform->channels == 0) {
+    waveform->samplerate = pcm->samplerate;
+    waveform->channels = (pcm->channels > WAVEFORM_CHANNELS) ?
+      WAVEFORM_CHANNELS : pcm->channels;
+  }
+
+  while (done < pcm->length) {
+    unsigned int n = pcm->length - done;
+
+    if (n > level->bucket - level->fill)
+      n = level->bucket - level->fill;
+
+    for (ch = 0; ch < waveform->channels; ch++) {
+      unsigned int src_ch = (ch < pcm->channels) ? ch : pcm->channels - 1;
+      float min, max;
+      double sumsq;
+
+      waveform_reduce(pcm->samples[src_ch] + done, n, &min, &max, &sumsq);
+      waveform_acc_add(&level->acc[ch], level->fill == 0, min, max, sumsq);
+    }
+    level->fill += n;
+    done += n;
+
+    if ((level->fill == level->bucket) &&
+	(waveform_emit(waveform, 0, error) < 0))
+      return -1;
+  }
+
+  waveform->samples += pcm->length;
+  return 0;
+}
+
+/* close the partial buckets at the end of the track, from the finest
+   level up so that they are passed on */
+static int waveform_flush(waveform_t *waveform, mp3dec_error_t *error) {
+  unsigned int i;
+
+  for (i = 0; i < MP3DEC_WAVEFORM_LEVELS; i++) {
+    if ((waveform->levels[i].fill > 0) &&
+	(waveform_emit(waveform, i, error) < 0))
+      return -1;
+  }
+  return 0;
+}
+
+static int waveform_write_all(int fd, void *data, unsigned long len,
+			      mp3dec_error_t *error) {
+  if (unix_write(fd, data, len) != len) {
+    error_set_strerror(error, "Could not write waveform");
+    return -1;
+  }
+  return 0;
+}
+
+int waveform_write(waveform_t *waveform, int fd,
+		   mp3dec_waveform_header_t *header, mp3dec_error_t *error) {
+  static unsigned char pad[8];
+  unsigned long long offset;
+  unsigned int i;
+
+  if (waveform_flush(waveform, error) < 0)
+    return -1;
+
+  memset(header, 0, sizeof(*header));
+  header->magic = MP3DEC_WAVEFORM_MAGIC;
+  header->version = MP3DEC_WAVEFORM_VERSION;
+  header->samplerate = waveform->samplerate;
+  header->channels = waveform->channels;
+  header->samples = waveform->samples;
+  header->levels = MP3DEC_WAVEFORM_LEVELS;
+
+  /* every level starts 8 byte aligned */
+  offset = sizeof(*header);
+  for (i = 0; i < MP3DEC_WAVEFORM_LEVELS; i++) {
+    header->level[i].bucket = waveform->levels[i].bucket;
+    header->level[i].count = waveform->levels[i].count;
+    header->level[i].offset = offset;
+    offset += waveform->levels[i].count * waveform->channels *
+      sizeof(mp3dec_waveform_point_t);
+    offset = (offset + 7) & ~7ULL;
+  }
+
+  if (waveform_write_all(fd, header, sizeof(*header), error) < 0)
+    return -1;
+
+  offset = sizeof(*header);
+  for (i = 0; i < MP3DEC_WAVEFORM_LEVELS; i++) {
+    unsigned long len = waveform->levels[i].count * waveform->channels *
+      sizeof(mp3dec_waveform_point_t);
+
+    if ((len > 0) &&
+	(waveform_write_all(fd, waveform->levels[i].points, len, error) < 0))
+      return -1;
+    offset += len;
+    if ((offset & 7) &&
+	(waveform_write_all(fd, pad, 8 - (offset & 7), error) < 0))
+      return -1;
+    offset = (offset + 7) & ~7ULL;
+  }
+
+  return 0;
+}
@@ -0,0 +1,43 @@
+#ifndef WAVEFORM_H__
+#define WAVEFORM_H__
+
+#include <mad.h>
+
+#include "maddec.h"
+#include "error.h"
+
+#define WAVEFORM_CHANNELS 2
+
+/* the bucket being filled on one level and channel */
+typedef struct waveform_acc_s {
+  float min;
+  float max;
+  double sumsq;
+} waveform_acc_t;
+
+typedef struct waveform_level_s {
+  unsigned int bucket;
+  unsigned int fill;     /* samples in the current bucket */
+  waveform_acc_t acc[WAVEFORM_CHANNELS];
+
+  mp3dec_waveform_point_t *points;
+  unsigned long count;   /* finished buckets */
+  unsigned long size;    /* buckets allocated */
+} waveform_level_t;
+
+typedef struct waveform_s {
+  unsigned int samplerate;
+  unsigned int channels;
+  unsigned long long samples;
+
+  waveform_level_t levels[MP3DEC_WAVEFORM_LEVELS];
+} waveform_t;
+
+void waveform_init(waveform_t *waveform);
+int  waveform_add(waveform_t *waveform, struct mad_pcm const *pcm,
+		  mp3dec_error_t *error);
+int  waveform_write(waveform_t *waveform, int fd,
+		    mp3dec_waveform_header_t *header, mp3dec_error_t *error);
+void waveform_finish(waveform_t *waveform);
+
+#endif /* WAVEFORM_H__ */